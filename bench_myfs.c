@@ -0,0 +1,510 @@
+// bench_myfs: microbenchmarks for the filesystem's core primitives. Each
+// benchmark runs a fixed number of operations per iteration, after warmup
+// iterations that are not measured, and reports the median time per
+// operation over the measured iterations together with the block I/O per
+// operation from the handle's counters (myfs_io_stats).
+//
+// The allocator and inode benchmarks call static functions of the core,
+// so this file includes libmyfs.c instead of linking against it.
+#include "libmyfs.c"
+
+#define BENCH_IMAGE_SIZE (34L * 1024 * 1024) // room for every data block
+#define MAX_ITERATIONS 100
+#define MAX_RESULTS 64
+
+typedef struct {
+    char name[64];
+    long ops;
+    double ns_per_op[MAX_ITERATIONS];
+    double reads, writes, hits; // per operation, averaged over the measured iterations
+} Result;
+
+static myfs_t* bench_fs;
+static int iterations = 5, warmup = 1;
+static const char* filter = NULL;
+static Result results[MAX_RESULTS];
+static int result_count = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs op(ctx, 0..ops-1) per iteration; 'reset', if given, runs untimed
+// after every iteration to put the image back the way the next expects.
+static void measure(const char* name, long ops, void (*op)(void*, long), void (*reset)(void*), void* ctx) {
+    if (filter && !strstr(name, filter)) return;
+    if (result_count == MAX_RESULTS || ops <= 0) return;
+    Result* r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ops = ops;
+
+    for (int it = 0; it < warmup + iterations; it++) {
+        struct myfs_io_stats before, after;
+        myfs_io_stats(bench_fs, &before);
+        double start = now_ns();
+        for (long i = 0; i < ops; i++) op(ctx, i);
+        double elapsed = now_ns() - start;
+        myfs_io_stats(bench_fs, &after);
+        if (reset) reset(ctx);
+        if (it < warmup) continue;
+
+        int m = it - warmup;
+        r->ns_per_op[m] = elapsed / ops;
+        double n = (double)ops * iterations;
+        for (int k = 0; k < MYFS_IO_KINDS; k++) {
+            r->reads += (after.reads[k] - before.reads[k]) / n;
+            r->writes += (after.writes[k] - before.writes[k]) / n;
+            r->hits += (after.cache_hits[k] - before.cache_hits[k]) / n;
+        }
+    }
+
+    double sorted[MAX_ITERATIONS];
+    memcpy(sorted, r->ns_per_op, iterations * sizeof(double));
+    qsort(sorted, iterations, sizeof(double), compare_double);
+    printf("%-28s %12.1f ns/op  (min %.1f, max %.1f)  %6.2f reads  %6.2f writes  %6.2f cache hits /op\n", name,
+           sorted[iterations / 2], sorted[0], sorted[iterations - 1], r->reads, r->writes, r->hits);
+    fflush(stdout);
+}
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "Error: Benchmark setup failed: %s\n", what);
+        exit(1);
+    }
+}
+
+// Path resolution
+typedef struct {
+    char path[MAX_PATH_LEN];
+} PathBench;
+
+static void op_lookup_path(void* ctx, long i) {
+    (void)i;
+    PathBench* b = ctx;
+    if (myfs_lookup(bench_fs, b->path) < 0) check(0, b->path);
+}
+
+static void bench_path_depths(void) {
+    static const int depths[] = { 1, 2, 4, 8, 16 };
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        PathBench b;
+        char name[64];
+        int len = snprintf(b.path, sizeof(b.path), "/depth%d", depths[d]);
+        for (int level = 1; level < depths[d]; level++) {
+            check(myfs_mkdir(bench_fs, b.path) >= 0, b.path);
+            len += snprintf(b.path + len, sizeof(b.path) - len, "/dir%d", level);
+        }
+        check(myfs_create(bench_fs, b.path, "x", 1) >= 0, b.path);
+        snprintf(name, sizeof(name), "lookup_path/depth=%d", depths[d]);
+        measure(name, 200000, op_lookup_path, NULL, &b);
+    }
+}
+
+// Directory entries
+typedef struct {
+    uint32_t dir;
+    int entries;
+    char names[INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK][16];
+} DirBench;
+
+static void op_find_hit(void* ctx, long i) {
+    DirBench* b = ctx;
+    if (myfs_lookup_at(bench_fs, b->dir, b->names[i % b->entries]) < 0) check(0, "lookup of an existing name");
+}
+
+static void op_find_miss(void* ctx, long i) {
+    (void)i;
+    DirBench* b = ctx;
+    if (myfs_lookup_at(bench_fs, b->dir, "missing") != MYFS_ENOENT) check(0, "lookup of a missing name");
+}
+
+static void bench_dir_sizes(void) {
+    // 4 entries stay inline in the inode; the largest fills all 12 blocks.
+    static const int sizes[] = { 4, 16, 64, INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK };
+    static DirBench b;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char name[64];
+        snprintf(name, sizeof(name), "dir%d", sizes[s]);
+        int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, name);
+        check(dir >= 0, name);
+        b.dir = dir;
+        b.entries = sizes[s];
+        for (int e = 0; e < b.entries; e++) {
+            snprintf(b.names[e], sizeof(b.names[e]), "f%d", e);
+            check(myfs_create_at(bench_fs, b.dir, b.names[e], NULL, 0) >= 0, b.names[e]);
+        }
+        snprintf(name, sizeof(name), "find_entry_hit/entries=%d", sizes[s]);
+        measure(name, 100000, op_find_hit, NULL, &b);
+        snprintf(name, sizeof(name), "find_entry_miss/entries=%d", sizes[s]);
+        measure(name, 100000, op_find_miss, NULL, &b);
+    }
+}
+
+// Data block allocation
+typedef struct {
+    int allocated[MAX_DATA_BLOCKS];
+    long count;
+} AllocBench;
+
+static void op_alloc(void* ctx, long i) {
+    AllocBench* b = ctx;
+    int block = alloc_data_block(bench_fs);
+    if (block < 0) check(0, "alloc_data_block");
+    b->allocated[i] = block;
+    b->count = i + 1;
+}
+
+// Frees what the iteration allocated and starts the next one from a cold
+// cursor, like a thread allocating for the first time.
+static void reset_alloc(void* ctx) {
+    AllocBench* b = ctx;
+    for (long i = 0; i < b->count; i++) free_data_block(bench_fs, b->allocated[i]);
+    b->count = 0;
+    block_cursor = -1;
+}
+
+static void bench_alloc_fill(void) {
+    static const int fills[] = { 0, 50, 90, 99 };
+    static AllocBench b;
+    static uint64_t saved[MAX_DATA_BLOCKS / 64];
+    int nblocks = bench_fs->sb.num_data_blocks;
+    memcpy(saved, bench_fs->data_block_bitmap, sizeof(saved));
+
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        // Mark a random 'fill' percent of the blocks used, on top of what
+        // the image holds; the real bitmap is put back afterwards.
+        unsigned seed = 42;
+        memcpy(bench_fs->data_block_bitmap, saved, sizeof(saved));
+        int want = (int)((long)nblocks * fills[f] / 100), used = 0;
+        for (int n = 0; n < nblocks; n++) used += get_bit(bench_fs->data_block_bitmap, n);
+        while (used < want) {
+            int n = rand_r(&seed) % nblocks;
+            if (get_bit(bench_fs->data_block_bitmap, n)) continue;
+            bench_fs->data_block_bitmap[n / 64] |= UINT64_C(1) << (n % 64);
+            used++;
+        }
+        long ops = (nblocks - used) / 2 < 1024 ? (nblocks - used) / 2 : 1024;
+        char name[64];
+        snprintf(name, sizeof(name), "alloc_data_block/fill=%d%%", fills[f]);
+        block_cursor = -1;
+        measure(name, ops, op_alloc, reset_alloc, &b);
+    }
+    memcpy(bench_fs->data_block_bitmap, saved, sizeof(saved));
+    __atomic_store_n(&bench_fs->data_bitmap_dirty, 1, __ATOMIC_RELEASE);
+    block_cursor = -1;
+}
+
+// Inode table
+typedef struct {
+    uint32_t inodes[64];
+    int count;
+} InodeBench;
+
+static void op_read_inode(void* ctx, long i) {
+    InodeBench* b = ctx;
+    Inode inode;
+    read_inode(bench_fs, b->inodes[i % b->count], &inode);
+}
+
+static void op_write_inode(void* ctx, long i) {
+    InodeBench* b = ctx;
+    Inode inode;
+    uint32_t ino = b->inodes[i % b->count];
+    read_inode(bench_fs, ino, &inode);
+    write_inode(bench_fs, ino, &inode);
+}
+
+static void bench_inodes(void) {
+    static InodeBench b;
+    int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, "inodes");
+    check(dir >= 0, "/inodes");
+    for (b.count = 0; b.count < 64; b.count++) {
+        char name[16];
+        snprintf(name, sizeof(name), "i%d", b.count);
+        int ino = myfs_create_at(bench_fs, dir, name, NULL, 0);
+        check(ino >= 0, name);
+        b.inodes[b.count] = ino;
+    }
+    measure("read_inode", 200000, op_read_inode, NULL, &b);
+    measure("write_inode", 20000, op_write_inode, NULL, &b);
+}
+
+// Whole files, as cp-to and cp-from move them
+#define COPY_FILES 32
+
+typedef struct {
+    uint32_t dir;
+    long size;
+    uint32_t file;
+    char data[MYFS_FILE_MAX];
+} CopyBench;
+
+static void op_copy_in(void* ctx, long i) {
+    CopyBench* b = ctx;
+    char name[16];
+    snprintf(name, sizeof(name), "c%ld", i);
+    if (myfs_create_at(bench_fs, b->dir, name, b->data, b->size) < 0) check(0, "create");
+}
+
+static void reset_copy_in(void* ctx) {
+    CopyBench* b = ctx;
+    char name[16];
+    for (long i = 0; i < COPY_FILES; i++) {
+        snprintf(name, sizeof(name), "c%ld", i);
+        myfs_unlink_at(bench_fs, b->dir, name);
+    }
+}
+
+static void op_copy_out(void* ctx, long i) {
+    (void)i;
+    CopyBench* b = ctx;
+    if (myfs_pread(bench_fs, b->file, b->data, b->size, 0) != b->size) check(0, "pread");
+}
+
+static void bench_copies(void) {
+    static const long sizes[] = { 4096, 16384, MYFS_FILE_MAX };
+    static CopyBench b;
+    for (int i = 0; i < MYFS_FILE_MAX; i++) b.data[i] = (char)(i * 7);
+    int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, "copies");
+    check(dir >= 0, "/copies");
+    b.dir = dir;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char name[64];
+        b.size = sizes[s];
+        snprintf(name, sizeof(name), "cp_to/size=%ld", sizes[s]);
+        measure(name, COPY_FILES, op_copy_in, reset_copy_in, &b);
+
+        snprintf(name, sizeof(name), "keep%ld", sizes[s]);
+        int file = myfs_create_at(bench_fs, b.dir, name, b.data, b.size);
+        check(file >= 0, name);
+        b.file = file;
+        snprintf(name, sizeof(name), "cp_from/size=%ld", sizes[s]);
+        measure(name, 20000, op_copy_out, NULL, &b);
+    }
+}
+
+// The codec on one cluster of text, and whole text files copied in and out
+// with the image's compression off and on
+typedef struct {
+    unsigned char in[CLUSTER_BLOCKS * BLOCK_SIZE], out[CLUSTER_BLOCKS * BLOCK_SIZE];
+    int len;
+} CodecBench;
+
+static void op_lz_compress(void* ctx, long i) {
+    (void)i;
+    CodecBench* b = ctx;
+    b->len = lz_compress(b->in, sizeof(b->in), b->out, sizeof(b->out));
+}
+
+static void op_lz_decompress(void* ctx, long i) {
+    (void)i;
+    CodecBench* b = ctx;
+    if (lz_decompress(b->out, b->len, b->in, sizeof(b->in)) != (int)sizeof(b->in)) check(0, "lz_decompress");
+}
+
+static void bench_compression(void) {
+    static const char* words[] = { "block ", "inode ", "the ", "directory ", "of ", "a ", "file ", "and ", "\n" };
+    static CopyBench b;
+    static CodecBench c;
+    for (long i = 0; i < MYFS_FILE_MAX; ) {
+        const char* w = words[(i * 7 + i / 13) % 9];
+        for (; *w && i < MYFS_FILE_MAX; w++) b.data[i++] = *w;
+    }
+    memcpy(c.in, b.data, sizeof(c.in));
+    op_lz_compress(&c, 0);
+    check(c.len > 0, "lz_compress");
+    measure("lz_compress/size=16384", 2000, op_lz_compress, NULL, &c);
+    measure("lz_decompress/size=16384", 2000, op_lz_decompress, NULL, &c);
+
+    int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, "text");
+    check(dir >= 0, "/text");
+    b.dir = dir;
+    b.size = MYFS_FILE_MAX;
+    static const char* codecs[] = { "none", "lz" };
+    for (int codec = MYFS_COMPRESS_NONE; codec <= MYFS_COMPRESS_LZ; codec++) {
+        char name[64];
+        check(myfs_set_compression(bench_fs, codec) == 0, "set_compression");
+        snprintf(name, sizeof(name), "cp_to_text/codec=%s/size=%ld", codecs[codec], b.size);
+        measure(name, COPY_FILES, op_copy_in, reset_copy_in, &b);
+
+        snprintf(name, sizeof(name), "keep_%s", codecs[codec]);
+        int file = myfs_create_at(bench_fs, b.dir, name, b.data, b.size);
+        check(file >= 0, name);
+        b.file = file;
+        snprintf(name, sizeof(name), "cp_from_text/codec=%s/size=%ld", codecs[codec], b.size);
+        measure(name, 2000, op_copy_out, NULL, &b);
+    }
+    check(myfs_set_compression(bench_fs, MYFS_COMPRESS_NONE) == 0, "set_compression");
+}
+
+// Hashing one block, copying in identical files with deduplication off
+// and on (the write-path cost of a lookup against the blocks saved), and
+// cloning a file, which only adds references
+static void op_clone(void* ctx, long i) {
+    CopyBench* b = ctx;
+    char name[16];
+    snprintf(name, sizeof(name), "c%ld", i);
+    if (myfs_clone_at(bench_fs, b->file, b->dir, name) < 0) check(0, "clone");
+}
+
+static void op_xxh64(void* ctx, long i) {
+    (void)i;
+    CodecBench* b = ctx;
+    b->len = (int)xxh64(b->in, BLOCK_SIZE, 0);
+}
+
+static void bench_dedup(void) {
+    static CopyBench b;
+    static CodecBench c;
+    for (int i = 0; i < MYFS_FILE_MAX; i++) b.data[i] = (char)(i * 7 + i / 4096);
+    memcpy(c.in, b.data, BLOCK_SIZE);
+    measure("xxh64/size=4096", 20000, op_xxh64, NULL, &c);
+
+    int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, "dups");
+    check(dir >= 0, "/dups");
+    b.dir = dir;
+    b.size = MYFS_FILE_MAX;
+    for (int on = 0; on <= 1; on++) {
+        char name[64];
+        check(myfs_set_dedup(bench_fs, on) == 0, "set_dedup");
+        snprintf(name, sizeof(name), "cp_to_dup/dedup=%s/size=%ld", on ? "on" : "off", b.size);
+        measure(name, COPY_FILES, op_copy_in, reset_copy_in, &b);
+    }
+    check(myfs_set_dedup(bench_fs, 0) == 0, "set_dedup");
+
+    int file = myfs_create_at(bench_fs, b.dir, "orig", b.data, b.size);
+    check(file >= 0, "orig");
+    b.file = file;
+    char name[64];
+    snprintf(name, sizeof(name), "clone/size=%ld", b.size);
+    measure(name, COPY_FILES, op_clone, reset_copy_in, &b);
+}
+
+// CRC32C of one block with the table code and with the instruction, and
+// copying a file in and reading it back past the block cache with
+// checksums off and on: what verifying every read costs
+typedef struct {
+    uint32_t (*update)(uint32_t crc, const unsigned char* p, size_t len);
+    unsigned char in[BLOCK_SIZE];
+    uint32_t crc;
+} CrcBench;
+
+static void op_crc32c(void* ctx, long i) {
+    (void)i;
+    CrcBench* b = ctx;
+    b->crc = b->update(~0u, b->in, BLOCK_SIZE);
+}
+
+static void bench_checksums(void) {
+    static CrcBench c;
+    for (int i = 0; i < BLOCK_SIZE; i++) c.in[i] = (unsigned char)(i * 13);
+    crc32c(c.in, 0);
+    c.update = crc32c_sw;
+    measure("crc32c/impl=table/size=4096", 20000, op_crc32c, NULL, &c);
+    if (crc32c_update != crc32c_sw) {
+        c.update = crc32c_update;
+        measure("crc32c/impl=sse4.2/size=4096", 20000, op_crc32c, NULL, &c);
+    }
+
+    static CopyBench b;
+    for (int i = 0; i < MYFS_FILE_MAX; i++) b.data[i] = (char)(i * 11);
+    int dir = myfs_mkdir_at(bench_fs, MYFS_ROOT_INO, "summed");
+    check(dir >= 0, "/summed");
+    b.dir = dir;
+    b.size = MYFS_FILE_MAX;
+    struct myfs_cache_stats cs;
+    myfs_cache_stats(&cs);
+    for (int on = 0; on <= 1; on++) {
+        char name[64];
+        check(myfs_set_checksums(bench_fs, on) == 0, "set_checksums");
+        snprintf(name, sizeof(name), "cp_to/checksums=%s/size=%ld", on ? "on" : "off", b.size);
+        measure(name, COPY_FILES, op_copy_in, reset_copy_in, &b);
+
+        snprintf(name, sizeof(name), "keep%d", on);
+        int file = myfs_create_at(bench_fs, b.dir, name, b.data, b.size);
+        check(file >= 0, name);
+        b.file = file;
+        myfs_cache_set_limit(0);
+        snprintf(name, sizeof(name), "cp_from_uncached/checksums=%s/size=%ld", on ? "on" : "off", b.size);
+        measure(name, 2000, op_copy_out, NULL, &b);
+        myfs_cache_set_limit(cs.limit_bytes);
+    }
+    check(myfs_set_checksums(bench_fs, 0) == 0, "set_checksums");
+}
+
+static int write_json(const char* path, int cached) {
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) return -1;
+    fprintf(out, "{\"iterations\": %d, \"warmup\": %d, \"block_cache\": %s, \"benchmarks\": [", iterations, warmup,
+            cached ? "true" : "false");
+    for (int i = 0; i < result_count; i++) {
+        Result* r = &results[i];
+        double sorted[MAX_ITERATIONS];
+        memcpy(sorted, r->ns_per_op, iterations * sizeof(double));
+        qsort(sorted, iterations, sizeof(double), compare_double);
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f, "
+                     "\"ns_per_op_max\": %.1f, \"reads_per_op\": %.3f, \"writes_per_op\": %.3f, "
+                     "\"cache_hits_per_op\": %.3f}",
+                i ? "," : "", r->name, r->ops, sorted[iterations / 2], sorted[0], sorted[iterations - 1],
+                r->reads, r->writes, r->hits);
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-i iterations] [-w warmup] [-f filter] [-j json_file|-] [-n] [image]\n"
+                    "    -n  run with the block cache disabled, so every block read reaches the image\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char* json_path = NULL;
+    int cached = 1, opt;
+    while ((opt = getopt(argc, argv, "i:w:f:j:n")) != -1) {
+        if (opt == 'i') iterations = atoi(optarg);
+        else if (opt == 'w') warmup = atoi(optarg);
+        else if (opt == 'f') filter = optarg;
+        else if (opt == 'j') json_path = optarg;
+        else if (opt == 'n') cached = 0;
+        else { usage(argv[0]); return 1; }
+    }
+    if (iterations < 1 || iterations > MAX_ITERATIONS || warmup < 0 || argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* image = optind < argc ? argv[optind] : "bench_myfs.img";
+
+    // The image is formatted and deleted afterwards, so it must not be one
+    // that holds anything.
+    if (access(image, F_OK) == 0) {
+        fprintf(stderr, "Error: '%s' already exists; give a path for a new scratch image.\n", image);
+        return 1;
+    }
+    check(myfs_mkfs(image, BENCH_IMAGE_SIZE) == 0 && myfs_mount(image, &bench_fs) == 0, image);
+    if (!cached) myfs_cache_set_limit(0);
+
+    bench_path_depths();
+    bench_dir_sizes();
+    bench_alloc_fill();
+    bench_inodes();
+    bench_copies();
+    bench_compression();
+    bench_dedup();
+    bench_checksums();
+
+    int rc = myfs_unmount(bench_fs);
+    remove(image);
+    if (json_path && write_json(json_path, cached) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'.\n", json_path);
+        return 1;
+    }
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,4136 @@
+// libmyfs: the filesystem core behind myfs.h. Everything that knows the
+// on-disk format lives here; the shell in myfs.c only parses commands and
+// prints results.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include <sched.h>
+#include "myfs.h"
+
+// Filesystem Constants
+#define BLOCK_SIZE MYFS_BLOCK_SIZE
+#define MAX_INODES 512
+#define MAX_DATA_BLOCKS 8192
+#define MAX_FILENAME_LEN MYFS_NAME_MAX
+#define INODE_DIRECT_POINTERS 12
+#define ROOT_INODE_NUM MYFS_ROOT_INO
+#define MAX_PATH_DEPTH 64
+#define MAX_PATH_LEN MYFS_PATH_MAX
+#define NO_NAME_HINT ((uint32_t)-1)
+#define UNUSED_BLOCK MYFS_NO_BLOCK //clear sentinel for unused blocks
+#define MYFS_MAGIC 0x4D594653 // "MYFS"
+_Static_assert(MYFS_FILE_MAX == INODE_DIRECT_POINTERS * BLOCK_SIZE, "public size limit matches the block map");
+
+// On-disk inode: fixed 128-byte little-endian record, so a block holds an
+// exact number of inodes and no inode ever straddles two blocks.
+#define INODE_SIZE 128
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define INODE_TABLE_BLOCKS (MAX_INODES / INODES_PER_BLOCK)
+#define INODE_INLINE_SIZE 80 // body bytes at offset 32: direct_blocks[] plus the spare tail
+#define INODE_FLAG_INLINE_DATA 0x0001 // file data or directory entries live in the inode body
+#define INODE_FLAG_COMPRESSED 0x0002  // file data is stored in clusters, some of them compressed
+#define INLINE_DIRENT_HEADER 5 // inline directory entry: u32 inode number, u8 name length, name
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(DirectoryEntry))
+_Static_assert(BLOCK_SIZE % INODE_SIZE == 0, "inodes must tile a block exactly");
+
+//disk Structure Layout
+#define SUPERBLOCK_BLOCK 0
+#define INODE_BITMAP_BLOCK 1
+#define DATA_BITMAP_BLOCK 2
+#define INODE_TABLE_START_BLOCK 3
+
+// Data Structures
+typedef struct {
+    uint32_t total_size;
+    uint32_t num_inodes;
+    uint32_t num_data_blocks;
+    uint32_t inode_bitmap_block;
+    uint32_t data_bitmap_block;
+    uint32_t inode_table_start_block;
+    uint32_t data_blocks_start_block;
+    uint32_t magic;
+    uint32_t compression; // MYFS_COMPRESS_* applied to files as they are created; 0 on older images
+    uint32_t dedup;       // new files share identical blocks
+    uint32_t refcount_block;    // first block of the reference counts, 0 if never reserved
+    uint32_t dedup_index_block; // first block of the hash index, 0 if never reserved
+    uint32_t checksums;         // blocks have CRC32Cs, verified as they are read
+    uint32_t checksum_block;    // first block of the checksum table, 0 if never reserved
+    uint32_t sb_checksum;       // with checksums on: CRC32C of this struct with this field 0
+} Superblock;
+
+// In-memory inode. Never memcpy'd to disk; see encode_inode/decode_inode.
+typedef struct {
+    uint16_t mode; // 0 for file, 1 for directory
+    uint16_t flags;
+    uint32_t size;
+    uint32_t link_count;
+    int64_t creation_time;
+    int64_t modification_time;
+    union {
+        uint32_t direct_blocks[INODE_DIRECT_POINTERS];
+        unsigned char inline_data[INODE_INLINE_SIZE]; // valid when INODE_FLAG_INLINE_DATA is set
+    };
+    uint32_t parent;      // directories only: inode number that ".." resolves to
+    uint32_t entry_count; // directories only: live entries, excluding "." and ".."
+    uint32_t free_slot;   // block directories only: no free entry slot below this index
+    uint32_t name_slot;   // directories only: hint for this directory's entry index in its parent
+} __attribute__((aligned(64))) Inode;
+
+/*
+ * On-disk inode layout (all fields little-endian):
+ *   0   u16  mode
+ *   2   u16  flags
+ *   4   u32  size
+ *   8   u32  link_count
+ *   12  u32  reserved
+ *   16  i64  creation_time
+ *   24  i64  modification_time
+ *   32  u32  direct_blocks[12]     (or 80 bytes of inline data / entries)
+ *   80  ...  reserved, zero
+ *   112 u32  parent (directories)
+ *   116 u32  entry_count (directories)
+ *   120 u32  free_slot hint (directories)
+ *   124 u32  name_slot hint (directories): entry index within the parent
+ *
+ * Directories never store "." and ".." entries; both are resolved from
+ * the inode itself.
+ */
+#define INODE_OFF_MODE 0
+#define INODE_OFF_FLAGS 2
+#define INODE_OFF_SIZE 4
+#define INODE_OFF_LINKS 8
+#define INODE_OFF_CTIME 16
+#define INODE_OFF_MTIME 24
+#define INODE_OFF_BLOCKS 32
+#define INODE_OFF_INLINE 32
+#define INODE_OFF_PARENT 112
+#define INODE_OFF_ENTRY_COUNT 116
+#define INODE_OFF_FREE_SLOT 120
+#define INODE_OFF_NAME_SLOT 124
+
+typedef struct {
+    char name[MAX_FILENAME_LEN + 1];
+    uint32_t inode_number;
+} DirectoryEntry;
+
+/*
+ * Locking. Any number of threads may call into one handle at once.
+ *   inode_locks[n]   rwlock per inode. Shared to read a file's data or look
+ *                    up a name in a directory; exclusive to change either.
+ *                    A directory's exclusive lock is its directory lock and
+ *                    covers its entries, entry count and link count.
+ *   itable_locks[b]  one mutex per inode-table block, taken inside
+ *                    read_inode/write_inode so that updates to different
+ *                    inodes sharing a block are not lost.
+ *   flush_lock       writing the allocation bitmaps back to the image.
+ *   cwd_lock         the working directory.
+ * Allocation itself takes no lock: bits are claimed and released with
+ * atomic operations on 64-bit bitmap words (see claim_bit).
+ * Inode locks are taken directory before file, and parent directory before
+ * child; at most two are held at once. The other locks are innermost.
+ * Block transfers use pread/pwrite, which need no lock.
+ */
+#define INODE_TABLE_LOCKS (MAX_INODES / INODES_PER_BLOCK)
+
+// Per-image mount state; everything that used to be a process global.
+// Entry of the block hash index: a block of a file, under the hash of its
+// contents, and the inode that held it when it was indexed. On disk as
+// le64, le32, le32.
+typedef struct {
+    uint64_t hash;
+    uint32_t block; // UNUSED_BLOCK: empty
+    uint32_t owner;
+} DedupEntry;
+
+#define DEDUP_ENTRY_SIZE 16
+#define DEDUP_PROBES 8 // index slots looked at from a hash's home slot
+#define REFS_PER_BLOCK (BLOCK_SIZE / 2)
+#define MAX_REFS UINT16_MAX
+_Static_assert(MAX_DATA_BLOCKS * DEDUP_ENTRY_SIZE / BLOCK_SIZE <= 64, "index blocks must fit a dirty mask");
+
+// The checksum table: one le32 CRC32C per block of the image, by block number.
+#define MAX_IMAGE_BLOCKS (INODE_TABLE_START_BLOCK + INODE_TABLE_BLOCKS + MAX_DATA_BLOCKS)
+#define CRCS_PER_BLOCK (BLOCK_SIZE / 4)
+_Static_assert((MAX_IMAGE_BLOCKS + CRCS_PER_BLOCK - 1) / CRCS_PER_BLOCK <= 64, "checksum blocks must fit a dirty mask");
+
+struct myfs {
+    int fd;
+    Superblock sb;
+    uint64_t inode_bitmap[MAX_INODES / 64];     // bit n is bit n%64 of word n/64, as on disk
+    uint64_t data_block_bitmap[MAX_DATA_BLOCKS / 64];
+    int inode_bitmap_dirty; // the bitmap differs from its block on disk
+    int data_bitmap_dirty;
+    int batch_depth;    // > 0 while myfs_batch_begin defers bitmap write-back
+    uint64_t cache_id;  // key of this mount's blocks in the shared block cache
+    int current_working_directory_inode;
+    char current_working_directory_path[MAX_PATH_LEN]; // kept in step by myfs_chdir; empty if unknown
+    pthread_rwlock_t inode_locks[MAX_INODES];
+    pthread_mutex_t itable_locks[INODE_TABLE_LOCKS];
+    pthread_mutex_t flush_lock;
+    pthread_mutex_t cwd_lock;
+    struct myfs_io_stats io; // updated with relaxed atomics; see COUNT
+    uint16_t refs[MAX_DATA_BLOCKS]; // extra references per data block; see Shared blocks
+    uint64_t refs_dirty;            // reference-count blocks that differ from the image, one bit each
+    pthread_mutex_t share_lock;     // taken to change a reference count
+    DedupEntry dedup_index[MAX_DATA_BLOCKS];
+    uint32_t dedup_slots;           // slots in use of dedup_index: a power of two, 0 if there is no index
+    uint64_t index_dirty;           // index blocks that differ from the image, one bit each
+    pthread_mutex_t index_lock;
+    uint32_t crcs[MAX_IMAGE_BLOCKS]; // CRC32C per block of the image; see Checksums
+    uint64_t crcs_dirty;             // checksum-table blocks that differ from the image, one bit each
+    int crc_pass;                    // myfs_set_checksums is computing them; writes take crc_lock
+    uint64_t crc_written[MAX_IMAGE_BLOCKS / 64 + 1]; // during that pass: written since the pass read them
+    pthread_mutex_t crc_lock;
+};
+
+// Adds to one of the handle's I/O counters. Counters are only ever read as
+// a snapshot by myfs_io_stats, so no ordering is needed.
+#define COUNT(fs, field, n) __atomic_fetch_add(&(fs)->io.field, (uint64_t)(n), __ATOMIC_RELAXED)
+
+// Sticky per thread: a block transfer failed during the current call, with
+// MYFS_EIO, or MYFS_ECORRUPT for a block that failed its checksum.
+static _Thread_local int io_error;
+
+struct myfs_file {
+    myfs_t* fs;
+    uint32_t inode_num;
+    int flags;
+    long position;
+};
+
+struct myfs_dir {
+    myfs_t* fs;
+    uint32_t inode_num;
+    Inode inode;           // inline directories: snapshot taken by opendir; block directories: refreshed by readdir
+    int inline_offset;     // inline directories: offset of the next packed entry
+    int slot;              // block directories: next slot to look at
+    uint32_t loaded_block; // data block held in 'buffer', UNUSED_BLOCK if none
+    char buffer[BLOCK_SIZE];
+};
+
+// Bitmap Helpers
+static void set_bit(unsigned char* bitmap, int n) { bitmap[n/8] |= (1 << (n%8)); }
+
+// Mounted bitmaps are shared between threads and only touched atomically.
+static int get_bit(const uint64_t* words, int n) {
+    return (__atomic_load_n(&words[n / 64], __ATOMIC_ACQUIRE) >> (n % 64)) & 1;
+}
+
+// Free bits among the first 'nbits' of the bitmap's word 'w'.
+static uint64_t free_bits(uint64_t word, int w, int nbits) {
+    uint64_t free_mask = ~word;
+    if (w == nbits / 64) free_mask &= (UINT64_C(1) << (nbits % 64)) - 1;
+    return free_mask;
+}
+
+// Little-endian encode/decode helpers
+static void put_le16(unsigned char* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_le32(unsigned char* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (8 * i); }
+static void put_le64(unsigned char* p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = v >> (8 * i); }
+static uint16_t get_le16(const unsigned char* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t get_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint64_t get_le64(const unsigned char* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void encode_inode(const Inode* inode, unsigned char* raw) {
+    memset(raw, 0, INODE_SIZE);
+    put_le16(raw + INODE_OFF_MODE, inode->mode);
+    put_le16(raw + INODE_OFF_FLAGS, inode->flags);
+    put_le32(raw + INODE_OFF_SIZE, inode->size);
+    put_le32(raw + INODE_OFF_LINKS, inode->link_count);
+    put_le64(raw + INODE_OFF_CTIME, (uint64_t)inode->creation_time);
+    put_le64(raw + INODE_OFF_MTIME, (uint64_t)inode->modification_time);
+    put_le32(raw + INODE_OFF_PARENT, inode->parent);
+    put_le32(raw + INODE_OFF_ENTRY_COUNT, inode->entry_count);
+    put_le32(raw + INODE_OFF_FREE_SLOT, inode->free_slot);
+    put_le32(raw + INODE_OFF_NAME_SLOT, inode->name_slot);
+    if (inode->flags & INODE_FLAG_INLINE_DATA) {
+        memcpy(raw + INODE_OFF_INLINE, inode->inline_data, INODE_INLINE_SIZE);
+        return;
+    }
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++)
+        put_le32(raw + INODE_OFF_BLOCKS + 4 * i, inode->direct_blocks[i]);
+}
+
+// Returns MYFS_ECORRUPT for an inline inode whose size overruns its body;
+// fsck and the layout report decode the table themselves and judge that.
+static int decode_inode(const unsigned char* raw, Inode* inode) {
+    memset(inode, 0, sizeof(Inode));
+    inode->mode = get_le16(raw + INODE_OFF_MODE);
+    inode->flags = get_le16(raw + INODE_OFF_FLAGS);
+    inode->size = get_le32(raw + INODE_OFF_SIZE);
+    inode->link_count = get_le32(raw + INODE_OFF_LINKS);
+    inode->creation_time = (int64_t)get_le64(raw + INODE_OFF_CTIME);
+    inode->modification_time = (int64_t)get_le64(raw + INODE_OFF_MTIME);
+    inode->parent = get_le32(raw + INODE_OFF_PARENT);
+    inode->entry_count = get_le32(raw + INODE_OFF_ENTRY_COUNT);
+    inode->free_slot = get_le32(raw + INODE_OFF_FREE_SLOT);
+    inode->name_slot = get_le32(raw + INODE_OFF_NAME_SLOT);
+    if (inode->flags & INODE_FLAG_INLINE_DATA) {
+        memcpy(inode->inline_data, raw + INODE_OFF_INLINE, INODE_INLINE_SIZE);
+        return inode->size > INODE_INLINE_SIZE ? MYFS_ECORRUPT : MYFS_OK;
+    }
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++)
+        inode->direct_blocks[i] = get_le32(raw + INODE_OFF_BLOCKS + 4 * i);
+    return MYFS_OK;
+}
+
+// Shared Block Cache
+// One pool for every image mounted in the process, bounded in bytes and
+// evicting the least recently used block first. Blocks are keyed by mount,
+// not by image file; myfs_mount's lock keeps an image to one mount. Writes
+// go through to the image, so an evicted block is never dirty and unmount
+// only has to drop its entries.
+#define CACHE_BUCKETS 4096
+#define CACHE_DEFAULT_LIMIT (8L * 1024 * 1024)
+
+typedef struct CacheEntry {
+    uint64_t mount;
+    uint32_t block;
+    struct CacheEntry* hash_next;
+    struct CacheEntry* lru_prev; // towards the most recently used end
+    struct CacheEntry* lru_next;
+    char data[BLOCK_SIZE];
+} CacheEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    CacheEntry* buckets[CACHE_BUCKETS];
+    CacheEntry* lru_head; // most recently used
+    CacheEntry* lru_tail; // next to evict
+    size_t limit;
+    size_t used;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t next_mount;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .limit = CACHE_DEFAULT_LIMIT, .next_mount = 1 };
+
+static unsigned cache_bucket(uint64_t mount, uint32_t block) {
+    return (unsigned)((mount * 0x9E3779B97F4A7C15ULL + block) % CACHE_BUCKETS);
+}
+
+static void cache_lru_unlink(CacheEntry* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else cache.lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else cache.lru_tail = e->lru_prev;
+}
+
+static void cache_lru_push(CacheEntry* e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache.lru_head;
+    if (cache.lru_head) cache.lru_head->lru_prev = e; else cache.lru_tail = e;
+    cache.lru_head = e;
+}
+
+static CacheEntry* cache_find(uint64_t mount, uint32_t block) {
+    for (CacheEntry* e = cache.buckets[cache_bucket(mount, block)]; e; e = e->hash_next) {
+        if (e->mount == mount && e->block == block) return e;
+    }
+    return NULL;
+}
+
+static void cache_remove(CacheEntry* e) {
+    CacheEntry** p = &cache.buckets[cache_bucket(e->mount, e->block)];
+    while (*p != e) p = &(*p)->hash_next;
+    *p = e->hash_next;
+    cache_lru_unlink(e);
+    cache.used -= BLOCK_SIZE;
+    free(e);
+}
+
+static void cache_shrink(size_t limit) {
+    while (cache.used > limit && cache.lru_tail) cache_remove(cache.lru_tail);
+}
+
+// Caller holds cache.lock. Stores a copy of the block, replacing any older one.
+static void cache_store(uint64_t mount, uint32_t block, const void* data) {
+    CacheEntry* e = cache_find(mount, block);
+    if (e) {
+        cache_lru_unlink(e);
+    } else {
+        if (cache.limit < BLOCK_SIZE) return;
+        cache_shrink(cache.limit - BLOCK_SIZE);
+        e = malloc(sizeof(CacheEntry));
+        if (!e) return; // the cache is an optimisation; run uncached
+        e->mount = mount;
+        e->block = block;
+        unsigned b = cache_bucket(mount, block);
+        e->hash_next = cache.buckets[b];
+        cache.buckets[b] = e;
+        cache.used += BLOCK_SIZE;
+    }
+    memcpy(e->data, data, BLOCK_SIZE);
+    cache_lru_push(e);
+}
+
+// Copies every block of the range into 'buffer' if all of them are cached.
+static int cache_lookup(uint64_t mount, uint32_t first_block, int count, char* buffer) {
+    CacheEntry* found[INODE_DIRECT_POINTERS];
+    if (count > INODE_DIRECT_POINTERS) return 0;
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < count; i++) {
+        found[i] = cache_find(mount, first_block + i);
+        if (!found[i]) {
+            cache.misses++;
+            pthread_mutex_unlock(&cache.lock);
+            return 0;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(buffer + (long)i * BLOCK_SIZE, found[i]->data, BLOCK_SIZE);
+        cache_lru_unlink(found[i]);
+        cache_lru_push(found[i]);
+    }
+    cache.hits++;
+    pthread_mutex_unlock(&cache.lock);
+    return 1;
+}
+
+static void cache_fill(uint64_t mount, uint32_t first_block, int count, const char* buffer) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < count; i++) cache_store(mount, first_block + i, buffer + (long)i * BLOCK_SIZE);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_drop_mount(uint64_t mount) {
+    pthread_mutex_lock(&cache.lock);
+    for (CacheEntry* e = cache.lru_head; e; ) {
+        CacheEntry* next = e->lru_next;
+        if (e->mount == mount) cache_remove(e);
+        e = next;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void myfs_cache_set_limit(size_t bytes) {
+    pthread_mutex_lock(&cache.lock);
+    cache.limit = bytes;
+    cache_shrink(bytes);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void myfs_cache_stats(struct myfs_cache_stats* out) {
+    pthread_mutex_lock(&cache.lock);
+    out->limit_bytes = cache.limit;
+    out->used_bytes = cache.used;
+    out->hits = cache.hits;
+    out->misses = cache.misses;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Checksums
+// CRC32C (Castagnoli polynomial, reflected), with the SSE4.2 crc32
+// instruction where the processor has it and slice-by-8 tables elsewhere.
+// The implementation is picked once per process.
+#define CRC32C_POLY 0x82F63B78u
+#define SCRUB_READ_BLOCKS 64 // blocks per transfer when checksums are computed or scrubbed
+
+static uint32_t crc32c_tables[8][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char* p, size_t len);
+static const char* crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = crc32c_tables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v = get_le64(p) ^ crc;
+        crc = crc32c_tables[7][v & 0xff] ^ crc32c_tables[6][(v >> 8) & 0xff] ^
+              crc32c_tables[5][(v >> 16) & 0xff] ^ crc32c_tables[4][(v >> 24) & 0xff] ^
+              crc32c_tables[3][(v >> 32) & 0xff] ^ crc32c_tables[2][(v >> 40) & 0xff] ^
+              crc32c_tables[1][(v >> 48) & 0xff] ^ crc32c_tables[0][v >> 56];
+    }
+    while (len-- > 0) crc = crc32c_tables[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction has a latency of three cycles but issues every
+// cycle, so long inputs are taken as three lanes of CRC32C_LANE bytes at
+// once. Each lane's CRC is then moved past the lanes after it with
+// crc32c_lane_shift: advancing a CRC over zero bytes is linear, so a table
+// per byte of the CRC does it in four lookups.
+#define CRC32C_LANE 1360 // a third of a block, rounded down to whole words
+
+static uint32_t crc32c_lane_shift[4][256];
+
+// get_le64 is not inlined across the target attribute; x86 is little-endian.
+__attribute__((target("sse4.2"))) static inline uint64_t crc32c_load(const unsigned char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static uint32_t crc32c_shift(uint32_t crc) {
+    return crc32c_lane_shift[0][crc & 0xff] ^ crc32c_lane_shift[1][(crc >> 8) & 0xff] ^
+           crc32c_lane_shift[2][(crc >> 16) & 0xff] ^ crc32c_lane_shift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw_serial(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) c = _mm_crc32_u64(c, crc32c_load(p));
+    crc = (uint32_t)c;
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+    for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE) {
+        uint64_t a = crc, b = 0, c = 0;
+        for (int i = 0; i < CRC32C_LANE; i += 8) {
+            a = _mm_crc32_u64(a, crc32c_load(p + i));
+            b = _mm_crc32_u64(b, crc32c_load(p + CRC32C_LANE + i));
+            c = _mm_crc32_u64(c, crc32c_load(p + 2 * CRC32C_LANE + i));
+        }
+        crc = crc32c_shift(crc32c_shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+    }
+    return crc32c_hw_serial(crc, p, len);
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        crc32c_tables[0][n] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int n = 0; n < 256; n++)
+            crc32c_tables[t][n] = (crc32c_tables[t - 1][n] >> 8) ^ crc32c_tables[0][crc32c_tables[t - 1][n] & 0xff];
+    }
+    crc32c_update = crc32c_sw;
+    crc32c_impl = "table";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        static const unsigned char zeros[CRC32C_LANE];
+        for (int k = 0; k < 4; k++) {
+            for (uint32_t v = 0; v < 256; v++) crc32c_lane_shift[k][v] = crc32c_hw_serial(v << (8 * k), zeros, CRC32C_LANE);
+        }
+        crc32c_update = crc32c_hw;
+        crc32c_impl = "sse4.2";
+    }
+#endif
+}
+
+static uint32_t crc32c(const void* data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~0u, data, len);
+}
+
+// Blocks of the image, and of the checksum table.
+static uint32_t image_blocks(const Superblock* sb) {
+    return sb->data_blocks_start_block + sb->num_data_blocks;
+}
+
+static int checksum_table_blocks(const Superblock* sb) {
+    return (image_blocks(sb) + CRCS_PER_BLOCK - 1) / CRCS_PER_BLOCK;
+}
+
+// Whether writes of the block keep its checksum: every block but the
+// superblock (checksummed in itself) and the table's own blocks.
+static int block_has_crc(myfs_t* fs, uint32_t block_num) {
+    uint32_t table = fs->sb.checksum_block;
+    return table && block_num != SUPERBLOCK_BLOCK && block_num < image_blocks(&fs->sb) &&
+           (block_num < table || block_num >= table + checksum_table_blocks(&fs->sb));
+}
+
+static void set_crc(myfs_t* fs, uint32_t block_num, uint32_t crc) {
+    __atomic_store_n(&fs->crcs[block_num], crc, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&fs->crcs_dirty, UINT64_C(1) << (block_num / CRCS_PER_BLOCK), __ATOMIC_RELEASE);
+}
+
+// Records the checksums of blocks just written. While myfs_set_checksums
+// computes them from the image, each one is stored under crc_lock and
+// marked written, so the pass does not replace it with one of older data.
+static void update_crcs(myfs_t* fs, uint32_t first_block, int count, const char* buffer) {
+    int pass = __atomic_load_n(&fs->crc_pass, __ATOMIC_ACQUIRE);
+    if (!pass && !__atomic_load_n(&fs->sb.checksums, __ATOMIC_ACQUIRE)) return;
+    for (int i = 0; i < count; i++) {
+        uint32_t b = first_block + i;
+        if (!block_has_crc(fs, b)) continue;
+        uint32_t crc = crc32c(buffer + (long)i * BLOCK_SIZE, BLOCK_SIZE);
+        if (pass) pthread_mutex_lock(&fs->crc_lock);
+        set_crc(fs, b, crc);
+        if (pass) {
+            fs->crc_written[b / 64] |= UINT64_C(1) << (b % 64);
+            pthread_mutex_unlock(&fs->crc_lock);
+        }
+    }
+}
+
+// Checks blocks just read from the image. Returns the first that fails, or -1.
+static long verify_crcs(myfs_t* fs, uint32_t first_block, int count, const char* buffer) {
+    if (!__atomic_load_n(&fs->sb.checksums, __ATOMIC_ACQUIRE)) return -1;
+    long bad = -1;
+    for (int i = 0; i < count; i++) {
+        uint32_t b = first_block + i;
+        if (!block_has_crc(fs, b)) continue;
+        COUNT(fs, checksums_verified, 1);
+        if (crc32c(buffer + (long)i * BLOCK_SIZE, BLOCK_SIZE) != __atomic_load_n(&fs->crcs[b], __ATOMIC_RELAXED)) {
+            COUNT(fs, checksum_failures, 1);
+            if (bad < 0) bad = b;
+        }
+    }
+    return bad;
+}
+
+// Low-Level I/O
+// A failed transfer sets io_error instead of exiting; the public call
+// in progress then reports it (see fs_done).
+// Multi-block transfers: one positioned transfer for 'count' consecutive blocks.
+// Both go through the shared block cache: a read is served from it when
+// every block of the range is cached, and a write updates it after the
+// image has been written. Every block is only transferred under the lock
+// that guards its contents, so a read cannot refill the cache with data a
+// concurrent write has just replaced.
+// With checksums on, a read that reaches the image is verified before it
+// is cached, and a write records the new checksums.
+// Transfers are counted by the kind of block; directory blocks sit among
+// the data blocks, so directory code says so through the *_dir_block calls.
+static int block_kind(myfs_t* fs, uint32_t block_num) {
+    if (block_num == SUPERBLOCK_BLOCK) return MYFS_IO_SUPERBLOCK;
+    if (block_num == fs->sb.inode_bitmap_block || block_num == fs->sb.data_bitmap_block) return MYFS_IO_BITMAP;
+    if (block_num < fs->sb.data_blocks_start_block) return MYFS_IO_INODE_TABLE;
+    return MYFS_IO_DATA;
+}
+
+// The transfer itself, past the cache. Past the end of a short image the
+// rest reads as zeros.
+static int read_image(myfs_t* fs, uint32_t first_block, int count, void* buffer) {
+    size_t len = (size_t)count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pread(fs->fd, (char*)buffer + done, len - done, (off_t)first_block * BLOCK_SIZE + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            io_error = MYFS_EIO;
+            return MYFS_EIO;
+        }
+        if (n == 0) {
+            memset((char*)buffer + done, 0, len - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int read_blocks_as(myfs_t* fs, int kind, uint32_t first_block, int count, void* buffer) {
+    if (cache_lookup(fs->cache_id, first_block, count, buffer)) {
+        COUNT(fs, cache_hits[kind], count);
+        return 0;
+    }
+    COUNT(fs, reads[kind], count);
+    COUNT(fs, bytes_read, (uint64_t)count * BLOCK_SIZE);
+    if (read_image(fs, first_block, count, buffer) != 0) return MYFS_EIO;
+    if (verify_crcs(fs, first_block, count, buffer) >= 0) {
+        // Not cached, so a later read goes back to the image.
+        if (!io_error) io_error = MYFS_ECORRUPT;
+        return MYFS_ECORRUPT;
+    }
+    cache_fill(fs->cache_id, first_block, count, buffer);
+    return 0;
+}
+
+static int write_blocks_as(myfs_t* fs, int kind, uint32_t first_block, int count, const void* buffer) {
+    COUNT(fs, writes[kind], count);
+    COUNT(fs, bytes_written, (uint64_t)count * BLOCK_SIZE);
+    size_t len = (size_t)count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fs->fd, (const char*)buffer + done, len - done, (off_t)first_block * BLOCK_SIZE + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            io_error = MYFS_EIO;
+            return MYFS_EIO;
+        }
+        done += n;
+    }
+    update_crcs(fs, first_block, count, buffer);
+    cache_fill(fs->cache_id, first_block, count, buffer);
+    return 0;
+}
+
+static int read_blocks(myfs_t* fs, uint32_t first_block, int count, void* buffer) {
+    return read_blocks_as(fs, block_kind(fs, first_block), first_block, count, buffer);
+}
+
+static int write_blocks(myfs_t* fs, uint32_t first_block, int count, const void* buffer) {
+    return write_blocks_as(fs, block_kind(fs, first_block), first_block, count, buffer);
+}
+
+static int read_block(myfs_t* fs, uint32_t block_num, void* buffer) {
+    return read_blocks(fs, block_num, 1, buffer);
+}
+
+static int write_block(myfs_t* fs, uint32_t block_num, const void* buffer) {
+    return write_blocks(fs, block_num, 1, buffer);
+}
+
+// A directory's entry block, by its index among the data blocks.
+static int read_dir_block(myfs_t* fs, uint32_t data_block, void* buffer) {
+    return read_blocks_as(fs, MYFS_IO_DIRECTORY, fs->sb.data_blocks_start_block + data_block, 1, buffer);
+}
+
+static int write_dir_block(myfs_t* fs, uint32_t data_block, const void* buffer) {
+    return write_blocks_as(fs, MYFS_IO_DIRECTORY, fs->sb.data_blocks_start_block + data_block, 1, buffer);
+}
+
+// Length of the run of physically consecutive blocks starting at direct_blocks[i].
+static int contiguous_run(const uint32_t* blocks, int i, int limit) {
+    int n = 1;
+    while (i + n < limit && blocks[i + n] != UNUSED_BLOCK && blocks[i + n] == blocks[i] + n) n++;
+    return n;
+}
+
+static int read_inode(myfs_t* fs, int inode_num, Inode* inode) {
+    int table_block = inode_num / INODES_PER_BLOCK;
+    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+    unsigned char buffer[BLOCK_SIZE];
+    COUNT(fs, inode_reads, 1);
+    pthread_mutex_lock(&fs->itable_locks[table_block]);
+    int rc = read_block(fs, fs->sb.inode_table_start_block + table_block, buffer);
+    pthread_mutex_unlock(&fs->itable_locks[table_block]);
+    int decoded = decode_inode(buffer + offset, inode);
+    return rc != 0 ? rc : decoded;
+}
+
+// Read-modify-write of the table block, under its lock so that a
+// concurrent write to a neighbouring inode is not undone.
+static int write_inode(myfs_t* fs, int inode_num, const Inode* inode) {
+    int table_block = inode_num / INODES_PER_BLOCK;
+    int offset = (inode_num % INODES_PER_BLOCK) * INODE_SIZE;
+    unsigned char buffer[BLOCK_SIZE];
+    COUNT(fs, inode_writes, 1);
+    pthread_mutex_lock(&fs->itable_locks[table_block]);
+    int rc = read_block(fs, fs->sb.inode_table_start_block + table_block, buffer);
+    if (rc == 0) {
+        encode_inode(inode, buffer + offset);
+        rc = write_block(fs, fs->sb.inode_table_start_block + table_block, buffer);
+    }
+    pthread_mutex_unlock(&fs->itable_locks[table_block]);
+    return rc;
+}
+
+// Inode locks. Callers resolve a name to an inode number without holding
+// its lock, so by the time the lock is taken the inode may have been
+// removed; lock_inode then fails with MYFS_ENOENT and holds nothing.
+static int lock_inode(myfs_t* fs, uint32_t inode_num, int exclusive) {
+    if (exclusive) pthread_rwlock_wrlock(&fs->inode_locks[inode_num]);
+    else pthread_rwlock_rdlock(&fs->inode_locks[inode_num]);
+    if (!get_bit(fs->inode_bitmap, inode_num)) {
+        pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+        return MYFS_ENOENT;
+    }
+    return 0;
+}
+
+static void unlock_inode(myfs_t* fs, uint32_t inode_num) {
+    pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+}
+
+// Writes one bitmap back if it is dirty. The flag is cleared before the
+// words are read, so a bit that changes meanwhile marks it dirty again
+// and is picked up by the next write-back. Caller holds flush_lock.
+static void flush_bitmap(myfs_t* fs, const uint64_t* words, int nwords, uint32_t block_num, int* dirty) {
+    if (!__atomic_exchange_n(dirty, 0, __ATOMIC_ACQ_REL)) return;
+    COUNT(fs, bitmap_writebacks, 1);
+    unsigned char buffer[BLOCK_SIZE] = {0};
+    for (int i = 0; i < nwords; i++) put_le64(buffer + 8 * i, __atomic_load_n(&words[i], __ATOMIC_ACQUIRE));
+    if (write_block(fs, block_num, buffer) != 0) __atomic_store_n(dirty, 1, __ATOMIC_RELEASE);
+}
+
+// Writes back the dirty blocks of the reference counts and the hash index.
+// Caller holds flush_lock.
+static void flush_share_tables(myfs_t* fs) {
+    unsigned char buffer[BLOCK_SIZE];
+    uint64_t dirty = fs->sb.refcount_block ? __atomic_exchange_n(&fs->refs_dirty, 0, __ATOMIC_ACQ_REL) : 0;
+    for (int b = 0; dirty; b++, dirty >>= 1) {
+        if (!(dirty & 1)) continue;
+        for (int i = 0; i < REFS_PER_BLOCK; i++) {
+            int n = b * REFS_PER_BLOCK + i;
+            put_le16(buffer + 2 * i, n < MAX_DATA_BLOCKS ? __atomic_load_n(&fs->refs[n], __ATOMIC_RELAXED) : 0);
+        }
+        if (write_block(fs, fs->sb.refcount_block + b, buffer) != 0)
+            __atomic_fetch_or(&fs->refs_dirty, UINT64_C(1) << b, __ATOMIC_RELEASE);
+    }
+    dirty = fs->sb.dedup_index_block ? __atomic_exchange_n(&fs->index_dirty, 0, __ATOMIC_ACQ_REL) : 0;
+    for (int b = 0; dirty; b++, dirty >>= 1) {
+        if (!(dirty & 1)) continue;
+        pthread_mutex_lock(&fs->index_lock);
+        for (int i = 0; i < BLOCK_SIZE / DEDUP_ENTRY_SIZE; i++) {
+            const DedupEntry* e = &fs->dedup_index[b * (BLOCK_SIZE / DEDUP_ENTRY_SIZE) + i];
+            put_le64(buffer + DEDUP_ENTRY_SIZE * i, e->hash);
+            put_le32(buffer + DEDUP_ENTRY_SIZE * i + 8, e->block);
+            put_le32(buffer + DEDUP_ENTRY_SIZE * i + 12, e->owner);
+        }
+        pthread_mutex_unlock(&fs->index_lock);
+        if (write_block(fs, fs->sb.dedup_index_block + b, buffer) != 0)
+            __atomic_fetch_or(&fs->index_dirty, UINT64_C(1) << b, __ATOMIC_RELEASE);
+    }
+}
+
+// Writes back the dirty blocks of the checksum table. Caller holds flush_lock.
+static void flush_checksums(myfs_t* fs) {
+    unsigned char buffer[BLOCK_SIZE];
+    uint64_t dirty = fs->sb.checksum_block ? __atomic_exchange_n(&fs->crcs_dirty, 0, __ATOMIC_ACQ_REL) : 0;
+    for (int b = 0; dirty; b++, dirty >>= 1) {
+        if (!(dirty & 1)) continue;
+        for (int i = 0; i < CRCS_PER_BLOCK; i++) {
+            int n = b * CRCS_PER_BLOCK + i;
+            put_le32(buffer + 4 * i, n < MAX_IMAGE_BLOCKS ? __atomic_load_n(&fs->crcs[n], __ATOMIC_RELAXED) : 0);
+        }
+        if (write_block(fs, fs->sb.checksum_block + b, buffer) != 0)
+            __atomic_fetch_or(&fs->crcs_dirty, UINT64_C(1) << b, __ATOMIC_RELEASE);
+    }
+}
+
+// Also writes back the reference counts and hash index, which change with
+// allocation and are deferred the same way, and then the checksums of all
+// of these.
+static void sync_bitmaps(myfs_t* fs) {
+    flush_bitmap(fs, fs->inode_bitmap, MAX_INODES / 64, fs->sb.inode_bitmap_block, &fs->inode_bitmap_dirty);
+    flush_bitmap(fs, fs->data_block_bitmap, MAX_DATA_BLOCKS / 64, fs->sb.data_bitmap_block, &fs->data_bitmap_dirty);
+    flush_share_tables(fs);
+    flush_checksums(fs);
+}
+
+// Ends a public call: writes back dirty bitmaps unless a batch is open, and
+// turns any block I/O failure seen during the call into MYFS_EIO, or
+// MYFS_ECORRUPT for a block that failed its checksum. If
+// another thread is already writing the bitmaps back, this call leaves
+// them to it (or to the next call, sync or unmount) instead of waiting.
+static long fs_done(myfs_t* fs, long rc) {
+    if (__atomic_load_n(&fs->batch_depth, __ATOMIC_ACQUIRE) == 0 &&
+        (__atomic_load_n(&fs->inode_bitmap_dirty, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&fs->data_bitmap_dirty, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&fs->refs_dirty, __ATOMIC_ACQUIRE) || __atomic_load_n(&fs->index_dirty, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&fs->crcs_dirty, __ATOMIC_ACQUIRE)) &&
+        pthread_mutex_trylock(&fs->flush_lock) == 0) {
+        sync_bitmaps(fs);
+        pthread_mutex_unlock(&fs->flush_lock);
+    }
+    if (io_error) {
+        rc = io_error;
+        io_error = 0;
+    }
+    return rc;
+}
+
+// Compression
+// An LZ77 codec in the LZ4 block format, small enough to live here. A
+// block is a list of sequences: a token whose high nibble is the literal
+// count and low nibble the match length minus 4 (15 in either: more length
+// bytes follow, each adding up to 255), the literals, a two-byte
+// little-endian match offset and the extra match-length bytes. The last
+// sequence has literals only, and the last 5 bytes are always literals.
+// Matches are found greedily through a hash of the next four bytes.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12 // no match starts in the last 12 bytes
+
+static uint32_t lz_hash(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char* lz_put_length(unsigned char* op, int n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+// Appends one sequence; mlen 0 ends the block. Returns 0 if it would not fit.
+static int lz_sequence(unsigned char** opp, const unsigned char* oend, const unsigned char* lit, int nlit, int offset,
+                       int mlen) {
+    unsigned char* op = *opp;
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    if (oend - op < 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1) return 0;
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15) op = lz_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (ml >= 15) op = lz_put_length(op, ml - 15);
+    }
+    *opp = op;
+    return 1;
+}
+
+// Returns the compressed length, or -1 if it would exceed 'cap'. Inputs
+// are at most a cluster, so every offset fits in two bytes.
+static int lz_compress(const unsigned char* in, int len, unsigned char* out, int cap) {
+    uint16_t table[1 << LZ_HASH_BITS] = {0};
+    const unsigned char *ip = in, *anchor = in, *end = in + len;
+    const unsigned char* match_limit = len > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : in;
+    unsigned char *op = out, *oend = out + cap;
+    while (ip < match_limit) {
+        uint32_t h = lz_hash(ip);
+        const unsigned char* ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end - LZ_LAST_LITERALS && ref[mlen] == ip[mlen]) mlen++;
+        if (!lz_sequence(&op, oend, anchor, ip - anchor, ip - ref, mlen)) return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!lz_sequence(&op, oend, anchor, end - anchor, 0, 0)) return -1;
+    return op - out;
+}
+
+static int lz_length(const unsigned char** ipp, const unsigned char* iend, int* n) {
+    int b;
+    do {
+        if (*ipp >= iend) return -1;
+        b = *(*ipp)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decompressed length, or -1 for a malformed block or one that
+// would exceed 'cap'.
+static int lz_decompress(const unsigned char* in, int len, unsigned char* out, int cap) {
+    const unsigned char *ip = in, *iend = in + len;
+    unsigned char *op = out, *oend = out + cap;
+    while (ip < iend) {
+        int token = *ip++;
+        int nlit = token >> 4;
+        if (nlit == 15 && lz_length(&ip, iend, &nlit) != 0) return -1;
+        if (nlit > iend - ip || nlit > oend - op) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15 && lz_length(&ip, iend, &mlen) != 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - out || mlen > oend - op) return -1;
+        // An overlapping match repeats the last 'offset' bytes; each copy
+        // stays clear of its own output and doubles what the next may take.
+        const unsigned char* ref = op - offset;
+        while (mlen > 0) {
+            int n = op - ref < mlen ? op - ref : mlen;
+            memcpy(op, ref, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+    return op - out;
+}
+
+// Hashing
+// XXH64, as specified by xxHash, to find blocks with the same contents.
+// A match is always confirmed by comparing the blocks.
+#define XXH_P1 UINT64_C(11400714785074694791)
+#define XXH_P2 UINT64_C(14029467366897019727)
+#define XXH_P3 UINT64_C(1609587929392839161)
+#define XXH_P4 UINT64_C(9650029242287828579)
+#define XXH_P5 UINT64_C(2870177450012600261)
+
+static uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return xxh_rotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, get_le64(p));
+            v2 = xxh_round(v2, get_le64(p + 8));
+            v3 = xxh_round(v3, get_le64(p + 16));
+            v4 = xxh_round(v4, get_le64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) h = xxh_rotl(h ^ xxh_round(0, get_le64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = xxh_rotl(h ^ get_le32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+// Core Filesystem Logic
+// Allocation claims a free bit with compare-and-swap on its 64-bit word, so
+// concurrent creates never wait on each other. Each thread keeps its own
+// cursor, the word its last allocation came from, and searches onwards
+// from there. Threads start at different words, so they claim from
+// different words and each thread's files stay contiguous; the first
+// thread starts at word 0, which keeps single-threaded allocation first-fit.
+static int next_thread_slot = 0;
+static _Thread_local int thread_slot = -1;
+static _Thread_local int inode_cursor = -1;
+static _Thread_local int block_cursor = -1;
+
+// Compare-and-swap attempts lost to another thread are added to *retries.
+static int claim_bit(uint64_t* words, int nbits, int* cursor, uint64_t* retries) {
+    int nwords = (nbits + 63) / 64;
+    if (nwords == 0) return -1;
+    if (*cursor < 0) {
+        if (thread_slot < 0) thread_slot = __atomic_fetch_add(&next_thread_slot, 1, __ATOMIC_RELAXED);
+        int stride = nwords >= 8 ? nwords / 8 : 1;
+        *cursor = thread_slot * stride + thread_slot / 8; // after 8 threads, offset by a word
+    }
+
+    int start = *cursor % nwords;
+    for (int k = 0; k < nwords; k++) {
+        int w = (start + k) % nwords;
+        uint64_t word = __atomic_load_n(&words[w], __ATOMIC_ACQUIRE);
+        uint64_t avail;
+        while ((avail = free_bits(word, w, nbits)) != 0) {
+            int bit = __builtin_ctzll(avail);
+            // On failure 'word' is reloaded and the next free bit is tried.
+            if (__atomic_compare_exchange_n(&words[w], &word, word | (UINT64_C(1) << bit), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                *cursor = w;
+                return w * 64 + bit;
+            }
+            __atomic_fetch_add(retries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return -1;
+}
+
+static void release_bit(uint64_t* words, int n) {
+    __atomic_fetch_and(&words[n / 64], ~(UINT64_C(1) << (n % 64)), __ATOMIC_RELEASE);
+}
+
+static int alloc_inode(myfs_t* fs) {
+    int i = claim_bit(fs->inode_bitmap, fs->sb.num_inodes, &inode_cursor, &fs->io.alloc_retries);
+    if (i < 0) return MYFS_ENOINODE;
+    COUNT(fs, inodes_allocated, 1);
+    __atomic_store_n(&fs->inode_bitmap_dirty, 1, __ATOMIC_RELEASE);
+    return i;
+}
+
+static void free_inode(myfs_t* fs, int inode_num) {
+    release_bit(fs->inode_bitmap, inode_num);
+    COUNT(fs, inodes_freed, 1);
+    __atomic_store_n(&fs->inode_bitmap_dirty, 1, __ATOMIC_RELEASE);
+}
+
+static int alloc_data_block(myfs_t* fs) {
+    int i = claim_bit(fs->data_block_bitmap, fs->sb.num_data_blocks, &block_cursor, &fs->io.alloc_retries);
+    if (i < 0) return MYFS_ENOSPC;
+    COUNT(fs, blocks_allocated, 1);
+    __atomic_store_n(&fs->data_bitmap_dirty, 1, __ATOMIC_RELEASE);
+    return i;
+}
+
+// Claims the lowest run of 'count' free data blocks and returns its first
+// block. Bits are claimed one at a time; if another thread takes one
+// midway, the ones already claimed are released and the search goes on.
+static int claim_data_run(myfs_t* fs, int count) {
+    int nblocks = fs->sb.num_data_blocks;
+    int start = 0;
+    while (start + count <= nblocks) {
+        int len = 0;
+        while (len < count && !get_bit(fs->data_block_bitmap, start + len)) len++;
+        if (len < count) {
+            start += len + 1;
+            continue;
+        }
+        int claimed = 0;
+        for (; claimed < count; claimed++) {
+            int b = start + claimed;
+            uint64_t mask = UINT64_C(1) << (b % 64);
+            if (__atomic_fetch_or(&fs->data_block_bitmap[b / 64], mask, __ATOMIC_ACQ_REL) & mask) break;
+        }
+        if (claimed == count) {
+            COUNT(fs, blocks_allocated, count);
+            __atomic_store_n(&fs->data_bitmap_dirty, 1, __ATOMIC_RELEASE);
+            return start;
+        }
+        for (int i = 0; i < claimed; i++) release_bit(fs->data_block_bitmap, start + i);
+        COUNT(fs, alloc_retries, 1);
+        start += claimed + 1;
+    }
+    return MYFS_ENOSPC;
+}
+
+// Shared blocks. Deduplication (and clones) let several block-map slots
+// point at one data block. fs->refs counts the references a block has
+// beyond the first, so a block nobody shares counts 0 and images that never
+// shared one need no table. Counts only go up while holding a lock (shared
+// or exclusive) on an inode that holds the block, and a block is written in
+// place only while its count is 0 and under its holder's exclusive lock;
+// any other write copies it first. So nobody shares a block while it is
+// being written, and the last holder is the only one that frees it.
+static void set_refs(myfs_t* fs, uint32_t block_num, uint16_t refs) {
+    __atomic_store_n(&fs->refs[block_num], refs, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&fs->refs_dirty, UINT64_C(1) << (block_num / REFS_PER_BLOCK), __ATOMIC_RELEASE);
+}
+
+static int block_shared(myfs_t* fs, uint32_t block_num) {
+    return __atomic_load_n(&fs->refs[block_num], __ATOMIC_RELAXED) != 0;
+}
+
+// Adds a reference to a block. Returns 0 if the image has no reference
+// counts or the block already has as many as a count holds.
+static int share_block(myfs_t* fs, uint32_t block_num) {
+    if (!__atomic_load_n(&fs->sb.refcount_block, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&fs->share_lock);
+    uint16_t refs = fs->refs[block_num];
+    if (refs < MAX_REFS) set_refs(fs, block_num, refs + 1);
+    pthread_mutex_unlock(&fs->share_lock);
+    return refs < MAX_REFS;
+}
+
+// A shared block only loses a reference; the last one frees it.
+static void free_data_block(myfs_t* fs, int block_num) {
+    if (__atomic_load_n(&fs->sb.refcount_block, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&fs->share_lock);
+        uint16_t refs = fs->refs[block_num];
+        if (refs > 0) set_refs(fs, block_num, refs - 1);
+        pthread_mutex_unlock(&fs->share_lock);
+        if (refs > 0) return;
+    }
+    release_bit(fs->data_block_bitmap, block_num);
+    COUNT(fs, blocks_freed, 1);
+    __atomic_store_n(&fs->data_bitmap_dirty, 1, __ATOMIC_RELEASE);
+}
+
+// Releases every data block an inode holds; inline inodes hold none.
+static void free_inode_blocks(myfs_t* fs, Inode* inode) {
+    if (inode->flags & INODE_FLAG_INLINE_DATA) return;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (inode->direct_blocks[i] != UNUSED_BLOCK) {
+            free_data_block(fs, inode->direct_blocks[i]);
+            inode->direct_blocks[i] = UNUSED_BLOCK;
+        }
+    }
+}
+
+// Inode numbers handed in by callers must name an allocated inode.
+static int check_inode_num(myfs_t* fs, uint32_t inode_num) {
+    if (inode_num >= fs->sb.num_inodes || !get_bit(fs->inode_bitmap, inode_num)) return MYFS_ENOENT;
+    return 0;
+}
+
+// A single directory entry name: no '/', not "." or "..", at most MAX_FILENAME_LEN bytes.
+static int check_name(const char* name) {
+    if (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return MYFS_EINVAL;
+    if (strlen(name) > MAX_FILENAME_LEN) return MYFS_ENAMETOOLONG;
+    return 0;
+}
+
+// Moves an inline file's contents into a freshly allocated first data block.
+// The caller writes the inode.
+static int promote_inline_file(myfs_t* fs, Inode* inode) {
+    int block_num = alloc_data_block(fs);
+    if (block_num < 0) return block_num;
+
+    char buffer[BLOCK_SIZE] = {0};
+    memcpy(buffer, inode->inline_data, inode->size);
+    int rc = write_block(fs, fs->sb.data_blocks_start_block + block_num, buffer);
+    if (rc != 0) {
+        free_data_block(fs, block_num);
+        return rc;
+    }
+
+    inode->flags &= ~INODE_FLAG_INLINE_DATA;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) inode->direct_blocks[i] = UNUSED_BLOCK;
+    inode->direct_blocks[0] = block_num;
+    return 0;
+}
+
+// Both tables live in runs of data blocks reserved the first time they are
+// needed: one reference count (le16) per data block, and an index with a
+// power of two of DEDUP_ENTRY_SIZE-byte slots, at least one per data block.
+static int refcount_table_blocks(const Superblock* sb) {
+    return (sb->num_data_blocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+}
+
+static uint32_t dedup_index_slots(const Superblock* sb) {
+    uint32_t slots = BLOCK_SIZE / DEDUP_ENTRY_SIZE;
+    while (slots < sb->num_data_blocks) slots *= 2;
+    return slots;
+}
+
+// The superblock is rewritten only when a setting changes. Caller holds
+// flush_lock.
+static uint32_t superblock_checksum(const Superblock* sb) {
+    Superblock copy = *sb;
+    copy.sb_checksum = 0;
+    return crc32c(&copy, sizeof(copy));
+}
+
+static void write_superblock(myfs_t* fs) {
+    char buffer[BLOCK_SIZE] = {0};
+    fs->sb.sb_checksum = fs->sb.checksums ? superblock_checksum(&fs->sb) : 0;
+    memcpy(buffer, &fs->sb, sizeof(Superblock));
+    write_block(fs, SUPERBLOCK_BLOCK, buffer);
+}
+
+// Reserves the reference counts and, with 'with_index', the hash index if
+// the image has none yet, and writes them out. The caller records them by
+// writing the superblock. Caller holds flush_lock.
+static int reserve_share_tables(myfs_t* fs, int with_index) {
+    if (!fs->sb.refcount_block) {
+        int n = refcount_table_blocks(&fs->sb);
+        int start = claim_data_run(fs, n);
+        if (start < 0) return start;
+        __atomic_fetch_or(&fs->refs_dirty, (UINT64_C(1) << n) - 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&fs->sb.refcount_block, fs->sb.data_blocks_start_block + start, __ATOMIC_RELEASE);
+    }
+    if (with_index && !fs->sb.dedup_index_block) {
+        uint32_t slots = dedup_index_slots(&fs->sb);
+        int n = slots / (BLOCK_SIZE / DEDUP_ENTRY_SIZE);
+        int start = claim_data_run(fs, n);
+        if (start < 0) return start;
+        pthread_mutex_lock(&fs->index_lock);
+        for (uint32_t i = 0; i < slots; i++) fs->dedup_index[i].block = UNUSED_BLOCK;
+        pthread_mutex_unlock(&fs->index_lock);
+        __atomic_fetch_or(&fs->index_dirty, (UINT64_C(1) << n) - 1, __ATOMIC_RELEASE);
+        fs->sb.dedup_index_block = fs->sb.data_blocks_start_block + start;
+        __atomic_store_n(&fs->dedup_slots, slots, __ATOMIC_RELEASE);
+    }
+    flush_share_tables(fs);
+    return 0;
+}
+
+// Reads the tables at mount, if the image has them.
+static int load_share_tables(myfs_t* fs) {
+    unsigned char buffer[BLOCK_SIZE];
+    uint32_t data_end = fs->sb.data_blocks_start_block + fs->sb.num_data_blocks;
+    if (fs->sb.refcount_block) {
+        int n = refcount_table_blocks(&fs->sb);
+        if (fs->sb.refcount_block < fs->sb.data_blocks_start_block || fs->sb.refcount_block + n > data_end)
+            return MYFS_EBADFS;
+        for (int b = 0; b < n; b++) {
+            int rc = read_block(fs, fs->sb.refcount_block + b, buffer);
+            if (rc != 0) return rc;
+            for (int i = 0; i < REFS_PER_BLOCK && b * REFS_PER_BLOCK + i < MAX_DATA_BLOCKS; i++)
+                fs->refs[b * REFS_PER_BLOCK + i] = get_le16(buffer + 2 * i);
+        }
+    }
+    if (fs->sb.dedup_index_block) {
+        uint32_t slots = dedup_index_slots(&fs->sb);
+        int n = slots / (BLOCK_SIZE / DEDUP_ENTRY_SIZE);
+        if (fs->sb.dedup_index_block < fs->sb.data_blocks_start_block || fs->sb.dedup_index_block + n > data_end)
+            return MYFS_EBADFS;
+        for (int b = 0; b < n; b++) {
+            int rc = read_block(fs, fs->sb.dedup_index_block + b, buffer);
+            if (rc != 0) return rc;
+            for (int i = 0; i < BLOCK_SIZE / DEDUP_ENTRY_SIZE; i++) {
+                DedupEntry* e = &fs->dedup_index[b * (BLOCK_SIZE / DEDUP_ENTRY_SIZE) + i];
+                e->hash = get_le64(buffer + DEDUP_ENTRY_SIZE * i);
+                e->block = get_le32(buffer + DEDUP_ENTRY_SIZE * i + 8);
+                e->owner = get_le32(buffer + DEDUP_ENTRY_SIZE * i + 12);
+            }
+        }
+        fs->dedup_slots = slots;
+    }
+    return 0;
+}
+
+// Checks the superblock's own checksum and reads the checksum table, if
+// the image has checksums on; done at mount before any other block is read.
+static int load_checksums(myfs_t* fs) {
+    if (!fs->sb.checksums) return 0;
+    if (fs->sb.sb_checksum != superblock_checksum(&fs->sb)) return MYFS_ECORRUPT;
+    int n = checksum_table_blocks(&fs->sb);
+    if (fs->sb.checksum_block < fs->sb.data_blocks_start_block || fs->sb.checksum_block + n > image_blocks(&fs->sb))
+        return MYFS_EBADFS;
+    unsigned char buffer[BLOCK_SIZE];
+    for (int b = 0; b < n; b++) {
+        int rc = read_block(fs, fs->sb.checksum_block + b, buffer);
+        if (rc != 0) return rc;
+        for (int i = 0; i < CRCS_PER_BLOCK && b * CRCS_PER_BLOCK + i < MAX_IMAGE_BLOCKS; i++)
+            fs->crcs[b * CRCS_PER_BLOCK + i] = get_le32(buffer + 4 * i);
+    }
+    return 0;
+}
+
+// Whether a data block belongs to one of the tables rather than to a file.
+static int table_block(myfs_t* fs, uint32_t block_num) {
+    uint32_t b = fs->sb.data_blocks_start_block + block_num;
+    return (fs->sb.checksum_block && b >= fs->sb.checksum_block &&
+            b < fs->sb.checksum_block + checksum_table_blocks(&fs->sb)) ||
+           (fs->sb.refcount_block && b >= fs->sb.refcount_block &&
+            b < fs->sb.refcount_block + refcount_table_blocks(&fs->sb)) ||
+           (fs->sb.dedup_index_block && b >= fs->sb.dedup_index_block &&
+            b < fs->sb.dedup_index_block + dedup_index_slots(&fs->sb) / (BLOCK_SIZE / DEDUP_ENTRY_SIZE));
+}
+
+// The hash index. Blocks of new files are entered under the XXH64 of
+// their contents, in the first of DEDUP_PROBES slots from the hash's home
+// slot that is free, holds a block since freed, or has the same hash (else
+// the home slot itself). Entries are hints: one goes stale when its block
+// is freed or rewritten, and is then simply not confirmed.
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void dedup_insert(myfs_t* fs, uint64_t hash, uint32_t block_num, uint32_t owner) {
+    pthread_mutex_lock(&fs->index_lock);
+    uint32_t mask = fs->dedup_slots - 1, slot = hash & mask;
+    for (int k = 0; k < DEDUP_PROBES; k++) {
+        const DedupEntry* e = &fs->dedup_index[(hash + k) & mask];
+        if (e->block == UNUSED_BLOCK || e->hash == hash || e->block >= fs->sb.num_data_blocks ||
+            !get_bit(fs->data_block_bitmap, e->block)) {
+            slot = (hash + k) & mask;
+            break;
+        }
+    }
+    fs->dedup_index[slot] = (DedupEntry){ .hash = hash, .block = block_num, .owner = owner };
+    __atomic_fetch_or(&fs->index_dirty, UINT64_C(1) << (slot / (BLOCK_SIZE / DEDUP_ENTRY_SIZE)), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs->index_lock);
+}
+
+// Looks for a stored block with the contents 'data', whose hash is 'hash'.
+// A candidate counts only if the inode it was indexed under still holds it
+// and the contents compare equal, both checked under that inode's lock.
+// The lock is only tried, so a busy inode is a miss rather than a wait; so
+// is the caller's own, which may be a reused number whose old block map is
+// still on disk. Returns the block with a reference added, or -1.
+static int dedup_find(myfs_t* fs, uint64_t hash, const char* data, int inode_num) {
+    DedupEntry probe[DEDUP_PROBES];
+    pthread_mutex_lock(&fs->index_lock);
+    uint32_t mask = fs->dedup_slots - 1;
+    for (int k = 0; k < DEDUP_PROBES; k++) probe[k] = fs->dedup_index[(hash + k) & mask];
+    pthread_mutex_unlock(&fs->index_lock);
+
+    char buffer[BLOCK_SIZE];
+    for (int k = 0; k < DEDUP_PROBES; k++) {
+        const DedupEntry* e = &probe[k];
+        if (e->block == UNUSED_BLOCK || e->hash != hash || e->block >= fs->sb.num_data_blocks ||
+            e->owner >= fs->sb.num_inodes || e->owner == (uint32_t)inode_num || !get_bit(fs->data_block_bitmap, e->block) ||
+            pthread_rwlock_tryrdlock(&fs->inode_locks[e->owner]) != 0)
+            continue;
+        Inode owner;
+        int held = 0;
+        if (get_bit(fs->inode_bitmap, e->owner) && read_inode(fs, e->owner, &owner) == 0 && owner.mode == 0 &&
+            !(owner.flags & INODE_FLAG_INLINE_DATA)) {
+            for (int i = 0; i < INODE_DIRECT_POINTERS; i++) held |= owner.direct_blocks[i] == e->block;
+        }
+        int shared = held && read_block(fs, fs->sb.data_blocks_start_block + e->block, buffer) == 0 &&
+                     memcmp(buffer, data, BLOCK_SIZE) == 0 && share_block(fs, e->block);
+        unlock_inode(fs, e->owner);
+        if (shared) return e->block;
+    }
+    return -1;
+}
+
+// Compressed files. A file's blocks are grouped in clusters of
+// CLUSTER_BLOCKS. A cluster whose data compresses by at least a block is
+// stored as a 4-byte length and the compressed stream, in the cluster's
+// first block-map slots, with the rest of its slots unused; any other
+// cluster is stored as it is, one block per slot. Reads decompress only
+// the clusters they touch. A write or truncate re-packs only the clusters
+// it changes, under the image's compression policy at that time; with the
+// policy on, a write to a plain file packs the clusters it touches too.
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_HEADER 4
+
+// Blocks of data a file of 'size' bytes has in cluster 'c'.
+static int cluster_span(long size, int c) {
+    int n = (int)((size + BLOCK_SIZE - 1) / BLOCK_SIZE) - c * CLUSTER_BLOCKS;
+    return n < CLUSTER_BLOCKS ? n : CLUSTER_BLOCKS;
+}
+
+// Lays out 'size' bytes of file data in block-map order: 'out' receives
+// what each slot's block holds, and 'used' which slots need a block.
+// Returns 1 if any cluster was compressed.
+static int pack_file_data(const char* data, long size, int compress, char* out, int* used) {
+    int blocks = (int)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    memset(used, 0, INODE_DIRECT_POINTERS * sizeof(int));
+    if (size > 0) memcpy(out, data, size);
+    memset(out + size, 0, (long)blocks * BLOCK_SIZE - size);
+
+    int packed = 0;
+    for (int c = 0; c * CLUSTER_BLOCKS < blocks; c++) {
+        int n = cluster_span(size, c), m = n;
+        char* cluster = out + (long)c * CLUSTER_BLOCKS * BLOCK_SIZE;
+        if (compress && n > 1) {
+            unsigned char stream[CLUSTER_BLOCKS * BLOCK_SIZE];
+            int len = lz_compress((const unsigned char*)cluster, n * BLOCK_SIZE, stream + CLUSTER_HEADER,
+                                  (n - 1) * BLOCK_SIZE - CLUSTER_HEADER);
+            if (len > 0) {
+                put_le32(stream, len);
+                m = (CLUSTER_HEADER + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                memcpy(cluster, stream, CLUSTER_HEADER + len);
+                memset(cluster + CLUSTER_HEADER + len, 0, (long)m * BLOCK_SIZE - CLUSTER_HEADER - len);
+                packed = 1;
+            }
+        }
+        for (int i = 0; i < m; i++) used[c * CLUSTER_BLOCKS + i] = 1;
+    }
+    return packed;
+}
+
+// Allocates a block for each slot 'used' marks and writes what pack_file_data
+// laid out for it, a run of consecutive new blocks per transfer. With
+// deduplication on, a block whose contents are already stored, earlier in
+// this file or indexed for another, is shared instead, and the new blocks
+// are indexed under 'inode_num' once they are written. On failure the
+// blocks taken here are released and 'blocks' is left all unused.
+static int store_file_blocks(myfs_t* fs, int inode_num, const char* data, const int* used, uint32_t* blocks) {
+    int dedup = __atomic_load_n(&fs->sb.dedup, __ATOMIC_RELAXED) && __atomic_load_n(&fs->dedup_slots, __ATOMIC_ACQUIRE);
+    uint64_t hashes[INODE_DIRECT_POINTERS];
+    int fresh[INODE_DIRECT_POINTERS] = {0};
+    int rc = MYFS_OK;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) blocks[i] = UNUSED_BLOCK;
+    for (int i = 0; rc == 0 && i < INODE_DIRECT_POINTERS; i++) {
+        if (!used[i]) continue;
+        const char* contents = data + (long)i * BLOCK_SIZE;
+        int block_num = -1;
+        if (dedup) {
+            uint64_t start = clock_ns();
+            hashes[i] = xxh64(contents, BLOCK_SIZE, 0);
+            for (int j = 0; j < i && block_num < 0; j++) {
+                if (fresh[j] && hashes[j] == hashes[i] && memcmp(data + (long)j * BLOCK_SIZE, contents, BLOCK_SIZE) == 0 &&
+                    share_block(fs, blocks[j]))
+                    block_num = blocks[j];
+            }
+            if (block_num < 0) block_num = dedup_find(fs, hashes[i], contents, inode_num);
+            COUNT(fs, dedup_lookups, 1);
+            COUNT(fs, dedup_hits, block_num >= 0);
+            COUNT(fs, dedup_ns, clock_ns() - start);
+        }
+        if (block_num < 0) {
+            block_num = alloc_data_block(fs);
+            if (block_num < 0) {
+                rc = block_num;
+                break;
+            }
+            fresh[i] = 1;
+        }
+        blocks[i] = block_num;
+    }
+    for (int i = 0; rc == 0 && i < INODE_DIRECT_POINTERS; ) {
+        if (!fresh[i]) {
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < INODE_DIRECT_POINTERS && fresh[i + run] && blocks[i + run] == blocks[i] + run) run++;
+        rc = write_blocks(fs, fs->sb.data_blocks_start_block + blocks[i], run, data + (long)i * BLOCK_SIZE);
+        i += run;
+    }
+    if (rc != 0) {
+        // Shared blocks lose the reference taken above; new ones are freed.
+        for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+            if (blocks[i] != UNUSED_BLOCK) free_data_block(fs, blocks[i]);
+            blocks[i] = UNUSED_BLOCK;
+        }
+        return rc;
+    }
+    for (int i = 0; dedup && i < INODE_DIRECT_POINTERS; i++) {
+        if (fresh[i]) dedup_insert(fs, hashes[i], blocks[i], inode_num);
+    }
+    return 0;
+}
+
+// Reads cluster 'c' of a compressed file into 'out', decompressed.
+static int read_cluster(myfs_t* fs, const Inode* inode, int c, char* out) {
+    const uint32_t* slots = inode->direct_blocks + c * CLUSTER_BLOCKS;
+    int n = cluster_span(inode->size, c), m = 0;
+    while (m < n && slots[m] != UNUSED_BLOCK) m++;
+    if (m == 0) return MYFS_ECORRUPT;
+
+    unsigned char stream[CLUSTER_BLOCKS * BLOCK_SIZE];
+    char* dst = m == n ? out : (char*)stream;
+    for (int i = 0; i < m; ) {
+        int run = contiguous_run(slots, i, m);
+        if (read_blocks(fs, fs->sb.data_blocks_start_block + slots[i], run, dst + (long)i * BLOCK_SIZE) != 0) return MYFS_EIO;
+        i += run;
+    }
+    if (m == n) return 0;
+    uint32_t len = get_le32(stream);
+    if (len > (uint32_t)m * BLOCK_SIZE - CLUSTER_HEADER ||
+        lz_decompress(stream + CLUSTER_HEADER, len, (unsigned char*)out, n * BLOCK_SIZE) != n * BLOCK_SIZE)
+        return MYFS_ECORRUPT;
+    return 0;
+}
+
+// Decodes the inline directory entry at 'offset'. Returns the offset of the
+// next entry, or -1 once the end of the packed entries is reached or an
+// entry would run past them (a corrupt size or name length).
+static int next_inline_entry(const Inode* dir_inode, int offset, char* name, uint32_t* inode_num) {
+    int end = dir_inode->size < INODE_INLINE_SIZE ? (int)dir_inode->size : INODE_INLINE_SIZE;
+    if (offset + INLINE_DIRENT_HEADER > end) return -1;
+    const unsigned char* p = dir_inode->inline_data + offset;
+    int name_len = p[4];
+    if (offset + INLINE_DIRENT_HEADER + name_len > end) return -1;
+    *inode_num = get_le32(p);
+    memcpy(name, p + INLINE_DIRENT_HEADER, name_len);
+    name[name_len] = '\0';
+    return offset + INLINE_DIRENT_HEADER + name_len;
+}
+
+// Returns the inode number 'name' refers to in the directory, or MYFS_ENOENT / MYFS_ENOTDIR.
+// Caller holds the directory's lock, shared or exclusive.
+static int find_entry_in_dir(myfs_t* fs, int dir_inode_num, const char* name) {
+    Inode dir_inode;
+    int rc = read_inode(fs, dir_inode_num, &dir_inode);
+    if (rc != 0) return rc;
+    if (dir_inode.mode != 1) return MYFS_ENOTDIR;
+
+    if (strcmp(name, ".") == 0) return dir_inode_num;
+    if (strcmp(name, "..") == 0) return dir_inode.parent;
+
+    if (dir_inode.flags & INODE_FLAG_INLINE_DATA) {
+        char entry_name[MAX_FILENAME_LEN + 1];
+        uint32_t entry_inode;
+        int next;
+        for (int off = 0; (next = next_inline_entry(&dir_inode, off, entry_name, &entry_inode)) != -1; off = next) {
+            if (strcmp(entry_name, name) == 0) return entry_inode;
+        }
+        return MYFS_ENOENT;
+    }
+
+    char buffer[BLOCK_SIZE];
+    int total_valid_entries = dir_inode.entry_count;
+    int entries_found = 0;
+
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (dir_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_valid_entries)
+            break;
+
+        if (read_dir_block(fs, dir_inode.direct_blocks[i], buffer) != 0) return MYFS_EIO;
+        DirectoryEntry* de = (DirectoryEntry*)buffer;
+        for (int j = 0; j < (int)DIR_ENTRIES_PER_BLOCK; j++) {
+            if (entries_found >= total_valid_entries) break;
+
+            if (de[j].name[0] != '\0') {
+                entries_found++;
+                if (strcmp(de[j].name, name) == 0) {
+                    return de[j].inode_number;
+                }
+            }
+        }
+    }
+    return MYFS_ENOENT;
+}
+
+// Converts an inline directory into a one-block directory holding the same
+// entries in the same order, so entry indexes (and name_slot hints) survive.
+// The caller writes the inode.
+static int promote_inline_dir(myfs_t* fs, Inode* dir_inode) {
+    int block_num = alloc_data_block(fs);
+    if (block_num < 0) return block_num;
+
+    char buffer[BLOCK_SIZE] = {0};
+    DirectoryEntry* de = (DirectoryEntry*)buffer;
+    int count = 0;
+    uint32_t entry_inode;
+    int next;
+    for (int off = 0; (next = next_inline_entry(dir_inode, off, de[count].name, &entry_inode)) != -1; off = next) {
+        de[count++].inode_number = entry_inode;
+    }
+    int rc = write_dir_block(fs, block_num, buffer);
+    if (rc != 0) {
+        free_data_block(fs, block_num);
+        return rc;
+    }
+
+    dir_inode->flags &= ~INODE_FLAG_INLINE_DATA;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) dir_inode->direct_blocks[i] = UNUSED_BLOCK;
+    dir_inode->direct_blocks[0] = block_num;
+    dir_inode->size = count * sizeof(DirectoryEntry);
+    dir_inode->free_slot = count;
+    return 0;
+}
+
+// Returns the entry's index within the directory (inline entries are
+// numbered in order, block entries by slot), or a MYFS_E* code.
+// Caller holds the directory's exclusive lock.
+static int add_entry_to_dir(myfs_t* fs, int dir_inode_num, const char* name, int new_inode_num) {
+    Inode dir_inode;
+    int rc = read_inode(fs, dir_inode_num, &dir_inode);
+    if (rc != 0) return rc;
+
+    if (dir_inode.flags & INODE_FLAG_INLINE_DATA) {
+        int name_len = strlen(name);
+        if (dir_inode.size + INLINE_DIRENT_HEADER + name_len <= INODE_INLINE_SIZE) {
+            unsigned char* p = dir_inode.inline_data + dir_inode.size;
+            put_le32(p, new_inode_num);
+            p[4] = name_len;
+            memcpy(p + INLINE_DIRENT_HEADER, name, name_len);
+            dir_inode.size += INLINE_DIRENT_HEADER + name_len;
+            int index = dir_inode.entry_count++;
+            dir_inode.modification_time = time(NULL);
+            rc = write_inode(fs, dir_inode_num, &dir_inode);
+            return rc != 0 ? rc : index;
+        }
+        rc = promote_inline_dir(fs, &dir_inode);
+        if (rc != 0) return rc;
+    }
+
+    DirectoryEntry new_entry;
+    strncpy(new_entry.name, name, MAX_FILENAME_LEN);
+    new_entry.name[MAX_FILENAME_LEN] = '\0';
+    new_entry.inode_number = new_inode_num;
+
+    char buffer[BLOCK_SIZE];
+    int entries_per_block = DIR_ENTRIES_PER_BLOCK;
+    int max_slots = INODE_DIRECT_POINTERS * entries_per_block;
+
+    // Every slot below free_slot is in use, so start the search there
+    // instead of at slot 0; appends land on the first slot tried.
+    int slot = dir_inode.free_slot < (uint32_t)max_slots ? (int)dir_inode.free_slot : max_slots;
+    while (slot < max_slots) {
+        int i = slot / entries_per_block;
+        int current_block_num;
+        int fresh = dir_inode.direct_blocks[i] == UNUSED_BLOCK;
+        if (fresh) {
+            current_block_num = alloc_data_block(fs);
+            if (current_block_num < 0) return current_block_num;
+            dir_inode.direct_blocks[i] = current_block_num;
+            memset(buffer, 0, BLOCK_SIZE);
+        } else {
+            current_block_num = dir_inode.direct_blocks[i];
+            rc = read_dir_block(fs, current_block_num, buffer);
+            if (rc != 0) return rc;
+        }
+
+        DirectoryEntry* de = (DirectoryEntry*)buffer;
+        for (int j = slot % entries_per_block; j < entries_per_block; j++, slot++) {
+            if (de[j].name[0] == '\0') {
+                memcpy(&de[j], &new_entry, sizeof(DirectoryEntry));
+                rc = write_dir_block(fs, current_block_num, buffer);
+                if (rc != 0) {
+                    if (fresh) free_data_block(fs, current_block_num);
+                    return rc;
+                }
+
+                // size tracks the highest slot ever used; holes below it are skipped on scan.
+                if ((slot + 1) * sizeof(DirectoryEntry) > dir_inode.size) {
+                    dir_inode.size = (slot + 1) * sizeof(DirectoryEntry);
+                }
+                dir_inode.entry_count++;
+                dir_inode.free_slot = slot + 1;
+
+                dir_inode.modification_time = time(NULL);
+                rc = write_inode(fs, dir_inode_num, &dir_inode);
+                return rc != 0 ? rc : slot;
+            }
+        }
+    }
+    return MYFS_EDIRFULL;
+}
+
+// Removes 'child_name' from the directory and updates its entry count and
+// free-slot hint. Returns 0 (also when the name is not there) or the first
+// read or write error. Caller holds the directory's exclusive lock.
+static int remove_entry_from_dir(myfs_t* fs, int parent_inode_num, const char* child_name) {
+    Inode parent_inode;
+    int rc = read_inode(fs, parent_inode_num, &parent_inode);
+    if (rc != 0) return rc;
+    char buffer[BLOCK_SIZE];
+
+    if (parent_inode.flags & INODE_FLAG_INLINE_DATA) {
+        char entry_name[MAX_FILENAME_LEN + 1];
+        uint32_t entry_inode;
+        int next;
+        for (int off = 0; (next = next_inline_entry(&parent_inode, off, entry_name, &entry_inode)) != -1; off = next) {
+            if (strcmp(entry_name, child_name) == 0) {
+                memmove(parent_inode.inline_data + off, parent_inode.inline_data + next, parent_inode.size - next);
+                parent_inode.size -= next - off;
+                parent_inode.entry_count--;
+                memset(parent_inode.inline_data + parent_inode.size, 0, INODE_INLINE_SIZE - parent_inode.size);
+                parent_inode.modification_time = time(NULL);
+                return write_inode(fs, parent_inode_num, &parent_inode);
+            }
+        }
+        return 0;
+    }
+
+    int total_entries = parent_inode.entry_count;
+    int entries_found = 0;
+
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (parent_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_entries)
+            break;
+
+        rc = read_dir_block(fs, parent_inode.direct_blocks[i], buffer);
+        if (rc != 0) return rc;
+        DirectoryEntry* de = (DirectoryEntry*)buffer;
+        for (int j = 0; j < (int)DIR_ENTRIES_PER_BLOCK; j++) {
+            if (entries_found >= total_entries) break;
+            if (de[j].name[0] != '\0') {
+                 entries_found++;
+                 if (strcmp(de[j].name, child_name) == 0) {
+                    memset(&de[j], 0, sizeof(DirectoryEntry));
+                    rc = write_dir_block(fs, parent_inode.direct_blocks[i], buffer);
+                    if (rc != 0) return rc;
+                    parent_inode.entry_count--;
+                    int slot = i * DIR_ENTRIES_PER_BLOCK + j;
+                    if (slot < (int)parent_inode.free_slot) parent_inode.free_slot = slot;
+                    parent_inode.modification_time = time(NULL);
+                    return write_inode(fs, parent_inode_num, &parent_inode);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Walks 'path' from 'base' (or the root for an absolute path), holding
+// each directory's shared lock only while looking up one component.
+static int resolve_from(myfs_t* fs, int base, const char* path) {
+    if (path == NULL || path[0] == '\0') return MYFS_ENOENT;
+
+    char path_copy[strlen(path) + 1];
+    strcpy(path_copy, path);
+
+    int current_inode = (path[0] == '/') ? ROOT_INODE_NUM : base;
+    char *token, *rest = path_copy;
+    while ((token = strtok_r(rest, "/", &rest))) {
+        int rc = lock_inode(fs, current_inode, 0);
+        if (rc != 0) return rc;
+        // find_entry_in_dir fails with MYFS_ENOTDIR if a middle component is a file.
+        int next = find_entry_in_dir(fs, current_inode, token);
+        unlock_inode(fs, current_inode);
+        if (next < 0) return next;
+        current_inode = next;
+    }
+    return current_inode;
+}
+
+static int cwd_inode(myfs_t* fs) {
+    pthread_mutex_lock(&fs->cwd_lock);
+    int inode_num = fs->current_working_directory_inode;
+    pthread_mutex_unlock(&fs->cwd_lock);
+    return inode_num;
+}
+
+static int resolve_path(myfs_t* fs, const char* path) {
+    return resolve_from(fs, cwd_inode(fs), path);
+}
+
+// Resolves the directory part of 'path' and copies its final component
+// into 'name'. Returns the parent's inode number or a MYFS_E* code.
+static int resolve_parent(myfs_t* fs, const char* path, char* name) {
+    char dname_path[strlen(path) + 1];
+    char bname_path[strlen(path) + 1];
+    strcpy(dname_path, path);
+    strcpy(bname_path, path);
+    char *parent_path = dirname(dname_path);
+    char *child_name = basename(bname_path);
+
+    int rc = check_name(child_name);
+    if (rc != 0) return rc;
+    strcpy(name, child_name);
+    return resolve_path(fs, parent_path);
+}
+
+// Creates an empty directory 'name' under the parent and returns its inode
+// number. Takes the parent's directory lock for the whole check-and-insert.
+static int create_directory(myfs_t* fs, int parent_inode_num, const char* name) {
+    int rc = lock_inode(fs, parent_inode_num, 1);
+    if (rc != 0) return rc;
+    rc = find_entry_in_dir(fs, parent_inode_num, name);
+    if (rc >= 0 || rc != MYFS_ENOENT) {
+        unlock_inode(fs, parent_inode_num);
+        return rc >= 0 ? MYFS_EEXIST : rc;
+    }
+
+    int new_inode_num = alloc_inode(fs);
+    if (new_inode_num < 0) {
+        unlock_inode(fs, parent_inode_num);
+        return new_inode_num;
+    }
+
+    // The entry is visible only once the parent is unlocked, after the
+    // new inode has been written below.
+    int name_slot = add_entry_to_dir(fs, parent_inode_num, name, new_inode_num);
+    if (name_slot < 0) {
+        free_inode(fs, new_inode_num);
+        unlock_inode(fs, parent_inode_num);
+        return name_slot;
+    }
+
+    // New directories start inline: no data block until they outgrow the inode.
+    Inode new_inode = {0};
+    new_inode.mode = 1;
+    new_inode.flags = INODE_FLAG_INLINE_DATA;
+    new_inode.size = 0;
+    new_inode.link_count = 2;
+    new_inode.parent = parent_inode_num;
+    new_inode.name_slot = name_slot;
+    new_inode.creation_time = new_inode.modification_time = time(NULL);
+    rc = write_inode(fs, new_inode_num, &new_inode);
+    if (rc != 0) {
+        remove_entry_from_dir(fs, parent_inode_num, name);
+        free_inode(fs, new_inode_num);
+        unlock_inode(fs, parent_inode_num);
+        return rc;
+    }
+
+    Inode parent_inode;
+    rc = read_inode(fs, parent_inode_num, &parent_inode);
+    if (rc == 0) {
+        parent_inode.link_count++;
+        rc = write_inode(fs, parent_inode_num, &parent_inode);
+    }
+    unlock_inode(fs, parent_inode_num);
+    return rc != 0 ? rc : new_inode_num;
+}
+
+// Creates file 'name' under the parent holding 'size' bytes of 'data' and
+// returns its inode number. Files of up to INODE_INLINE_SIZE bytes are
+// stored in the inode. The data is written before the parent's directory
+// lock is taken, so that lock is held only for the check-and-insert; a
+// shared-lock lookup first saves writing data for a name that exists.
+static int create_file(myfs_t* fs, int parent_inode_num, const char* name, const char* data, long size) {
+    if (size < 0) return MYFS_EINVAL;
+    if (size > INODE_DIRECT_POINTERS * BLOCK_SIZE) return MYFS_EFBIG;
+
+    int rc = lock_inode(fs, parent_inode_num, 0);
+    if (rc != 0) return rc;
+    rc = find_entry_in_dir(fs, parent_inode_num, name);
+    unlock_inode(fs, parent_inode_num);
+    if (rc >= 0) return MYFS_EEXIST;
+    if (rc != MYFS_ENOENT) return rc;
+
+    int new_inode_num = alloc_inode(fs);
+    if (new_inode_num < 0) return new_inode_num;
+
+    Inode new_inode = {0};
+    new_inode.mode = 0; // File
+    new_inode.size = size;
+    new_inode.link_count = 1;
+    new_inode.creation_time = new_inode.modification_time = time(NULL);
+    for(int i = 0; i < INODE_DIRECT_POINTERS; i++) new_inode.direct_blocks[i] = UNUSED_BLOCK;
+
+    if (size <= INODE_INLINE_SIZE) {
+        // Tiny files are stored in the inode body and cost no data block.
+        new_inode.flags |= INODE_FLAG_INLINE_DATA;
+        memset(new_inode.inline_data, 0, INODE_INLINE_SIZE);
+        if (size > 0) memcpy(new_inode.inline_data, data, size);
+    }
+
+    if (!(new_inode.flags & INODE_FLAG_INLINE_DATA)) {
+        // The image's compression policy applies as the file is created.
+        char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+        int used[INODE_DIRECT_POINTERS];
+        int compress = __atomic_load_n(&fs->sb.compression, __ATOMIC_RELAXED) != MYFS_COMPRESS_NONE;
+        if (pack_file_data(data, size, compress, buffer, used)) new_inode.flags |= INODE_FLAG_COMPRESSED;
+        rc = store_file_blocks(fs, new_inode_num, buffer, used, new_inode.direct_blocks);
+        if (rc != 0) {
+            free_inode(fs, new_inode_num);
+            return rc;
+        }
+    }
+
+    rc = write_inode(fs, new_inode_num, &new_inode);
+    if (rc == 0) rc = lock_inode(fs, parent_inode_num, 1);
+    if (rc == 0) {
+        rc = find_entry_in_dir(fs, parent_inode_num, name);
+        if (rc >= 0) rc = MYFS_EEXIST;
+        else if (rc == MYFS_ENOENT) rc = add_entry_to_dir(fs, parent_inode_num, name, new_inode_num);
+        unlock_inode(fs, parent_inode_num);
+    }
+    if (rc < 0) {
+        free_inode_blocks(fs, &new_inode);
+        free_inode(fs, new_inode_num);
+        return rc;
+    }
+    return new_inode_num;
+}
+
+// Reads up to 'len' bytes starting at 'offset' into 'out'. Only the blocks
+// covering the range are read. Returns the number of bytes read.
+// Caller holds the inode's lock, shared or exclusive.
+static long inode_read(myfs_t* fs, const Inode* inode, char* out, long len, long offset) {
+    if (offset >= inode->size || len == 0) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+
+    if (inode->flags & INODE_FLAG_INLINE_DATA) {
+        if (inode->size > INODE_INLINE_SIZE) return MYFS_ECORRUPT;
+        memcpy(out, inode->inline_data + offset, len);
+        return len;
+    }
+
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + len - 1) / BLOCK_SIZE;
+    char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    if (inode->flags & INODE_FLAG_COMPRESSED) {
+        char cluster[CLUSTER_BLOCKS * BLOCK_SIZE];
+        for (int c = first / CLUSTER_BLOCKS; c <= last / CLUSTER_BLOCKS; c++) {
+            int rc = read_cluster(fs, inode, c, cluster);
+            if (rc != 0) return rc;
+            int from = c * CLUSTER_BLOCKS > first ? c * CLUSTER_BLOCKS : first;
+            int to = c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 < last ? c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1 : last;
+            memcpy(buffer + (long)(from - first) * BLOCK_SIZE, cluster + (long)(from - c * CLUSTER_BLOCKS) * BLOCK_SIZE,
+                   (long)(to - from + 1) * BLOCK_SIZE);
+        }
+        memcpy(out, buffer + offset % BLOCK_SIZE, len);
+        return len;
+    }
+
+    // Read each run of consecutive blocks with a single transfer.
+    for (int i = first; i <= last; ) {
+        char* dst = buffer + (long)(i - first) * BLOCK_SIZE;
+        if (inode->direct_blocks[i] == UNUSED_BLOCK) {
+            memset(dst, 0, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        int run = contiguous_run(inode->direct_blocks, i, last + 1);
+        int rc = read_blocks(fs, fs->sb.data_blocks_start_block + inode->direct_blocks[i], run, dst);
+        if (rc != 0) return rc;
+        i += run;
+    }
+    memcpy(out, buffer + offset % BLOCK_SIZE, len);
+    return len;
+}
+
+// Rewrites a file's data as plain blocks, or in compressed clusters when
+// 'compress' is set. The inode is written before the old blocks are
+// freed, so the file is never left without its data. Caller holds the
+// inode's exclusive lock.
+static int rewrite_file_data(myfs_t* fs, int inode_num, Inode* inode, int compress) {
+    char data[INODE_DIRECT_POINTERS * BLOCK_SIZE], packed[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    long size = inode_read(fs, inode, data, inode->size, 0);
+    if (size < 0) return size;
+
+    Inode updated = *inode;
+    int used[INODE_DIRECT_POINTERS];
+    updated.flags &= ~INODE_FLAG_COMPRESSED;
+    if (pack_file_data(data, size, compress, packed, used)) updated.flags |= INODE_FLAG_COMPRESSED;
+    int rc = store_file_blocks(fs, inode_num, packed, used, updated.direct_blocks);
+    if (rc != 0) return rc;
+    if (write_inode(fs, inode_num, &updated) != 0) {
+        free_inode_blocks(fs, &updated);
+        return MYFS_EIO;
+    }
+    free_inode_blocks(fs, inode);
+    *inode = updated;
+    return 0;
+}
+
+// Gives a file stored in blocks a new size of 'size' bytes with 'len'
+// bytes of 'data' (zeros if 'data' is NULL) written at 'offset', which
+// must lie within it. Each cluster the change touches is read, updated
+// and packed again per the image's policy into new blocks, and the
+// clusters past the new end are dropped; the others are left as they are.
+// The inode is written before the replaced blocks are freed, so a failure
+// leaves the file as it was. Caller holds the inode's exclusive lock.
+static int write_clusters(myfs_t* fs, int inode_num, Inode* inode, const char* data, long len, long offset, long size) {
+    const long cluster_size = CLUSTER_BLOCKS * BLOCK_SIZE;
+    long start = offset < (long)inode->size ? offset : (long)inode->size;
+    int first = start / cluster_size;
+    int last = offset + len > 0 ? (int)((offset + len - 1) / cluster_size) : -1;
+    int compress = __atomic_load_n(&fs->sb.compression, __ATOMIC_RELAXED) != MYFS_COMPRESS_NONE;
+
+    char packed[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    int used[INODE_DIRECT_POINTERS] = {0};
+    for (int c = first; c <= last; c++) {
+        long base = (long)c * cluster_size;
+        char cluster[CLUSTER_BLOCKS * BLOCK_SIZE], out[CLUSTER_BLOCKS * BLOCK_SIZE];
+        int cluster_used[INODE_DIRECT_POINTERS];
+        memset(cluster, 0, sizeof(cluster));
+        if (base < (long)inode->size) {
+            long rc = (inode->flags & INODE_FLAG_COMPRESSED) ? read_cluster(fs, inode, c, cluster)
+                                                              : inode_read(fs, inode, cluster, cluster_size, base);
+            if (rc < 0) return rc;
+        }
+        long from = offset > base ? offset : base;
+        long to = offset + len < base + cluster_size ? offset + len : base + cluster_size;
+        if (from < to) {
+            if (data) memcpy(cluster + (from - base), data + (from - offset), to - from);
+            else memset(cluster + (from - base), 0, to - from);
+        }
+        long bytes = size - base < cluster_size ? size - base : cluster_size;
+        pack_file_data(cluster, bytes, compress, out, cluster_used);
+        memcpy(packed + base, out, (long)cluster_span(size, c) * BLOCK_SIZE);
+        memcpy(used + c * CLUSTER_BLOCKS, cluster_used, CLUSTER_BLOCKS * sizeof(int));
+    }
+    uint32_t blocks[INODE_DIRECT_POINTERS];
+    int rc = store_file_blocks(fs, inode_num, packed, used, blocks);
+    if (rc != 0) return rc;
+
+    Inode updated = *inode;
+    int clusters = (int)((size + cluster_size - 1) / cluster_size);
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        int c = i / CLUSTER_BLOCKS;
+        if (c >= first && c <= last) updated.direct_blocks[i] = blocks[i];
+        else if (c >= clusters) updated.direct_blocks[i] = UNUSED_BLOCK;
+    }
+    // The file stays flagged as compressed while any of its clusters is.
+    updated.flags &= ~INODE_FLAG_COMPRESSED;
+    for (int c = 0; c < clusters; c++) {
+        int n = cluster_span(size, c);
+        if (updated.direct_blocks[c * CLUSTER_BLOCKS + n - 1] == UNUSED_BLOCK) updated.flags |= INODE_FLAG_COMPRESSED;
+    }
+    updated.size = size;
+    updated.modification_time = time(NULL);
+    if (write_inode(fs, inode_num, &updated) != 0) {
+        for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+            if (blocks[i] != UNUSED_BLOCK) free_data_block(fs, blocks[i]);
+        }
+        return MYFS_EIO;
+    }
+    // Deduplication may have handed back a block the file already held; it
+    // took a reference of its own, so the old one is still dropped.
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        int c = i / CLUSTER_BLOCKS;
+        if (inode->direct_blocks[i] != UNUSED_BLOCK && ((c >= first && c <= last) || c >= clusters))
+            free_data_block(fs, inode->direct_blocks[i]);
+    }
+    *inode = updated;
+    return 0;
+}
+
+// Writes 'len' bytes of 'data' (zeros if 'data' is NULL) at 'offset',
+// growing the file if needed; any gap between the old end and 'offset'
+// reads back as nulls. Only the blocks covering the range are touched, and
+// partially covered blocks are read first. Returns 'len', or a MYFS_E*
+// code; a partial block that cannot be read fails the write before any
+// block is allocated or written. A compressed file, or any file while the
+// image's compression policy is on, goes through write_clusters instead.
+// Caller holds the inode's exclusive lock.
+static long inode_write(myfs_t* fs, int inode_num, const char* data, long len, long offset) {
+    Inode inode;
+    int rc = read_inode(fs, inode_num, &inode);
+    if (rc != 0) return rc;
+    if (inode.mode != 0) return MYFS_EISDIR;
+    if (offset < 0 || len < 0) return MYFS_EINVAL;
+    if (len == 0) return 0;
+
+    long end = offset + len;
+    if (end > INODE_DIRECT_POINTERS * BLOCK_SIZE) return MYFS_EFBIG;
+
+    long old_size = inode.size;
+    uint16_t old_flags = inode.flags;
+    if (inode.flags & INODE_FLAG_INLINE_DATA) {
+        if (end <= INODE_INLINE_SIZE) {
+            // The inline tail past the old size is kept zeroed, so gaps are nulls already.
+            if (data) memcpy(inode.inline_data + offset, data, len);
+            else memset(inode.inline_data + offset, 0, len);
+            if (end > old_size) inode.size = end;
+            inode.modification_time = time(NULL);
+            rc = write_inode(fs, inode_num, &inode);
+            return rc != 0 ? rc : len;
+        }
+        rc = promote_inline_file(fs, &inode);
+        if (rc != 0) return rc;
+    } else if ((inode.flags & INODE_FLAG_COMPRESSED) ||
+               __atomic_load_n(&fs->sb.compression, __ATOMIC_RELAXED) != MYFS_COMPRESS_NONE) {
+        rc = write_clusters(fs, inode_num, &inode, data, len, offset, end > old_size ? end : old_size);
+        return rc != 0 ? rc : len;
+    }
+
+    // When writing past the end, the range starts at the old end so the gap
+    // is zeroed in the same pass; every block below it already exists. A
+    // shared block in the range gets a new block too, and the write goes
+    // there (copy on write); the shared one loses a reference once the
+    // inode points at the copy.
+    long start = offset < old_size ? offset : old_size;
+    int first = start / BLOCK_SIZE;
+    int last = (end - 1) / BLOCK_SIZE;
+
+    // Only the first and last blocks can be partially covered; their old
+    // contents are read before anything changes, so a block that fails its
+    // checksum is never merged into and rewritten with a valid one.
+    char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    size_t span = last - first + 1;
+    memset(buffer, 0, span * BLOCK_SIZE);
+    if (inode.direct_blocks[first] != UNUSED_BLOCK && (start % BLOCK_SIZE != 0 || (first == last && end % BLOCK_SIZE != 0)))
+        rc = read_block(fs, fs->sb.data_blocks_start_block + inode.direct_blocks[first], buffer);
+    if (rc == 0 && last != first && inode.direct_blocks[last] != UNUSED_BLOCK && end % BLOCK_SIZE != 0)
+        rc = read_block(fs, fs->sb.data_blocks_start_block + inode.direct_blocks[last], buffer + (long)(span - 1) * BLOCK_SIZE);
+    if (rc != 0) {
+        if (inode.flags != old_flags) write_inode(fs, inode_num, &inode); // keeps a promotion done above
+        return rc;
+    }
+
+    int fresh[INODE_DIRECT_POINTERS] = {0};
+    uint32_t copied[INODE_DIRECT_POINTERS]; // for a fresh block: the shared one it replaces, if any
+    memcpy(copied, inode.direct_blocks, sizeof(copied));
+    for (int i = first; i <= last; i++) {
+        if (copied[i] != UNUSED_BLOCK && !block_shared(fs, copied[i])) continue;
+        int new_block = alloc_data_block(fs);
+        if (new_block < 0) {
+            rc = new_block;
+            break;
+        }
+        inode.direct_blocks[i] = new_block;
+        fresh[i] = 1;
+    }
+
+    long base = (long)first * BLOCK_SIZE;
+    if (offset > start) memset(buffer + (start - base), 0, offset - start);
+    if (data) memcpy(buffer + (offset - base), data, len);
+    else memset(buffer + (offset - base), 0, len);
+
+    for (int i = first; rc == 0 && i <= last; ) {
+        int run = contiguous_run(inode.direct_blocks, i, last + 1);
+        rc = write_blocks(fs, fs->sb.data_blocks_start_block + inode.direct_blocks[i], run, buffer + (long)(i - first) * BLOCK_SIZE);
+        i += run;
+    }
+
+    Inode updated = inode;
+    if (end > old_size) updated.size = end;
+    updated.modification_time = time(NULL);
+    if (rc == 0) rc = write_inode(fs, inode_num, &updated);
+    if (rc != 0) {
+        // The inode keeps its old blocks; fresh ones are given back.
+        for (int i = first; i <= last; i++) {
+            if (fresh[i]) { free_data_block(fs, inode.direct_blocks[i]); inode.direct_blocks[i] = copied[i]; }
+        }
+        if (inode.flags != old_flags) write_inode(fs, inode_num, &inode); // keeps a promotion done above
+        return rc;
+    }
+    for (int i = first; i <= last; i++) {
+        if (!fresh[i] || copied[i] == UNUSED_BLOCK) continue;
+        free_data_block(fs, copied[i]);
+        COUNT(fs, cow_copies, 1);
+    }
+    return len;
+}
+
+// Looks up the name under which the parent lists child_inode_num. 'hint' is
+// the child's name_slot; when it still points at the right entry the lookup
+// costs at most one block read, otherwise the parent is scanned.
+static int find_name_in_parent(myfs_t* fs, int parent_inode_num, int child_inode_num, uint32_t hint, char* name_buffer) {
+    Inode parent_inode;
+    if (read_inode(fs, parent_inode_num, &parent_inode) != 0 || parent_inode.mode != 1) return -1;
+
+    if (parent_inode.flags & INODE_FLAG_INLINE_DATA) {
+        // Inline entries are already in memory; a scan costs no I/O.
+        uint32_t entry_inode;
+        int next;
+        for (int off = 0; (next = next_inline_entry(&parent_inode, off, name_buffer, &entry_inode)) != -1; off = next) {
+            if (entry_inode == (uint32_t)child_inode_num) return 0;
+        }
+        return -1;
+    }
+
+    char block_buffer[BLOCK_SIZE];
+    if (hint < INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK &&
+        parent_inode.direct_blocks[hint / DIR_ENTRIES_PER_BLOCK] != UNUSED_BLOCK) {
+        DirectoryEntry* de = (DirectoryEntry*)block_buffer + hint % DIR_ENTRIES_PER_BLOCK;
+        if (read_dir_block(fs, parent_inode.direct_blocks[hint / DIR_ENTRIES_PER_BLOCK], block_buffer) == 0 &&
+            de->name[0] != '\0' && de->inode_number == (uint32_t)child_inode_num) {
+            strcpy(name_buffer, de->name);
+            return 0;
+        }
+    }
+
+    int total_entries = parent_inode.entry_count;
+    int entries_found = 0;
+
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (parent_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_entries)
+            break;
+
+        if (read_dir_block(fs, parent_inode.direct_blocks[i], block_buffer) != 0) return -1;
+        DirectoryEntry* de = (DirectoryEntry*)block_buffer;
+        for (int j = 0; j < (int)DIR_ENTRIES_PER_BLOCK; j++) {
+            if (entries_found >= total_entries) break;
+            if (de[j].name[0] != '\0') {
+                entries_found++;
+                if (de[j].inode_number == (uint32_t)child_inode_num) {
+                    strcpy(name_buffer, de[j].name);
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+static int find_name_for_inode(myfs_t* fs, int parent_inode_num, int child_inode_num, uint32_t hint, char* name_buffer) {
+    if (lock_inode(fs, parent_inode_num, 0) != 0) return -1;
+    int rc = find_name_in_parent(fs, parent_inode_num, child_inode_num, hint, name_buffer);
+    unlock_inode(fs, parent_inode_num);
+    return rc;
+}
+
+// Rebuilds the absolute path of a directory by following parent pointers
+// and name_slot hints up to the root: O(depth) inode and block reads.
+static int build_path_for_inode(myfs_t* fs, int inode_num, char* out, size_t out_len) {
+    char components[MAX_PATH_DEPTH][MAX_FILENAME_LEN + 1];
+    int depth = 0;
+    int current_inode = inode_num;
+
+    while (current_inode != ROOT_INODE_NUM) {
+        if (depth >= MAX_PATH_DEPTH) return -1;
+
+        Inode inode;
+        if (read_inode(fs, current_inode, &inode) != 0) return -1;
+        if (inode.mode != 1 || inode.parent == (uint32_t)current_inode) return -1;
+        if (find_name_for_inode(fs, inode.parent, current_inode, inode.name_slot, components[depth]) != 0) return -1;
+        depth++;
+        current_inode = inode.parent;
+    }
+
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = depth - 1; i >= 0; i--) {
+        int n = snprintf(out + len, out_len - len, "/%s", components[i]);
+        if (n < 0 || (size_t)n >= out_len - len) return -1;
+        len += n;
+    }
+    if (len == 0) snprintf(out, out_len, "/");
+    return 0;
+}
+
+// Resolves '.' and '..' in 'path' lexically against the absolute path
+// 'base'. Directories cannot be hard linked, so this names the same
+// directory resolve_path walks to. Returns -1 if the result does not fit.
+static int normalize_path(const char* base, const char* path, char* out, size_t out_len) {
+    char work[MAX_PATH_LEN * 2];
+    int n = (path[0] == '/') ? snprintf(work, sizeof(work), "%s", path)
+                             : snprintf(work, sizeof(work), "%s/%s", base, path);
+    if (n < 0 || n >= (int)sizeof(work)) return -1;
+
+    char* components[MAX_PATH_LEN];
+    int depth = 0;
+    char *token, *rest = work;
+    while ((token = strtok_r(rest, "/", &rest))) {
+        if (strcmp(token, ".") == 0) continue;
+        if (strcmp(token, "..") == 0) { if (depth > 0) depth--; continue; }
+        components[depth++] = token;
+    }
+
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < depth; i++) {
+        n = snprintf(out + len, out_len - len, "/%s", components[i]);
+        if (n < 0 || (size_t)n >= out_len - len) return -1;
+        len += n;
+    }
+    if (len == 0) snprintf(out, out_len, "/");
+    return 0;
+}
+
+static void fill_stat(uint32_t inode_num, const Inode* inode, struct myfs_stat* out) {
+    memset(out, 0, sizeof(*out));
+    out->ino = inode_num;
+    out->is_dir = inode->mode == 1;
+    out->size = inode->size;
+    out->nlink = inode->link_count;
+    out->ctime = inode->creation_time;
+    out->mtime = inode->modification_time;
+    out->first_block = UNUSED_BLOCK;
+    out->compressed = (inode->flags & INODE_FLAG_COMPRESSED) != 0;
+    if (inode->flags & INODE_FLAG_INLINE_DATA) return;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (inode->direct_blocks[i] == UNUSED_BLOCK) continue;
+        if (out->blocks++ == 0) out->first_block = inode->direct_blocks[i];
+    }
+}
+
+// Public API
+
+const char* myfs_strerror(int err) {
+    switch (err) {
+    case MYFS_OK: return "Success";
+    case MYFS_ENOENT: return "No such file or directory";
+    case MYFS_EEXIST: return "Name already exists";
+    case MYFS_ENOTDIR: return "Not a directory";
+    case MYFS_EISDIR: return "Is a directory";
+    case MYFS_ENOTEMPTY: return "Directory not empty";
+    case MYFS_ENOSPC: return "Out of data blocks";
+    case MYFS_ENOINODE: return "Out of inodes";
+    case MYFS_EDIRFULL: return "Directory is full";
+    case MYFS_EFBIG: return "File is too large for this simple filesystem";
+    case MYFS_ENAMETOOLONG: return "Name too long";
+    case MYFS_EINVAL: return "Invalid argument";
+    case MYFS_EPERM: return "Operation not permitted";
+    case MYFS_EBADF: return "File handle not open for this access";
+    case MYFS_EIO: return "I/O error on the disk image";
+    case MYFS_ENOMEM: return "Out of memory";
+    case MYFS_EBADFS: return "Not a myfs image or uses an older on-disk format";
+    case MYFS_ECORRUPT: return "Filesystem is inconsistent";
+    case MYFS_EBUSY: return "Image is in use by another process or handle";
+    default: return "Unknown error";
+    }
+}
+
+int myfs_mkfs(const char* image_path, long size_bytes) {
+    int num_inode_blocks = INODE_TABLE_BLOCKS;
+    long num_total_blocks = size_bytes / BLOCK_SIZE;
+    if (num_total_blocks <= INODE_TABLE_START_BLOCK + num_inode_blocks || size_bytes > UINT32_MAX) return MYFS_EINVAL;
+
+    FILE* temp_disk = fopen(image_path, "w+b");
+    if (!temp_disk) return MYFS_EIO;
+
+    if (ftruncate(fileno(temp_disk), size_bytes) != 0) {
+        fclose(temp_disk);
+        return MYFS_EIO;
+    }
+
+    Superblock temp_sb = {0};
+    temp_sb.total_size = size_bytes;
+    temp_sb.num_inodes = MAX_INODES;
+    temp_sb.inode_bitmap_block = INODE_BITMAP_BLOCK;
+    temp_sb.data_bitmap_block = DATA_BITMAP_BLOCK;
+    temp_sb.inode_table_start_block = INODE_TABLE_START_BLOCK;
+    temp_sb.data_blocks_start_block = temp_sb.inode_table_start_block + num_inode_blocks;
+    temp_sb.num_data_blocks = num_total_blocks - temp_sb.data_blocks_start_block;
+    if (temp_sb.num_data_blocks > MAX_DATA_BLOCKS) temp_sb.num_data_blocks = MAX_DATA_BLOCKS;
+    temp_sb.magic = MYFS_MAGIC;
+
+    unsigned char buffer[BLOCK_SIZE] = {0};
+    int ok = 1;
+
+    memcpy(buffer, &temp_sb, sizeof(Superblock));
+    ok &= fseek(temp_disk, SUPERBLOCK_BLOCK * BLOCK_SIZE, SEEK_SET) == 0;
+    ok &= fwrite(buffer, BLOCK_SIZE, 1, temp_disk) == 1;
+
+    unsigned char local_inode_bitmap[MAX_INODES / 8] = {0};
+    unsigned char local_data_block_bitmap[MAX_DATA_BLOCKS / 8] = {0};
+
+    set_bit(local_inode_bitmap, ROOT_INODE_NUM);
+
+    ok &= fseek(temp_disk, temp_sb.inode_bitmap_block * BLOCK_SIZE, SEEK_SET) == 0;
+    ok &= fwrite(local_inode_bitmap, sizeof(local_inode_bitmap), 1, temp_disk) == 1;
+
+    ok &= fseek(temp_disk, temp_sb.data_bitmap_block * BLOCK_SIZE, SEEK_SET) == 0;
+    ok &= fwrite(local_data_block_bitmap, sizeof(local_data_block_bitmap), 1, temp_disk) == 1;
+
+    // The root starts as an empty inline directory whose ".." is itself.
+    Inode root_inode = {0};
+    root_inode.mode = 1;
+    root_inode.flags = INODE_FLAG_INLINE_DATA;
+    root_inode.size = 0;
+    root_inode.link_count = 2;
+    root_inode.parent = ROOT_INODE_NUM;
+    root_inode.name_slot = NO_NAME_HINT;
+    root_inode.creation_time = root_inode.modification_time = time(NULL);
+
+    memset(buffer, 0, BLOCK_SIZE);
+    encode_inode(&root_inode, buffer);
+    ok &= fseek(temp_disk, temp_sb.inode_table_start_block * BLOCK_SIZE, SEEK_SET) == 0;
+    ok &= fwrite(buffer, BLOCK_SIZE, 1, temp_disk) == 1;
+
+    if (fclose(temp_disk) != 0) ok = 0;
+    return ok ? MYFS_OK : MYFS_EIO;
+}
+
+int myfs_mount(const char* image_path, myfs_t** out) {
+    *out = NULL;
+    myfs_t* fs = calloc(1, sizeof(myfs_t));
+    if (!fs) return MYFS_ENOMEM;
+
+    fs->fd = open(image_path, O_RDWR);
+    if (fs->fd < 0) {
+        int rc = (errno == ENOENT) ? MYFS_ENOENT : MYFS_EIO;
+        free(fs);
+        return rc;
+    }
+    if (flock(fs->fd, LOCK_EX | LOCK_NB) != 0) {
+        int rc = (errno == EWOULDBLOCK) ? MYFS_EBUSY : MYFS_EIO;
+        close(fs->fd);
+        free(fs);
+        return rc;
+    }
+    pthread_mutex_lock(&cache.lock);
+    fs->cache_id = cache.next_mount++;
+    pthread_mutex_unlock(&cache.lock);
+
+    char buffer[BLOCK_SIZE] = {0};
+    int rc = read_block(fs, SUPERBLOCK_BLOCK, buffer);
+    memcpy(&fs->sb, buffer, sizeof(Superblock));
+    if (rc == 0 && (fs->sb.magic != MYFS_MAGIC || fs->sb.num_inodes > MAX_INODES ||
+                    fs->sb.num_data_blocks > MAX_DATA_BLOCKS)) {
+        rc = MYFS_EBADFS;
+    }
+    if (rc == 0) rc = load_checksums(fs);
+    if (rc == 0) rc = read_block(fs, fs->sb.inode_bitmap_block, buffer);
+    for (int i = 0; i < MAX_INODES / 64; i++) fs->inode_bitmap[i] = get_le64((unsigned char*)buffer + 8 * i);
+    if (rc == 0) rc = read_block(fs, fs->sb.data_bitmap_block, buffer);
+    for (int i = 0; i < MAX_DATA_BLOCKS / 64; i++) fs->data_block_bitmap[i] = get_le64((unsigned char*)buffer + 8 * i);
+    if (rc == 0) rc = load_share_tables(fs);
+    io_error = 0;
+    if (rc != 0) {
+        cache_drop_mount(fs->cache_id);
+        close(fs->fd);
+        free(fs);
+        return rc;
+    }
+
+    for (int i = 0; i < MAX_INODES; i++) pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    for (int i = 0; i < INODE_TABLE_LOCKS; i++) pthread_mutex_init(&fs->itable_locks[i], NULL);
+    pthread_mutex_init(&fs->flush_lock, NULL);
+    pthread_mutex_init(&fs->cwd_lock, NULL);
+    pthread_mutex_init(&fs->share_lock, NULL);
+    pthread_mutex_init(&fs->index_lock, NULL);
+    pthread_mutex_init(&fs->crc_lock, NULL);
+    fs->current_working_directory_inode = ROOT_INODE_NUM;
+    strcpy(fs->current_working_directory_path, "/");
+    *out = fs;
+    return MYFS_OK;
+}
+
+int myfs_sync(myfs_t* fs) {
+    pthread_mutex_lock(&fs->flush_lock);
+    sync_bitmaps(fs);
+    pthread_mutex_unlock(&fs->flush_lock);
+    return fs_done(fs, MYFS_OK);
+}
+
+int myfs_unmount(myfs_t* fs) {
+    if (!fs) return MYFS_OK;
+    fs->batch_depth = 0;
+    int rc = myfs_sync(fs);
+    if (close(fs->fd) != 0 && rc == MYFS_OK) rc = MYFS_EIO;
+    cache_drop_mount(fs->cache_id);
+    for (int i = 0; i < MAX_INODES; i++) pthread_rwlock_destroy(&fs->inode_locks[i]);
+    for (int i = 0; i < INODE_TABLE_LOCKS; i++) pthread_mutex_destroy(&fs->itable_locks[i]);
+    pthread_mutex_destroy(&fs->flush_lock);
+    pthread_mutex_destroy(&fs->cwd_lock);
+    pthread_mutex_destroy(&fs->share_lock);
+    pthread_mutex_destroy(&fs->index_lock);
+    pthread_mutex_destroy(&fs->crc_lock);
+    free(fs);
+    return rc;
+}
+
+int myfs_statfs(myfs_t* fs, struct myfs_statfs* out) {
+    memset(out, 0, sizeof(*out));
+    out->block_size = BLOCK_SIZE;
+    out->total_inodes = fs->sb.num_inodes;
+    out->total_blocks = fs->sb.num_data_blocks;
+    out->total_bytes = fs->sb.total_size;
+    out->compression = __atomic_load_n(&fs->sb.compression, __ATOMIC_RELAXED);
+    out->dedup = __atomic_load_n(&fs->sb.dedup, __ATOMIC_RELAXED);
+    out->checksums = __atomic_load_n(&fs->sb.checksums, __ATOMIC_RELAXED);
+    for (uint32_t b = 0; b < fs->sb.num_data_blocks; b++) out->saved_blocks += __atomic_load_n(&fs->refs[b], __ATOMIC_RELAXED);
+    for (int w = 0; w * 64 < (int)fs->sb.num_inodes; w++)
+        out->free_inodes += __builtin_popcountll(free_bits(__atomic_load_n(&fs->inode_bitmap[w], __ATOMIC_ACQUIRE), w, fs->sb.num_inodes));
+    for (int w = 0; w * 64 < (int)fs->sb.num_data_blocks; w++)
+        out->free_blocks += __builtin_popcountll(free_bits(__atomic_load_n(&fs->data_block_bitmap[w], __ATOMIC_ACQUIRE), w, fs->sb.num_data_blocks));
+    return MYFS_OK;
+}
+
+int myfs_io_stats(myfs_t* fs, struct myfs_io_stats* out) {
+    const uint64_t* from = (const uint64_t*)&fs->io;
+    uint64_t* to = (uint64_t*)out;
+    for (size_t i = 0; i < sizeof(*out) / sizeof(uint64_t); i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return MYFS_OK;
+}
+
+void myfs_batch_begin(myfs_t* fs) {
+    __atomic_fetch_add(&fs->batch_depth, 1, __ATOMIC_ACQ_REL);
+}
+
+int myfs_batch_end(myfs_t* fs) {
+    int depth = __atomic_load_n(&fs->batch_depth, __ATOMIC_ACQUIRE);
+    while (depth > 0 && !__atomic_compare_exchange_n(&fs->batch_depth, &depth, depth - 1, 0,
+                                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    }
+    return fs_done(fs, MYFS_OK);
+}
+
+long myfs_file_blocks(long size) {
+    return size <= INODE_INLINE_SIZE ? 0 : (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+long myfs_dir_blocks(long entries, long name_bytes) {
+    if (entries * INLINE_DIRENT_HEADER + name_bytes <= INODE_INLINE_SIZE) return 0;
+    return (entries + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+}
+
+int myfs_lookup(myfs_t* fs, const char* path) {
+    return fs_done(fs, resolve_path(fs, path));
+}
+
+int myfs_lookup_at(myfs_t* fs, uint32_t dir_ino, const char* name) {
+    int rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = lock_inode(fs, dir_ino, 0);
+    if (rc != 0) return rc;
+    rc = find_entry_in_dir(fs, dir_ino, name);
+    unlock_inode(fs, dir_ino);
+    return fs_done(fs, rc);
+}
+
+int myfs_stat_ino(myfs_t* fs, uint32_t ino, struct myfs_stat* out) {
+    int rc = check_inode_num(fs, ino);
+    if (rc == 0) rc = lock_inode(fs, ino, 0);
+    if (rc != 0) return rc;
+    Inode inode;
+    rc = read_inode(fs, ino, &inode);
+    unlock_inode(fs, ino);
+    if (rc == 0) fill_stat(ino, &inode, out);
+    return fs_done(fs, rc);
+}
+
+int myfs_block_map(myfs_t* fs, uint32_t ino, uint32_t blocks[MYFS_MAP_SLOTS]) {
+    int rc = check_inode_num(fs, ino);
+    if (rc == 0) rc = lock_inode(fs, ino, 0);
+    if (rc != 0) return rc;
+    Inode inode;
+    rc = read_inode(fs, ino, &inode);
+    unlock_inode(fs, ino);
+    if (rc != 0) return fs_done(fs, rc);
+    int used = 0;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        blocks[i] = (inode.flags & INODE_FLAG_INLINE_DATA) ? UNUSED_BLOCK : inode.direct_blocks[i];
+        if (blocks[i] != UNUSED_BLOCK) used++;
+    }
+    return fs_done(fs, used);
+}
+
+int myfs_stat(myfs_t* fs, const char* path, struct myfs_stat* out) {
+    int ino = resolve_path(fs, path);
+    if (ino < 0) return fs_done(fs, ino);
+    return myfs_stat_ino(fs, ino, out);
+}
+
+int myfs_mkdir_at(myfs_t* fs, uint32_t dir_ino, const char* name) {
+    int rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+    return fs_done(fs, create_directory(fs, dir_ino, name));
+}
+
+int myfs_mkdir(myfs_t* fs, const char* path) {
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return fs_done(fs, create_directory(fs, parent, name));
+}
+
+int myfs_create_at(myfs_t* fs, uint32_t dir_ino, const char* name, const void* data, long size) {
+    int rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+    return fs_done(fs, create_file(fs, dir_ino, name, data, size));
+}
+
+int myfs_create(myfs_t* fs, const char* path, const void* data, long size) {
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return fs_done(fs, create_file(fs, parent, name, data, size));
+}
+
+// Locks the directory and then the child 'name' it lists, both exclusively.
+// Returns the child's inode number with both locks held, or a MYFS_E* code
+// with neither.
+static int lock_dir_and_child(myfs_t* fs, uint32_t dir_ino, const char* name) {
+    int rc = lock_inode(fs, dir_ino, 1);
+    if (rc != 0) return rc;
+    int child_inode_num = find_entry_in_dir(fs, dir_ino, name);
+    if (child_inode_num < 0) {
+        unlock_inode(fs, dir_ino);
+        return child_inode_num;
+    }
+    // The entry pins the child: it cannot be freed while the parent is locked.
+    pthread_rwlock_wrlock(&fs->inode_locks[child_inode_num]);
+    return child_inode_num;
+}
+
+int myfs_unlink_at(myfs_t* fs, uint32_t dir_ino, const char* name) {
+    int rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+
+    int child_inode_num = lock_dir_and_child(fs, dir_ino, name);
+    if (child_inode_num < 0) return fs_done(fs, child_inode_num);
+
+    // Nothing is freed unless the entry and the link count were both
+    // updated; a block that fails to read or write stops the unlink there.
+    Inode child_inode;
+    rc = read_inode(fs, child_inode_num, &child_inode);
+    if (rc == 0 && child_inode.mode == 1) rc = MYFS_EISDIR;
+    if (rc == 0) rc = remove_entry_from_dir(fs, dir_ino, name);
+    if (rc == 0) {
+        child_inode.link_count--;
+        rc = write_inode(fs, child_inode_num, &child_inode);
+    }
+    if (rc == 0) {
+        if (child_inode.link_count == 0) {
+            free_inode_blocks(fs, &child_inode);
+            free_inode(fs, child_inode_num);
+        }
+    }
+    unlock_inode(fs, child_inode_num);
+    unlock_inode(fs, dir_ino);
+    return fs_done(fs, rc);
+}
+
+int myfs_unlink(myfs_t* fs, const char* path) {
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return myfs_unlink_at(fs, parent, name);
+}
+
+int myfs_rmdir_at(myfs_t* fs, uint32_t dir_ino, const char* name) {
+    int rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+
+    int inode_num = lock_dir_and_child(fs, dir_ino, name);
+    if (inode_num < 0) return fs_done(fs, inode_num);
+
+    Inode inode;
+    rc = read_inode(fs, inode_num, &inode);
+    if (rc == 0 && inode.mode != 1) rc = MYFS_ENOTDIR;
+    else if (rc == 0 && inode.entry_count > 0) rc = MYFS_ENOTEMPTY;
+    if (rc == 0) rc = remove_entry_from_dir(fs, dir_ino, name);
+    if (rc == 0) {
+        // The entry is gone, so the directory is freed even if the parent's
+        // link count cannot be updated; fsck recounts it.
+        Inode parent_inode;
+        rc = read_inode(fs, dir_ino, &parent_inode);
+        if (rc == 0) {
+            parent_inode.link_count--;
+            rc = write_inode(fs, dir_ino, &parent_inode);
+        }
+        free_inode_blocks(fs, &inode);
+        free_inode(fs, inode_num);
+    }
+    unlock_inode(fs, inode_num);
+    unlock_inode(fs, dir_ino);
+    return fs_done(fs, rc);
+}
+
+int myfs_rmdir(myfs_t* fs, const char* path) {
+    int inode_num = resolve_path(fs, path);
+    if (inode_num == ROOT_INODE_NUM) return fs_done(fs, MYFS_EPERM);
+
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return myfs_rmdir_at(fs, parent, name);
+}
+
+int myfs_link_at(myfs_t* fs, uint32_t ino, uint32_t dir_ino, const char* name) {
+    int rc = check_inode_num(fs, ino);
+    if (rc == 0) rc = check_inode_num(fs, dir_ino);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+
+    // Checked before locking too: a directory target could be dir_ino itself.
+    Inode target_inode;
+    rc = read_inode(fs, ino, &target_inode);
+    if (rc != 0) return fs_done(fs, rc);
+    if (target_inode.mode == 1) return fs_done(fs, MYFS_EPERM); // no hard links to directories
+
+    // Nothing pins the target while the directory is locked; it may have
+    // been freed and reused as a directory since the check above. Only try
+    // its lock, and back off from the directory if it is busy.
+    for (;;) {
+        rc = lock_inode(fs, dir_ino, 1);
+        if (rc != 0) return fs_done(fs, rc);
+        if (pthread_rwlock_trywrlock(&fs->inode_locks[ino]) == 0) break;
+        unlock_inode(fs, dir_ino);
+        sched_yield();
+    }
+    if (!get_bit(fs->inode_bitmap, ino)) {
+        unlock_inode(fs, ino);
+        unlock_inode(fs, dir_ino);
+        return fs_done(fs, MYFS_ENOENT);
+    }
+
+    rc = read_inode(fs, ino, &target_inode);
+    if (rc == 0) {
+        rc = find_entry_in_dir(fs, dir_ino, name);
+        if (target_inode.mode == 1) rc = MYFS_EPERM;
+        else if (rc >= 0) rc = MYFS_EEXIST;
+        else if (rc == MYFS_ENOENT) rc = add_entry_to_dir(fs, dir_ino, name, ino);
+    }
+    if (rc >= 0) {
+        // An entry the link count does not cover would let an unlink free
+        // the inode under it, so it goes again if the count is not written.
+        target_inode.link_count++;
+        rc = write_inode(fs, ino, &target_inode);
+        if (rc != 0) remove_entry_from_dir(fs, dir_ino, name);
+    }
+    unlock_inode(fs, ino);
+    unlock_inode(fs, dir_ino);
+    return fs_done(fs, rc);
+}
+
+int myfs_link(myfs_t* fs, const char* target_path, const char* link_path) {
+    int target = resolve_path(fs, target_path);
+    if (target < 0) return fs_done(fs, target);
+
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, link_path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return myfs_link_at(fs, target, parent, name);
+}
+
+// Creates 'name' under the destination parent as a copy of a file on
+// another (or the same) image. The source is read run by run under its
+// shared lock and released before the destination directory is locked, so
+// a copy never holds locks on two images, or a file before a directory.
+static int copy_file(myfs_t* src, int src_inode_num, myfs_t* dst, int parent_inode_num, const char* name) {
+    char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    int rc = lock_inode(src, src_inode_num, 0);
+    if (rc != 0) return rc;
+    Inode src_inode;
+    rc = read_inode(src, src_inode_num, &src_inode);
+    long size = rc != 0 ? rc : inode_read(src, &src_inode, buffer, src_inode.size, 0);
+    unlock_inode(src, src_inode_num);
+    if (size < 0) return size;
+    return create_file(dst, parent_inode_num, name, buffer, size);
+}
+
+// Lists a directory's entries into a new array, under its shared lock,
+// without the flush and error reporting of the public readdir. Returns
+// the number of entries; the caller frees '*out'.
+static int list_dir_entries(myfs_t* fs, int dir_inode_num, struct myfs_dirent** out) {
+    *out = NULL;
+    int rc = lock_inode(fs, dir_inode_num, 0);
+    if (rc != 0) return rc;
+
+    Inode dir_inode;
+    struct myfs_dirent* entries = NULL;
+    int count = 0;
+    rc = read_inode(fs, dir_inode_num, &dir_inode);
+    if (rc == 0 && dir_inode.mode != 1) rc = MYFS_ENOTDIR;
+    // Every inline entry takes at least its header; size bounds the block slots used.
+    int inline_dir = (dir_inode.flags & INODE_FLAG_INLINE_DATA) != 0;
+    long slots = dir_inode.size / sizeof(DirectoryEntry);
+    if (slots > INODE_DIRECT_POINTERS * (long)DIR_ENTRIES_PER_BLOCK) slots = INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK;
+    long capacity = inline_dir ? INODE_INLINE_SIZE / INLINE_DIRENT_HEADER : slots;
+    if (rc == 0 && !(entries = malloc((capacity > 0 ? capacity : 1) * sizeof(struct myfs_dirent)))) rc = MYFS_ENOMEM;
+
+    if (rc == 0 && inline_dir) {
+        int next;
+        for (int off = 0; (next = next_inline_entry(&dir_inode, off, entries[count].name, &entries[count].ino)) != -1;
+             off = next)
+            count++;
+    } else if (rc == 0) {
+        char block_buffer[BLOCK_SIZE];
+        for (int i = 0; rc == 0 && i * (long)DIR_ENTRIES_PER_BLOCK < slots; i++) {
+            if (dir_inode.direct_blocks[i] == UNUSED_BLOCK) continue;
+            rc = read_dir_block(fs, dir_inode.direct_blocks[i], block_buffer);
+            DirectoryEntry* de = (DirectoryEntry*)block_buffer;
+            for (int j = 0; rc == 0 && j < (int)DIR_ENTRIES_PER_BLOCK && i * (long)DIR_ENTRIES_PER_BLOCK + j < slots; j++) {
+                if (de[j].name[0] == '\0') continue;
+                entries[count].ino = de[j].inode_number;
+                strcpy(entries[count++].name, de[j].name);
+            }
+        }
+    }
+    unlock_inode(fs, dir_inode_num);
+    if (rc != 0) {
+        free(entries);
+        return rc;
+    }
+    *out = entries;
+    return count;
+}
+
+// Copies a file, or a directory and everything below it, to 'name' under
+// the destination parent. Returns the new inode number. Only internal
+// calls are made, so an I/O error on either image is left for
+// myfs_copy_at to report.
+static int copy_tree(myfs_t* src, int src_inode_num, myfs_t* dst, int parent_inode_num, const char* name) {
+    Inode src_inode;
+    int rc = read_inode(src, src_inode_num, &src_inode);
+    if (rc != 0) return rc;
+    if (src_inode.mode == 0) return copy_file(src, src_inode_num, dst, parent_inode_num, name);
+
+    int new_dir = create_directory(dst, parent_inode_num, name);
+    if (new_dir < 0) return new_dir;
+
+    // The entries are taken first so no lock on the source is held while the copy below writes.
+    struct myfs_dirent* entries;
+    int count = list_dir_entries(src, src_inode_num, &entries);
+    if (count < 0) return count;
+    rc = 0;
+    for (int i = 0; i < count && rc >= 0; i++) rc = copy_tree(src, entries[i].ino, dst, new_dir, entries[i].name);
+    free(entries);
+    return rc < 0 ? rc : new_dir;
+}
+
+// Creates 'name' under the parent as a clone of a file: a new inode with
+// the source's size, flags and block map, each block taking one more
+// reference, so neither file's later writes reach the other (they copy a
+// shared block first). A block that already has MAX_REFS extra references
+// is copied instead. The source's shared lock is held only while its
+// blocks are referenced; as in create_file, the parent is locked last.
+static int clone_file(myfs_t* fs, int src_inode_num, int parent_inode_num, const char* name) {
+    int rc = lock_inode(fs, parent_inode_num, 0);
+    if (rc != 0) return rc;
+    rc = find_entry_in_dir(fs, parent_inode_num, name);
+    unlock_inode(fs, parent_inode_num);
+    if (rc >= 0) return MYFS_EEXIST;
+    if (rc != MYFS_ENOENT) return rc;
+
+    // The reference counts are reserved on the first clone, as by myfs_set_dedup.
+    pthread_mutex_lock(&fs->flush_lock);
+    rc = MYFS_OK;
+    if (!fs->sb.refcount_block && (rc = reserve_share_tables(fs, 0)) == 0) write_superblock(fs);
+    pthread_mutex_unlock(&fs->flush_lock);
+    if (rc != 0) return rc;
+
+    int new_inode_num = alloc_inode(fs);
+    if (new_inode_num < 0) return new_inode_num;
+
+    Inode new_inode;
+    rc = lock_inode(fs, src_inode_num, 0);
+    if (rc != 0) {
+        free_inode(fs, new_inode_num);
+        return rc;
+    }
+    rc = read_inode(fs, src_inode_num, &new_inode);
+    if (rc == 0 && new_inode.mode != 0) rc = MYFS_EISDIR;
+    for (int i = 0; rc == 0 && !(new_inode.flags & INODE_FLAG_INLINE_DATA) && i < INODE_DIRECT_POINTERS; i++) {
+        uint32_t block = new_inode.direct_blocks[i];
+        if (block == UNUSED_BLOCK || share_block(fs, block)) continue;
+        char buffer[BLOCK_SIZE];
+        int copy = alloc_data_block(fs);
+        if (copy >= 0 && read_block(fs, fs->sb.data_blocks_start_block + block, buffer) == 0 &&
+            write_block(fs, fs->sb.data_blocks_start_block + copy, buffer) == 0) {
+            new_inode.direct_blocks[i] = copy;
+            continue;
+        }
+        if (copy >= 0) free_data_block(fs, copy);
+        rc = copy >= 0 ? MYFS_EIO : copy;
+        // Drop the references taken so far.
+        for (int j = 0; j < i; j++) {
+            if (new_inode.direct_blocks[j] != UNUSED_BLOCK) free_data_block(fs, new_inode.direct_blocks[j]);
+        }
+    }
+    unlock_inode(fs, src_inode_num);
+    if (rc != 0) {
+        free_inode(fs, new_inode_num);
+        return rc;
+    }
+
+    new_inode.link_count = 1;
+    new_inode.creation_time = new_inode.modification_time = time(NULL);
+    rc = write_inode(fs, new_inode_num, &new_inode);
+    if (rc == 0) rc = lock_inode(fs, parent_inode_num, 1);
+    if (rc == 0) {
+        rc = find_entry_in_dir(fs, parent_inode_num, name);
+        if (rc >= 0) rc = MYFS_EEXIST;
+        else if (rc == MYFS_ENOENT) rc = add_entry_to_dir(fs, parent_inode_num, name, new_inode_num);
+        unlock_inode(fs, parent_inode_num);
+    }
+    if (rc < 0) {
+        free_inode_blocks(fs, &new_inode);
+        free_inode(fs, new_inode_num);
+        return rc;
+    }
+    return new_inode_num;
+}
+
+int myfs_copy_at(myfs_t* src, uint32_t src_ino, myfs_t* dst, uint32_t dst_dir, const char* name) {
+    int rc = check_inode_num(src, src_ino);
+    if (rc == 0) rc = check_inode_num(dst, dst_dir);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+
+    Inode dir_inode;
+    rc = read_inode(dst, dst_dir, &dir_inode);
+    if (rc != 0) return fs_done(dst, rc);
+    if (dir_inode.mode != 1) return fs_done(dst, MYFS_ENOTDIR);
+
+    // Within one image, a directory must not be copied into its own subtree.
+    if (src == dst) {
+        uint32_t d = dst_dir;
+        for (int depth = 0; d != src_ino && d != ROOT_INODE_NUM && depth < MAX_INODES; depth++) {
+            rc = read_inode(dst, d, &dir_inode);
+            if (rc != 0) return fs_done(dst, rc);
+            d = dir_inode.parent;
+        }
+        if (d == src_ino) return fs_done(dst, MYFS_EINVAL);
+    }
+
+    myfs_batch_begin(dst);
+    rc = copy_tree(src, src_ino, dst, dst_dir, name);
+    int end_rc = myfs_batch_end(dst);
+    rc = fs_done(src, rc);
+    return (rc >= 0 && end_rc != 0) ? end_rc : rc;
+}
+
+int myfs_copy(myfs_t* src, const char* src_path, myfs_t* dst, const char* dst_path) {
+    int src_ino = resolve_path(src, src_path);
+    if (src_ino < 0) return fs_done(src, src_ino);
+
+    // An existing directory as the destination receives the source under its own name.
+    char name[MAX_FILENAME_LEN + 1];
+    int dst_dir = resolve_path(dst, dst_path);
+    Inode dir_inode;
+    if (dst_dir >= 0 && read_inode(dst, dst_dir, &dir_inode) == 0 && dir_inode.mode == 1) {
+        char temp_path[MAX_PATH_LEN];
+        snprintf(temp_path, sizeof(temp_path), "%s", src_path);
+        char* src_name = basename(temp_path);
+        if (strlen(src_name) > MAX_FILENAME_LEN) return fs_done(dst, MYFS_ENAMETOOLONG);
+        strcpy(name, src_name);
+    } else if (dst_dir >= 0) {
+        return fs_done(dst, MYFS_EEXIST);
+    } else {
+        dst_dir = resolve_parent(dst, dst_path, name);
+        if (dst_dir < 0) return fs_done(dst, dst_dir);
+    }
+    return myfs_copy_at(src, src_ino, dst, dst_dir, name);
+}
+
+int myfs_clone_at(myfs_t* fs, uint32_t src_ino, uint32_t dst_dir, const char* name) {
+    int rc = check_inode_num(fs, src_ino);
+    if (rc == 0) rc = check_inode_num(fs, dst_dir);
+    if (rc == 0) rc = check_name(name);
+    if (rc != 0) return rc;
+    return fs_done(fs, clone_file(fs, src_ino, dst_dir, name));
+}
+
+int myfs_clone(myfs_t* fs, const char* src_path, const char* dst_path) {
+    int src_ino = resolve_path(fs, src_path);
+    if (src_ino < 0) return fs_done(fs, src_ino);
+
+    char name[MAX_FILENAME_LEN + 1];
+    int parent = resolve_parent(fs, dst_path, name);
+    if (parent < 0) return fs_done(fs, parent);
+    return fs_done(fs, clone_file(fs, src_ino, parent, name));
+}
+
+long myfs_pread(myfs_t* fs, uint32_t ino, void* buf, long len, long offset) {
+    int rc = check_inode_num(fs, ino);
+    if (rc != 0) return rc;
+    if (offset < 0 || len < 0) return MYFS_EINVAL;
+    rc = lock_inode(fs, ino, 0);
+    if (rc != 0) return rc;
+
+    Inode inode;
+    long n = read_inode(fs, ino, &inode);
+    if (n == 0) n = inode.mode != 0 ? MYFS_EISDIR : inode_read(fs, &inode, buf, len, offset);
+    unlock_inode(fs, ino);
+    return fs_done(fs, n);
+}
+
+// pwrite, or an append at the end of file as it stands under the lock when
+// 'offset' is NULL. Returns the bytes written and where the write started.
+static long write_locked(myfs_t* fs, uint32_t ino, const void* buf, long len, long offset, long* start) {
+    int rc = check_inode_num(fs, ino);
+    if (rc != 0) return rc;
+    if (buf == NULL && len > 0) return MYFS_EINVAL;
+    rc = lock_inode(fs, ino, 1);
+    if (rc != 0) return rc;
+
+    long n = 0;
+    if (offset < 0) {
+        Inode inode;
+        n = read_inode(fs, ino, &inode);
+        offset = inode.size;
+    }
+    if (n == 0) n = inode_write(fs, ino, buf, len, offset);
+    unlock_inode(fs, ino);
+    if (start) *start = offset;
+    return fs_done(fs, n);
+}
+
+long myfs_pwrite(myfs_t* fs, uint32_t ino, const void* buf, long len, long offset) {
+    if (offset < 0) return MYFS_EINVAL;
+    return write_locked(fs, ino, buf, len, offset, NULL);
+}
+
+int myfs_truncate(myfs_t* fs, uint32_t ino, long size) {
+    int rc = check_inode_num(fs, ino);
+    if (rc != 0) return rc;
+    if (size < 0) return MYFS_EINVAL;
+    rc = lock_inode(fs, ino, 1);
+    if (rc != 0) return rc;
+
+    Inode inode;
+    rc = read_inode(fs, ino, &inode);
+    if (rc != 0) {
+        // Nothing is freed from a file whose inode cannot be read.
+    } else if (inode.mode != 0) {
+        rc = MYFS_EISDIR;
+    } else if (size > (long)inode.size) {
+        long n = inode_write(fs, ino, NULL, size - inode.size, inode.size);
+        rc = n < 0 ? n : MYFS_OK;
+    } else if (inode.flags & INODE_FLAG_COMPRESSED) {
+        // Only the new last cluster is packed again; without room for it the file stays as it is.
+        rc = write_clusters(fs, ino, &inode, NULL, 0, size, size);
+    } else {
+        if (inode.flags & INODE_FLAG_INLINE_DATA) {
+            // Keep the inline tail zeroed so a later append reads back nulls.
+            memset(inode.inline_data + size, 0, inode.size - size);
+        } else {
+            int last_block_idx_to_keep = (size > 0) ? (int)((size - 1) / BLOCK_SIZE) : -1;
+            for (int i = last_block_idx_to_keep + 1; i < INODE_DIRECT_POINTERS; i++) {
+                if (inode.direct_blocks[i] != UNUSED_BLOCK) {
+                    free_data_block(fs, inode.direct_blocks[i]);
+                    inode.direct_blocks[i] = UNUSED_BLOCK;
+                }
+            }
+        }
+
+        inode.size = size;
+        inode.modification_time = time(NULL);
+        rc = write_inode(fs, ino, &inode);
+    }
+    unlock_inode(fs, ino);
+    return fs_done(fs, rc);
+}
+
+int myfs_set_compression(myfs_t* fs, int codec) {
+    if (codec != MYFS_COMPRESS_NONE && codec != MYFS_COMPRESS_LZ) return MYFS_EINVAL;
+    pthread_mutex_lock(&fs->flush_lock);
+    __atomic_store_n(&fs->sb.compression, codec, __ATOMIC_RELAXED);
+    write_superblock(fs);
+    pthread_mutex_unlock(&fs->flush_lock);
+    return fs_done(fs, MYFS_OK);
+}
+
+int myfs_set_dedup(myfs_t* fs, int on) {
+    pthread_mutex_lock(&fs->flush_lock);
+    int rc = on ? reserve_share_tables(fs, 1) : MYFS_OK;
+    if (rc == 0) {
+        __atomic_store_n(&fs->sb.dedup, on != 0, __ATOMIC_RELAXED);
+        write_superblock(fs);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+    return fs_done(fs, rc);
+}
+
+// Computes the checksum of every block from the image. A write made
+// meanwhile records its own checksum and marks the block written (see
+// update_crcs); the pass keeps that one rather than what it read before
+// the write. On success checksums are left on. Caller holds flush_lock.
+static int compute_checksums(myfs_t* fs) {
+    char* buffer = malloc((long)SCRUB_READ_BLOCKS * BLOCK_SIZE);
+    if (!buffer) return MYFS_ENOMEM;
+    memset(fs->crc_written, 0, sizeof(fs->crc_written));
+    __atomic_store_n(&fs->crc_pass, 1, __ATOMIC_RELEASE);
+
+    int rc = MYFS_OK;
+    uint32_t total = image_blocks(&fs->sb);
+    for (uint32_t first = 0; first < total && rc == 0; first += SCRUB_READ_BLOCKS) {
+        int count = total - first < SCRUB_READ_BLOCKS ? (int)(total - first) : SCRUB_READ_BLOCKS;
+        pthread_mutex_lock(&fs->crc_lock);
+        for (uint32_t b = first; b < first + count; b++) fs->crc_written[b / 64] &= ~(UINT64_C(1) << (b % 64));
+        pthread_mutex_unlock(&fs->crc_lock);
+        rc = read_image(fs, first, count, buffer);
+        COUNT(fs, bytes_read, (uint64_t)count * BLOCK_SIZE);
+        pthread_mutex_lock(&fs->crc_lock);
+        for (int i = 0; rc == 0 && i < count; i++) {
+            uint32_t b = first + i;
+            if (block_has_crc(fs, b) && !(fs->crc_written[b / 64] & (UINT64_C(1) << (b % 64))))
+                set_crc(fs, b, crc32c(buffer + (long)i * BLOCK_SIZE, BLOCK_SIZE));
+        }
+        pthread_mutex_unlock(&fs->crc_lock);
+    }
+    // Checksums go on before the pass ends, so that no write in between goes unrecorded.
+    if (rc == 0) __atomic_store_n(&fs->sb.checksums, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->crc_pass, 0, __ATOMIC_RELEASE);
+    free(buffer);
+    return rc;
+}
+
+int myfs_set_checksums(myfs_t* fs, int on) {
+    pthread_mutex_lock(&fs->flush_lock);
+    int rc = MYFS_OK;
+    if (on && !fs->sb.checksums) {
+        if (!fs->sb.checksum_block) {
+            int start = claim_data_run(fs, checksum_table_blocks(&fs->sb));
+            if (start < 0) rc = start;
+            else __atomic_store_n(&fs->sb.checksum_block, fs->sb.data_blocks_start_block + start, __ATOMIC_RELEASE);
+        }
+        if (rc == 0) rc = compute_checksums(fs);
+    } else if (!on) {
+        __atomic_store_n(&fs->sb.checksums, 0, __ATOMIC_RELEASE);
+    }
+    if (rc == 0) {
+        write_superblock(fs);
+        flush_checksums(fs);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+    return fs_done(fs, rc);
+}
+
+int myfs_compress(myfs_t* fs, uint32_t ino, int codec) {
+    int rc = check_inode_num(fs, ino);
+    if (rc != 0) return rc;
+    if (codec != MYFS_COMPRESS_NONE && codec != MYFS_COMPRESS_LZ) return MYFS_EINVAL;
+    rc = lock_inode(fs, ino, 1);
+    if (rc != 0) return rc;
+
+    Inode inode;
+    rc = read_inode(fs, ino, &inode);
+    int compressed = (inode.flags & INODE_FLAG_COMPRESSED) != 0;
+    if (rc == 0 && inode.mode != 0) rc = MYFS_EISDIR;
+    else if (!(inode.flags & INODE_FLAG_INLINE_DATA) && compressed != (codec != MYFS_COMPRESS_NONE))
+        rc = rewrite_file_data(fs, ino, &inode, codec != MYFS_COMPRESS_NONE);
+    unlock_inode(fs, ino);
+    if (rc != 0) return fs_done(fs, rc);
+
+    struct myfs_stat st;
+    fill_stat(ino, &inode, &st);
+    return fs_done(fs, st.blocks);
+}
+
+int myfs_open(myfs_t* fs, const char* path, int flags, myfs_file_t** out) {
+    *out = NULL;
+    int ino = resolve_path(fs, path);
+    if (ino == MYFS_ENOENT && (flags & MYFS_O_CREAT)) {
+        char name[MAX_FILENAME_LEN + 1];
+        int parent = resolve_parent(fs, path, name);
+        ino = parent < 0 ? parent : create_file(fs, parent, name, NULL, 0);
+        // Another thread created it first: open that file instead.
+        if (ino == MYFS_EEXIST) ino = resolve_path(fs, path);
+    }
+    if (ino < 0) return fs_done(fs, ino);
+
+    Inode inode;
+    int rc = read_inode(fs, ino, &inode);
+    if (rc != 0) return fs_done(fs, rc);
+    if (inode.mode != 0) return fs_done(fs, MYFS_EISDIR);
+
+    myfs_file_t* f = malloc(sizeof(myfs_file_t));
+    if (!f) return fs_done(fs, MYFS_ENOMEM);
+    f->fs = fs;
+    f->inode_num = ino;
+    f->flags = flags;
+    f->position = 0;
+
+    if ((flags & MYFS_O_TRUNC) && (flags & MYFS_O_ACCMODE) != MYFS_O_RDONLY) {
+        rc = myfs_truncate(fs, ino, 0);
+        if (rc != 0) { free(f); return rc; }
+    }
+    *out = f;
+    return fs_done(fs, MYFS_OK);
+}
+
+long myfs_read(myfs_file_t* f, void* buf, long len) {
+    if ((f->flags & MYFS_O_ACCMODE) == MYFS_O_WRONLY) return MYFS_EBADF;
+    long n = myfs_pread(f->fs, f->inode_num, buf, len, f->position);
+    if (n > 0) f->position += n;
+    return n;
+}
+
+long myfs_write(myfs_file_t* f, const void* buf, long len) {
+    if ((f->flags & MYFS_O_ACCMODE) == MYFS_O_RDONLY) return MYFS_EBADF;
+    long start;
+    long n = write_locked(f->fs, f->inode_num, buf, len, (f->flags & MYFS_O_APPEND) ? -1 : f->position, &start);
+    if (n >= 0) f->position = start + n;
+    return n;
+}
+
+long myfs_seek(myfs_file_t* f, long offset, int whence) {
+    long base = 0;
+    if (whence == SEEK_CUR) {
+        base = f->position;
+    } else if (whence == SEEK_END) {
+        struct myfs_stat st;
+        int rc = myfs_stat_ino(f->fs, f->inode_num, &st);
+        if (rc != 0) return rc;
+        base = st.size;
+    } else if (whence != SEEK_SET) {
+        return MYFS_EINVAL;
+    }
+    if (base + offset < 0) return MYFS_EINVAL;
+    f->position = base + offset;
+    return f->position;
+}
+
+int myfs_close(myfs_file_t* f) {
+    free(f);
+    return MYFS_OK;
+}
+
+int myfs_opendir_ino(myfs_t* fs, uint32_t ino, myfs_dir_t** out) {
+    *out = NULL;
+    int rc = check_inode_num(fs, ino);
+    if (rc != 0) return rc;
+
+    myfs_dir_t* d = malloc(sizeof(myfs_dir_t));
+    if (!d) return MYFS_ENOMEM;
+    rc = lock_inode(fs, ino, 0);
+    if (rc != 0) { free(d); return rc; }
+    rc = read_inode(fs, ino, &d->inode);
+    unlock_inode(fs, ino);
+    if (rc == 0 && d->inode.mode != 1) rc = MYFS_ENOTDIR;
+    if (rc != 0) { free(d); return fs_done(fs, rc); }
+    d->fs = fs;
+    d->inode_num = ino;
+    d->inline_offset = 0;
+    d->slot = 0;
+    d->loaded_block = UNUSED_BLOCK;
+    *out = d;
+    return fs_done(fs, MYFS_OK);
+}
+
+int myfs_opendir(myfs_t* fs, const char* path, myfs_dir_t** out) {
+    *out = NULL;
+    int ino = resolve_path(fs, path);
+    if (ino < 0) return fs_done(fs, ino);
+    return myfs_opendir_ino(fs, ino, out);
+}
+
+int myfs_readdir(myfs_dir_t* d, struct myfs_dirent* out) {
+    if (d->inode.flags & INODE_FLAG_INLINE_DATA) {
+        int next = next_inline_entry(&d->inode, d->inline_offset, out->name, &out->ino);
+        if (next == -1) return 0;
+        d->inline_offset = next;
+        return 1;
+    }
+
+    // Block directories are read live, one block at a time, under the
+    // directory's shared lock; size bounds the highest slot ever used.
+    myfs_t* fs = d->fs;
+    int rc = lock_inode(fs, d->inode_num, 0);
+    if (rc != 0) return fs_done(fs, rc);
+    rc = read_inode(fs, d->inode_num, &d->inode);
+    if (rc != 0) {
+        unlock_inode(fs, d->inode_num);
+        return fs_done(fs, rc);
+    }
+
+    int end_slot = d->inode.size / sizeof(DirectoryEntry);
+    while (d->slot < end_slot) {
+        int i = d->slot / DIR_ENTRIES_PER_BLOCK;
+        if (d->inode.direct_blocks[i] == UNUSED_BLOCK) {
+            d->slot = (i + 1) * DIR_ENTRIES_PER_BLOCK;
+            continue;
+        }
+        if (d->loaded_block != d->inode.direct_blocks[i]) {
+            rc = read_dir_block(fs, d->inode.direct_blocks[i], d->buffer);
+            if (rc != 0) break;
+            d->loaded_block = d->inode.direct_blocks[i];
+        }
+        DirectoryEntry* de = (DirectoryEntry*)d->buffer + d->slot % DIR_ENTRIES_PER_BLOCK;
+        d->slot++;
+        if (de->name[0] == '\0') continue;
+        out->ino = de->inode_number;
+        strcpy(out->name, de->name);
+        rc = 1;
+        break;
+    }
+    unlock_inode(fs, d->inode_num);
+    return fs_done(fs, rc);
+}
+
+void myfs_closedir(myfs_dir_t* d) {
+    free(d);
+}
+
+int myfs_chdir(myfs_t* fs, const char* path) {
+    if (path[0] == '\0') return MYFS_OK;
+
+    // Resolve against a consistent snapshot of the working directory.
+    char base_path[MAX_PATH_LEN];
+    pthread_mutex_lock(&fs->cwd_lock);
+    int base = fs->current_working_directory_inode;
+    strcpy(base_path, fs->current_working_directory_path);
+    pthread_mutex_unlock(&fs->cwd_lock);
+
+    int target_inode_num = resolve_from(fs, base, path);
+    if (target_inode_num < 0) return fs_done(fs, target_inode_num);
+
+    Inode target_inode;
+    int rc = read_inode(fs, target_inode_num, &target_inode);
+    if (rc != 0) return fs_done(fs, rc);
+    if (target_inode.mode != 1) return fs_done(fs, MYFS_ENOTDIR);
+
+    // Keep the cached path in step; getcwd falls back to the on-disk walk if it is lost.
+    char new_path[MAX_PATH_LEN];
+    if (base_path[0] != '\0' && normalize_path(base_path, path, new_path, sizeof(new_path)) == 0) {
+        // new_path is already set
+    } else if (build_path_for_inode(fs, target_inode_num, new_path, sizeof(new_path)) != 0) {
+        new_path[0] = '\0';
+    }
+    pthread_mutex_lock(&fs->cwd_lock);
+    strcpy(fs->current_working_directory_path, new_path);
+    fs->current_working_directory_inode = target_inode_num;
+    pthread_mutex_unlock(&fs->cwd_lock);
+    return fs_done(fs, MYFS_OK);
+}
+
+int myfs_getcwd(myfs_t* fs, char* buf, size_t len) {
+    char path[MAX_PATH_LEN];
+    pthread_mutex_lock(&fs->cwd_lock);
+    int inode_num = fs->current_working_directory_inode;
+    strcpy(path, fs->current_working_directory_path);
+    pthread_mutex_unlock(&fs->cwd_lock);
+
+    if (path[0] == '\0' && build_path_for_inode(fs, inode_num, path, sizeof(path)) != 0)
+        return fs_done(fs, MYFS_ECORRUPT);
+    if (strlen(path) >= len) return fs_done(fs, MYFS_ENAMETOOLONG);
+    strcpy(buf, path);
+    return fs_done(fs, MYFS_OK);
+}
+
+// Consistency Check
+// myfs_fsck works on a private copy of the inode table and never trusts the
+// allocation bitmaps: the walk from the root decides which inodes are in
+// use, and the inodes reached decide which blocks are. Worker threads take
+// directories from a shared queue and queue the subdirectories they find,
+// so the walk fans out as the tree does; per-inode counters they share are
+// updated atomically. Anything that depends on the order the workers ran
+// in (which of two names of a directory survives, which of two inodes
+// keeps a block) is settled afterwards by the calling thread, which also
+// makes every repair.
+#define FSCK_MAX_THREADS 16
+#define FSCK_READ_BLOCKS 64 // inode-table blocks per transfer
+#define FSCK_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t dir;
+    uint32_t child;
+    char name[MAX_FILENAME_LEN + 1];
+} FsckEntry;
+
+typedef struct {
+    FsckEntry* entries;
+    int count, capacity;
+} FsckList;
+
+typedef struct {
+    myfs_t* fs;
+    Inode* table;
+    unsigned char* changed; // per inode: the copy in 'table' has been corrected
+    uint32_t* names;        // per inode: entries naming it
+    uint32_t* subdirs;      // per directory: entries in it naming a directory
+    uint32_t* listed_in;    // per directory: the directory keeping its name
+    uint32_t* block_owner;  // per data block: lowest inode number pointing at it
+    uint32_t* block_refs;   // per data block: pointers at it that are kept
+    unsigned char* queued;  // per directory: already in the queue
+    uint32_t* queue;
+    int queue_len, queue_next, busy;
+    int io_failed;          // io_error is per thread, so workers report theirs (or MYFS_ENOMEM) here
+    FsckList bad;           // entries to remove
+    FsckList dir_links;     // entries naming a directory
+    pthread_mutex_t lock;
+    pthread_cond_t changed_queue;
+    struct myfs_fsck_report report;
+} Fsck;
+
+typedef struct {
+    Fsck* ck;
+    uint32_t from, to;
+} FsckRange;
+
+// Caller holds ck->lock.
+// Returns MYFS_ENOMEM, with the list as it was, if it cannot grow.
+static int fsck_list_add(FsckList* list, uint32_t dir, uint32_t child, const char* name) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        FsckEntry* entries = realloc(list->entries, capacity * sizeof(FsckEntry));
+        if (!entries) return MYFS_ENOMEM;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    FsckEntry* e = &list->entries[list->count++];
+    e->dir = dir;
+    e->child = child;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    return MYFS_OK;
+}
+
+static int fsck_reached(Fsck* ck, uint32_t inode_num) {
+    return inode_num == ROOT_INODE_NUM || ck->names[inode_num] > 0;
+}
+
+// Accounts for one entry of 'dir'. An entry is bad if its inode number is
+// out of range, names the root, or names an inode that is free in the
+// bitmap and has no links (or no valid mode) in the table; a freshly
+// created inode whose bitmap bit was not yet written back still counts.
+static void fsck_entry(Fsck* ck, uint32_t dir, const char* name, uint32_t inode_num) {
+    myfs_t* fs = ck->fs;
+    const Inode* child = inode_num < fs->sb.num_inodes ? &ck->table[inode_num] : NULL;
+    if (!child || inode_num == ROOT_INODE_NUM || child->mode > 1 ||
+        (!get_bit(fs->inode_bitmap, inode_num) && child->link_count == 0)) {
+        pthread_mutex_lock(&ck->lock);
+        if (fsck_list_add(&ck->bad, dir, inode_num, name) != 0)
+            __atomic_store_n(&ck->io_failed, MYFS_ENOMEM, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ck->lock);
+        return;
+    }
+    __atomic_fetch_add(&ck->names[inode_num], 1, __ATOMIC_RELAXED);
+    if (child->mode != 1) return;
+
+    ck->subdirs[dir]++; // only this worker checks 'dir'
+    pthread_mutex_lock(&ck->lock);
+    if (fsck_list_add(&ck->dir_links, dir, inode_num, name) != 0)
+        __atomic_store_n(&ck->io_failed, MYFS_ENOMEM, __ATOMIC_RELAXED);
+    if (!ck->queued[inode_num]) {
+        ck->queued[inode_num] = 1;
+        ck->queue[ck->queue_len++] = inode_num;
+        pthread_cond_signal(&ck->changed_queue);
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// Checks one directory's entries against its entry count and size.
+static void fsck_directory(Fsck* ck, uint32_t dir) {
+    myfs_t* fs = ck->fs;
+    Inode* d = &ck->table[dir];
+    uint32_t live = 0;
+
+    if (d->flags & INODE_FLAG_INLINE_DATA) {
+        char name[MAX_FILENAME_LEN + 1];
+        uint32_t inode_num;
+        int next, off = 0;
+        int torn = d->size > INODE_INLINE_SIZE;
+        if (torn) d->size = INODE_INLINE_SIZE;
+        while ((next = next_inline_entry(d, off, name, &inode_num)) != -1) {
+            fsck_entry(ck, dir, name, inode_num);
+            live++;
+            off = next;
+        }
+        if (torn || off != (int)d->size) {
+            // A torn last entry: keep the whole ones.
+            d->size = off;
+            ck->changed[dir] = 1;
+            __atomic_fetch_add(&ck->report.bad_inodes, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        char buffer[BLOCK_SIZE];
+        uint32_t end = 0;
+        for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+            uint32_t block = d->direct_blocks[i];
+            if (block == UNUSED_BLOCK || block >= fs->sb.num_data_blocks) continue; // left to fsck_blocks
+            if (read_dir_block(fs, block, buffer) != 0) continue;
+            DirectoryEntry* de = (DirectoryEntry*)buffer;
+            for (int j = 0; j < (int)DIR_ENTRIES_PER_BLOCK; j++) {
+                if (de[j].name[0] == '\0') continue;
+                de[j].name[MAX_FILENAME_LEN] = '\0';
+                fsck_entry(ck, dir, de[j].name, de[j].inode_number);
+                live++;
+                end = (i * DIR_ENTRIES_PER_BLOCK + j + 1) * sizeof(DirectoryEntry);
+            }
+        }
+        // readdir stops at size, so it must cover the last entry.
+        if (end > d->size) {
+            d->size = end;
+            ck->changed[dir] = 1;
+            __atomic_fetch_add(&ck->report.bad_inodes, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (live != d->entry_count) {
+        d->entry_count = live;
+        ck->changed[dir] = 1;
+        __atomic_fetch_add(&ck->report.bad_inodes, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* fsck_walk_worker(void* arg) {
+    Fsck* ck = *(Fsck**)arg;
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        while (ck->queue_next == ck->queue_len && ck->busy > 0) pthread_cond_wait(&ck->changed_queue, &ck->lock);
+        if (ck->queue_next == ck->queue_len) break;
+        uint32_t dir = ck->queue[ck->queue_next++];
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+        fsck_directory(ck, dir);
+        pthread_mutex_lock(&ck->lock);
+        ck->busy--;
+        pthread_cond_broadcast(&ck->changed_queue);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    if (io_error) __atomic_store_n(&ck->io_failed, io_error, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Checks the sizes and block pointers of a range of reached inodes and
+// claims their blocks; of two inodes pointing at one block, the lower
+// inode number keeps it.
+static void* fsck_blocks_worker(void* arg) {
+    FsckRange* range = arg;
+    Fsck* ck = range->ck;
+    myfs_t* fs = ck->fs;
+    for (uint32_t n = range->from; n < range->to; n++) {
+        if (!fsck_reached(ck, n)) continue;
+        Inode* inode = &ck->table[n];
+        uint32_t limit = (inode->flags & INODE_FLAG_INLINE_DATA) ? INODE_INLINE_SIZE : MYFS_FILE_MAX;
+        if (inode->mode == 0 && inode->size > limit) {
+            inode->size = limit;
+            ck->changed[n] = 1;
+            __atomic_fetch_add(&ck->report.bad_inodes, 1, __ATOMIC_RELAXED);
+        }
+        if (inode->flags & INODE_FLAG_INLINE_DATA) continue;
+        int keep = inode->mode == 1 ? INODE_DIRECT_POINTERS : (int)((inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+            uint32_t block = inode->direct_blocks[i];
+            if (block == UNUSED_BLOCK) continue;
+            if (block >= fs->sb.num_data_blocks || i >= keep || table_block(fs, block)) {
+                inode->direct_blocks[i] = UNUSED_BLOCK;
+                ck->changed[n] = 1;
+                __atomic_fetch_add(&ck->report.bad_blocks, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            uint32_t owner = __atomic_load_n(&ck->block_owner[block], __ATOMIC_RELAXED);
+            while (n < owner && !__atomic_compare_exchange_n(&ck->block_owner[block], &owner, n, 1, __ATOMIC_RELAXED,
+                                                              __ATOMIC_RELAXED)) {}
+        }
+    }
+    return NULL;
+}
+
+// Orders names of directories by directory and name, whatever order the
+// workers found them in.
+static int fsck_compare_entries(const void* a, const void* b) {
+    const FsckEntry *x = a, *y = b;
+    if (x->dir != y->dir) return x->dir < y->dir ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Starts 'n' threads on 'fn', each with its own argument, and waits for them.
+static void fsck_run(int n, void* (*fn)(void*), void* args, size_t arg_size) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    for (int i = 0; i < n; i++) pthread_create(&threads[i], NULL, fn, (char*)args + i * arg_size);
+    for (int i = 0; i < n; i++) pthread_join(threads[i], NULL);
+}
+
+// Bits set in exactly one of the two bitmaps among the first 'nbits'.
+static uint32_t fsck_bitmap_diff(const uint64_t* have, const uint64_t* want, int nbits, uint32_t* only_in_have) {
+    uint32_t diff = 0;
+    for (int w = 0; w * 64 < nbits; w++) {
+        uint64_t h = __atomic_load_n(&have[w], __ATOMIC_ACQUIRE) & free_bits(0, w, nbits); // bits in range
+        diff += __builtin_popcountll(h ^ want[w]);
+        if (only_in_have) *only_in_have += __builtin_popcountll(h & ~want[w]);
+    }
+    return diff;
+}
+
+int myfs_fsck(myfs_t* fs, int flags, int threads, struct myfs_fsck_report* out) {
+    uint32_t ninodes = fs->sb.num_inodes, nblocks = fs->sb.num_data_blocks;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+
+    Fsck ck = { .fs = fs, .lock = PTHREAD_MUTEX_INITIALIZER, .changed_queue = PTHREAD_COND_INITIALIZER };
+    ck.table = calloc(ninodes, sizeof(Inode));
+    ck.changed = calloc(ninodes, 1);
+    ck.names = calloc(ninodes, sizeof(uint32_t));
+    ck.subdirs = calloc(ninodes, sizeof(uint32_t));
+    ck.listed_in = malloc(ninodes * sizeof(uint32_t));
+    ck.queued = calloc(ninodes, 1);
+    ck.queue = malloc(ninodes * sizeof(uint32_t));
+    ck.block_owner = malloc(nblocks * sizeof(uint32_t));
+    ck.block_refs = calloc(nblocks, sizeof(uint32_t));
+    int table_blocks = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    unsigned char* raw = malloc((long)FSCK_READ_BLOCKS * BLOCK_SIZE);
+    int rc = MYFS_OK;
+    if (!ck.table || !ck.changed || !ck.names || !ck.subdirs || !ck.listed_in || !ck.queued || !ck.queue ||
+        !ck.block_owner || !ck.block_refs || !raw) {
+        rc = MYFS_ENOMEM;
+        goto done;
+    }
+    for (uint32_t n = 0; n < ninodes; n++) ck.listed_in[n] = FSCK_NONE;
+    for (uint32_t b = 0; b < nblocks; b++) ck.block_owner[b] = FSCK_NONE;
+
+    // The inode table, FSCK_READ_BLOCKS blocks per transfer.
+    for (int b = 0; b < table_blocks; b += FSCK_READ_BLOCKS) {
+        int count = table_blocks - b < FSCK_READ_BLOCKS ? table_blocks - b : FSCK_READ_BLOCKS;
+        if (read_blocks_as(fs, MYFS_IO_INODE_TABLE, fs->sb.inode_table_start_block + b, count, raw) != 0) {
+            rc = MYFS_EIO;
+            goto done;
+        }
+        for (int i = 0; i < count * INODES_PER_BLOCK && (uint32_t)(b * INODES_PER_BLOCK + i) < ninodes; i++)
+            decode_inode(raw + (long)i * INODE_SIZE, &ck.table[b * INODES_PER_BLOCK + i]);
+    }
+    COUNT(fs, inode_reads, ninodes);
+
+    // Walk the tree from the root.
+    Fsck* walkers[FSCK_MAX_THREADS];
+    for (int i = 0; i < threads; i++) walkers[i] = &ck;
+    ck.queued[ROOT_INODE_NUM] = 1;
+    ck.queue[ck.queue_len++] = ROOT_INODE_NUM;
+    if (ck.table[ROOT_INODE_NUM].mode != 1) {
+        rc = MYFS_ECORRUPT; // nothing to walk from
+        goto done;
+    }
+    fsck_run(threads, fsck_walk_worker, walkers, sizeof(Fsck*));
+
+    // A directory keeps one name: one in the directory its parent pointer
+    // names if there is one, else the first in directory and name order.
+    if (ck.dir_links.count > 0) qsort(ck.dir_links.entries, ck.dir_links.count, sizeof(FsckEntry), fsck_compare_entries);
+    for (int i = 0; i < ck.dir_links.count; i++) {
+        FsckEntry* e = &ck.dir_links.entries[i];
+        uint32_t keep = ck.listed_in[e->child], parent = ck.table[e->child].parent;
+        if (keep == FSCK_NONE || (e->dir == parent && keep != parent)) ck.listed_in[e->child] = e->dir;
+    }
+    memset(ck.queued, 0, ninodes); // from here on: the kept name has been seen
+    for (int i = 0; i < ck.dir_links.count; i++) {
+        FsckEntry* e = &ck.dir_links.entries[i];
+        if (ck.listed_in[e->child] == e->dir && !ck.queued[e->child]) {
+            ck.queued[e->child] = 1;
+            continue;
+        }
+        // Every other name of the directory is dropped.
+        ck.names[e->child]--;
+        ck.subdirs[e->dir]--;
+        if (fsck_list_add(&ck.bad, e->dir, e->child, e->name) != 0) {
+            rc = MYFS_ENOMEM;
+            goto done;
+        }
+    }
+    ck.report.bad_entries = ck.bad.count;
+
+    // Block pointers, in parallel over ranges of inodes.
+    FsckRange ranges[FSCK_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        ranges[i].ck = &ck;
+        ranges[i].from = (uint64_t)ninodes * i / threads;
+        ranges[i].to = (uint64_t)ninodes * (i + 1) / threads;
+    }
+    fsck_run(threads, fsck_blocks_worker, ranges, sizeof(FsckRange));
+
+    // Rebuild the bitmaps, link counts and block reference counts from what
+    // was reached. Files may share blocks once the image has reference
+    // counts; a directory's blocks are never shared.
+    uint64_t inodes_used[MAX_INODES / 64] = {0}, blocks_used[MAX_DATA_BLOCKS / 64] = {0};
+    int sharing = fs->sb.refcount_block != 0;
+    for (uint32_t n = 0; n < ninodes; n++) {
+        if (!fsck_reached(&ck, n)) continue;
+        Inode* inode = &ck.table[n];
+        inodes_used[n / 64] |= UINT64_C(1) << (n % 64);
+        ck.report.inodes++;
+        if (!(inode->flags & INODE_FLAG_INLINE_DATA)) {
+            for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+                uint32_t block = inode->direct_blocks[i];
+                if (block == UNUSED_BLOCK) continue;
+                uint32_t owner = ck.block_owner[block];
+                if (owner != n && !(sharing && inode->mode == 0 && ck.table[owner].mode == 0)) {
+                    inode->direct_blocks[i] = UNUSED_BLOCK;
+                    ck.changed[n] = 1;
+                    ck.report.bad_blocks++;
+                    continue;
+                }
+                if (ck.block_refs[block]++ > 0) continue;
+                blocks_used[block / 64] |= UINT64_C(1) << (block % 64);
+                ck.report.blocks++;
+            }
+        }
+        uint32_t links = inode->mode == 1 ? 2 + ck.subdirs[n] : ck.names[n];
+        if (inode->link_count != links) {
+            inode->link_count = links;
+            ck.changed[n] = 1;
+            ck.report.link_counts++;
+        }
+        if (inode->mode == 1) {
+            ck.report.directories++;
+            uint32_t parent = n == ROOT_INODE_NUM ? ROOT_INODE_NUM : ck.listed_in[n];
+            if (inode->parent != parent) {
+                // ".." and getcwd follow this pointer.
+                inode->parent = parent;
+                inode->name_slot = NO_NAME_HINT;
+                ck.changed[n] = 1;
+                ck.report.bad_inodes++;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < nblocks; b++) {
+        if (table_block(fs, b)) blocks_used[b / 64] |= UINT64_C(1) << (b % 64);
+        uint32_t extra = ck.block_refs[b] > 1 ? ck.block_refs[b] - 1 : 0;
+        ck.block_refs[b] = extra < MAX_REFS ? extra : MAX_REFS; // from here on: the count to store
+        if (fs->refs[b] != ck.block_refs[b]) ck.report.ref_counts++;
+    }
+    ck.report.inode_bitmap = fsck_bitmap_diff(fs->inode_bitmap, inodes_used, ninodes, &ck.report.orphans);
+    ck.report.block_bitmap = fsck_bitmap_diff(fs->data_block_bitmap, blocks_used, nblocks, NULL);
+    if (__atomic_load_n(&ck.io_failed, __ATOMIC_RELAXED)) io_error = ck.io_failed;
+
+    uint32_t problems = ck.report.bad_entries + ck.report.bad_blocks + ck.report.bad_inodes +
+                        ck.report.link_counts + ck.report.inode_bitmap + ck.report.block_bitmap + ck.report.ref_counts;
+    if ((flags & MYFS_FSCK_REPAIR) && problems > 0 && !io_error) {
+        // Inodes first, so that a directory's entry count is right before
+        // its bad entries are removed through it.
+        for (uint32_t n = 0; n < ninodes; n++) {
+            if (fsck_reached(&ck, n) && ck.changed[n]) {
+                write_inode(fs, n, &ck.table[n]);
+            } else if (!fsck_reached(&ck, n) && get_bit(fs->inode_bitmap, n) && ck.table[n].link_count != 0) {
+                ck.table[n].link_count = 0; // an orphan: marks it free to later checks
+                write_inode(fs, n, &ck.table[n]);
+            }
+        }
+        for (int i = 0; i < ck.bad.count; i++) {
+            FsckEntry* e = &ck.bad.entries[i];
+            if (lock_inode(fs, e->dir, 1) != 0) continue;
+            remove_entry_from_dir(fs, e->dir, e->name);
+            unlock_inode(fs, e->dir);
+        }
+        for (uint32_t b = 0; b < nblocks; b++) {
+            if (fs->refs[b] != ck.block_refs[b]) set_refs(fs, b, ck.block_refs[b]);
+        }
+        for (int w = 0; w < MAX_INODES / 64; w++) __atomic_store_n(&fs->inode_bitmap[w], inodes_used[w], __ATOMIC_RELEASE);
+        for (int w = 0; w < MAX_DATA_BLOCKS / 64; w++)
+            __atomic_store_n(&fs->data_block_bitmap[w], blocks_used[w], __ATOMIC_RELEASE);
+        __atomic_store_n(&fs->inode_bitmap_dirty, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&fs->data_bitmap_dirty, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&fs->flush_lock);
+        sync_bitmaps(fs);
+        pthread_mutex_unlock(&fs->flush_lock);
+        if (!io_error) ck.report.repaired = problems;
+    }
+    ck.report.threads = threads;
+    if (out) *out = ck.report;
+    rc = problems;
+
+done:
+    pthread_mutex_destroy(&ck.lock);
+    pthread_cond_destroy(&ck.changed_queue);
+    free(ck.table);
+    free(ck.changed);
+    free(ck.names);
+    free(ck.subdirs);
+    free(ck.listed_in);
+    free(ck.queued);
+    free(ck.queue);
+    free(ck.block_owner);
+    free(ck.block_refs);
+    free(ck.bad.entries);
+    free(ck.dir_links.entries);
+    free(raw);
+    return fs_done(fs, rc);
+}
+
+// Scrub
+// Every checksummed block is read straight from the image, past the block
+// cache, SCRUB_READ_BLOCKS at a time, each thread over its own stretch of
+// the image. The table is not locked: a block that fails is read and
+// compared once more, since a write may have landed between the read and
+// the comparison.
+
+typedef struct {
+    myfs_t* fs;
+    uint32_t from, to;
+    uint32_t blocks, bad, bad_metadata, listed;
+    uint32_t list[MYFS_SCRUB_LIST]; // bad blocks, in block order
+    int io_failed;
+} ScrubRange;
+
+static int scrub_block_ok(myfs_t* fs, uint32_t block_num, const char* data) {
+    return crc32c(data, BLOCK_SIZE) == __atomic_load_n(&fs->crcs[block_num], __ATOMIC_RELAXED);
+}
+
+static void* scrub_worker(void* arg) {
+    ScrubRange* r = arg;
+    myfs_t* fs = r->fs;
+    char* buffer = malloc((long)SCRUB_READ_BLOCKS * BLOCK_SIZE);
+    if (!buffer) {
+        r->io_failed = MYFS_ENOMEM;
+        return NULL;
+    }
+    for (uint32_t first = r->from; first < r->to; first += SCRUB_READ_BLOCKS) {
+        int count = r->to - first < SCRUB_READ_BLOCKS ? (int)(r->to - first) : SCRUB_READ_BLOCKS;
+        if (read_image(fs, first, count, buffer) != 0) break;
+        COUNT(fs, bytes_read, (uint64_t)count * BLOCK_SIZE);
+        for (int i = 0; i < count; i++) {
+            uint32_t b = first + i;
+            if (!block_has_crc(fs, b)) continue;
+            r->blocks++;
+            COUNT(fs, checksums_verified, 1);
+            char* data = buffer + (long)i * BLOCK_SIZE;
+            if (scrub_block_ok(fs, b, data) || (read_image(fs, b, 1, data) == 0 && scrub_block_ok(fs, b, data)))
+                continue;
+            COUNT(fs, checksum_failures, 1);
+            r->bad++;
+            if (block_kind(fs, b) != MYFS_IO_DATA) r->bad_metadata++;
+            if (r->listed < MYFS_SCRUB_LIST) r->list[r->listed++] = b;
+        }
+    }
+    free(buffer);
+    if (io_error) r->io_failed = io_error;
+    return NULL;
+}
+
+int myfs_scrub(myfs_t* fs, int threads, struct myfs_scrub_report* out) {
+    memset(out, 0, sizeof(*out));
+    if (!__atomic_load_n(&fs->sb.checksums, __ATOMIC_ACQUIRE)) return MYFS_EINVAL;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+    uint64_t start = clock_ns();
+
+    // The superblock, against the checksum it carries.
+    char buffer[BLOCK_SIZE];
+    Superblock sb;
+    if (read_image(fs, SUPERBLOCK_BLOCK, 1, buffer) != 0) return fs_done(fs, MYFS_EIO);
+    memcpy(&sb, buffer, sizeof(sb));
+    out->blocks = 1;
+    if (sb.sb_checksum != superblock_checksum(&sb)) {
+        out->bad = out->bad_metadata = 1;
+        out->bad_blocks[out->listed].block = SUPERBLOCK_BLOCK;
+        out->bad_blocks[out->listed++].kind = MYFS_IO_SUPERBLOCK;
+    }
+
+    ScrubRange ranges[FSCK_MAX_THREADS] = {0};
+    uint32_t total = image_blocks(&fs->sb) - 1;
+    for (int i = 0; i < threads; i++) {
+        ranges[i].fs = fs;
+        ranges[i].from = 1 + (uint64_t)total * i / threads;
+        ranges[i].to = 1 + (uint64_t)total * (i + 1) / threads;
+    }
+    fsck_run(threads, scrub_worker, ranges, sizeof(ScrubRange));
+
+    int rc = MYFS_OK;
+    for (int i = 0; i < threads; i++) {
+        ScrubRange* r = &ranges[i];
+        if (r->io_failed) rc = r->io_failed;
+        out->blocks += r->blocks;
+        out->bad += r->bad;
+        out->bad_metadata += r->bad_metadata;
+        for (uint32_t j = 0; j < r->listed && out->listed < MYFS_SCRUB_LIST; j++) {
+            out->bad_blocks[out->listed].block = r->list[j];
+            out->bad_blocks[out->listed++].kind = block_kind(fs, r->list[j]);
+        }
+    }
+    out->bytes = (uint64_t)image_blocks(&fs->sb) * BLOCK_SIZE;
+    out->ns = clock_ns() - start;
+    out->threads = threads;
+    return fs_done(fs, rc != 0 ? rc : (int)out->bad);
+}
+
+// Defragmentation
+// myfs_defrag works online, one inode at a time under that inode's
+// exclusive lock, so other calls only ever wait for the file or directory
+// being rewritten. A file in more than one run of blocks is copied into
+// the lowest free run long enough to hold it, and its inode is switched to
+// the copy before the old blocks are freed. A directory gets its entries
+// packed from slot 0 in the same order; it goes back inline when they fit
+// in the inode, and otherwise frees the blocks past the last one it needs.
+typedef struct {
+    myfs_t* fs;
+    unsigned char* seen; // per inode: already visited through another name
+    struct myfs_defrag_report report;
+} Defrag;
+
+// Runs of consecutive blocks among the first 'count' slots of a block map.
+static int count_extents(const uint32_t* blocks, int count) {
+    int extents = 0;
+    for (int i = 0; i < count; i += contiguous_run(blocks, i, count)) extents++;
+    return extents;
+}
+
+// Gathers the data blocks a file or directory holds, in slot order, and
+// the slot each came from. A compressed file leaves unused slots between
+// its clusters, so the used ones are not always a prefix of the map.
+static int inode_blocks(const Inode* inode, uint32_t* blocks, int* slots) {
+    int count = 0;
+    if (inode->flags & INODE_FLAG_INLINE_DATA) return 0;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
+        if (inode->direct_blocks[i] == UNUSED_BLOCK) continue;
+        if (slots) slots[count] = i;
+        blocks[count++] = inode->direct_blocks[i];
+    }
+    return count;
+}
+
+// Runs of free data blocks, and the length of the longest.
+static void count_free_extents(myfs_t* fs, uint32_t* extents, uint32_t* largest) {
+    uint32_t run = 0;
+    *extents = *largest = 0;
+    for (int b = 0; b < (int)fs->sb.num_data_blocks; b++) {
+        if (get_bit(fs->data_block_bitmap, b)) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0) (*extents)++;
+        if (run > *largest) *largest = run;
+    }
+}
+
+// Moves a fragmented file into one run of blocks. Its modification time
+// is left alone: the contents do not change. A file with shared blocks
+// stays where it is, since moving it would unshare them.
+static void defrag_file(Defrag* df, uint32_t inode_num) {
+    myfs_t* fs = df->fs;
+    if (lock_inode(fs, inode_num, 1) != 0) return;
+    Inode inode;
+    uint32_t old_blocks[INODE_DIRECT_POINTERS];
+    int slots[INODE_DIRECT_POINTERS];
+    int count = read_inode(fs, inode_num, &inode) == 0 && inode.mode == 0 ? inode_blocks(&inode, old_blocks, slots) : 0;
+    if (count == 0) {
+        unlock_inode(fs, inode_num);
+        return;
+    }
+
+    int extents = count_extents(old_blocks, count);
+    df->report.files++;
+    df->report.extents_before += extents;
+    int shared = 0;
+    for (int i = 0; i < count; i++) shared |= block_shared(fs, old_blocks[i]);
+    if (extents > 1) {
+        df->report.fragmented_before++;
+        int start = shared ? MYFS_ENOSPC : claim_data_run(fs, count);
+        if (start < 0) {
+            df->report.skipped++;
+        } else {
+            char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+            int rc = 0;
+            for (int i = 0; i < count && rc == 0; ) {
+                int run = contiguous_run(old_blocks, i, count);
+                rc = read_blocks(fs, fs->sb.data_blocks_start_block + old_blocks[i], run,
+                                 buffer + (long)i * BLOCK_SIZE);
+                i += run;
+            }
+            if (rc == 0) rc = write_blocks(fs, fs->sb.data_blocks_start_block + start, count, buffer);
+
+            for (int i = 0; i < count; i++) inode.direct_blocks[slots[i]] = start + i;
+            if (rc == 0) rc = write_inode(fs, inode_num, &inode);
+            for (int i = 0; i < count; i++) free_data_block(fs, rc == 0 ? old_blocks[i] : (uint32_t)start + i);
+            if (rc == 0) {
+                df->report.blocks_moved += count;
+                extents = 1;
+            }
+        }
+    }
+    if (extents > 1) df->report.fragmented_after++;
+    df->report.extents_after += extents;
+    unlock_inode(fs, inode_num);
+}
+
+// Points a subdirectory's name_slot hint at its entry's new index. Caller
+// holds the parent's exclusive lock; the child's is taken after it.
+static void defrag_name_hint(myfs_t* fs, uint32_t parent_num, uint32_t child_num, uint32_t index) {
+    if (child_num >= fs->sb.num_inodes || lock_inode(fs, child_num, 1) != 0) return;
+    Inode child;
+    if (read_inode(fs, child_num, &child) == 0 && child.mode == 1 && child.parent == parent_num && child.name_slot != index) {
+        child.name_slot = index;
+        write_inode(fs, child_num, &child);
+    }
+    unlock_inode(fs, child_num);
+}
+
+// Entry 'slot' of a directory whose blocks were read one after another into 'buffer'.
+static DirectoryEntry* defrag_slot(char* buffer, int slot) {
+    return (DirectoryEntry*)(buffer + (long)(slot / DIR_ENTRIES_PER_BLOCK) * BLOCK_SIZE) + slot % DIR_ENTRIES_PER_BLOCK;
+}
+
+// Packs a directory and lists the inode numbers of its entries in
+// 'children'. Returns how many there are, or MYFS_ENOTDIR for a file.
+static int defrag_directory(Defrag* df, uint32_t dir_num, uint32_t* children) {
+    myfs_t* fs = df->fs;
+    int rc = lock_inode(fs, dir_num, 1);
+    if (rc != 0) return rc;
+    Inode dir;
+    rc = read_inode(fs, dir_num, &dir);
+    if (rc == 0 && dir.mode != 1) rc = MYFS_ENOTDIR;
+    if (rc != 0) {
+        unlock_inode(fs, dir_num);
+        return rc;
+    }
+    df->report.directories++;
+
+    int count = 0;
+    if (dir.flags & INODE_FLAG_INLINE_DATA) {
+        char name[MAX_FILENAME_LEN + 1];
+        int next;
+        for (int off = 0; (next = next_inline_entry(&dir, off, name, &children[count])) != -1; off = next) count++;
+        unlock_inode(fs, dir_num);
+        return count;
+    }
+
+    // Entries only ever move to a lower slot, so writing the packed blocks
+    // in ascending order never overwrites an entry before its new copy is
+    // on disk: a crash part way leaves an entry listed twice, never lost.
+    char buffer[INODE_DIRECT_POINTERS * BLOCK_SIZE];
+    int nblocks = 0;
+    while (nblocks < INODE_DIRECT_POINTERS && dir.direct_blocks[nblocks] != UNUSED_BLOCK) {
+        if (read_dir_block(fs, dir.direct_blocks[nblocks], buffer + (long)nblocks * BLOCK_SIZE) != 0) {
+            unlock_inode(fs, dir_num);
+            return MYFS_EIO;
+        }
+        nblocks++;
+    }
+    int end_slot = dir.size / sizeof(DirectoryEntry);
+    if (end_slot > nblocks * (int)DIR_ENTRIES_PER_BLOCK) end_slot = nblocks * DIR_ENTRIES_PER_BLOCK;
+    int moved[INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK];
+    int inline_size = 0;
+    for (int slot = 0; slot < end_slot; slot++) {
+        DirectoryEntry* from = defrag_slot(buffer, slot);
+        if (from->name[0] == '\0') continue;
+        DirectoryEntry* to = defrag_slot(buffer, count);
+        moved[count] = slot != count;
+        if (slot != count) {
+            *to = *from;
+            memset(from, 0, sizeof(DirectoryEntry));
+        }
+        children[count] = to->inode_number;
+        inline_size += INLINE_DIRENT_HEADER + strlen(to->name);
+        count++;
+    }
+
+    int keep = inline_size <= INODE_INLINE_SIZE ? 0 : (count + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    if (count == end_slot && keep == nblocks) {
+        unlock_inode(fs, dir_num);
+        return count;
+    }
+
+    rc = 0;
+    uint32_t old_blocks[INODE_DIRECT_POINTERS];
+    memcpy(old_blocks, dir.direct_blocks, sizeof(old_blocks));
+    if (keep == 0) {
+        // The same entries in the same order: inline indexes match the packed slots.
+        dir.flags |= INODE_FLAG_INLINE_DATA;
+        memset(dir.inline_data, 0, INODE_INLINE_SIZE);
+        unsigned char* p = dir.inline_data;
+        for (int i = 0; i < count; i++) {
+            DirectoryEntry* de = defrag_slot(buffer, i);
+            int name_len = strlen(de->name);
+            put_le32(p, de->inode_number);
+            p[4] = name_len;
+            memcpy(p + INLINE_DIRENT_HEADER, de->name, name_len);
+            p += INLINE_DIRENT_HEADER + name_len;
+        }
+        dir.size = inline_size;
+        dir.free_slot = 0;
+        df->report.dirs_inlined++;
+    } else {
+        for (int i = 0; i < keep && rc == 0; i++) rc = write_dir_block(fs, dir.direct_blocks[i], buffer + (long)i * BLOCK_SIZE);
+        for (int i = keep; i < INODE_DIRECT_POINTERS; i++) dir.direct_blocks[i] = UNUSED_BLOCK;
+        dir.size = count * sizeof(DirectoryEntry);
+        dir.free_slot = count;
+    }
+    dir.entry_count = count;
+    if (rc == 0) rc = write_inode(fs, dir_num, &dir);
+    if (rc == 0) {
+        for (int i = keep; i < nblocks; i++) free_data_block(fs, old_blocks[i]);
+        df->report.dir_holes += end_slot - count;
+        df->report.dir_blocks_freed += nblocks - keep;
+        for (int i = 0; i < count; i++) {
+            if (moved[i]) defrag_name_hint(fs, dir_num, children[i], i);
+        }
+    }
+    unlock_inode(fs, dir_num);
+    return count;
+}
+
+static void defrag_tree(Defrag* df, uint32_t inode_num) {
+    if (inode_num >= df->fs->sb.num_inodes || df->seen[inode_num]) return;
+    df->seen[inode_num] = 1;
+    uint32_t children[INODE_DIRECT_POINTERS * DIR_ENTRIES_PER_BLOCK];
+    int count = defrag_directory(df, inode_num, children);
+    if (count == MYFS_ENOTDIR) defrag_file(df, inode_num);
+    for (int i = 0; i < count; i++) defrag_tree(df, children[i]);
+}
+
+int myfs_defrag(myfs_t* fs, const char* path, struct myfs_defrag_report* out) {
+    int ino = resolve_path(fs, path);
+    if (ino < 0) return fs_done(fs, ino);
+    Defrag df = { .fs = fs };
+    df.seen = calloc(fs->sb.num_inodes, 1);
+    if (!df.seen) return fs_done(fs, MYFS_ENOMEM);
+
+    count_free_extents(fs, &df.report.free_extents_before, &df.report.largest_free_before);
+    defrag_tree(&df, ino);
+    count_free_extents(fs, &df.report.free_extents_after, &df.report.largest_free_after);
+    free(df.seen);
+    if (out) *out = df.report;
+    return fs_done(fs, MYFS_OK);
+}
+
+// Layout Report
+// One pass over the data bitmap and one sequential read of the inode
+// table; directory blocks are never read, since a block directory's size
+// (its highest slot ever used) and entry count already give its holes.
+int myfs_layout(myfs_t* fs, struct myfs_layout* out) {
+    memset(out, 0, sizeof(*out));
+    uint32_t ninodes = fs->sb.num_inodes;
+    int table_blocks = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    unsigned char* raw = malloc((long)table_blocks * BLOCK_SIZE);
+    if (!raw) return fs_done(fs, MYFS_ENOMEM);
+
+    out->data_blocks = fs->sb.num_data_blocks;
+    uint32_t run = 0;
+    for (uint32_t b = 0; b <= fs->sb.num_data_blocks; b++) {
+        if (b < fs->sb.num_data_blocks && !get_bit(fs->data_block_bitmap, b)) {
+            out->free_blocks++;
+            run++;
+            continue;
+        }
+        if (run == 0) continue;
+        out->free_extents++;
+        out->free_runs[63 - __builtin_clzll(run)]++;
+        if (run > out->largest_free_run) out->largest_free_run = run;
+        run = 0;
+    }
+
+    // All table locks, in order, so no inode is caught half written.
+    for (int b = 0; b < table_blocks; b++) pthread_mutex_lock(&fs->itable_locks[b]);
+    int rc = read_blocks_as(fs, MYFS_IO_INODE_TABLE, fs->sb.inode_table_start_block, table_blocks, raw);
+    for (int b = table_blocks - 1; b >= 0; b--) pthread_mutex_unlock(&fs->itable_locks[b]);
+    if (rc != 0) {
+        free(raw);
+        return fs_done(fs, MYFS_EIO);
+    }
+
+    out->inodes = ninodes;
+    out->itable_blocks = table_blocks;
+    for (int b = 0; b < table_blocks; b++) {
+        int block_used = 0;
+        for (int i = 0; i < INODES_PER_BLOCK && (uint32_t)(b * INODES_PER_BLOCK + i) < ninodes; i++) {
+            uint32_t n = b * INODES_PER_BLOCK + i;
+            if (!get_bit(fs->inode_bitmap, n)) continue;
+            Inode inode;
+            decode_inode(raw + (long)n * INODE_SIZE, &inode);
+            out->inodes_used++;
+            block_used = 1;
+
+            int is_inline = inode.flags & INODE_FLAG_INLINE_DATA;
+            uint32_t blocks[INODE_DIRECT_POINTERS];
+            int count = inode_blocks(&inode, blocks, NULL);
+            if (inode.mode == 1) {
+                out->directories++;
+                if (is_inline) {
+                    out->inline_directories++;
+                    out->inline_dir_bytes += inode.size;
+                    continue;
+                }
+                uint32_t end_slot = inode.size / sizeof(DirectoryEntry);
+                out->dir_blocks += count;
+                out->dir_slots += count * DIR_ENTRIES_PER_BLOCK;
+                out->dir_entries += inode.entry_count;
+                if (end_slot > inode.entry_count) out->dir_holes += end_slot - inode.entry_count;
+                continue;
+            }
+            out->files++;
+            if (is_inline) {
+                out->inline_files++;
+                continue;
+            }
+            int extents = count_extents(blocks, count);
+            out->file_blocks += count;
+            out->file_extents += extents;
+            out->files_by_extents[extents]++;
+        }
+        out->itable_blocks_used += block_used;
+    }
+    free(raw);
+    return fs_done(fs, MYFS_OK);
+}
@@ -1,912 +1,1843 @@
+// myfs shell: an interactive (or one-shot) front end over libmyfs. This
+// file only parses commands and prints results; the filesystem itself is
+// in libmyfs.c behind the API in myfs.h.
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "myfs.h"
+#include "myfs_hist.h"
 
-// Filesystem Constants
-#define BLOCK_SIZE 4096
-#define MAX_INODES 512
-#define MAX_DATA_BLOCKS 8192
-#define MAX_FILENAME_LEN 255
-#define INODE_DIRECT_POINTERS 12
-#define ROOT_INODE_NUM 0
-#define MAX_PATH_DEPTH 64
-#define UNUSED_BLOCK ((uint32_t)-1) //clear sentinel for unused blocks
-
-//disk Structure Layout
-#define SUPERBLOCK_BLOCK 0
-#define INODE_BITMAP_BLOCK 1
-#define DATA_BITMAP_BLOCK 2
-#define INODE_TABLE_START_BLOCK 3
-
-// Data Structures
-typedef struct {
-    uint32_t total_size;
-    uint32_t num_inodes;
-    uint32_t num_data_blocks;
-    uint32_t inode_bitmap_block;
-    uint32_t data_bitmap_block;
-    uint32_t inode_table_start_block;
-    uint32_t data_blocks_start_block;
-} Superblock;
+#define MAX_PATH_LEN MYFS_PATH_MAX
+#define MAX_FILENAME_LEN MYFS_NAME_MAX
+#define MAX_FILE_SIZE MYFS_FILE_MAX
 
-typedef struct {
-    uint16_t mode; // 0 for file, 1 for directory
-    uint32_t size;
-    uint32_t link_count;
-    time_t creation_time;
-    time_t modification_time;
-    uint32_t direct_blocks[INODE_DIRECT_POINTERS];
-} Inode;
+#define MAX_MOUNTS 64
+#define MAX_MOUNT_NAME 32
+
+// Global Variables
+myfs_t* fs = NULL; // the image the shell is working on
 
+// Every image the shell has mounted. 'fs' is always the handle of
+// mounts[current_mount]; 'use' switches between them.
 typedef struct {
-    char name[MAX_FILENAME_LEN + 1];
-    uint32_t inode_number;
-} DirectoryEntry;
+    char name[MAX_MOUNT_NAME];
+    char image_path[MAX_PATH_LEN];
+    myfs_t* fs;
+} Mount;
 
-// Global Variables
-FILE *virtual_disk = NULL;
-Superblock sb;
-unsigned char inode_bitmap[MAX_INODES / 8];
-unsigned char data_block_bitmap[MAX_DATA_BLOCKS / 8];
-int current_working_directory_inode = ROOT_INODE_NUM; // For CWD support
-
-// Forward Declarations
-void do_mkfs(const char *disk_path, long size_bytes);
-int get_path_inode(const char* path);
-void read_inode(int inode_num, Inode* inode);
-int find_entry_in_dir(int dir_inode_num, const char* name);
-
-// Bitmap Helpers
-void set_bit(unsigned char* bitmap, int n) { bitmap[n/8] |= (1 << (n%8)); }
-void clear_bit(unsigned char* bitmap, int n) { bitmap[n/8] &= ~(1 << (n%8)); }
-int get_bit(unsigned char* bitmap, int n) { return (bitmap[n/8] & (1 << (n%8))) != 0; }
-
-// Low-Level I/O
-void read_block(int block_num, void* buffer) {
-    if (fseek(virtual_disk, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("fseek failed");
-        exit(1);
-    }
-    if (fread(buffer, BLOCK_SIZE, 1, virtual_disk) != 1) {
-        // In testing with pipes, feof might be set before a read error.
-        if (feof(virtual_disk)) return;
-        perror("fread failed");
-        exit(1);
-    }
-}
-
-void write_block(int block_num, void* buffer) {
-    if (fseek(virtual_disk, block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("fseek failed");
-        exit(1);
-    }
-    if (fwrite(buffer, BLOCK_SIZE, 1, virtual_disk) != 1) {
-        perror("fwrite failed");
-        exit(1);
-    }
-}
-
-void read_inode(int inode_num, Inode* inode) {
-    int block_num = sb.inode_table_start_block + (inode_num * sizeof(Inode)) / BLOCK_SIZE;
-    int offset = (inode_num * sizeof(Inode)) % BLOCK_SIZE;
-    char buffer[BLOCK_SIZE];
-    read_block(block_num, buffer);
-    memcpy(inode, buffer + offset, sizeof(Inode));
-}
-
-void write_inode(int inode_num, Inode* inode) {
-    int block_num = sb.inode_table_start_block + (inode_num * sizeof(Inode)) / BLOCK_SIZE;
-    int offset = (inode_num * sizeof(Inode)) % BLOCK_SIZE;
-    char buffer[BLOCK_SIZE];
-    read_block(block_num, buffer);
-    memcpy(buffer + offset, inode, sizeof(Inode));
-    write_block(block_num, buffer);
-}
-
-void sync_bitmaps() {
-    char buffer[BLOCK_SIZE];
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(buffer, inode_bitmap, sizeof(inode_bitmap));
-    write_block(sb.inode_bitmap_block, buffer);
-
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(buffer, data_block_bitmap, sizeof(data_block_bitmap));
-    write_block(sb.data_bitmap_block, buffer);
-}
-
-// Core Filesystem Logic
-int alloc_inode() {
-    for (int i = 0; i < sb.num_inodes; i++) {
-        if (!get_bit(inode_bitmap, i)) {
-            set_bit(inode_bitmap, i);
-            return i;
-        }
-    }
-    return -1;
-}
+Mount mounts[MAX_MOUNTS];
+int mount_count = 0;
+int current_mount = -1;
 
-void free_inode(int inode_num) {
-    clear_bit(inode_bitmap, inode_num);
+// Statistics
+// Every command is timed, and the block I/O it caused is the difference in
+// the mounts' counters before and after it. Handles that have been
+// unmounted leave their counters in retired_io, so totals never go back.
+#define MAX_COMMAND_STATS 48
+
+typedef struct {
+    char name[16];
+    myfs_hist_t latency; // nanoseconds
+    uint64_t blocks_read, blocks_written, cache_hits;
+} CommandStats;
+
+CommandStats command_stats[MAX_COMMAND_STATS];
+int command_stats_count = 0;
+struct myfs_io_stats retired_io;  // counters of handles already unmounted
+struct myfs_io_stats io_baseline; // totals at the last 'stats reset'
+const char* stats_json_path = NULL; // --stats-json: "-" for stderr, else a file
+FILE* trace_file = NULL;            // --trace: every command, for myfs_work to replay
+struct timespec trace_start;
+const char* io_kind_names[MYFS_IO_KINDS] = { "superblock", "bitmap", "inode_table", "directory", "data" };
+
+int command_failed = 0; // the command being run reported an error; one-shot mode exits with 1
+
+// Every error message goes through here: the text follows "Error: ".
+void print_failure(const char* format, ...) {
+    command_failed = 1;
+    va_list args;
+    va_start(args, format);
+    printf("Error: ");
+    vprintf(format, args);
+    va_end(args);
 }
 
-int alloc_data_block() {
-    for (int i = 0; i < sb.num_data_blocks; i++) {
-        if (!get_bit(data_block_bitmap, i)) {
-            set_bit(data_block_bitmap, i);
-            return i;
-        }
-    }
-    return -1;
+void print_usage(const char* usage) {
+    command_failed = 1;
+    printf("Usage: %s", usage);
 }
 
-void free_data_block(int block_num) {
-    clear_bit(data_block_bitmap, block_num);
+void print_error(const char* what, int rc) {
+    print_failure("%s: %s.\n", what, myfs_strerror(rc));
 }
 
-// FIXED: Corrected loop logic
-int find_entry_in_dir(int dir_inode_num, const char* name) {
-    Inode dir_inode;
-    read_inode(dir_inode_num, &dir_inode);
-    if (dir_inode.mode != 1) return -1;
+void do_mkdir(const char *path) {
+    int rc = myfs_mkdir(fs, path);
+    if (rc < 0) { print_error(path, rc); return; }
+    printf("Directory created: %s\n", path);
+}
 
-    char buffer[BLOCK_SIZE];
-    int total_valid_entries = dir_inode.size / sizeof(DirectoryEntry);
-    int entries_found = 0;
+void do_ls(const char *path) {
+    if (path == NULL || path[0] == '\0')
+        path = ".";
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        if (dir_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_valid_entries)
-            break;
+    struct myfs_stat st;
+    if (myfs_stat(fs, path, &st) != 0) {
+        printf("ls: cannot access '%s': No such file or directory\n", path);
+        command_failed = 1;
+        return;
+    }
 
-        read_block(sb.data_blocks_start_block + dir_inode.direct_blocks[i], buffer);
-        int entries_in_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        DirectoryEntry* de = (DirectoryEntry*)buffer;
-        for (int j = 0; j < entries_in_block; j++) {
-            if (entries_found >= total_valid_entries) break;
-            
-            if (de[j].name[0] != '\0') {
-                entries_found++;
-                if (strcmp(de[j].name, name) == 0) {
-                    return de[j].inode_number;
-                }
-            }
-        }
+    if (!st.is_dir) {
+        char temp_path[strlen(path)+1];
+        strcpy(temp_path, path);
+        printf("f\t%u\t\t%s\n", st.size, basename(temp_path));
+        return;
     }
-    return -1;
-}
 
-void add_entry_to_dir(int dir_inode_num, const char* name, int new_inode_num) {
-    Inode dir_inode;
-    read_inode(dir_inode_num, &dir_inode);
+    myfs_dir_t* dir;
+    int rc = myfs_opendir_ino(fs, st.ino, &dir);
+    if (rc != 0) { print_error(path, rc); return; }
 
-    DirectoryEntry new_entry;
-    strncpy(new_entry.name, name, MAX_FILENAME_LEN);
-    new_entry.name[MAX_FILENAME_LEN] = '\0';
-    new_entry.inode_number = new_inode_num;
+    printf("Contents of %s:\n", path);
+    printf("Type\tSize\t\tName\n");
+    printf("----\t----\t\t----\n");
 
-    char buffer[BLOCK_SIZE];
-    int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
+    printf("d\t%u\t\t.\n", st.size);
+    struct myfs_stat parent_st;
+    int parent = myfs_lookup_at(fs, st.ino, "..");
+    rc = parent < 0 ? parent : myfs_stat_ino(fs, parent, &parent_st);
+    if (rc == 0) printf("d\t%u\t\t..\n", parent_st.size);
+    else print_error("..", rc);
+
+    struct myfs_dirent entry;
+    while ((rc = myfs_readdir(dir, &entry)) == 1) {
+        struct myfs_stat entry_st;
+        int stat_rc = myfs_stat_ino(fs, entry.ino, &entry_st);
+        if (stat_rc != 0) { print_error(entry.name, stat_rc); continue; }
+        printf("%s\t%u\t\t%s\n", (entry_st.is_dir ? "d" : "f"), entry_st.size, entry.name);
+    }
+    if (rc < 0) print_error(path, rc);
+    myfs_closedir(dir);
+}
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        int current_block_num;
-        if (dir_inode.direct_blocks[i] == UNUSED_BLOCK) {
-            current_block_num = alloc_data_block();
-            if (current_block_num == -1) {
-                printf("Error: Out of data blocks.\n");
-                return;
-            }
-            dir_inode.direct_blocks[i] = current_block_num;
-            memset(buffer, 0, BLOCK_SIZE); 
-        } else {
-            current_block_num = dir_inode.direct_blocks[i];
-            read_block(sb.data_blocks_start_block + current_block_num, buffer);
-        }
+void do_cp_to_vdisk(const char* host_path, const char* vdisk_path) {
+    FILE *src_file = fopen(host_path, "rb");
+    if (!src_file) { print_failure("Cannot open host file %s\n", host_path); return; }
 
-        DirectoryEntry* de = (DirectoryEntry*)buffer;
-        for (int j = 0; j < entries_per_block; j++) {
-            if (de[j].name[0] == '\0') {
-                memcpy(&de[j], &new_entry, sizeof(DirectoryEntry));
-                write_block(sb.data_blocks_start_block + current_block_num, buffer);
+    fseek(src_file, 0, SEEK_END);
+    long file_size = ftell(src_file);
+    fseek(src_file, 0, SEEK_SET);
 
-                int current_entry_offset = (i * entries_per_block) + j;
-                if (current_entry_offset * sizeof(DirectoryEntry) >= dir_inode.size) {
-                    dir_inode.size += sizeof(DirectoryEntry);
-                }
+    if (file_size > MAX_FILE_SIZE) {
+        print_failure("File is too large for this simple filesystem.\n");
+        fclose(src_file);
+        return;
+    }
 
-                dir_inode.modification_time = time(NULL);
-                write_inode(dir_inode_num, &dir_inode);
-                return;
-            }
-        }
+    static char data[MAX_FILE_SIZE];
+    if (file_size > 0 && fread(data, file_size, 1, src_file) != 1) {
+        print_failure("Cannot read host file %s\n", host_path);
+        fclose(src_file);
+        return;
     }
-    printf("Error: Directory is full.\n");
+    fclose(src_file);
+
+    int rc = myfs_create(fs, vdisk_path, data, file_size);
+    if (rc < 0) { print_error(vdisk_path, rc); return; }
+    printf("Copied %s to %s\n", host_path, vdisk_path);
 }
 
+void do_cp_from_vdisk(const char* vdisk_path, const char* host_path) {
+    struct myfs_stat st;
+    int rc = myfs_stat(fs, vdisk_path, &st);
+    if (rc != 0) { print_failure("File not found on virtual disk.\n"); return; }
+    if (st.is_dir) { print_failure("Not a file.\n"); return; }
 
-int get_path_inode(const char* path) {
-    if (path == NULL || path[0] == '\0') return -1;
+    static char data[MAX_FILE_SIZE];
+    long n = myfs_pread(fs, st.ino, data, st.size, 0);
+    if (n < 0) { print_error(vdisk_path, n); return; }
 
-    if (strcmp(path, ".") == 0) return current_working_directory_inode;
+    FILE *dest_file = fopen(host_path, "wb");
+    if (!dest_file) { print_failure("Cannot create host file %s\n", host_path); return; }
+    if (n > 0 && fwrite(data, n, 1, dest_file) != 1) {
+        print_failure("Cannot write host file %s\n", host_path);
+        fclose(dest_file);
+        return;
+    }
+    fclose(dest_file);
+    printf("Copied %s to %s\n", vdisk_path, host_path);
+}
 
-    char path_copy[strlen(path) + 1];
-    strcpy(path_copy, path);
+void do_rm(const char* path) {
+    int rc = myfs_unlink(fs, path);
+    if (rc == MYFS_EISDIR) { print_failure("Cannot remove directory with 'rm'. Use 'rmdir'.\n"); return; }
+    if (rc != 0) { print_error(path, rc); return; }
+    printf("Removed %s\n", path);
+}
 
-    char *token;
-    char *rest = path_copy;
-    int start_inode;
+void do_rmdir(const char* path) {
+    int rc = myfs_rmdir(fs, path);
+    if (rc == MYFS_EPERM) { print_failure("Cannot remove root directory.\n"); return; }
+    if (rc != 0) { print_error(path, rc); return; }
+    printf("Removed directory %s\n", path);
+}
 
-    if (path[0] == '/') {
-        start_inode = ROOT_INODE_NUM;
-        if (strlen(rest) > 1) rest++;
-    } else {
-        start_inode = current_working_directory_inode;
-    }
+void do_ln(const char* target_path, const char* link_path) {
+    int rc = myfs_link(fs, target_path, link_path);
+    if (rc == MYFS_EPERM) { print_failure("Hard links to directories not supported.\n"); return; }
+    if (rc != 0) { print_error(link_path, rc); return; }
+    printf("Created hard link %s -> %s\n", link_path, target_path);
+}
 
-    if (strlen(path_copy) == 1 && path_copy[0] == '/')
-        return ROOT_INODE_NUM;
+void do_clone(const char* src_path, const char* dst_path) {
+    int ino = myfs_clone(fs, src_path, dst_path);
+    if (ino == MYFS_EISDIR) { print_failure("Only files can be cloned; use 'cp' for a directory.\n"); return; }
+    if (ino < 0) { print_error(dst_path, ino); return; }
+    struct myfs_stat st;
+    int rc = myfs_stat_ino(fs, ino, &st);
+    if (rc < 0) { print_error(dst_path, rc); return; }
+    printf("Cloned %s to %s, sharing %u data blocks\n", src_path, dst_path, st.blocks);
+}
 
-    int current_inode = start_inode;
-    while ((token = strtok_r(rest, "/", &rest))) {
-        if (strlen(token) == 0) continue;
+// Fragmentation and space report for 'frag' and 'df -v'. The score is the
+// share of boundaries between a file's consecutive blocks that are breaks:
+// 0% when every file is one run, 100% when no two blocks are adjacent.
+void print_layout() {
+    struct myfs_layout l;
+    int rc = myfs_layout(fs, &l);
+    if (rc < 0) { print_error("layout", rc); return; }
+
+    printf("Free space: %u of %u blocks in %u run%s, largest %u blocks\n", l.free_blocks, l.data_blocks,
+           l.free_extents, l.free_extents == 1 ? "" : "s", l.largest_free_run);
+    for (int b = 0; b < MYFS_FREE_RUN_BUCKETS; b++) {
+        if (l.free_runs[b] == 0) continue;
+        char range[32];
+        if (b == 0) snprintf(range, sizeof(range), "1");
+        else snprintf(range, sizeof(range), "%u-%u", 1u << b, (2u << b) - 1);
+        printf("  runs of %-10s %6u\n", range, l.free_runs[b]);
+    }
 
-        current_inode = find_entry_in_dir(current_inode, token);
-        if (current_inode == -1) {
-            return -1;
-        }
+    uint32_t with_blocks = 0;
+    for (int n = 1; n <= MYFS_MAP_SLOTS; n++) with_blocks += l.files_by_extents[n];
+    double score = l.file_blocks > with_blocks ?
+        100.0 * (l.file_extents - with_blocks) / (l.file_blocks - with_blocks) : 0.0;
+    printf("Files: %u (%u inline), %u blocks in %u extents, fragmentation score %.1f%%\n", l.files,
+           l.inline_files, l.file_blocks, l.file_extents, score);
+    for (int n = 1; n <= MYFS_MAP_SLOTS; n++) {
+        if (l.files_by_extents[n]) printf("  in %2d extent%s %6u\n", n, n == 1 ? " " : "s", l.files_by_extents[n]);
+    }
 
-        Inode temp_inode;
-        read_inode(current_inode, &temp_inode);
-        if (temp_inode.mode != 1 && rest && *rest != '\0') {
-            return -1;
-        }
+    printf("Directories: %u (%u inline, %u bytes of entries)\n", l.directories, l.inline_directories,
+           l.inline_dir_bytes);
+    if (l.dir_blocks) {
+        printf("  %u blocks, %u of %u slots in use (%.1f%%), %u holes\n", l.dir_blocks, l.dir_entries, l.dir_slots,
+               100.0 * l.dir_entries / l.dir_slots, l.dir_holes);
     }
-    return current_inode;
+    printf("Inode table: %u of %u inodes in use (%.1f%%), in %u of %u blocks\n", l.inodes_used, l.inodes,
+           l.inodes ? 100.0 * l.inodes_used / l.inodes : 0.0, l.itable_blocks_used, l.itable_blocks);
 }
 
-void do_mkdir(const char *path) {
-    char dname_path[strlen(path) + 1];
-    char bname_path[strlen(path) + 1];
-    strcpy(dname_path, path);
-    strcpy(bname_path, path);
+void do_df(const char* arg) {
+    if (arg[0] != '\0' && strcmp(arg, "-v") != 0) { print_usage("df [-v]\n"); return; }
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    int used_inodes = sfs.total_inodes - sfs.free_inodes;
+    int used_data_blocks = sfs.total_blocks - sfs.free_blocks;
 
-    char *parent_path = dirname(dname_path);
-    char *child_name = basename(bname_path);
-
-    int parent_inode_num = get_path_inode(parent_path);
-    if (parent_inode_num == -1) { printf("Error: Parent directory not found for '%s'.\n", path); return; }
-    if (find_entry_in_dir(parent_inode_num, child_name) != -1) { printf("Error: Name '%s' already exists.\n", child_name); return; }
-
-    int new_inode_num = alloc_inode();
-    if (new_inode_num == -1) { printf("Error: Out of inodes.\n"); return; }
+    printf("Disk Usage:\n");
+    printf("  Inodes:      %d used, %u free, %u total\n", used_inodes, sfs.free_inodes, sfs.total_inodes);
+    printf("  Data Blocks: %d used, %u free, %u total\n", used_data_blocks, sfs.free_blocks, sfs.total_blocks);
+    printf("  Disk Space:  %ld bytes used, %ld bytes free, %lu bytes total\n",
+           (long)used_data_blocks * sfs.block_size,
+           (long)sfs.free_blocks * sfs.block_size, (unsigned long)sfs.total_bytes);
+    if (arg[0] != '\0') print_layout();
+}
 
-    int new_block_num = alloc_data_block();
-    if (new_block_num == -1) {
-        printf("Error: Out of data blocks.\n");
-        free_inode(new_inode_num);
+void do_append(const char *path, int n_bytes) {
+    if (n_bytes <= 0) { print_failure("Must append a positive number of bytes.\n"); return; }
+    struct myfs_stat st;
+    if (myfs_stat(fs, path, &st) != 0) { print_failure("File not found.\n"); return; }
+    if (st.is_dir) { print_failure("Not a file.\n"); return; }
+    if ((long)st.size + n_bytes > MAX_FILE_SIZE) {
+        print_failure("Appending would exceed maximum file size.\n");
         return;
     }
 
-    Inode new_inode;
-    new_inode.mode = 1;
-    new_inode.size = 2 * sizeof(DirectoryEntry);
-    new_inode.link_count = 2;
-    new_inode.creation_time = new_inode.modification_time = time(NULL);
-    for(int i = 0; i < INODE_DIRECT_POINTERS; i++) new_inode.direct_blocks[i] = UNUSED_BLOCK;
-    new_inode.direct_blocks[0] = new_block_num;
-    write_inode(new_inode_num, &new_inode);
-
-    DirectoryEntry entries[2];
-    strcpy(entries[0].name, ".");
-    entries[0].inode_number = new_inode_num;
-    strcpy(entries[1].name, "..");
-    entries[1].inode_number = parent_inode_num;
+    int rc = myfs_truncate(fs, st.ino, (long)st.size + n_bytes);
+    if (rc != 0) { print_error(path, rc); return; }
+    printf("Appended %d bytes to %s.\n", n_bytes, path);
+}
 
-    char buffer[BLOCK_SIZE] = {0};
-    memcpy(buffer, entries, 2 * sizeof(DirectoryEntry));
-    write_block(sb.data_blocks_start_block + new_block_num, buffer);
+void do_truncate(const char *path, int n_bytes) {
+    if (n_bytes <= 0) { print_failure("Must shorten by a positive number of bytes.\n"); return; }
+    struct myfs_stat st;
+    if (myfs_stat(fs, path, &st) != 0) { print_failure("File not found.\n"); return; }
+    if (st.is_dir) { print_failure("Not a file.\n"); return; }
 
-    add_entry_to_dir(parent_inode_num, child_name, new_inode_num);
+    long original_size = st.size;
+    long new_size = (n_bytes >= original_size) ? 0 : original_size - n_bytes;
+    int rc = myfs_truncate(fs, st.ino, new_size);
+    if (rc != 0) { print_error(path, rc); return; }
 
-    Inode parent_inode;
-    read_inode(parent_inode_num, &parent_inode);
-    parent_inode.link_count++;
-    write_inode(parent_inode_num, &parent_inode);
+    if (new_size == 0 && original_size > 0) {
+        printf("Truncated %s to 0 bytes.\n", path);
+    } else {
+        printf("Shortened %s to %ld bytes.\n", path, new_size);
+    }
+}
 
-    sync_bitmaps();
-    printf("Directory created: %s\n", path);
+void do_read(const char* path, long offset, long len) {
+    struct myfs_stat st;
+    if (myfs_stat(fs, path, &st) != 0) { print_failure("File not found.\n"); return; }
+    if (len > MAX_FILE_SIZE) len = MAX_FILE_SIZE;
+
+    static char data[MAX_FILE_SIZE];
+    long n = myfs_pread(fs, st.ino, data, len, offset);
+    if (n < 0) { print_error(path, n); return; }
+    // Raw bytes, so one-shot mode can be redirected straight into a host file.
+    fwrite(data, 1, n, stdout);
+    fflush(stdout);
 }
 
-// FIXED: Corrected loop logic
-void do_ls(const char *path) {
-    if (path == NULL || path[0] == '\0')
-        path = ".";
+void do_write(const char* path, long offset, const char* host_path) {
+    int inode_num = myfs_lookup(fs, path);
+    if (inode_num < 0) { print_failure("File not found.\n"); return; }
 
-    int inode_num = get_path_inode(path);
-    if (inode_num == -1) {
-        printf("ls: cannot access '%s': No such file or directory\n", path);
+    FILE* src_file = strcmp(host_path, "-") == 0 ? stdin : fopen(host_path, "rb");
+    if (!src_file) { print_failure("Cannot open host file %s\n", host_path); return; }
+
+    // Read one byte past the limit so oversized sources are rejected, not cut short.
+    static char data[MAX_FILE_SIZE + 1];
+    long len = fread(data, 1, sizeof(data), src_file);
+    if (src_file != stdin) fclose(src_file);
+    if (len > MAX_FILE_SIZE) {
+        print_failure("Writing would exceed maximum file size.\n");
         return;
     }
 
-    Inode inode;
-    read_inode(inode_num, &inode);
-    if (inode.mode != 1) {
-        char temp_path[strlen(path)+1];
-        strcpy(temp_path, path);
-        printf("f\t%u\t\t%s\n", inode.size, basename(temp_path));
+    long n = myfs_pwrite(fs, inode_num, data, len, offset);
+    if (n < 0) { print_error(path, n); return; }
+    printf("Wrote %ld bytes to %s at offset %ld.\n", len, path, offset);
+}
+
+void do_pwd() {
+    char path[MAX_PATH_LEN];
+    if (myfs_getcwd(fs, path, sizeof(path)) != 0) {
+        printf("/<error: fs inconsistent>\n");
         return;
     }
+    printf("%s\n", path);
+}
 
-    printf("Contents of %s:\n", path);
-    printf("Type\tSize\t\tName\n");
-    printf("----\t----\t\t----\n");
+void do_cd(const char *path) {
+    int rc = myfs_chdir(fs, path);
+    if (rc == MYFS_ENOTDIR) {
+        printf("cd: not a directory: %s\n", path);
+    } else if (rc != 0) {
+        printf("cd: no such file or directory: %s\n", path);
+    }
+}
 
-    char buffer[BLOCK_SIZE];
-    int total_valid_entries = inode.size / sizeof(DirectoryEntry);
-    int entries_found = 0;
+// Mounts
+// Images beyond the one given on the command line are added with 'mount'
+// and named so commands can refer to them; paths written as name:/path
+// address a file on a particular mount. All mounts share one block cache.
+// Unmounts a handle, keeping its I/O counters in the shell's totals.
+int unmount_handle(myfs_t* handle) {
+    struct myfs_io_stats io;
+    myfs_io_stats(handle, &io);
+    uint64_t* to = (uint64_t*)&retired_io;
+    const uint64_t* from = (const uint64_t*)&io;
+    for (size_t k = 0; k < sizeof(io) / sizeof(uint64_t); k++) to[k] += from[k];
+    return myfs_unmount(handle);
+}
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        if (inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_valid_entries)
-            break;
+int find_mount(const char* name) {
+    for (int i = 0; i < mount_count; i++) {
+        if (strcmp(mounts[i].name, name) == 0) return i;
+    }
+    return -1;
+}
 
-        read_block(sb.data_blocks_start_block + inode.direct_blocks[i], buffer);
-        int entries_in_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-
-        DirectoryEntry *de = (DirectoryEntry*)buffer;
-        for (int j = 0; j < entries_in_block; j++) {
-            if (entries_found >= total_valid_entries) break;
-
-            if (de[j].name[0] != '\0') {
-                entries_found++;
-                Inode entry_inode;
-                read_inode(de[j].inode_number, &entry_inode);
-                printf("%s\t%u\t\t%s\n",
-                       (entry_inode.mode == 1 ? "d" : "f"),
-                       entry_inode.size,
-                       de[j].name);
-            }
-        }
+// Default mount name: the image's file name without its extension.
+void default_mount_name(const char* image_path, char* name) {
+    char temp_path[MAX_PATH_LEN];
+    snprintf(temp_path, sizeof(temp_path), "%s", image_path);
+    snprintf(name, MAX_MOUNT_NAME, "%s", basename(temp_path));
+    char* dot = strrchr(name, '.');
+    if (dot && dot != name) *dot = '\0';
+    for (char* c = name; *c; c++) {
+        if (*c == ':') *c = '_';
     }
 }
 
-void do_cp_to_vdisk(const char* host_path, const char* vdisk_path) {
-    FILE *src_file = fopen(host_path, "rb");
-    if (!src_file) { printf("Error: Cannot open host file %s\n", host_path); return; }
+int add_mount(const char* image_path, const char* name, myfs_t* handle) {
+    if (mount_count == MAX_MOUNTS) { print_failure("Too many mounted images (max %d).\n", MAX_MOUNTS); return -1; }
+    if (strlen(name) >= MAX_MOUNT_NAME || strchr(name, ':') || strchr(name, '/')) {
+        print_failure("Invalid mount name '%s'.\n", name);
+        return -1;
+    }
+    if (find_mount(name) >= 0) { print_failure("Mount name '%s' is already in use.\n", name); return -1; }
 
-    fseek(src_file, 0, SEEK_END);
-    long file_size = ftell(src_file);
-    fseek(src_file, 0, SEEK_SET);
+    Mount* m = &mounts[mount_count];
+    strcpy(m->name, name);
+    snprintf(m->image_path, sizeof(m->image_path), "%s", image_path);
+    m->fs = handle;
+    return mount_count++;
+}
 
-    if (file_size > INODE_DIRECT_POINTERS * BLOCK_SIZE) {
-        printf("Error: File is too large for this simple filesystem.\n");
-        fclose(src_file);
-        return;
+void do_mount(const char* image_path, const char* name) {
+    char default_name[MAX_MOUNT_NAME];
+    if (name[0] == '\0') {
+        default_mount_name(image_path, default_name);
+        name = default_name;
     }
-
-    char dname_path[strlen(vdisk_path) + 1];
-    char bname_path[strlen(vdisk_path) + 1];
-    strcpy(dname_path, vdisk_path);
-    strcpy(bname_path, vdisk_path);
-    char *parent_path = dirname(dname_path);
-    char *child_name = basename(bname_path);
-
-    int parent_inode_num = get_path_inode(parent_path);
-    if (parent_inode_num == -1) { printf("Error: Parent directory not found.\n"); fclose(src_file); return; }
-    if (find_entry_in_dir(parent_inode_num, child_name) != -1) { printf("Error: Name already exists.\n"); fclose(src_file); return; }
-
-    int new_inode_num = alloc_inode();
-    if (new_inode_num == -1) { printf("Error: Out of inodes.\n"); fclose(src_file); return; }
-
-    Inode new_inode;
-    new_inode.mode = 0; // File
-    new_inode.size = file_size;
-    new_inode.link_count = 1;
-    new_inode.creation_time = new_inode.modification_time = time(NULL);
-    for(int i = 0; i < INODE_DIRECT_POINTERS; i++) new_inode.direct_blocks[i] = UNUSED_BLOCK;
-
-    char buffer[BLOCK_SIZE];
-    long bytes_left = file_size;
-    int blocks_allocated = 0;
-    for (int i = 0; i < INODE_DIRECT_POINTERS && bytes_left > 0; i++) {
-        int new_block = alloc_data_block();
-        if (new_block == -1) {
-            printf("Error: Out of data blocks during copy. Cleaning up.\n");
-            for (int j = 0; j < blocks_allocated; j++) {
-                free_data_block(new_inode.direct_blocks[j]);
-            }
-            free_inode(new_inode_num);
-            sync_bitmaps();
-            fclose(src_file);
+    for (int i = 0; i < mount_count; i++) {
+        if (strcmp(mounts[i].image_path, image_path) == 0) {
+            print_failure("'%s' is already mounted as '%s'.\n", image_path, mounts[i].name);
             return;
         }
-        new_inode.direct_blocks[i] = new_block;
-        blocks_allocated++;
-
-        size_t bytes_to_read = bytes_left > BLOCK_SIZE ? BLOCK_SIZE : (size_t)bytes_left;
-        fread(buffer, bytes_to_read, 1, src_file);
-        memset(buffer + bytes_to_read, 0, BLOCK_SIZE - bytes_to_read); // Zero-pad
-        write_block(sb.data_blocks_start_block + new_block, buffer);
-        bytes_left -= bytes_to_read;
     }
+    if (find_mount(name) >= 0) { print_failure("Mount name '%s' is already in use.\n", name); return; }
 
-    write_inode(new_inode_num, &new_inode);
-    add_entry_to_dir(parent_inode_num, child_name, new_inode_num);
-    sync_bitmaps();
-    fclose(src_file);
-    printf("Copied %s to %s\n", host_path, vdisk_path);
+    myfs_t* handle;
+    int rc = myfs_mount(image_path, &handle);
+    if (rc != 0) { print_error(image_path, rc); return; }
+    if (add_mount(image_path, name, handle) < 0) { unmount_handle(handle); return; }
+    printf("Mounted %s as %s\n", image_path, name);
 }
 
-void do_cp_from_vdisk(const char* vdisk_path, const char* host_path) {
-    int inode_num = get_path_inode(vdisk_path);
-    if (inode_num == -1) { printf("Error: File not found on virtual disk.\n"); return; }
-
-    Inode inode;
-    read_inode(inode_num, &inode);
-    if(inode.mode != 0) { printf("Error: Not a file.\n"); return; }
+void do_umount(const char* name) {
+    int i = find_mount(name);
+    if (i < 0) { print_failure("No mount named '%s'.\n", name); return; }
+    if (i == current_mount) { print_failure("Cannot unmount the image in use; 'use' another one first.\n"); return; }
+
+    int rc = unmount_handle(mounts[i].fs);
+    memmove(&mounts[i], &mounts[i + 1], (mount_count - i - 1) * sizeof(Mount));
+    mount_count--;
+    if (current_mount > i) current_mount--;
+    if (rc != 0) { print_error(name, rc); return; }
+    printf("Unmounted %s\n", name);
+}
 
-    FILE *dest_file = fopen(host_path, "wb");
-    if (!dest_file) { printf("Error: Cannot create host file %s\n", host_path); return; }
+void do_use(const char* name) {
+    int i = find_mount(name);
+    if (i < 0) { print_failure("No mount named '%s'.\n", name); return; }
+    current_mount = i;
+    fs = mounts[i].fs;
+}
 
-    char buffer[BLOCK_SIZE];
-    long bytes_left = inode.size;
-    for (int i = 0; i < INODE_DIRECT_POINTERS && bytes_left > 0; i++) {
-        if (inode.direct_blocks[i] == UNUSED_BLOCK) break;
-        read_block(sb.data_blocks_start_block + inode.direct_blocks[i], buffer);
-        size_t bytes_to_write = bytes_left > BLOCK_SIZE ? BLOCK_SIZE : (size_t)bytes_left;
-        fwrite(buffer, bytes_to_write, 1, dest_file);
-        bytes_left -= bytes_to_write;
+void do_mounts() {
+    printf("Name\t\tImage\n");
+    printf("----\t\t-----\n");
+    for (int i = 0; i < mount_count; i++) {
+        printf("%s%s\t\t%s\n", i == current_mount ? "*" : "", mounts[i].name, mounts[i].image_path);
     }
-
-    fclose(dest_file);
-    printf("Copied %s to %s\n", vdisk_path, host_path);
+    struct myfs_cache_stats cs;
+    myfs_cache_stats(&cs);
+    printf("Block cache: %lu of %lu KiB used, %lu hits, %lu misses\n",
+           (unsigned long)(cs.used_bytes / 1024), (unsigned long)(cs.limit_bytes / 1024),
+           (unsigned long)cs.hits, (unsigned long)cs.misses);
 }
 
-void do_rm_entry(int parent_inode_num, const char* child_name) {
-    Inode parent_inode;
-    read_inode(parent_inode_num, &parent_inode);
-    char buffer[BLOCK_SIZE];
-
-    int total_entries = parent_inode.size / sizeof(DirectoryEntry);
-    int entries_found = 0;
-
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        if (parent_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_entries)
-            break;
-
-        read_block(sb.data_blocks_start_block + parent_inode.direct_blocks[i], buffer);
-        int entries_in_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        DirectoryEntry* de = (DirectoryEntry*)buffer;
-        for (int j = 0; j < entries_in_block; j++) {
-            if (entries_found >= total_entries) break;
-            if (de[j].name[0] != '\0') {
-                 entries_found++;
-                 if (strcmp(de[j].name, child_name) == 0) {
-                    memset(&de[j], 0, sizeof(DirectoryEntry));
-                    write_block(sb.data_blocks_start_block + parent_inode.direct_blocks[i], buffer);
-                    return;
-                }
-            }
+// Splits "name:/path" into a mount and a path. Anything without a known
+// mount name before the first ':' is a path on the current image.
+myfs_t* split_mount_path(const char* spec, const char** path) {
+    const char* colon = strchr(spec, ':');
+    if (colon && colon - spec < MAX_MOUNT_NAME) {
+        char name[MAX_MOUNT_NAME];
+        memcpy(name, spec, colon - spec);
+        name[colon - spec] = '\0';
+        int i = find_mount(name);
+        if (i >= 0) {
+            *path = colon[1] ? colon + 1 : "/";
+            return mounts[i].fs;
         }
     }
+    *path = spec;
+    return fs;
 }
 
-void do_rm(const char* path) {
-    char dname_path[strlen(path) + 1];
-    char bname_path[strlen(path) + 1];
-    strcpy(dname_path, path);
-    strcpy(bname_path, path);
-    char *parent_path = dirname(dname_path);
-    char *child_name = basename(bname_path);
+void do_cp(const char* src_spec, const char* dst_spec) {
+    const char *src_path, *dst_path;
+    myfs_t* src = split_mount_path(src_spec, &src_path);
+    myfs_t* dst = split_mount_path(dst_spec, &dst_path);
 
-    int parent_inode_num = get_path_inode(parent_path);
-    if (parent_inode_num == -1) { printf("Error: Parent directory not found.\n"); return; }
-
-    int child_inode_num = find_entry_in_dir(parent_inode_num, child_name);
-    if (child_inode_num == -1) { printf("Error: File or link not found.\n"); return; }
+    int rc = myfs_copy(src, src_path, dst, dst_path);
+    if (rc < 0) { print_error(dst_spec, rc); return; }
+    printf("Copied %s to %s\n", src_spec, dst_spec);
+}
 
-    Inode child_inode;
-    read_inode(child_inode_num, &child_inode);
-    if (child_inode.mode == 1) { printf("Error: Cannot remove directory with 'rm'. Use 'rmdir'.\n"); return; }
+// Bulk Import
+// import walks a host tree once, sizes the whole job up front, and then
+// creates entries in batches. Reader threads load the next batch's file
+// contents while the main thread commits the current one; each entry's
+// parent inode is pinned from the walk, so no path is ever re-resolved,
+// and the bitmaps are written once per batch instead of once per file.
+#define IMPORT_READER_THREADS 4
+#define IMPORT_BATCH_SIZE 64
 
-    do_rm_entry(parent_inode_num, child_name);
+typedef struct {
+    char* host_path;
+    char name[MAX_FILENAME_LEN + 1];
+    int parent;      // index of the parent directory entry, -1 for the import root
+    int is_dir;
+    long size;
+    int vdisk_inode; // directories: inode number once created, -1 if that failed
+    char* data;      // files: contents, filled in by a reader thread
+    int read_failed;
+} ImportEntry;
 
-    Inode parent_inode;
-    read_inode(parent_inode_num, &parent_inode);
-    parent_inode.size -= sizeof(DirectoryEntry);
-    write_inode(parent_inode_num, &parent_inode);
+typedef struct {
+    ImportEntry* entries;
+    int count;
+    int capacity;
+    int skipped;
+} ImportPlan;
 
-    child_inode.link_count--;
-    write_inode(child_inode_num, &child_inode);
+typedef struct {
+    ImportEntry* entries;
+    int end;
+    int next; // next entry index to claim, shared by the reader threads
+    pthread_t threads[IMPORT_READER_THREADS];
+} ImportBatch;
+
+ImportEntry* import_plan_add(ImportPlan* plan) {
+    if (plan->count == plan->capacity) {
+        int new_capacity = plan->capacity ? plan->capacity * 2 : 64;
+        ImportEntry* grown = realloc(plan->entries, new_capacity * sizeof(ImportEntry));
+        if (!grown) return NULL;
+        plan->entries = grown;
+        plan->capacity = new_capacity;
+    }
+    ImportEntry* e = &plan->entries[plan->count++];
+    memset(e, 0, sizeof(ImportEntry));
+    e->vdisk_inode = -1;
+    return e;
+}
 
-    if (child_inode.link_count == 0) {
-        for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-            if (child_inode.direct_blocks[i] != UNUSED_BLOCK) {
-                free_data_block(child_inode.direct_blocks[i]);
-            }
+// Appends the contents of host_dir in pre-order, so every directory is
+// listed before anything inside it.
+int import_scan(ImportPlan* plan, const char* host_dir, int parent_index) {
+    struct dirent** names;
+    int n = scandir(host_dir, &names, NULL, alphasort);
+    if (n < 0) { print_failure("Cannot read host directory %s\n", host_dir); return -1; }
+
+    int rc = 0;
+    for (int i = 0; i < n && rc == 0; i++) {
+        const char* name = names[i]->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        char host_path[MAX_PATH_LEN];
+        struct stat st;
+        if (snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name) >= (int)sizeof(host_path) ||
+            strlen(name) > MAX_FILENAME_LEN || lstat(host_path, &st) != 0) {
+            printf("Skipping %s/%s: name too long or unreadable\n", host_dir, name);
+            plan->skipped++;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            printf("Skipping %s: not a regular file or directory\n", host_path);
+            plan->skipped++;
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE) {
+            printf("Skipping %s: file is too large for this simple filesystem\n", host_path);
+            plan->skipped++;
+            continue;
         }
-        free_inode(child_inode_num);
+
+        ImportEntry* e = import_plan_add(plan);
+        if (!e) { print_failure("Out of memory while scanning %s\n", host_dir); rc = -1; break; }
+        e->host_path = strdup(host_path);
+        strcpy(e->name, name);
+        e->parent = parent_index;
+        e->is_dir = S_ISDIR(st.st_mode);
+        e->size = e->is_dir ? 0 : st.st_size;
+
+        if (e->is_dir) rc = import_scan(plan, host_path, plan->count - 1);
     }
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+    return rc;
+}
 
-    sync_bitmaps();
-    printf("Removed %s\n", path);
+void* import_reader(void* arg) {
+    ImportBatch* batch = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->end) {
+        ImportEntry* e = &batch->entries[i];
+        if (e->is_dir) continue;
+
+        e->data = malloc(e->size > 0 ? e->size : 1);
+        FILE* f = fopen(e->host_path, "rb");
+        if (!e->data || !f || (e->size > 0 && fread(e->data, e->size, 1, f) != 1)) e->read_failed = 1;
+        if (f) fclose(f);
+    }
+    return NULL;
 }
 
-void do_rmdir(const char* path) {
-    if (strcmp(path, "/") == 0) { printf("Error: Cannot remove root directory.\n"); return; }
+void import_start_batch(ImportBatch* batch, ImportPlan* plan, int start) {
+    batch->entries = plan->entries;
+    batch->next = start;
+    batch->end = start + IMPORT_BATCH_SIZE < plan->count ? start + IMPORT_BATCH_SIZE : plan->count;
+    for (int t = 0; t < IMPORT_READER_THREADS; t++)
+        pthread_create(&batch->threads[t], NULL, import_reader, batch);
+}
 
-    int inode_num = get_path_inode(path);
-    if (inode_num == -1) { printf("Error: Directory not found.\n"); return; }
+void import_finish_batch(ImportBatch* batch) {
+    for (int t = 0; t < IMPORT_READER_THREADS; t++)
+        pthread_join(batch->threads[t], NULL);
+}
 
-    Inode inode;
-    read_inode(inode_num, &inode);
-    if (inode.mode != 1) { printf("Error: Not a directory.\n"); return; }
+void do_import(const char* host_dir, const char* vdisk_dir) {
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        print_failure("Host directory %s not found.\n", host_dir);
+        return;
+    }
 
-    int entry_count = 0;
-    char buffer[BLOCK_SIZE];
-    int total_entries = inode.size / sizeof(DirectoryEntry);
-    int entries_found = 0;
+    struct myfs_stat dest_st;
+    int dest_inode_num = myfs_stat(fs, vdisk_dir, &dest_st) == 0 ? (int)dest_st.ino : -1;
+    if (dest_inode_num != -1 && !dest_st.is_dir) { print_failure("%s is not a directory.\n", vdisk_dir); return; }
+
+    ImportPlan plan = {0};
+    if (import_scan(&plan, host_dir, -1) != 0) goto out;
+
+    // Size the whole import before touching the image: one inode per entry,
+    // each file's data blocks, and the blocks each directory's entries need.
+    long inodes_needed = plan.count + (dest_inode_num == -1);
+    long blocks_needed = 0;
+    long* child_count = calloc(plan.count + 1, sizeof(long));
+    long* child_bytes = calloc(plan.count + 1, sizeof(long));
+    if (!child_count || !child_bytes) {
+        print_failure("Out of memory while sizing the import of %s\n", host_dir);
+        free(child_count);
+        free(child_bytes);
+        goto out;
+    }
+    for (int i = 0; i < plan.count; i++) {
+        ImportEntry* e = &plan.entries[i];
+        if (!e->is_dir) blocks_needed += myfs_file_blocks(e->size);
+        child_count[e->parent + 1]++;
+        child_bytes[e->parent + 1] += strlen(e->name);
+    }
+    for (int i = 0; i <= plan.count; i++) blocks_needed += myfs_dir_blocks(child_count[i], child_bytes[i]);
+    free(child_count);
+    free(child_bytes);
+
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    if (inodes_needed > sfs.free_inodes || blocks_needed > sfs.free_blocks) {
+        print_failure("Import needs %ld inodes and %ld data blocks; only %u and %u are free.\n",
+               inodes_needed, blocks_needed, sfs.free_inodes, sfs.free_blocks);
+        goto out;
+    }
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        if (inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_entries)
-            break;
+    if (dest_inode_num == -1) {
+        dest_inode_num = myfs_mkdir(fs, vdisk_dir);
+        if (dest_inode_num < 0) { print_error(vdisk_dir, dest_inode_num); goto out; }
+    }
 
-        read_block(sb.data_blocks_start_block + inode.direct_blocks[i], buffer);
-        int entries_in_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        DirectoryEntry* de = (DirectoryEntry*)buffer;
-        for (int j = 0; j < entries_in_block; j++) {
-            if (entries_found >= total_entries) break;
-            if (de[j].name[0] != '\0') {
-                 entries_found++;
-                 entry_count++;
+    int dirs_created = 0, files_created = 0, failed = 0;
+    long bytes_copied = 0;
+    ImportBatch batches[2];
+    int current = 0;
+    if (plan.count > 0) import_start_batch(&batches[current], &plan, 0);
+
+    for (int start = 0; start < plan.count; start += IMPORT_BATCH_SIZE) {
+        ImportBatch* batch = &batches[current];
+        import_finish_batch(batch);
+        // Let the readers fetch the next batch while this one is committed.
+        if (batch->end < plan.count) import_start_batch(&batches[current ^ 1], &plan, batch->end);
+
+        myfs_batch_begin(fs);
+        for (int i = start; i < batch->end; i++) {
+            ImportEntry* e = &plan.entries[i];
+            int parent_inode_num = e->parent == -1 ? dest_inode_num : plan.entries[e->parent].vdisk_inode;
+            if (parent_inode_num == -1) { failed++; continue; } // parent already reported
+
+            if (e->is_dir) {
+                int rc = myfs_mkdir_at(fs, parent_inode_num, e->name);
+                if (rc == MYFS_EEXIST) {
+                    // Merging into an existing tree: reuse directories, refuse to replace files.
+                    struct myfs_stat existing_st;
+                    int existing = myfs_lookup_at(fs, parent_inode_num, e->name);
+                    if (existing >= 0 && myfs_stat_ino(fs, existing, &existing_st) == 0 && existing_st.is_dir) {
+                        e->vdisk_inode = existing;
+                        continue;
+                    }
+                }
+                if (rc < 0) { print_error(e->name, rc); failed++; continue; }
+                e->vdisk_inode = rc;
+                dirs_created++;
+                continue;
+            }
+
+            if (e->read_failed) {
+                print_failure("Cannot read host file %s\n", e->host_path);
+                failed++;
+            } else {
+                int rc = myfs_create_at(fs, parent_inode_num, e->name, e->data, e->size);
+                if (rc < 0) {
+                    print_error(e->name, rc);
+                    failed++;
+                } else {
+                    files_created++;
+                    bytes_copied += e->size;
+                }
             }
+            free(e->data);
+            e->data = NULL;
         }
+        myfs_batch_end(fs);
+        current ^= 1;
     }
 
-    if (entry_count > 2) { printf("Error: Directory not empty.\n"); return; }
+    printf("Imported %d directories and %d files (%ld bytes) from %s to %s\n",
+           dirs_created, files_created, bytes_copied, host_dir, vdisk_dir);
+    if (failed + plan.skipped > 0) {
+        printf("%d entries were not imported.\n", failed + plan.skipped);
+        command_failed = 1;
+    }
 
-    char dname_path[strlen(path) + 1];
-    char bname_path[strlen(path) + 1];
-    strcpy(dname_path, path);
-    strcpy(bname_path, path);
-    char *parent_path = dirname(dname_path);
-    char *child_name = basename(bname_path);
+out:
+    for (int i = 0; i < plan.count; i++) {
+        free(plan.entries[i].host_path);
+        free(plan.entries[i].data);
+    }
+    free(plan.entries);
+}
 
-    int parent_inode_num = get_path_inode(parent_path);
+// Bulk Export
+// export walks a vdisk subtree breadth-first, then reads every file in
+// order of its first data block so the image is read close to
+// sequentially. Writer threads create the host files from a bounded queue
+// while the main thread keeps reading.
+#define EXPORT_WRITER_THREADS 4
+#define EXPORT_QUEUE_DEPTH 64
 
-    do_rm_entry(parent_inode_num, child_name);
+typedef struct {
+    char* host_path;
+    struct myfs_stat st; // st.first_block is the sort key; inline files sort first, they need no block read
+    char* data;
+} ExportFile;
 
-    Inode parent_inode;
-    read_inode(parent_inode_num, &parent_inode);
-    parent_inode.size -= sizeof(DirectoryEntry);
-    parent_inode.link_count--;
-    write_inode(parent_inode_num, &parent_inode);
+typedef struct {
+    ExportFile* items[EXPORT_QUEUE_DEPTH];
+    int head, count, closed;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} ExportQueue;
 
-    if(inode.direct_blocks[0] != UNUSED_BLOCK) {
-        free_data_block(inode.direct_blocks[0]);
+typedef struct {
+    char** dirs; // host directories to create, parents first
+    int dir_count, dir_capacity;
+    ExportFile* files;
+    int file_count, file_capacity;
+    // BFS work list of (vdisk inode, host path) pairs
+    uint32_t* queue_inodes;
+    char** queue_paths;
+    int queue_head, queue_count, queue_capacity;
+    const char* current_host_dir;
+    int oom;
+} ExportPlan;
+
+int export_collect(ExportPlan* plan, const char* name, uint32_t inode_num) {
+    char host_path[MAX_PATH_LEN];
+    if (snprintf(host_path, sizeof(host_path), "%s/%s", plan->current_host_dir, name) >= (int)sizeof(host_path)) {
+        printf("Skipping %s/%s: host path too long\n", plan->current_host_dir, name);
+        return 0;
     }
-    free_inode(inode_num);
 
-    sync_bitmaps();
-    printf("Removed directory %s\n", path);
+    struct myfs_stat st;
+    if (myfs_stat_ino(fs, inode_num, &st) != 0) {
+        printf("Skipping %s: cannot read inode %u\n", host_path, inode_num);
+        return 0;
+    }
+    if (st.is_dir) {
+        if (plan->queue_count == plan->queue_capacity) {
+            int cap = plan->queue_capacity ? plan->queue_capacity * 2 : 64;
+            uint32_t* inodes = realloc(plan->queue_inodes, cap * sizeof(uint32_t));
+            if (inodes) plan->queue_inodes = inodes;
+            char** paths = realloc(plan->queue_paths, cap * sizeof(char*));
+            if (paths) plan->queue_paths = paths;
+            if (!inodes || !paths) { plan->oom = 1; return 1; }
+            plan->queue_capacity = cap;
+        }
+        char* path = strdup(host_path);
+        if (!path) { plan->oom = 1; return 1; }
+        plan->queue_inodes[plan->queue_count] = inode_num;
+        plan->queue_paths[plan->queue_count++] = path;
+        return 0;
+    }
+
+    if (plan->file_count == plan->file_capacity) {
+        int cap = plan->file_capacity ? plan->file_capacity * 2 : 64;
+        ExportFile* files = realloc(plan->files, cap * sizeof(ExportFile));
+        if (!files) { plan->oom = 1; return 1; }
+        plan->files = files;
+        plan->file_capacity = cap;
+    }
+    char* path = strdup(host_path);
+    if (!path) { plan->oom = 1; return 1; }
+    ExportFile* f = &plan->files[plan->file_count++];
+    memset(f, 0, sizeof(ExportFile));
+    f->host_path = path;
+    f->st = st;
+    return 0;
 }
 
-void do_ln(const char* target_path, const char* link_path) {
-    int target_inode_num = get_path_inode(target_path);
-    if (target_inode_num == -1) { printf("Error: Target does not exist.\n"); return; }
+int export_compare_files(const void* a, const void* b) {
+    const ExportFile* fa = a;
+    const ExportFile* fb = b;
+    int inline_a = fa->st.blocks == 0;
+    int inline_b = fb->st.blocks == 0;
+    if (inline_a != inline_b) return inline_b - inline_a;
+    return (fa->st.first_block > fb->st.first_block) - (fa->st.first_block < fb->st.first_block);
+}
+
+void* export_writer(void* arg) {
+    ExportQueue* q = arg;
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->lock);
+        if (q->count == 0) { pthread_mutex_unlock(&q->lock); return NULL; }
+        ExportFile* f = q->items[q->head];
+        q->head = (q->head + 1) % EXPORT_QUEUE_DEPTH;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+        pthread_mutex_unlock(&q->lock);
+
+        FILE* out = fopen(f->host_path, "wb");
+        int ok = out != NULL;
+        if (ok && f->st.size > 0) ok = fwrite(f->data, f->st.size, 1, out) == 1;
+        if (out && fclose(out) != 0) ok = 0;
+        if (!ok) {
+            pthread_mutex_lock(&q->lock);
+            print_failure("Cannot create host file %s\n", f->host_path);
+            q->failed++;
+            pthread_mutex_unlock(&q->lock);
+        }
+        free(f->data);
+        f->data = NULL;
+    }
+}
 
-    Inode target_inode;
-    read_inode(target_inode_num, &target_inode);
-    if (target_inode.mode == 1) { printf("Error: Hard links to directories not supported.\n"); return; }
+void do_export(const char* vdisk_dir, const char* host_dir) {
+    struct myfs_stat root_st;
+    if (myfs_stat(fs, vdisk_dir, &root_st) != 0) { print_failure("Directory not found.\n"); return; }
+    if (!root_st.is_dir) { print_failure("Not a directory.\n"); return; }
+
+    ExportPlan plan = {0};
+    plan.queue_inodes = malloc(sizeof(uint32_t));
+    plan.queue_paths = malloc(sizeof(char*));
+    char* root_path = strdup(host_dir);
+    if (plan.queue_inodes && plan.queue_paths && root_path) {
+        plan.queue_capacity = 1;
+        plan.queue_inodes[0] = root_st.ino;
+        plan.queue_paths[0] = root_path;
+        plan.queue_count = 1;
+    } else {
+        free(root_path);
+        plan.oom = 1;
+    }
 
-    char dname_path[strlen(link_path) + 1];
-    char bname_path[strlen(link_path) + 1];
-    strcpy(dname_path, link_path);
-    strcpy(bname_path, link_path);
-    char *parent_path = dirname(dname_path);
-    char *child_name = basename(bname_path);
+    // Breadth-first: every directory is queued before anything below it.
+    while (plan.queue_head < plan.queue_count && !plan.oom) {
+        int idx = plan.queue_head++;
+        myfs_dir_t* dir;
+        if (myfs_opendir_ino(fs, plan.queue_inodes[idx], &dir) != 0) continue;
+        plan.current_host_dir = plan.queue_paths[idx];
+        struct myfs_dirent entry;
+        while (myfs_readdir(dir, &entry) == 1 && export_collect(&plan, entry.name, entry.ino) == 0);
+        myfs_closedir(dir);
+    }
+    if (plan.oom) { print_failure("Out of memory while walking %s\n", vdisk_dir); goto out; }
 
-    int parent_inode_num = get_path_inode(parent_path);
-    if (parent_inode_num == -1) { printf("Error: Parent directory for link not found.\n"); return; }
+    int dirs_created = 0;
+    for (int i = 0; i < plan.queue_count; i++) {
+        if (mkdir(plan.queue_paths[i], 0755) != 0 && errno != EEXIST) {
+            print_failure("Cannot create host directory %s\n", plan.queue_paths[i]);
+            goto out;
+        }
+        if (i > 0) dirs_created++;
+    }
 
-    if (find_entry_in_dir(parent_inode_num, child_name) != -1) {
-        printf("Error: Link name '%s' already exists.\n", child_name);
-        return;
+    qsort(plan.files, plan.file_count, sizeof(ExportFile), export_compare_files);
+
+    ExportQueue q = {0};
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.not_empty, NULL);
+    pthread_cond_init(&q.not_full, NULL);
+    pthread_t writers[EXPORT_WRITER_THREADS];
+    for (int t = 0; t < EXPORT_WRITER_THREADS; t++) pthread_create(&writers[t], NULL, export_writer, &q);
+
+    long bytes_copied = 0;
+    int queued = 0, stopped = 0;
+    for (int i = 0; i < plan.file_count; i++) {
+        ExportFile* f = &plan.files[i];
+        f->data = malloc(f->st.size > 0 ? f->st.size : 1);
+        if (!f->data) {
+            print_failure("Out of memory while exporting %s\n", f->host_path);
+            stopped = 1;
+            break;
+        }
+        long n = myfs_pread(fs, f->st.ino, f->data, f->st.size, 0);
+        if (n < 0) {
+            print_error(f->host_path, n);
+            free(f->data);
+            f->data = NULL;
+            continue;
+        }
+        bytes_copied += f->st.size;
+
+        pthread_mutex_lock(&q.lock);
+        while (q.count == EXPORT_QUEUE_DEPTH) pthread_cond_wait(&q.not_full, &q.lock);
+        q.items[(q.head + q.count) % EXPORT_QUEUE_DEPTH] = f;
+        q.count++;
+        pthread_cond_signal(&q.not_empty);
+        pthread_mutex_unlock(&q.lock);
+        queued++;
     }
 
-    add_entry_to_dir(parent_inode_num, child_name, target_inode_num);
-    target_inode.link_count++;
-    write_inode(target_inode_num, &target_inode);
+    pthread_mutex_lock(&q.lock);
+    q.closed = 1;
+    pthread_cond_broadcast(&q.not_empty);
+    pthread_mutex_unlock(&q.lock);
+    for (int t = 0; t < EXPORT_WRITER_THREADS; t++) pthread_join(writers[t], NULL);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.not_empty);
+    pthread_cond_destroy(&q.not_full);
+
+    // Only files handed to the writers count, less those they could not write.
+    int written = queued - q.failed;
+    if (stopped) {
+        print_failure("Export of %s stopped after %d of %d files\n", vdisk_dir, written, plan.file_count);
+    } else {
+        printf("Exported %d directories and %d files (%ld bytes) from %s to %s\n",
+               dirs_created, written, bytes_copied, vdisk_dir, host_dir);
+    }
 
-    printf("Created hard link %s -> %s\n", link_path, target_path);
+out:
+    for (int i = 0; i < plan.queue_count; i++) free(plan.queue_paths[i]);
+    for (int i = 0; i < plan.file_count; i++) {
+        free(plan.files[i].host_path);
+        free(plan.files[i].data);
+    }
+    free(plan.queue_paths);
+    free(plan.queue_inodes);
+    free(plan.files);
 }
 
-void do_df() {
-    int used_inodes = 0;
-    for (int i = 0; i < sb.num_inodes; i++) {
-        if (get_bit(inode_bitmap, i)) used_inodes++;
-    }
+// Tar Streaming
+// tar-in and tar-out stream POSIX ustar archives straight into and out of
+// the image, holding at most one file in memory. "-" means stdin/stdout so
+// both can sit in a pipeline.
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+#define TAR_BATCH_SIZE 64 // entries created between bitmap syncs
 
-    int used_data_blocks = 0;
-    for (int i = 0; i < sb.num_data_blocks; i++) {
-        if (get_bit(data_block_bitmap, i)) used_data_blocks++;
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+_Static_assert(sizeof(TarHeader) == TAR_BLOCK, "ustar header is one 512-byte block");
+
+long tar_parse_octal(const char* field, int len) {
+    long value = 0;
+    for (int i = 0; i < len && field[i] != '\0' && field[i] != ' '; i++) {
+        if (field[i] < '0' || field[i] > '7') return -1;
+        value = value * 8 + (field[i] - '0');
     }
+    return value;
+}
 
-    printf("Disk Usage:\n");
-    printf("  Inodes:      %d used, %d free, %d total\n", used_inodes, sb.num_inodes - used_inodes, sb.num_inodes);
-    printf("  Data Blocks: %d used, %d free, %d total\n", used_data_blocks, sb.num_data_blocks - used_data_blocks, sb.num_data_blocks);
-    printf("  Disk Space:  %ld bytes used, %ld bytes free, %u bytes total\n",
-           (long)used_data_blocks * BLOCK_SIZE,
-           (long)(sb.num_data_blocks - used_data_blocks) * BLOCK_SIZE, sb.total_size);
+unsigned int tar_checksum(const TarHeader* h) {
+    const unsigned char* p = (const unsigned char*)h;
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : p[i]; // chksum field counts as spaces
+    }
+    return sum;
 }
 
-void do_append(const char *path, int n_bytes) {
-    if (n_bytes <= 0) { printf("Error: Must append a positive number of bytes.\n"); return; }
-    int inode_num = get_path_inode(path);
-    if (inode_num == -1) { printf("Error: File not found.\n"); return; }
-
-    Inode inode;
-    read_inode(inode_num, &inode);
-    if (inode.mode != 0) { printf("Error: Not a file.\n"); return; }
-
-    long original_size = inode.size;
-    long new_size = original_size + n_bytes;
-    if (new_size > INODE_DIRECT_POINTERS * BLOCK_SIZE) {
-        printf("Error: Appending would exceed maximum file size.\n");
-        return;
+// Reads and discards 'len' bytes, rounded up to whole tar blocks.
+int tar_skip(FILE* in, long len) {
+    char block[TAR_BLOCK];
+    for (long left = (len + TAR_BLOCK - 1) / TAR_BLOCK; left > 0; left--) {
+        if (fread(block, TAR_BLOCK, 1, in) != 1) return -1;
     }
+    return 0;
+}
 
-    char buffer[BLOCK_SIZE] = {0};
-    long bytes_to_add = n_bytes;
+// Reads 'len' bytes of entry data plus the padding up to the next tar
+// block; 'buffer' must have room for the padded length.
+int tar_read_padded(FILE* in, char* buffer, long len) {
+    long padded = (len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    if (padded > 0 && fread(buffer, padded, 1, in) != 1) return -1;
+    return 0;
+}
 
-    int last_block_idx = (original_size > 0) ? (original_size - 1) / BLOCK_SIZE : -1;
-    if (original_size > 0 && original_size % BLOCK_SIZE != 0) {
-        int last_block_num = inode.direct_blocks[last_block_idx];
-        read_block(sb.data_blocks_start_block + last_block_num, buffer);
+// Walks 'rel_dir' (components separated by '/') below base_inode_num,
+// creating any missing directories, and returns the final inode or -1.
+int tar_resolve_dir(int base_inode_num, const char* rel_dir) {
+    char path_copy[strlen(rel_dir) + 1];
+    strcpy(path_copy, rel_dir);
 
-        int offset = original_size % BLOCK_SIZE;
-        int space_in_block = BLOCK_SIZE - offset;
-        int bytes_to_write = (bytes_to_add < space_in_block) ? (int)bytes_to_add : space_in_block;
+    int current_inode = base_inode_num;
+    char *token, *rest = path_copy;
+    while ((token = strtok_r(rest, "/", &rest))) {
+        if (strcmp(token, ".") == 0) continue;
+        int next_inode = myfs_lookup_at(fs, current_inode, token);
+        if (next_inode == MYFS_ENOENT) {
+            next_inode = myfs_mkdir_at(fs, current_inode, token);
+            if (next_inode < 0) { print_error(token, next_inode); return -1; }
+        } else {
+            struct myfs_stat st;
+            if (next_inode < 0 || myfs_stat_ino(fs, next_inode, &st) != 0 || !st.is_dir) {
+                print_failure("'%s' exists and is not a directory.\n", token);
+                return -1;
+            }
+        }
+        current_inode = next_inode;
+    }
+    return current_inode;
+}
 
-        memset(buffer + offset, 0, bytes_to_write);
-        write_block(sb.data_blocks_start_block + last_block_num, buffer);
-        bytes_to_add -= bytes_to_write;
-        last_block_idx++;
+void do_tar_in(const char* archive_path, const char* vdisk_dir) {
+    // Like import, a missing destination directory is created on the fly.
+    int base_inode_num = myfs_lookup(fs, vdisk_dir);
+    if (base_inode_num < 0) {
+        int start = myfs_lookup(fs, vdisk_dir[0] == '/' ? "/" : ".");
+        base_inode_num = tar_resolve_dir(start, vdisk_dir);
+        if (base_inode_num == -1) { print_failure("Cannot create directory %s\n", vdisk_dir); return; }
     }
+    struct myfs_stat base_st;
+    if (myfs_stat_ino(fs, base_inode_num, &base_st) != 0 || !base_st.is_dir) { print_failure("Not a directory.\n"); return; }
+
+    FILE* in = strcmp(archive_path, "-") == 0 ? stdin : fopen(archive_path, "rb");
+    if (!in) { print_failure("Cannot open host file %s\n", archive_path); return; }
+
+    static char data[MAX_FILE_SIZE + TAR_BLOCK];
+    char long_name[MAX_PATH_LEN + TAR_BLOCK] = {0}; // GNU 'L' records carry the next entry's name
+    int dirs_created = 0, files_created = 0, links_created = 0, failed = 0, pending = 0;
+    long bytes_copied = 0;
+    TarHeader h;
+
+    myfs_batch_begin(fs);
+    while (fread(&h, TAR_BLOCK, 1, in) == 1) {
+        if (h.name[0] == '\0') break; // end-of-archive marker
+        if (tar_parse_octal(h.chksum, sizeof(h.chksum)) != (long)tar_checksum(&h)) {
+            print_failure("Bad tar header checksum, stopping.\n");
+            failed++;
+            break;
+        }
+        long size = tar_parse_octal(h.size, sizeof(h.size));
+        if (size < 0) { print_failure("Bad tar header size, stopping.\n"); failed++; break; }
+
+        char full_name[MAX_PATH_LEN + TAR_BLOCK];
+        if (long_name[0] != '\0') {
+            snprintf(full_name, sizeof(full_name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (h.prefix[0] != '\0' && strncmp(h.magic, "ustar", 5) == 0) {
+            snprintf(full_name, sizeof(full_name), "%.155s/%.100s", h.prefix, h.name);
+        } else {
+            snprintf(full_name, sizeof(full_name), "%.100s", h.name);
+        }
 
-    while (bytes_to_add > 0) {
-        if (last_block_idx >= INODE_DIRECT_POINTERS) break;
+        if (h.typeflag == 'L') {
+            if (size >= MAX_PATH_LEN || tar_read_padded(in, long_name, size) != 0) {
+                print_failure("Bad GNU long name record, stopping.\n");
+                failed++;
+                break;
+            }
+            long_name[size] = '\0';
+            continue;
+        }
 
-        int new_block_num = alloc_data_block();
-        if (new_block_num == -1) {
-            printf("Error: Out of data blocks.\n");
-            break;
+        // Split into parent directory and final component; strip "./" and "/".
+        char* rel = full_name;
+        while (rel[0] == '/' || (rel[0] == '.' && rel[1] == '/')) rel += (rel[0] == '/') ? 1 : 2;
+        size_t len = strlen(rel);
+        while (len > 0 && rel[len - 1] == '/') rel[--len] = '\0';
+        if (len == 0 || strcmp(rel, ".") == 0) { tar_skip(in, size); continue; }
+
+        char* slash = strrchr(rel, '/');
+        const char* child_name = slash ? slash + 1 : rel;
+        if (slash) *slash = '\0';
+        int parent_inode_num = slash ? tar_resolve_dir(base_inode_num, rel) : base_inode_num;
+        if (slash) *slash = '/';
+
+        if (parent_inode_num == -1 || strlen(child_name) > MAX_FILENAME_LEN) {
+            if (parent_inode_num != -1) print_failure("Name too long: %s\n", rel);
+            failed++;
+            if (tar_skip(in, size) != 0) break;
+            continue;
+        }
+
+        if (h.typeflag == '5') {
+            int rc = myfs_mkdir_at(fs, parent_inode_num, child_name);
+            if (rc >= 0) dirs_created++;
+            else if (rc != MYFS_EEXIST) { print_error(rel, rc); failed++; }
+            if (tar_skip(in, size) != 0) break;
+        } else if (h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7') {
+            if (size > MAX_FILE_SIZE) {
+                print_failure("%s is too large for this simple filesystem.\n", rel);
+                failed++;
+                if (tar_skip(in, size) != 0) break;
+                continue;
+            }
+            if (tar_read_padded(in, data, size) != 0) { print_failure("Truncated tar archive.\n"); failed++; break; }
+
+            int rc = myfs_create_at(fs, parent_inode_num, child_name, data, size);
+            if (rc < 0) {
+                print_error(rel, rc);
+                failed++;
+            } else {
+                files_created++;
+                bytes_copied += size;
+            }
+        } else if (h.typeflag == '1') {
+            // Hard link: the target is named relative to the archive root.
+            char target[MAX_PATH_LEN];
+            snprintf(target, sizeof(target), "%.100s", h.linkname);
+            char* target_rel = target;
+            while (target_rel[0] == '/' || (target_rel[0] == '.' && target_rel[1] == '/')) target_rel += (target_rel[0] == '/') ? 1 : 2;
+            char* target_slash = strrchr(target_rel, '/');
+            int target_dir = base_inode_num;
+            if (target_slash) { *target_slash = '\0'; target_dir = tar_resolve_dir(base_inode_num, target_rel); }
+            int target_inode_num = target_dir == -1 ? -1 : myfs_lookup_at(fs, target_dir, target_slash ? target_slash + 1 : target_rel);
+
+            if (target_inode_num < 0 || myfs_link_at(fs, target_inode_num, parent_inode_num, child_name) != 0) {
+                print_failure("Cannot link %s to %.100s\n", rel, h.linkname);
+                failed++;
+            } else {
+                links_created++;
+            }
+            if (tar_skip(in, size) != 0) break;
+        } else {
+            // pax headers, symlinks, devices: nothing in this filesystem to map them to.
+            if (h.typeflag != 'x' && h.typeflag != 'g') printf("Skipping %s: unsupported tar entry type '%c'\n", rel, h.typeflag);
+            if (tar_skip(in, size) != 0) break;
         }
-        inode.direct_blocks[last_block_idx] = new_block_num;
 
-        int bytes_to_write = (bytes_to_add > BLOCK_SIZE) ? BLOCK_SIZE : (int)bytes_to_add;
-        memset(buffer, 0, BLOCK_SIZE);
-        write_block(sb.data_blocks_start_block + new_block_num, buffer);
-        bytes_to_add -= bytes_to_write;
-        last_block_idx++;
+        if (++pending == TAR_BATCH_SIZE) {
+            myfs_batch_end(fs);
+            myfs_batch_begin(fs);
+            pending = 0;
+        }
     }
+    myfs_batch_end(fs);
+    if (in != stdin) fclose(in);
+
+    printf("Extracted %d directories, %d files (%ld bytes) and %d links into %s\n",
+           dirs_created, files_created, bytes_copied, links_created, vdisk_dir);
+    if (failed > 0) {
+        printf("%d entries were not extracted.\n", failed);
+        command_failed = 1;
+    }
+}
 
-    inode.size = new_size - bytes_to_add;
-    inode.modification_time = time(NULL);
-    write_inode(inode_num, &inode);
-    sync_bitmaps();
-    printf("Appended %ld bytes to %s.\n", n_bytes - bytes_to_add, path);
+// Fills in a ustar header for 'rel_path'. Returns -1 if the path cannot be
+// expressed in the 100-byte name plus 155-byte prefix fields.
+int tar_fill_header(TarHeader* h, const char* rel_path, char typeflag, const struct myfs_stat* st, long size, const char* linkname) {
+    memset(h, 0, sizeof(TarHeader));
+    size_t len = strlen(rel_path);
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, rel_path, len);
+    } else {
+        // Split at a '/' so the tail fits in name and the head in prefix.
+        const char* split = rel_path + len - sizeof(h->name) - 1;
+        while (*split && *split != '/') split++;
+        if (*split != '/' || (size_t)(split - rel_path) > sizeof(h->prefix)) return -1;
+        memcpy(h->prefix, rel_path, split - rel_path);
+        memcpy(h->name, split + 1, len - (split - rel_path) - 1);
+    }
+    snprintf(h->mode, sizeof(h->mode), "%07o", st->is_dir ? 0755 : 0644);
+    snprintf(h->uid, sizeof(h->uid), "%07o", 0);
+    snprintf(h->gid, sizeof(h->gid), "%07o", 0);
+    snprintf(h->size, sizeof(h->size), "%011lo", (unsigned long)size);
+    snprintf(h->mtime, sizeof(h->mtime), "%011lo", (unsigned long)st->mtime);
+    h->typeflag = typeflag;
+    if (linkname) snprintf(h->linkname, sizeof(h->linkname), "%s", linkname);
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", tar_checksum(h));
+    h->chksum[7] = ' ';
+    return 0;
 }
 
-void do_truncate(const char *path, int n_bytes) {
-    if (n_bytes <= 0) { printf("Error: Must shorten by a positive number of bytes.\n"); return; }
-    int inode_num = get_path_inode(path);
-    if (inode_num == -1) { printf("Error: File not found.\n"); return; }
+typedef struct {
+    FILE* out;
+    char rel_dir[MAX_PATH_LEN];  // path of the directory being walked, relative to the archive root
+    uint32_t* linked_inodes;     // inodes with link_count > 1 already written, and their first path
+    char** linked_paths;
+    int linked_count, linked_capacity;
+    int dirs, files, links, failed;
+    long bytes;
+    long written;                // archive bytes written so far
+} TarWriter;
+
+int tar_write(TarWriter* w, const void* buf, size_t len) {
+    if (len > 0 && fwrite(buf, len, 1, w->out) != 1) return -1;
+    w->written += len;
+    return 0;
+}
 
-    Inode inode;
-    read_inode(inode_num, &inode);
-    if (inode.mode != 0) { printf("Error: Not a file.\n"); return; }
+int tar_emit_dir(TarWriter* w, uint32_t dir_inode_num);
 
-    long original_size = inode.size;
-    long new_size = (n_bytes >= original_size) ? 0 : original_size - n_bytes;
+int tar_emit_entry(TarWriter* w, const char* name, uint32_t inode_num) {
+    char rel_path[MAX_PATH_LEN];
+    if (snprintf(rel_path, sizeof(rel_path), "%s%s", w->rel_dir, name) >= (int)sizeof(rel_path) - 1) {
+        fprintf(stderr, "Error: Path too long for tar: %s%s\n", w->rel_dir, name);
+        w->failed++;
+        return 0;
+    }
 
-    int last_block_idx_to_keep = (new_size > 0) ? (int)((new_size - 1) / BLOCK_SIZE) : -1;
+    struct myfs_stat st;
+    if (myfs_stat_ino(fs, inode_num, &st) != 0) {
+        fprintf(stderr, "Error: Cannot read %s\n", rel_path);
+        w->failed++;
+        return 0;
+    }
+    TarHeader h;
 
-    for (int i = last_block_idx_to_keep + 1; i < INODE_DIRECT_POINTERS; i++) {
-        if (inode.direct_blocks[i] != UNUSED_BLOCK) {
-            free_data_block(inode.direct_blocks[i]);
-            inode.direct_blocks[i] = UNUSED_BLOCK;
+    if (st.is_dir) {
+        strcat(rel_path, "/");
+        if (tar_fill_header(&h, rel_path, '5', &st, 0, NULL) != 0) {
+            fprintf(stderr, "Error: Path too long for tar: %s\n", rel_path);
+            w->failed++;
+            return 0;
         }
+        if (tar_write(w, &h, TAR_BLOCK) != 0) return -1;
+        w->dirs++;
+
+        // Directory entries come before their contents, as tar expects.
+        size_t saved_len = strlen(w->rel_dir);
+        strcpy(w->rel_dir, rel_path);
+        int rc = tar_emit_dir(w, inode_num);
+        w->rel_dir[saved_len] = '\0';
+        return rc;
     }
 
-    inode.size = new_size;
-    inode.modification_time = time(NULL);
-    write_inode(inode_num, &inode);
-    sync_bitmaps();
+    if (st.nlink > 1) {
+        for (int i = 0; i < w->linked_count; i++) {
+            if (w->linked_inodes[i] != inode_num) continue;
+            if (tar_fill_header(&h, rel_path, '1', &st, 0, w->linked_paths[i]) != 0) {
+                fprintf(stderr, "Error: Path too long for tar: %s\n", rel_path);
+                w->failed++;
+                return 0;
+            }
+            if (tar_write(w, &h, TAR_BLOCK) != 0) return -1;
+            w->links++;
+            return 0;
+        }
+    }
 
-    if (new_size == 0 && original_size > 0) {
-        printf("Truncated %s to 0 bytes.\n", path);
-    } else {
-        printf("Shortened %s to %ld bytes.\n", path, new_size);
+    if (tar_fill_header(&h, rel_path, '0', &st, st.size, NULL) != 0) {
+        fprintf(stderr, "Error: Path too long for tar: %s\n", rel_path);
+        w->failed++;
+        return 0;
+    }
+    static char data[MAX_FILE_SIZE + TAR_BLOCK];
+    if (myfs_pread(fs, inode_num, data, st.size, 0) != (long)st.size) {
+        fprintf(stderr, "Error: Cannot read %s\n", rel_path);
+        w->failed++;
+        return 0;
+    }
+    long padded = (st.size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    memset(data + st.size, 0, padded - st.size);
+    if (tar_write(w, &h, TAR_BLOCK) != 0 || tar_write(w, data, padded) != 0) return -1;
+    w->files++;
+    w->bytes += st.size;
+
+    if (st.nlink > 1 && strlen(rel_path) <= sizeof(h.linkname)) {
+        if (w->linked_count == w->linked_capacity) {
+            int cap = w->linked_capacity ? w->linked_capacity * 2 : 16;
+            uint32_t* inodes = realloc(w->linked_inodes, cap * sizeof(uint32_t));
+            if (inodes) w->linked_inodes = inodes;
+            char** paths = realloc(w->linked_paths, cap * sizeof(char*));
+            if (paths) w->linked_paths = paths;
+            if (!inodes || !paths) return 0; // later links are stored as copies
+            w->linked_capacity = cap;
+        }
+        w->linked_inodes[w->linked_count] = inode_num;
+        w->linked_paths[w->linked_count++] = strdup(rel_path);
     }
+    return 0;
 }
 
-int find_name_for_inode(int parent_inode_num, int child_inode_num, char* name_buffer) {
-    Inode parent_inode;
-    read_inode(parent_inode_num, &parent_inode);
-    if (parent_inode.mode != 1) return -1;
+// Emits every entry of a directory; returns -1 once the archive cannot be written.
+int tar_emit_dir(TarWriter* w, uint32_t dir_inode_num) {
+    myfs_dir_t* dir;
+    if (myfs_opendir_ino(fs, dir_inode_num, &dir) != 0) {
+        fprintf(stderr, "Error: Cannot read directory %s\n", w->rel_dir);
+        w->failed++;
+        return 0;
+    }
+    struct myfs_dirent entry;
+    int rc = 0;
+    while (rc == 0 && myfs_readdir(dir, &entry) == 1) rc = tar_emit_entry(w, entry.name, entry.ino);
+    myfs_closedir(dir);
+    return rc;
+}
 
-    int total_entries = parent_inode.size / sizeof(DirectoryEntry);
-    int entries_found = 0;
-    char block_buffer[BLOCK_SIZE];
+void do_tar_out(const char* vdisk_dir, const char* archive_path) {
+    int to_stdout = strcmp(archive_path, "-") == 0;
+    FILE* status = to_stdout ? stderr : stdout; // keep the archive stream clean
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; i++) {
-        if (parent_inode.direct_blocks[i] == UNUSED_BLOCK || entries_found >= total_entries)
-            break;
+    struct myfs_stat root_st;
+    if (myfs_stat(fs, vdisk_dir, &root_st) != 0) { fprintf(status, "Error: Directory not found.\n"); return; }
+    if (!root_st.is_dir) { fprintf(status, "Error: Not a directory.\n"); return; }
 
-        read_block(sb.data_blocks_start_block + parent_inode.direct_blocks[i], block_buffer);
-        int entries_in_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        DirectoryEntry* de = (DirectoryEntry*)block_buffer;
-        for (int j = 0; j < entries_in_block; j++) {
-            if (entries_found >= total_entries) break;
-            if (de[j].name[0] != '\0') {
-                 entries_found++;
-                if (de[j].inode_number == child_inode_num &&
-                    strcmp(de[j].name, ".") != 0 && strcmp(de[j].name, "..") != 0) {
-                    strcpy(name_buffer, de[j].name);
-                    return 0;
-                }
-            }
-        }
-    }
-    return -1;
+    TarWriter w = {0};
+    w.out = to_stdout ? stdout : fopen(archive_path, "wb");
+    if (!w.out) { fprintf(status, "Error: Cannot create host file %s\n", archive_path); return; }
+    setvbuf(w.out, NULL, _IOFBF, 1 << 20);
+
+    int rc = tar_emit_dir(&w, root_st.ino);
+
+    // Two zero blocks end the archive; pad to a whole 10 KiB record.
+    char zeros[TAR_RECORD] = {0};
+    if (rc == 0) rc = tar_write(&w, zeros, 2 * TAR_BLOCK);
+    if (rc == 0 && w.written % TAR_RECORD != 0) rc = tar_write(&w, zeros, TAR_RECORD - w.written % TAR_RECORD);
+    if (fflush(w.out) != 0) rc = -1;
+    if (!to_stdout) fclose(w.out);
+
+    for (int i = 0; i < w.linked_count; i++) free(w.linked_paths[i]);
+    free(w.linked_paths);
+    free(w.linked_inodes);
+
+    if (rc != 0) { fprintf(status, "Error: Writing %s failed.\n", archive_path); return; }
+    fprintf(status, "Archived %d directories, %d files (%ld bytes) and %d links from %s\n",
+            w.dirs, w.files, w.bytes, w.links, vdisk_dir);
 }
 
-void do_pwd() {
-    if (current_working_directory_inode == ROOT_INODE_NUM) {
-        printf("/\n");
-        return;
+// Counters of every handle the shell has mounted, since the last reset.
+void io_totals(struct myfs_io_stats* out) {
+    struct myfs_io_stats io;
+    *out = retired_io;
+    uint64_t* to = (uint64_t*)out;
+    for (int i = 0; i < mount_count; i++) {
+        myfs_io_stats(mounts[i].fs, &io);
+        const uint64_t* from = (const uint64_t*)&io;
+        for (size_t k = 0; k < sizeof(io) / sizeof(uint64_t); k++) to[k] += from[k];
     }
+    const uint64_t* base = (const uint64_t*)&io_baseline;
+    for (size_t k = 0; k < sizeof(io) / sizeof(uint64_t); k++) to[k] -= base[k];
+}
 
-    char components[MAX_PATH_DEPTH][MAX_FILENAME_LEN + 1];
-    int depth = 0;
-    int current_inode = current_working_directory_inode;
-
-    while (current_inode != ROOT_INODE_NUM) {
-        int parent_inode = find_entry_in_dir(current_inode, "..");
-        if (depth >= MAX_PATH_DEPTH) {
-            printf("/<path too deep>\n");
-            return;
-        }
+uint64_t sum_kinds(const uint64_t* counts) {
+    uint64_t total = 0;
+    for (int k = 0; k < MYFS_IO_KINDS; k++) total += counts[k];
+    return total;
+}
 
-        if (find_name_for_inode(parent_inode, current_inode, components[depth]) != 0) {
-            printf("/<error: fs inconsistent>\n");
-            return;
-        }
-        depth++;
-        if (parent_inode == current_inode) break;
-        current_inode = parent_inode;
+void record_command(const char* name, uint64_t ns, const struct myfs_io_stats* before, const struct myfs_io_stats* after) {
+    CommandStats* c = NULL;
+    for (int i = 0; i < command_stats_count && !c; i++) {
+        if (strcmp(command_stats[i].name, name) == 0) c = &command_stats[i];
+    }
+    if (!c) {
+        if (command_stats_count == MAX_COMMAND_STATS) return;
+        c = &command_stats[command_stats_count++];
+        snprintf(c->name, sizeof(c->name), "%s", name);
+        myfs_hist_reset(&c->latency);
     }
+    myfs_hist_record(&c->latency, ns);
+    c->blocks_read += sum_kinds(after->reads) - sum_kinds(before->reads);
+    c->blocks_written += sum_kinds(after->writes) - sum_kinds(before->writes);
+    c->cache_hits += sum_kinds(after->cache_hits) - sum_kinds(before->cache_hits);
+}
 
-    printf("/");
-    for (int i = depth - 1; i >= 0; i--) {
-        printf("%s", components[i]);
-        if (i > 0) printf("/");
+// Writes a command to the trace with its start time in microseconds. The
+// source of cp-to becomes @size, so the trace replays without the host file.
+void trace_command(const char* line, const struct timespec* start) {
+    char cmd[16] = {0}, src[512] = {0}, dst[512] = {0};
+    long us = (start->tv_sec - trace_start.tv_sec) * 1000000L + (start->tv_nsec - trace_start.tv_nsec) / 1000;
+    struct stat st;
+    sscanf(line, "%15s %511s %511s", cmd, src, dst);
+    if (strcmp(cmd, "cp-to") == 0 && stat(src, &st) == 0) {
+        fprintf(trace_file, "%ld cp-to @%ld %s\n", us, (long)st.st_size, dst);
+    } else {
+        fprintf(trace_file, "%ld %.*s\n", us, (int)strcspn(line, "\r\n"), line);
     }
-    printf("\n");
 }
 
-void do_cd(const char *path) {
-    if (path[0] == '\0') {
+double to_us(uint64_t ns) { return ns / 1000.0; }
+
+void do_stats(const char* arg) {
+    struct myfs_io_stats io;
+    if (strcmp(arg, "reset") == 0) {
+        memset(&io_baseline, 0, sizeof(io_baseline));
+        io_totals(&io_baseline);
+        command_stats_count = 0;
+        printf("Statistics reset.\n");
         return;
     }
 
-    int target_inode_num = get_path_inode(path);
-    if (target_inode_num == -1) {
-        printf("cd: no such file or directory: %s\n", path);
-        return;
+    io_totals(&io);
+    printf("Kind\t\tReads\tWrites\tCache hits\n");
+    printf("----\t\t-----\t------\t----------\n");
+    for (int k = 0; k < MYFS_IO_KINDS; k++) {
+        printf("%-12s\t%llu\t%llu\t%llu\n", io_kind_names[k], (unsigned long long)io.reads[k],
+               (unsigned long long)io.writes[k], (unsigned long long)io.cache_hits[k]);
+    }
+    printf("Bytes read: %llu, written: %llu\n", (unsigned long long)io.bytes_read, (unsigned long long)io.bytes_written);
+    printf("Inodes read: %llu, written: %llu, allocated: %llu, freed: %llu\n", (unsigned long long)io.inode_reads,
+           (unsigned long long)io.inode_writes, (unsigned long long)io.inodes_allocated, (unsigned long long)io.inodes_freed);
+    printf("Blocks allocated: %llu, freed: %llu, allocation retries: %llu, bitmap write-backs: %llu\n",
+           (unsigned long long)io.blocks_allocated, (unsigned long long)io.blocks_freed,
+           (unsigned long long)io.alloc_retries, (unsigned long long)io.bitmap_writebacks);
+    if (io.dedup_lookups || io.cow_copies) {
+        printf("Dedup lookups: %llu, hits: %llu, %.0f ns per block; copy-on-write copies: %llu\n",
+               (unsigned long long)io.dedup_lookups, (unsigned long long)io.dedup_hits,
+               io.dedup_lookups ? (double)io.dedup_ns / io.dedup_lookups : 0.0, (unsigned long long)io.cow_copies);
+    }
+    if (io.checksums_verified) {
+        printf("Checksums verified: %llu, mismatches: %llu\n", (unsigned long long)io.checksums_verified,
+               (unsigned long long)io.checksum_failures);
     }
 
-    Inode target_inode;
-    read_inode(target_inode_num, &target_inode);
-    if (target_inode.mode != 1) {
-        printf("cd: not a directory: %s\n", path);
-        return;
+    printf("\nCommand\t\tCount\tMean us\tp50 us\tp90 us\tp99 us\tMax us\tReads/op\tWrites/op\n");
+    printf("-------\t\t-----\t-------\t------\t------\t------\t------\t--------\t---------\n");
+    for (int i = 0; i < command_stats_count; i++) {
+        const CommandStats* c = &command_stats[i];
+        const myfs_hist_t* h = &c->latency;
+        printf("%-12s\t%llu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t\t%.1f\n", c->name, (unsigned long long)h->count,
+               myfs_hist_mean(h) / 1000.0, to_us(myfs_hist_percentile(h, 50)), to_us(myfs_hist_percentile(h, 90)),
+               to_us(myfs_hist_percentile(h, 99)), to_us(h->max),
+               (double)c->blocks_read / h->count, (double)c->blocks_written / h->count);
     }
-    current_working_directory_inode = target_inode_num;
 }
 
-// FIXED: Corrected initialization of root directory entries
-void do_mkfs(const char *disk_path, long size_bytes) {
-    FILE* temp_disk = fopen(disk_path, "w+b");
-    if (!temp_disk) { perror("Error creating virtual disk file"); exit(1); }
-
-    if (ftruncate(fileno(temp_disk), size_bytes) != 0) {
-        perror("Error setting disk size");
-        fclose(temp_disk);
-        exit(1);
+void do_fsck(const char* arg) {
+    int repair = strcmp(arg, "repair") == 0;
+    if (arg[0] != '\0' && !repair) { print_usage("fsck [repair]\n"); return; }
+
+    struct myfs_fsck_report r;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = myfs_fsck(fs, repair ? MYFS_FSCK_REPAIR : 0, 0, &r);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rc < 0) { print_error("fsck", rc); return; }
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Checked %u inodes, %u directories and %u data blocks on %d thread%s in %.1f ms\n", r.inodes,
+           r.directories, r.blocks, r.threads, r.threads == 1 ? "" : "s", ms);
+    if (rc == 0) { printf("No problems found.\n"); return; }
+    const struct { const char* what; uint32_t count; } problems[] = {
+        { "Bad directory entries", r.bad_entries },
+        { "Bad block pointers", r.bad_blocks },
+        { "Wrong sizes, entry counts or parents", r.bad_inodes },
+        { "Wrong link counts", r.link_counts },
+        { "Wrong inode bitmap bits", r.inode_bitmap },
+        { "  of which unreachable inodes", r.orphans },
+        { "Wrong data bitmap bits", r.block_bitmap },
+        { "Wrong block reference counts", r.ref_counts },
+    };
+    for (size_t i = 0; i < sizeof(problems) / sizeof(problems[0]); i++) {
+        if (problems[i].count) printf("  %-38s %u\n", problems[i].what, problems[i].count);
     }
+    if (repair) printf("Repaired %u problems.\n", r.repaired);
+    else printf("%d problems; run 'fsck repair' to fix them.\n", rc);
+}
 
-    int num_inode_blocks = (MAX_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int num_total_blocks = size_bytes / BLOCK_SIZE;
+void do_defrag(const char* arg) {
+    const char* path = arg[0] != '\0' ? arg : "/";
+    struct myfs_defrag_report r;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = myfs_defrag(fs, path, &r);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rc < 0) { print_error(path, rc); return; }
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("Defragmented %s: %u files and %u directories in %.1f ms\n", path, r.files, r.directories, ms);
+    printf("  %-22s %8s %8s\n", "", "before", "after");
+    printf("  %-22s %8u %8u\n", "Fragmented files", r.fragmented_before, r.fragmented_after);
+    printf("  %-22s %8u %8u\n", "File extents", r.extents_before, r.extents_after);
+    printf("  %-22s %8u %8u\n", "Free extents", r.free_extents_before, r.free_extents_after);
+    printf("  %-22s %8u %8u\n", "Largest free run", r.largest_free_before, r.largest_free_after);
+    printf("Moved %u blocks; packed %u directory slots, freed %u directory blocks, moved %u directories inline.\n",
+           r.blocks_moved, r.dir_holes, r.dir_blocks_freed, r.dirs_inlined);
+    if (r.skipped) printf("Skipped %u fragmented files: shared blocks, or no free run long enough.\n", r.skipped);
+}
 
-    Superblock temp_sb;
-    temp_sb.total_size = size_bytes;
-    temp_sb.num_inodes = MAX_INODES;
-    temp_sb.inode_bitmap_block = INODE_BITMAP_BLOCK;
-    temp_sb.data_bitmap_block = DATA_BITMAP_BLOCK;
-    temp_sb.inode_table_start_block = INODE_TABLE_START_BLOCK;
-    temp_sb.data_blocks_start_block = temp_sb.inode_table_start_block + num_inode_blocks;
-    temp_sb.num_data_blocks = num_total_blocks - temp_sb.data_blocks_start_block;
-    if (temp_sb.num_data_blocks > MAX_DATA_BLOCKS) temp_sb.num_data_blocks = MAX_DATA_BLOCKS;
+void do_compression(const char* arg) {
+    if (arg[0] != '\0') {
+        int codec;
+        if (strcmp(arg, "on") == 0) codec = MYFS_COMPRESS_LZ;
+        else if (strcmp(arg, "off") == 0) codec = MYFS_COMPRESS_NONE;
+        else { print_usage("compression [on|off]\n"); return; }
+        int rc = myfs_set_compression(fs, codec);
+        if (rc != 0) { print_error("compression", rc); return; }
+    }
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    printf("Compression of new files: %s\n", sfs.compression == MYFS_COMPRESS_NONE ? "off" : "on (lz)");
+}
 
-    char buffer[BLOCK_SIZE] = {0};
+void do_dedup(const char* arg) {
+    if (arg[0] != '\0') {
+        if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) { print_usage("dedup [on|off]\n"); return; }
+        int rc = myfs_set_dedup(fs, strcmp(arg, "on") == 0);
+        if (rc != 0) { print_error("dedup", rc); return; }
+    }
+    struct myfs_statfs sfs;
+    struct myfs_io_stats io;
+    myfs_statfs(fs, &sfs);
+    myfs_io_stats(fs, &io);
+    printf("Deduplication of new files: %s\n", sfs.dedup ? "on" : "off");
+    printf("Blocks saved by sharing: %u (%llu bytes)\n", sfs.saved_blocks,
+           (unsigned long long)sfs.saved_blocks * sfs.block_size);
+    if (io.dedup_lookups) {
+        printf("This mount: %llu blocks looked up, %llu shared, %.0f ns per block\n",
+               (unsigned long long)io.dedup_lookups, (unsigned long long)io.dedup_hits,
+               (double)io.dedup_ns / io.dedup_lookups);
+    }
+}
 
-    memcpy(buffer, &temp_sb, sizeof(Superblock));
-    fseek(temp_disk, SUPERBLOCK_BLOCK * BLOCK_SIZE, SEEK_SET);
-    fwrite(buffer, BLOCK_SIZE, 1, temp_disk);
+void do_checksums(const char* arg) {
+    if (arg[0] != '\0') {
+        if (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) { print_usage("checksums [on|off]\n"); return; }
+        int rc = myfs_set_checksums(fs, strcmp(arg, "on") == 0);
+        if (rc != 0) { print_error("checksums", rc); return; }
+    }
+    struct myfs_statfs sfs;
+    struct myfs_io_stats io;
+    myfs_statfs(fs, &sfs);
+    myfs_io_stats(fs, &io);
+    printf("Block checksums (CRC32C): %s\n", sfs.checksums ? "on" : "off");
+    if (io.checksums_verified) {
+        printf("This mount: %llu blocks verified, %llu mismatches\n", (unsigned long long)io.checksums_verified,
+               (unsigned long long)io.checksum_failures);
+    }
+}
 
-    unsigned char local_inode_bitmap[MAX_INODES / 8] = {0};
-    unsigned char local_data_block_bitmap[MAX_DATA_BLOCKS / 8] = {0};
+void do_scrub(const char* arg) {
+    struct myfs_scrub_report r;
+    int rc = myfs_scrub(fs, atoi(arg), &r);
+    if (rc == MYFS_EINVAL) { print_failure("The image has no checksums; turn them on with 'checksums on'.\n"); return; }
+    if (rc < 0) { print_error("scrub", rc); return; }
+
+    double ms = r.ns / 1e6;
+    printf("Scrubbed %u blocks (%.1f MiB) on %d thread%s in %.1f ms, %.0f MiB/s\n", r.blocks, r.bytes / 1048576.0,
+           r.threads, r.threads == 1 ? "" : "s", ms, ms > 0 ? r.bytes / 1048576.0 / (ms / 1e3) : 0.0);
+    if (rc == 0) { printf("Every block matches its checksum.\n"); return; }
+    printf("%u corrupt blocks, %u of them metadata:\n", r.bad, r.bad_metadata);
+    for (uint32_t i = 0; i < r.listed; i++) printf("  block %u (%s)\n", r.bad_blocks[i].block, io_kind_names[r.bad_blocks[i].kind]);
+    if (r.bad > r.listed) printf("  ... and %u more\n", r.bad - r.listed);
+}
 
-    set_bit(local_inode_bitmap, ROOT_INODE_NUM);
-    set_bit(local_data_block_bitmap, 0);
+void do_compress(const char* path, const char* arg) {
+    if (arg[0] != '\0' && strcmp(arg, "off") != 0) { print_usage("compress <path> [off]\n"); return; }
+    struct myfs_stat st;
+    int rc = myfs_stat(fs, path, &st);
+    if (rc != 0) { print_error(path, rc); return; }
+    uint32_t before = st.blocks;
+    rc = myfs_compress(fs, st.ino, arg[0] != '\0' ? MYFS_COMPRESS_NONE : MYFS_COMPRESS_LZ);
+    if (rc < 0) { print_error(path, rc); return; }
+    printf("%s %s: %u blocks -> %d blocks for %u bytes.\n", arg[0] != '\0' ? "Expanded" : "Compressed", path,
+           before, rc, st.size);
+}
 
-    fseek(temp_disk, temp_sb.inode_bitmap_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(local_inode_bitmap, sizeof(local_inode_bitmap), 1, temp_disk);
+void write_counts_json(FILE* out, const char* key, const uint64_t* counts) {
+    fprintf(out, "\"%s\": {", key);
+    for (int k = 0; k < MYFS_IO_KINDS; k++) {
+        fprintf(out, "%s\"%s\": %llu", k ? ", " : "", io_kind_names[k], (unsigned long long)counts[k]);
+    }
+    fprintf(out, "}");
+}
 
-    fseek(temp_disk, temp_sb.data_bitmap_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(local_data_block_bitmap, sizeof(local_data_block_bitmap), 1, temp_disk);
+// The same numbers as 'stats', as one JSON object, for --stats-json.
+void write_stats_json(FILE* out) {
+    struct myfs_io_stats io;
+    io_totals(&io);
+    fprintf(out, "{\"io\": {");
+    write_counts_json(out, "reads", io.reads);
+    fprintf(out, ", ");
+    write_counts_json(out, "writes", io.writes);
+    fprintf(out, ", ");
+    write_counts_json(out, "cache_hits", io.cache_hits);
+    fprintf(out, ", \"bytes_read\": %llu, \"bytes_written\": %llu, \"inode_reads\": %llu, \"inode_writes\": %llu, "
+                 "\"inodes_allocated\": %llu, \"inodes_freed\": %llu, \"blocks_allocated\": %llu, "
+                 "\"blocks_freed\": %llu, \"alloc_retries\": %llu, \"bitmap_writebacks\": %llu, "
+                 "\"dedup_lookups\": %llu, \"dedup_hits\": %llu, \"dedup_ns\": %llu, \"cow_copies\": %llu, "
+                 "\"checksums_verified\": %llu, \"checksum_failures\": %llu}",
+            (unsigned long long)io.bytes_read, (unsigned long long)io.bytes_written,
+            (unsigned long long)io.inode_reads, (unsigned long long)io.inode_writes,
+            (unsigned long long)io.inodes_allocated, (unsigned long long)io.inodes_freed,
+            (unsigned long long)io.blocks_allocated, (unsigned long long)io.blocks_freed,
+            (unsigned long long)io.alloc_retries, (unsigned long long)io.bitmap_writebacks,
+            (unsigned long long)io.dedup_lookups, (unsigned long long)io.dedup_hits,
+            (unsigned long long)io.dedup_ns, (unsigned long long)io.cow_copies,
+            (unsigned long long)io.checksums_verified, (unsigned long long)io.checksum_failures);
+
+    fprintf(out, ", \"commands\": {");
+    for (int i = 0; i < command_stats_count; i++) {
+        const CommandStats* c = &command_stats[i];
+        const myfs_hist_t* h = &c->latency;
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"min_us\": %.1f, \"p50_us\": %.1f, "
+                     "\"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+                     "\"blocks_read\": %llu, \"blocks_written\": %llu, \"cache_hits\": %llu}",
+                i ? ", " : "", c->name, (unsigned long long)h->count, myfs_hist_mean(h) / 1000.0, to_us(h->min),
+                to_us(myfs_hist_percentile(h, 50)), to_us(myfs_hist_percentile(h, 90)),
+                to_us(myfs_hist_percentile(h, 99)), to_us(myfs_hist_percentile(h, 99.9)), to_us(h->max),
+                (unsigned long long)c->blocks_read, (unsigned long long)c->blocks_written,
+                (unsigned long long)c->cache_hits);
+    }
+    fprintf(out, "}}\n");
+}
 
-    Inode root_inode;
-    root_inode.mode = 1;
-    root_inode.size = 2 * sizeof(DirectoryEntry);
-    root_inode.link_count = 2;
-    root_inode.creation_time = root_inode.modification_time = time(NULL);
-    for(int i = 0; i < INODE_DIRECT_POINTERS; i++)
-        root_inode.direct_blocks[i] = UNUSED_BLOCK;
-    root_inode.direct_blocks[0] = 0;
+// Returns 1 to leave the shell, 0 otherwise, and -1 for an unknown command.
+int execute_command(const char* line) {
+    if (line[0] == '\n' || line[0] == '#' || line[0] == '\r') return 0;
 
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(buffer, &root_inode, sizeof(Inode));
-    fseek(temp_disk, temp_sb.inode_table_start_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(buffer, BLOCK_SIZE, 1, temp_disk);
+    char cmd[16] = {0}, arg1[512] = {0}, arg2[512] = {0}, arg3[512] = {0};
+    sscanf(line, "%15s %511s %511s %511s", cmd, arg1, arg2, arg3);
+    if (strlen(cmd) == 0) return 0;
 
-    DirectoryEntry entries[2];
-    strcpy(entries[0].name, ".");
-    entries[0].inode_number = ROOT_INODE_NUM;
-    strcpy(entries[1].name, "..");
-    entries[1].inode_number = ROOT_INODE_NUM;
+    if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
+        return 1;
+    } else if (strcmp(cmd, "cd") == 0) {
+        if (arg1[0] == '\0') do_cd("/"); else do_cd(arg1);
+    } else if (strcmp(cmd, "pwd") == 0) {
+        do_pwd();
+    } else if (strcmp(cmd, "ls") == 0) {
+        if (arg1[0] == '\0') do_ls("."); else do_ls(arg1);
+    } else if (strcmp(cmd, "mkdir") == 0) {
+        if (arg1[0] == '\0') { print_usage("mkdir <path>\n"); return 0; }
+        do_mkdir(arg1);
+    } else if (strcmp(cmd, "cp-to") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("cp-to <host_path> <vdisk_path>\n"); return 0; }
+        do_cp_to_vdisk(arg1, arg2);
+    } else if (strcmp(cmd, "cp-from") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("cp-from <vdisk_path> <host_path>\n"); return 0; }
+        do_cp_from_vdisk(arg1, arg2);
+    } else if (strcmp(cmd, "rm") == 0) {
+        if (arg1[0] == '\0') { print_usage("rm <path>\n"); return 0; }
+        do_rm(arg1);
+    } else if (strcmp(cmd, "rmdir") == 0) {
+        if (arg1[0] == '\0') { print_usage("rmdir <path>\n"); return 0; }
+        do_rmdir(arg1);
+    } else if (strcmp(cmd, "ln") == 0) {
+         if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("ln <target_path> <link_path>\n"); return 0; }
+        do_ln(arg1, arg2);
+    } else if (strcmp(cmd, "clone") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("clone <src_path> <dst_path>\n"); return 0; }
+        do_clone(arg1, arg2);
+    } else if (strcmp(cmd, "df") == 0) {
+        do_df(arg1);
+    } else if (strcmp(cmd, "frag") == 0) {
+        print_layout();
+    } else if (strcmp(cmd, "append") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("append <path> <bytes>\n"); return 0; }
+        do_append(arg1, atoi(arg2));
+    } else if (strcmp(cmd, "truncate") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("truncate <path> <bytes>\n"); return 0; }
+        do_truncate(arg1, atoi(arg2));
+    } else if (strcmp(cmd, "read") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0' || arg3[0] == '\0') { print_usage("read <path> <offset> <len>\n"); return 0; }
+        do_read(arg1, atol(arg2), atol(arg3));
+    } else if (strcmp(cmd, "write") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0' || arg3[0] == '\0') { print_usage("write <path> <offset> <host_src|->\n"); return 0; }
+        do_write(arg1, atol(arg2), arg3);
+    } else if (strcmp(cmd, "import") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("import <host_dir> <vdisk_dir>\n"); return 0; }
+        do_import(arg1, arg2);
+    } else if (strcmp(cmd, "export") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("export <vdisk_dir> <host_dir>\n"); return 0; }
+        do_export(arg1, arg2);
+    } else if (strcmp(cmd, "tar-in") == 0) {
+        if (arg1[0] == '\0') { print_usage("tar-in <host.tar|-> [vdisk_dir]\n"); return 0; }
+        do_tar_in(arg1, arg2[0] == '\0' ? "." : arg2);
+    } else if (strcmp(cmd, "tar-out") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("tar-out <vdisk_dir> <host.tar|->\n"); return 0; }
+        do_tar_out(arg1, arg2);
+    } else if (strcmp(cmd, "cp") == 0) {
+        if (arg1[0] == '\0' || arg2[0] == '\0') { print_usage("cp <[mount:]src> <[mount:]dst>\n"); return 0; }
+        do_cp(arg1, arg2);
+    } else if (strcmp(cmd, "mount") == 0) {
+        if (arg1[0] == '\0') { print_usage("mount <image> [name]\n"); return 0; }
+        do_mount(arg1, arg2);
+    } else if (strcmp(cmd, "umount") == 0) {
+        if (arg1[0] == '\0') { print_usage("umount <name>\n"); return 0; }
+        do_umount(arg1);
+    } else if (strcmp(cmd, "use") == 0) {
+        if (arg1[0] == '\0') { print_usage("use <name>\n"); return 0; }
+        do_use(arg1);
+    } else if (strcmp(cmd, "mounts") == 0) {
+        do_mounts();
+    } else if (strcmp(cmd, "stats") == 0) {
+        do_stats(arg1);
+    } else if (strcmp(cmd, "fsck") == 0) {
+        do_fsck(arg1);
+    } else if (strcmp(cmd, "defrag") == 0) {
+        do_defrag(arg1);
+    } else if (strcmp(cmd, "compression") == 0) {
+        do_compression(arg1);
+    } else if (strcmp(cmd, "dedup") == 0) {
+        do_dedup(arg1);
+    } else if (strcmp(cmd, "checksums") == 0) {
+        do_checksums(arg1);
+    } else if (strcmp(cmd, "scrub") == 0) {
+        do_scrub(arg1);
+    } else if (strcmp(cmd, "compress") == 0) {
+        if (arg1[0] == '\0') { print_usage("compress <path> [off]\n"); return 0; }
+        do_compress(arg1, arg2);
+    } else if (strcmp(cmd, "help") == 0) {
+        printf("Available commands:\n");
+        printf("  ls [path]                - List directory contents (default: current dir)\n");
+        printf("  cd [path]                - Change current directory (.. is supported)\n");
+        printf("  pwd                      - Print current directory path\n");
+        printf("  mkdir <path>             - Create a directory\n");
+        printf("  rmdir <path>             - Remove an empty directory\n");
+        printf("  cp-to <host> <vdisk>     - Copy file from host to virtual disk\n");
+        printf("  cp-from <vdisk> <host>   - Copy file from virtual disk to host\n");
+        printf("  import <host> <vdisk>    - Recursively copy a host directory tree into the virtual disk\n");
+        printf("  export <vdisk> <host>    - Recursively copy a virtual disk directory tree to the host\n");
+        printf("  tar-in <tar|-> [vdisk]   - Extract a ustar archive (or stdin) into a directory\n");
+        printf("  tar-out <vdisk> <tar|->  - Write a directory tree as a ustar archive (or to stdout)\n");
+        printf("  cp <src> <dst>           - Copy a file or tree; prefix a path with mount: for another image\n");
+        printf("  mount <image> [name]     - Mount another image (default name: file name without extension)\n");
+        printf("  umount <name>            - Unmount an image\n");
+        printf("  use <name>               - Switch the image commands work on\n");
+        printf("  mounts                   - List mounted images and block cache usage\n");
+        printf("  rm <path>                - Remove a file or link\n");
+        printf("  ln <target> <link_name>  - Create a hard link\n");
+        printf("  clone <src> <dst>        - Copy a file instantly; the copies share blocks until written\n");
+        printf("  append <path> <bytes>    - Add N null bytes to a file\n");
+        printf("  truncate <path> <bytes>  - Shorten a file by N bytes (or to 0)\n");
+        printf("  read <path> <off> <len>  - Print len bytes of a file starting at off\n");
+        printf("  write <path> <off> <src> - Overwrite a file at off with a host file (or stdin)\n");
+        printf("  df [-v]                  - Display disk usage information (-v: with the frag report)\n");
+        printf("  frag                     - Report free-space runs, file extents and directory holes\n");
+        printf("  stats [reset]            - Show block I/O counters and per-command latency\n");
+        printf("  fsck [repair]            - Check the image's consistency, and fix it with 'repair'\n");
+        printf("  defrag [path]            - Make files contiguous and pack directories under path\n");
+        printf("  compression [on|off]     - Show or set whether new files are stored compressed\n");
+        printf("  compress <path> [off]    - Compress a file's data now, or store it plain again with 'off'\n");
+        printf("  dedup [on|off]           - Show or set whether new files share blocks with identical ones\n");
+        printf("  checksums [on|off]       - Show or set whether blocks are checksummed and verified on read\n");
+        printf("  scrub [threads]          - Verify every block of the image against its checksum\n");
+        printf("  exit/quit                - Exit the program\n");
+    } else {
+        printf("Unknown command: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
 
-    memset(buffer, 0, BLOCK_SIZE);
-    memcpy(buffer, entries, 2 * sizeof(DirectoryEntry));
-    fseek(temp_disk, (temp_sb.data_blocks_start_block) * BLOCK_SIZE, SEEK_SET);
-    fwrite(buffer, BLOCK_SIZE, 1, temp_disk);
+// Runs one command line, timing it and recording its I/O. Returns 1 when
+// the shell should exit.
+int run_command(const char* line) {
+    char cmd[16] = {0};
+    if (sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#') return 0;
+
+    struct myfs_io_stats before, after;
+    struct timespec start, end;
+    io_totals(&before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = execute_command(line);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rc < 0) command_failed = 1;
+    if (rc == 0 && strcmp(cmd, "stats") != 0 && strcmp(cmd, "help") != 0) {
+        io_totals(&after);
+        uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + (end.tv_nsec - start.tv_nsec);
+        record_command(cmd, ns, &before, &after);
+        if (trace_file) trace_command(line, &start);
+    }
+    return rc == 1;
+}
 
-    fclose(temp_disk);
-    if(isatty(fileno(stdout))) {
-        printf("Virtual disk created successfully: %s (%ld bytes)\n", disk_path, size_bytes);
+int unmount_all() {
+    int failed = 0;
+    for (int i = 0; i < mount_count; i++) {
+        if (unmount_handle(mounts[i].fs) != 0) {
+            fprintf(stderr, "Error: Failed to write back '%s'.\n", mounts[i].image_path);
+            failed = 1;
+        }
     }
+    mount_count = 0;
+    fs = NULL;
+    return failed ? -1 : 0;
+}
+
+// Unmounts everything and writes the --stats-json dump. Returns the exit status.
+int finish() {
+    int failed = unmount_all() != 0;
+    if (trace_file) fclose(trace_file);
+    if (stats_json_path) {
+        FILE* out = strcmp(stats_json_path, "-") == 0 ? stderr : fopen(stats_json_path, "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot write statistics to '%s'.\n", stats_json_path);
+            return 1;
+        }
+        write_stats_json(out);
+        if (out != stderr) fclose(out);
+    }
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <virtual_disk_file>\n", argv[0]);
+    // Options before the image. --stats-json[=file] dumps statistics at
+    // exit, to stderr by default so that one-shot output on stdout stays
+    // clean; --trace=file records the commands run, with their timing.
+    const char* trace_path = NULL;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--stats-json") == 0) stats_json_path = "-";
+        else if (strncmp(argv[1], "--stats-json=", 13) == 0) stats_json_path = argv[1] + 13;
+        else if (strncmp(argv[1], "--trace=", 8) == 0) trace_path = argv[1] + 8;
+        else break;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s [--stats-json[=file]] [--trace=file] <virtual_disk_file> [command [args...]]\n",
+                argv[0]);
         return 1;
     }
+    if (trace_path && !(trace_file = fopen(trace_path, "w"))) {
+        fprintf(stderr, "Error: Cannot write trace '%s'.\n", trace_path);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
     
     int is_interactive = isatty(fileno(stdin));
     char *disk_path = argv[1];
-    virtual_disk = fopen(disk_path, "r+b");
+    int rc = myfs_mount(disk_path, &fs);
 
-    if (!virtual_disk) {
+    if (rc == MYFS_ENOENT) {
         char input_buffer[128];
         char answer = 'n';
 
@@ -933,101 +1864,63 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
 
-            do_mkfs(disk_path, size);
-            virtual_disk = fopen(disk_path, "r+b");
-            if (!virtual_disk) {
-                perror("Failed to open newly created disk");
+            rc = myfs_mkfs(disk_path, size);
+            if (rc != 0) {
+                fprintf(stderr, "Error creating virtual disk file: %s\n", myfs_strerror(rc));
                 return 1;
             }
+            if (isatty(fileno(stdout))) {
+                printf("Virtual disk created successfully: %s (%ld bytes)\n", disk_path, size);
+            }
+            rc = myfs_mount(disk_path, &fs);
         } else {
             if (is_interactive) printf("Exiting.\n");
             return 0;
         }
     }
 
-    char buffer[BLOCK_SIZE];
-    read_block(SUPERBLOCK_BLOCK, buffer);
-    memcpy(&sb, buffer, sizeof(Superblock));
-
-    read_block(sb.inode_bitmap_block, buffer);
-    memcpy(inode_bitmap, buffer, sizeof(inode_bitmap));
+    if (rc == MYFS_EBADFS) {
+        fprintf(stderr, "Error: '%s' is not a myfs image or uses an older on-disk format.\n", disk_path);
+        return 1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot open '%s': %s.\n", disk_path, myfs_strerror(rc));
+        return 1;
+    }
 
-    read_block(sb.data_bitmap_block, buffer);
-    memcpy(data_block_bitmap, buffer, sizeof(data_block_bitmap));
+    char name[MAX_MOUNT_NAME];
+    default_mount_name(disk_path, name);
+    current_mount = add_mount(disk_path, name, fs);
 
     if (is_interactive) printf("Virtual File System Initialized. Type 'help' for commands.\n");
     
-    char line[1024];
-    char cmd[16] = {0}, arg1[512] = {0}, arg2[512] = {0};
+    if (argc > 2) {
+        // One-shot mode: run the command given after the image path, so
+        // commands such as `tar-in -` can sit in a shell pipeline. A
+        // command that reports an error makes the exit status 1.
+        char line[1024];
+        size_t used = 0;
+        for (int i = 2; i < argc; i++) {
+            int n = snprintf(line + used, sizeof(line) - used, "%s ", argv[i]);
+            if (n < 0 || (size_t)n >= sizeof(line) - used) {
+                fprintf(stderr, "Error: The command is longer than %zu bytes.\n", sizeof(line) - 1);
+                finish();
+                return 1;
+            }
+            used += n;
+        }
+        run_command(line);
+        int status = finish();
+        return command_failed ? 1 : status;
+    }
 
+    char line[1024];
     while (1) {
         if (is_interactive) printf("vfs> ");
         if (!fgets(line, sizeof(line), stdin)) break;
-
-        if (line[0] == '\n' || line[0] == '#' || line[0] == '\r') continue;
-
-        cmd[0] = arg1[0] = arg2[0] = '\0';
-        sscanf(line, "%15s %511s %511s", cmd, arg1, arg2);
-        if (strlen(cmd) == 0) continue;
-
-        if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
-            break;
-        } else if (strcmp(cmd, "cd") == 0) {
-            if (arg1[0] == '\0') do_cd("/"); else do_cd(arg1);
-        } else if (strcmp(cmd, "pwd") == 0) {
-            do_pwd();
-        } else if (strcmp(cmd, "ls") == 0) {
-            if (arg1[0] == '\0') do_ls("."); else do_ls(arg1);
-        } else if (strcmp(cmd, "mkdir") == 0) {
-            if (arg1[0] == '\0') { printf("Usage: mkdir <path>\n"); continue; }
-            do_mkdir(arg1);
-        } else if (strcmp(cmd, "cp-to") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') { printf("Usage: cp-to <host_path> <vdisk_path>\n"); continue; }
-            do_cp_to_vdisk(arg1, arg2);
-        } else if (strcmp(cmd, "cp-from") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') { printf("Usage: cp-from <vdisk_path> <host_path>\n"); continue; }
-            do_cp_from_vdisk(arg1, arg2);
-        } else if (strcmp(cmd, "rm") == 0) {
-            if (arg1[0] == '\0') { printf("Usage: rm <path>\n"); continue; }
-            do_rm(arg1);
-        } else if (strcmp(cmd, "rmdir") == 0) {
-            if (arg1[0] == '\0') { printf("Usage: rmdir <path>\n"); continue; }
-            do_rmdir(arg1);
-        } else if (strcmp(cmd, "ln") == 0) {
-             if (arg1[0] == '\0' || arg2[0] == '\0') { printf("Usage: ln <target_path> <link_path>\n"); continue; }
-            do_ln(arg1, arg2);
-        } else if (strcmp(cmd, "df") == 0) {
-            do_df();
-        } else if (strcmp(cmd, "append") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') { printf("Usage: append <path> <bytes>\n"); continue; }
-            do_append(arg1, atoi(arg2));
-        } else if (strcmp(cmd, "truncate") == 0) {
-            if (arg1[0] == '\0' || arg2[0] == '\0') { printf("Usage: truncate <path> <bytes>\n"); continue; }
-            do_truncate(arg1, atoi(arg2));
-        } else if (strcmp(cmd, "help") == 0) {
-            printf("Available commands:\n");
-            printf("  ls [path]                - List directory contents (default: current dir)\n");
-            printf("  cd [path]                - Change current directory (.. is supported)\n");
-            printf("  pwd                      - Print current directory path\n");
-            printf("  mkdir <path>             - Create a directory\n");
-            printf("  rmdir <path>             - Remove an empty directory\n");
-            printf("  cp-to <host> <vdisk>     - Copy file from host to virtual disk\n");
-            printf("  cp-from <vdisk> <host>   - Copy file from virtual disk to host\n");
-            printf("  rm <path>                - Remove a file or link\n");
-            printf("  ln <target> <link_name>  - Create a hard link\n");
-            printf("  append <path> <bytes>    - Add N null bytes to a file\n");
-            printf("  truncate <path> <bytes>  - Shorten a file by N bytes (or to 0)\n");
-            printf("  df                       - Display disk usage information\n");
-            printf("  exit/quit                - Exit the program\n");
-        } else {
-            if (strlen(cmd) > 0) printf("Unknown command: %s\n", cmd);
-        }
+        if (run_command(line)) break;
     }
 
     if (is_interactive) printf("Exiting.\n");
-    if (virtual_disk) {
-        fclose(virtual_disk);
-    }
-    
-    return 0;
+    return finish();
 }
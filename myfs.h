@@ -0,0 +1,381 @@
+// libmyfs: embeddable API for myfs disk images.
+//
+// All state for a mounted image lives in an opaque myfs_t handle, so a
+// process can link the library and work on an image in-process instead of
+// piping commands into the shell. Calls never print; every function that
+// can fail returns a negative MYFS_E* code (see myfs_strerror), and
+// functions that produce a count or an inode number return it as a
+// non-negative value on success.
+//
+// Paths are absolute or relative to the handle's working directory (see
+// myfs_chdir). The *_at variants take a directory inode number and a single
+// name instead, so callers that already hold inode numbers (bulk copies,
+// FUSE-style frontends) never re-resolve a path.
+//
+// Threads: any number of threads may call into the same handle at once.
+// Operations on different files, and lookups in the same directory, run in
+// parallel; changes to one directory are serialised by its lock. A
+// myfs_file_t or myfs_dir_t belongs to one thread at a time, and mount,
+// unmount and the working directory are per handle, not per thread.
+#ifndef MYFS_H
+#define MYFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MYFS_BLOCK_SIZE 4096
+#define MYFS_NAME_MAX 255
+#define MYFS_PATH_MAX 4096
+#define MYFS_FILE_MAX (12 * MYFS_BLOCK_SIZE) // 12 direct blocks per file
+#define MYFS_ROOT_INO 0
+#define MYFS_NO_BLOCK ((uint32_t)-1)
+
+enum {
+    MYFS_OK = 0,
+    MYFS_ENOENT = -1,        // no such file or directory
+    MYFS_EEXIST = -2,        // name already exists
+    MYFS_ENOTDIR = -3,       // not a directory
+    MYFS_EISDIR = -4,        // is a directory
+    MYFS_ENOTEMPTY = -5,     // directory not empty
+    MYFS_ENOSPC = -6,        // out of data blocks
+    MYFS_ENOINODE = -7,      // out of inodes
+    MYFS_EDIRFULL = -8,      // directory has no free entry slot
+    MYFS_EFBIG = -9,         // file would exceed MYFS_FILE_MAX
+    MYFS_ENAMETOOLONG = -10, // name or path too long
+    MYFS_EINVAL = -11,       // invalid argument
+    MYFS_EPERM = -12,        // operation not permitted (root, directory links)
+    MYFS_EBADF = -13,        // file handle not open for this access
+    MYFS_EIO = -14,          // host I/O error on the image
+    MYFS_ENOMEM = -15,       // out of memory
+    MYFS_EBADFS = -16,       // not a myfs image, or an unsupported format
+    MYFS_ECORRUPT = -17,     // on-disk structures are inconsistent, or a block failed its checksum
+    MYFS_EBUSY = -18,        // image is mounted by another handle or process
+};
+
+// Access modes and flags for myfs_open, with the same values as <fcntl.h> on Linux.
+#define MYFS_O_RDONLY 00
+#define MYFS_O_WRONLY 01
+#define MYFS_O_RDWR 02
+#define MYFS_O_ACCMODE 03
+#define MYFS_O_CREAT 0100
+#define MYFS_O_TRUNC 01000
+#define MYFS_O_APPEND 02000
+
+typedef struct myfs myfs_t;
+typedef struct myfs_file myfs_file_t;
+typedef struct myfs_dir myfs_dir_t;
+
+struct myfs_stat {
+    uint32_t ino;
+    int is_dir;
+    uint32_t size;
+    uint32_t nlink;
+    uint32_t blocks;      // data blocks held
+    uint32_t first_block; // first data block or MYFS_NO_BLOCK; sort key for sequential reads
+    int64_t ctime;
+    int64_t mtime;
+    int compressed;       // some of the data is held in compressed clusters
+};
+
+struct myfs_statfs {
+    uint32_t block_size;
+    uint32_t total_inodes;
+    uint32_t free_inodes;
+    uint32_t total_blocks; // data blocks
+    uint32_t free_blocks;
+    uint64_t total_bytes;  // size of the image
+    int compression;       // MYFS_COMPRESS_* policy for new files
+    int dedup;             // new files share blocks with identical ones already stored
+    uint32_t saved_blocks; // block references served by a block that is shared
+    int checksums;         // blocks are checksummed and verified as they are read
+};
+
+struct myfs_dirent {
+    uint32_t ino;
+    char name[MYFS_NAME_MAX + 1];
+};
+
+const char* myfs_strerror(int err);
+
+// Images. Any number of images can be mounted at once; each handle is
+// independent.
+int myfs_mkfs(const char* image_path, long size_bytes);
+// mount takes an exclusive lock on the image file for the life of the
+// handle, so a second mount anywhere fails with MYFS_EBUSY instead of
+// working from its own copy of the bitmaps.
+int myfs_mount(const char* image_path, myfs_t** out); // MYFS_ENOENT if the image file is missing
+int myfs_unmount(myfs_t* fs);
+int myfs_sync(myfs_t* fs);
+int myfs_statfs(myfs_t* fs, struct myfs_statfs* out);
+
+// Block cache shared by every mounted image in the process, bounded in
+// bytes (8 MiB by default, 0 disables it). Writes go through to the image,
+// so the cache never holds unwritten data.
+struct myfs_cache_stats {
+    uint64_t limit_bytes;
+    uint64_t used_bytes;
+    uint64_t hits;   // block reads served from the cache
+    uint64_t misses; // block reads that went to an image
+};
+
+void myfs_cache_set_limit(size_t bytes);
+void myfs_cache_stats(struct myfs_cache_stats* out);
+
+// I/O counters of one handle since it was mounted. Block transfers are
+// split by the kind of block; a read served by the block cache counts as
+// a cache hit, not a read.
+enum {
+    MYFS_IO_SUPERBLOCK,
+    MYFS_IO_BITMAP,
+    MYFS_IO_INODE_TABLE,
+    MYFS_IO_DIRECTORY,
+    MYFS_IO_DATA,
+    MYFS_IO_KINDS
+};
+
+struct myfs_io_stats {
+    uint64_t reads[MYFS_IO_KINDS];      // blocks read from the image
+    uint64_t writes[MYFS_IO_KINDS];     // blocks written to the image
+    uint64_t cache_hits[MYFS_IO_KINDS]; // blocks read from the cache instead
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t inode_reads;  // inodes decoded from the inode table
+    uint64_t inode_writes; // inodes written back
+    uint64_t inodes_allocated;
+    uint64_t inodes_freed;
+    uint64_t blocks_allocated;
+    uint64_t blocks_freed;
+    uint64_t alloc_retries;     // bitmap words re-read after losing a race to another thread
+    uint64_t bitmap_writebacks; // allocation bitmap blocks written back
+    uint64_t dedup_lookups;     // blocks of new files hashed and looked up
+    uint64_t dedup_hits;        // of those, stored by sharing a block with identical contents
+    uint64_t dedup_ns;          // time spent hashing, looking up and comparing
+    uint64_t cow_copies;        // shared blocks copied before a write
+    uint64_t checksums_verified; // blocks read from the image and checked against their CRC32C
+    uint64_t checksum_failures;  // of those, blocks whose contents did not match
+};
+
+int myfs_io_stats(myfs_t* fs, struct myfs_io_stats* out);
+
+// Consistency check. The inode table is read in large sequential
+// transfers and every directory is walked from the root by 'threads'
+// worker threads (0: one per CPU). The walk decides which inodes are in
+// use and how many links each should have; the inodes reached decide which
+// data blocks are in use and how often each is shared. Differences from
+// the bitmaps, link counts, block reference counts, entry counts, sizes
+// and parent pointers are counted in the report, and with
+// MYFS_FSCK_REPAIR fixed: bad entries are removed, unreachable inodes
+// freed, and inodes and bitmaps rewritten. Returns the number of problems
+// found. Nothing else may use the handle meanwhile.
+#define MYFS_FSCK_REPAIR 1
+
+struct myfs_fsck_report {
+    uint32_t inodes;       // reachable from the root
+    uint32_t directories;
+    uint32_t blocks;       // data blocks in use by the inodes reached
+    uint32_t bad_entries;  // entries naming a free or invalid inode, or a second name of a directory
+    uint32_t bad_blocks;   // pointers out of range, past the end of a file, or to a block another inode holds unshared
+    uint32_t bad_inodes;   // wrong size, entry count or parent
+    uint32_t link_counts;  // link counts that differ from the names found
+    uint32_t inode_bitmap; // bits that differ from the inodes reached
+    uint32_t block_bitmap; // bits that differ from the blocks in use
+    uint32_t orphans;      // allocated inodes nothing reaches (also counted in inode_bitmap)
+    uint32_t ref_counts;   // block reference counts that differ from the pointers found
+    uint32_t repaired;
+    int threads;
+};
+
+int myfs_fsck(myfs_t* fs, int flags, int threads, struct myfs_fsck_report* out);
+
+// Scrub: reads every checksummed block of the image, bypassing the block
+// cache, in large sequential transfers split between 'threads' threads
+// (0: one per CPU), and compares each with its checksum. A block that
+// fails is read once more before it counts, so a write racing the scrub
+// is not reported. Returns the number of bad blocks; MYFS_EINVAL if the
+// image has no checksums.
+#define MYFS_SCRUB_LIST 16
+
+struct myfs_scrub_report {
+    uint32_t blocks;       // blocks verified
+    uint32_t bad;          // blocks whose contents do not match their checksum
+    uint32_t bad_metadata; // of those, superblock, bitmap and inode-table blocks
+    uint32_t listed;       // entries filled in 'bad_blocks', the lowest block numbers first
+    struct {
+        uint32_t block; // block number in the image
+        int kind;       // MYFS_IO_*; directory blocks count as data
+    } bad_blocks[MYFS_SCRUB_LIST];
+    uint64_t bytes;
+    uint64_t ns;
+    int threads;
+};
+
+int myfs_scrub(myfs_t* fs, int threads, struct myfs_scrub_report* out);
+
+// Online defragmentation of 'path' and everything below it. Each file
+// held in more than one run of blocks is moved into the lowest free run
+// that fits it (files with shared blocks, or that no such run fits, are
+// skipped), and each directory is rewritten with its entries packed from
+// the first slot, moving back into the inode when they fit there and
+// freeing the blocks it no longer needs. Only the inode being rewritten is locked at a time; a readdir in
+// progress on a directory being packed may miss entries that moved.
+struct myfs_defrag_report {
+    uint32_t files;             // files with data blocks
+    uint32_t directories;
+    uint32_t fragmented_before; // files in more than one run of blocks
+    uint32_t fragmented_after;
+    uint32_t extents_before;    // runs of consecutive blocks over all files
+    uint32_t extents_after;
+    uint32_t blocks_moved;
+    uint32_t skipped;           // fragmented files with shared blocks or no free run long enough
+    uint32_t dir_holes;         // empty directory slots packed away
+    uint32_t dir_blocks_freed;
+    uint32_t dirs_inlined;      // directories moved back into their inode
+    uint32_t free_extents_before; // runs of free data blocks
+    uint32_t free_extents_after;
+    uint32_t largest_free_before; // longest run of free data blocks
+    uint32_t largest_free_after;
+};
+
+int myfs_defrag(myfs_t* fs, const char* path, struct myfs_defrag_report* out);
+
+// Between batch_begin and batch_end, allocation bitmaps are written back
+// once at the end instead of after every call. Batches nest.
+void myfs_batch_begin(myfs_t* fs);
+int myfs_batch_end(myfs_t* fs);
+
+// Data blocks a file of 'size' bytes, or a directory holding 'entries'
+// names totalling 'name_bytes', occupies; for sizing bulk operations up front.
+long myfs_file_blocks(long size);
+long myfs_dir_blocks(long entries, long name_bytes);
+
+// Names and metadata. Lookups return an inode number.
+int myfs_lookup(myfs_t* fs, const char* path);
+int myfs_lookup_at(myfs_t* fs, uint32_t dir_ino, const char* name);
+int myfs_stat(myfs_t* fs, const char* path, struct myfs_stat* out);
+int myfs_stat_ino(myfs_t* fs, uint32_t ino, struct myfs_stat* out);
+// Data blocks of a file or directory in block-map order, MYFS_NO_BLOCK for
+// slots without one; returns how many are in use. Inline inodes have none.
+#define MYFS_MAP_SLOTS (MYFS_FILE_MAX / MYFS_BLOCK_SIZE)
+int myfs_block_map(myfs_t* fs, uint32_t ino, uint32_t blocks[MYFS_MAP_SLOTS]);
+
+// Where the image's space goes, from one pass over the data bitmap and one
+// read of the inode table. A snapshot: figures taken while other threads
+// change the image need not add up exactly.
+#define MYFS_FREE_RUN_BUCKETS 14 // free_runs[b]: runs of 2^b to 2^(b+1)-1 blocks
+
+struct myfs_layout {
+    uint32_t data_blocks;
+    uint32_t free_blocks;
+    uint32_t free_extents;     // runs of free data blocks
+    uint32_t largest_free_run;
+    uint32_t free_runs[MYFS_FREE_RUN_BUCKETS];
+    uint32_t files;
+    uint32_t inline_files;     // stored in the inode, no data blocks
+    uint32_t file_blocks;
+    uint32_t file_extents;     // runs of consecutive blocks over all files
+    uint32_t files_by_extents[MYFS_MAP_SLOTS + 1]; // [n]: files with data blocks in n runs
+    uint32_t directories;
+    uint32_t inline_directories;
+    uint32_t inline_dir_bytes; // packed entries held in inodes
+    uint32_t dir_blocks;       // block directories from here on
+    uint32_t dir_slots;
+    uint32_t dir_entries;
+    uint32_t dir_holes;        // empty slots below the highest one used
+    uint32_t inodes;
+    uint32_t inodes_used;
+    uint32_t itable_blocks;
+    uint32_t itable_blocks_used; // inode-table blocks holding at least one inode in use
+};
+
+int myfs_layout(myfs_t* fs, struct myfs_layout* out);
+
+// Namespace changes. mkdir and create return the new inode number.
+int myfs_mkdir(myfs_t* fs, const char* path);
+int myfs_mkdir_at(myfs_t* fs, uint32_t dir_ino, const char* name);
+int myfs_create(myfs_t* fs, const char* path, const void* data, long size);
+int myfs_create_at(myfs_t* fs, uint32_t dir_ino, const char* name, const void* data, long size);
+int myfs_unlink(myfs_t* fs, const char* path);
+int myfs_unlink_at(myfs_t* fs, uint32_t dir_ino, const char* name);
+int myfs_rmdir(myfs_t* fs, const char* path);
+int myfs_rmdir_at(myfs_t* fs, uint32_t dir_ino, const char* name);
+int myfs_link(myfs_t* fs, const char* target_path, const char* link_path);
+int myfs_link_at(myfs_t* fs, uint32_t ino, uint32_t dir_ino, const char* name);
+
+// Copies a file or a whole directory tree from one mounted image to another
+// (or within one image) block by block, without going through the host.
+// myfs_copy follows cp: an existing destination directory receives the
+// source under its own name. Hard links inside a copied tree become
+// separate files. Both return the new inode number.
+int myfs_copy(myfs_t* src, const char* src_path, myfs_t* dst, const char* dst_path);
+int myfs_copy_at(myfs_t* src, uint32_t src_ino, myfs_t* dst, uint32_t dst_dir, const char* name);
+
+// Clones a file within one image in constant time: the new file shares
+// the source's data blocks, each with one more reference, and whichever
+// file is written to later copies a shared block before changing it. The
+// first clone reserves the image's reference counts (see myfs_set_dedup).
+// Both return the new inode number; a directory source is MYFS_EISDIR.
+int myfs_clone(myfs_t* fs, const char* src_path, const char* dst_path);
+int myfs_clone_at(myfs_t* fs, uint32_t src_ino, uint32_t dst_dir, const char* name);
+
+// Byte-range I/O by inode number; only the blocks covering the range are
+// touched. pread returns the bytes read (0 at end of file). Writes past the
+// end grow the file and the gap reads back as zeros; truncate shrinks or
+// zero-extends to exactly 'size' bytes.
+long myfs_pread(myfs_t* fs, uint32_t ino, void* buf, long len, long offset);
+long myfs_pwrite(myfs_t* fs, uint32_t ino, const void* buf, long len, long offset);
+int myfs_truncate(myfs_t* fs, uint32_t ino, long size);
+
+// Transparent compression. File data is grouped in clusters of 4 blocks,
+// and a cluster is stored compressed (LZ4 block format) when that saves
+// at least one block; the rest stay plain. Reads decompress the clusters
+// they touch. The image's policy, kept in its superblock, applies to files
+// as they are created (create, copy) and to the clusters a write changes,
+// or a truncate of a compressed file; myfs_compress recompresses or expands one file
+// and returns the data blocks it holds afterwards.
+#define MYFS_COMPRESS_NONE 0
+#define MYFS_COMPRESS_LZ 1
+
+int myfs_set_compression(myfs_t* fs, int codec);
+int myfs_compress(myfs_t* fs, uint32_t ino, int codec);
+
+// Block deduplication. With it on, each block of a file being created is
+// hashed (XXH64) and looked up in an index kept on the image; a block
+// whose contents are already stored, as confirmed by comparing them, is
+// shared instead of written again. Each data block has a count of extra
+// references, and a shared block is freed with its last reference and
+// copied before any write to it. Files written in place (myfs_pwrite and
+// handles) are not deduplicated. Turning it on the first time reserves the
+// index and the reference counts in the data area; turning it off stops
+// lookups but keeps the blocks already shared.
+int myfs_set_dedup(myfs_t* fs, int on);
+
+// Block checksums. With them on, every block of the image but the
+// superblock has a CRC32C (computed with the SSE4.2 crc32 instruction
+// where the processor has it) in a table kept on the image, updated as
+// the block is written. Each block read from the image rather than the
+// block cache is verified, and a mismatch fails the call with
+// MYFS_ECORRUPT; the superblock carries its own checksum, checked at
+// mount. Turning them on the first time reserves the table in the data
+// area; each time, it reads the whole image once to compute them.
+int myfs_set_checksums(myfs_t* fs, int on);
+
+// File handles: a position on top of pread/pwrite.
+int myfs_open(myfs_t* fs, const char* path, int flags, myfs_file_t** out);
+long myfs_read(myfs_file_t* f, void* buf, long len);
+long myfs_write(myfs_file_t* f, const void* buf, long len);
+long myfs_seek(myfs_file_t* f, long offset, int whence); // SEEK_SET/SEEK_CUR/SEEK_END
+int myfs_close(myfs_file_t* f);
+
+// Directory iteration. readdir returns 1 and fills 'out' for each entry,
+// excluding "." and "..", then 0 at the end. Entries added or removed
+// after opendir may or may not be seen; every other entry is seen once.
+int myfs_opendir(myfs_t* fs, const char* path, myfs_dir_t** out);
+int myfs_opendir_ino(myfs_t* fs, uint32_t ino, myfs_dir_t** out);
+int myfs_readdir(myfs_dir_t* d, struct myfs_dirent* out);
+void myfs_closedir(myfs_dir_t* d);
+
+// Working directory used to resolve relative paths on this handle.
+int myfs_chdir(myfs_t* fs, const char* path);
+int myfs_getcwd(myfs_t* fs, char* buf, size_t len);
+
+#endif
@@ -0,0 +1,406 @@
+// myfs_fuse: mounts an image into the host namespace through the libfuse
+// low-level API, so ordinary tools (cp, rsync, find) can work on it.
+//
+// Every request arrives with inode numbers and is served by the matching
+// *_at call in myfs.h; no path is ever resolved. FUSE's root is inode 1,
+// so a FUSE inode number is the myfs inode number plus one.
+//
+// myfs_mount locks the image, so nothing else can change it while it is
+// mounted here. The kernel may therefore cache attributes, names and file
+// pages for as long as it likes: every change goes through this process
+// and the kernel sees it.
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "myfs.h"
+
+myfs_t* fs = NULL;
+
+struct options {
+    double attr_timeout;     // seconds the kernel may cache attributes
+    double entry_timeout;    // seconds the kernel may cache a name lookup
+    double negative_timeout; // seconds the kernel may cache a missing name
+};
+
+struct options options = { 1.0, 1.0, 1.0 };
+
+static const struct fuse_opt option_spec[] = {
+    { "attr_timeout=%lf", offsetof(struct options, attr_timeout), 0 },
+    { "entry_timeout=%lf", offsetof(struct options, entry_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(struct options, negative_timeout), 0 },
+    FUSE_OPT_END
+};
+
+uint32_t to_myfs(fuse_ino_t ino) { return (uint32_t)(ino - 1); }
+fuse_ino_t to_fuse(uint32_t ino) { return (fuse_ino_t)ino + 1; }
+
+int to_errno(int rc) {
+    switch (rc) {
+    case MYFS_ENOENT: return ENOENT;
+    case MYFS_EEXIST: return EEXIST;
+    case MYFS_ENOTDIR: return ENOTDIR;
+    case MYFS_EISDIR: return EISDIR;
+    case MYFS_ENOTEMPTY: return ENOTEMPTY;
+    case MYFS_ENOSPC:
+    case MYFS_ENOINODE:
+    case MYFS_EDIRFULL: return ENOSPC;
+    case MYFS_EFBIG: return EFBIG;
+    case MYFS_ENAMETOOLONG: return ENAMETOOLONG;
+    case MYFS_EINVAL: return EINVAL;
+    case MYFS_EPERM: return EPERM;
+    case MYFS_EBADF: return EBADF;
+    case MYFS_ENOMEM: return ENOMEM;
+    case MYFS_EBUSY: return EBUSY;
+    default: return EIO;
+    }
+}
+
+// myfs has no owners or permission bits; everything belongs to the user
+// who mounted the image.
+void fill_stat(const struct myfs_stat* st, struct stat* out) {
+    memset(out, 0, sizeof(*out));
+    out->st_ino = to_fuse(st->ino);
+    out->st_mode = st->is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    out->st_nlink = st->nlink;
+    out->st_size = st->size;
+    out->st_blocks = (blkcnt_t)st->blocks * (MYFS_BLOCK_SIZE / 512);
+    out->st_blksize = MYFS_BLOCK_SIZE;
+    out->st_uid = getuid();
+    out->st_gid = getgid();
+    out->st_mtime = st->mtime;
+    out->st_ctime = st->ctime;
+    out->st_atime = st->mtime;
+}
+
+// Fills an entry for a name that resolved to 'ino'. Returns 0 or a MYFS_E* code.
+int fill_entry(uint32_t ino, struct fuse_entry_param* e) {
+    struct myfs_stat st;
+    int rc = myfs_stat_ino(fs, ino, &st);
+    if (rc != 0) return rc;
+    memset(e, 0, sizeof(*e));
+    e->ino = to_fuse(ino);
+    fill_stat(&st, &e->attr);
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.entry_timeout;
+    return 0;
+}
+
+// Replies to a request that created or resolved a name.
+void reply_entry(fuse_req_t req, int ino) {
+    struct fuse_entry_param e;
+    int rc = ino < 0 ? ino : fill_entry(ino, &e);
+    if (rc != 0) fuse_reply_err(req, to_errno(rc));
+    else fuse_reply_entry(req, &e);
+}
+
+// Operations
+void op_init(void* userdata, struct fuse_conn_info* conn) {
+    (void)userdata;
+    // Read replies are spliced from our buffer into the FUSE device.
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+void op_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    int ino = myfs_lookup_at(fs, to_myfs(parent), name);
+    if (ino == MYFS_ENOENT) {
+        // An entry with inode 0 lets the kernel cache the miss.
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = options.negative_timeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    reply_entry(req, ino);
+}
+
+void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    (void)fi;
+    struct myfs_stat st;
+    struct stat attr;
+    int rc = myfs_stat_ino(fs, to_myfs(ino), &st);
+    if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    fill_stat(&st, &attr);
+    fuse_reply_attr(req, &attr, options.attr_timeout);
+}
+
+// Only the size can change. Modes, owners and times are not stored, so
+// those requests succeed without effect rather than failing cp -p or rsync.
+void op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int rc = attr->st_size > MYFS_FILE_MAX ? MYFS_EFBIG : myfs_truncate(fs, to_myfs(ino), attr->st_size);
+        if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    }
+    op_getattr(req, ino, fi);
+}
+
+void op_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+    (void)mode;
+    reply_entry(req, myfs_mkdir_at(fs, to_myfs(parent), name));
+}
+
+void op_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+    (void)mode;
+    struct fuse_entry_param e;
+    int ino = myfs_create_at(fs, to_myfs(parent), name, NULL, 0);
+    int rc = ino < 0 ? ino : fill_entry(ino, &e);
+    if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    fi->keep_cache = 1;
+    fuse_reply_create(req, &e, fi);
+}
+
+void op_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    int rc = myfs_unlink_at(fs, to_myfs(parent), name);
+    fuse_reply_err(req, rc ? to_errno(rc) : 0);
+}
+
+void op_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    int rc = myfs_rmdir_at(fs, to_myfs(parent), name);
+    fuse_reply_err(req, rc ? to_errno(rc) : 0);
+}
+
+void op_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) {
+    int rc = myfs_link_at(fs, to_myfs(ino), to_myfs(newparent), newname);
+    reply_entry(req, rc ? rc : (int)to_myfs(ino));
+}
+
+// myfs has no rename, so a file is moved by linking the new name and
+// unlinking the old one. This is not atomic: for a moment another reader
+// can see the file under both names, or a replaced file under neither.
+// A file already at the new name is removed only once the source is
+// linked into the destination directory under a temporary name, so a
+// link that fails for want of space or a full directory leaves the old
+// file in place. The temporary name gets a counter that is bumped while
+// the name is taken, so an entry the user made cannot be clobbered.
+// Directories cannot be relinked; EXDEV makes mv fall back to copying.
+int replace_entry(int ino, uint32_t dir, const char* name) {
+    char temp[32];
+    int rc = MYFS_EEXIST;
+    for (int n = 0; n < 1000 && rc == MYFS_EEXIST; n++) {
+        snprintf(temp, sizeof(temp), ".rename.%d.%d", ino, n);
+        rc = myfs_link_at(fs, ino, dir, temp);
+    }
+    if (rc != 0) return rc;
+    rc = myfs_unlink_at(fs, dir, name);
+    // The new name takes the slot just freed, so it needs no new space.
+    if (rc == 0) rc = myfs_link_at(fs, ino, dir, name);
+    int temp_rc = myfs_unlink_at(fs, dir, temp);
+    return rc != 0 ? rc : temp_rc;
+}
+
+void op_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname,
+               unsigned int flags) {
+    if (flags) { fuse_reply_err(req, EINVAL); return; }
+    uint32_t from = to_myfs(parent), to = to_myfs(newparent);
+    struct myfs_stat st, old;
+    int ino = myfs_lookup_at(fs, from, name);
+    int rc = ino < 0 ? ino : myfs_stat_ino(fs, ino, &st);
+    if (rc == 0 && st.is_dir) { fuse_reply_err(req, EXDEV); return; }
+
+    int existing = rc == 0 ? myfs_lookup_at(fs, to, newname) : MYFS_ENOENT;
+    if (existing == ino) { fuse_reply_err(req, 0); return; } // same file: nothing to do
+    if (rc == 0 && existing >= 0) {
+        rc = myfs_stat_ino(fs, existing, &old);
+        if (rc == 0) rc = old.is_dir ? MYFS_EISDIR : replace_entry(ino, to, newname);
+    } else if (rc == 0) {
+        rc = myfs_link_at(fs, ino, to, newname);
+    }
+    if (rc == 0) rc = myfs_unlink_at(fs, from, name);
+    fuse_reply_err(req, rc ? to_errno(rc) : 0);
+}
+
+void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    struct myfs_stat st;
+    int rc = myfs_stat_ino(fs, to_myfs(ino), &st);
+    if (rc == 0 && st.is_dir) rc = MYFS_EISDIR;
+    if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    if (fi->flags & O_TRUNC) {
+        rc = myfs_truncate(fs, to_myfs(ino), 0);
+        if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    }
+    fi->keep_cache = 1; // pages cannot go stale, see the top of this file
+    fuse_reply_open(req, fi);
+}
+
+void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+    (void)fi;
+    if (off >= MYFS_FILE_MAX) { fuse_reply_buf(req, NULL, 0); return; }
+    if (size > MYFS_FILE_MAX) size = MYFS_FILE_MAX;
+    char* buf = malloc(size);
+    if (!buf) { fuse_reply_err(req, ENOMEM); return; }
+    long n = myfs_pread(fs, to_myfs(ino), buf, size, off);
+    if (n < 0) {
+        fuse_reply_err(req, to_errno(n));
+    } else {
+        struct fuse_bufvec data = FUSE_BUFVEC_INIT(n);
+        data.buf[0].mem = buf;
+        fuse_reply_data(req, &data, FUSE_BUF_SPLICE_MOVE);
+    }
+    free(buf);
+}
+
+void op_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+    (void)fi;
+    long n = off > MYFS_FILE_MAX ? MYFS_EFBIG : myfs_pwrite(fs, to_myfs(ino), buf, size, off);
+    if (n < 0) fuse_reply_err(req, to_errno(n));
+    else fuse_reply_write(req, n);
+}
+
+void op_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+    (void)ino; (void)datasync; (void)fi;
+    int rc = myfs_sync(fs);
+    fuse_reply_err(req, rc ? to_errno(rc) : 0);
+}
+
+// Directory offsets are entry indexes: 1 and 2 are "." and "..", and the
+// n-th stored entry has offset n + 2.
+void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+    (void)fi;
+    myfs_dir_t* d;
+    int rc = myfs_opendir_ino(fs, to_myfs(ino), &d);
+    if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    char* buf = malloc(size);
+    if (!buf) { myfs_closedir(d); fuse_reply_err(req, ENOMEM); return; }
+
+    size_t used = 0;
+    off_t next = 0;
+    struct stat attr;
+    memset(&attr, 0, sizeof(attr));
+    struct myfs_dirent entry;
+    for (;;) {
+        const char* name;
+        if (next == 0) {
+            name = ".";
+            attr.st_ino = ino;
+            attr.st_mode = S_IFDIR;
+        } else if (next == 1) {
+            int parent = myfs_lookup_at(fs, to_myfs(ino), "..");
+            name = "..";
+            attr.st_ino = parent < 0 ? ino : to_fuse(parent);
+            attr.st_mode = S_IFDIR;
+        } else {
+            rc = myfs_readdir(d, &entry);
+            if (rc != 1) break;
+            struct myfs_stat st;
+            name = entry.name;
+            attr.st_ino = to_fuse(entry.ino);
+            attr.st_mode = myfs_stat_ino(fs, entry.ino, &st) == 0 && st.is_dir ? S_IFDIR : S_IFREG;
+        }
+        next++;
+        if (next <= off) continue;
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &attr, next);
+        if (len > size - used) break;
+        used += len;
+    }
+    myfs_closedir(d);
+    if (rc < 0) fuse_reply_err(req, to_errno(rc));
+    else fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+void op_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void)ino;
+    struct myfs_statfs sfs;
+    struct statvfs out;
+    int rc = myfs_statfs(fs, &sfs);
+    if (rc != 0) { fuse_reply_err(req, to_errno(rc)); return; }
+    memset(&out, 0, sizeof(out));
+    out.f_bsize = out.f_frsize = sfs.block_size;
+    out.f_blocks = sfs.total_blocks;
+    out.f_bfree = out.f_bavail = sfs.free_blocks;
+    out.f_files = sfs.total_inodes;
+    out.f_ffree = out.f_favail = sfs.free_inodes;
+    out.f_namemax = MYFS_NAME_MAX;
+    fuse_reply_statfs(req, &out);
+}
+
+static const struct fuse_lowlevel_ops operations = {
+    .init = op_init,
+    .lookup = op_lookup,
+    .getattr = op_getattr,
+    .setattr = op_setattr,
+    .mkdir = op_mkdir,
+    .create = op_create,
+    .unlink = op_unlink,
+    .rmdir = op_rmdir,
+    .link = op_link,
+    .rename = op_rename,
+    .open = op_open,
+    .read = op_read,
+    .write = op_write,
+    .fsync = op_fsync,
+    .readdir = op_readdir,
+    .statfs = op_statfs,
+};
+
+void usage(const char* prog) {
+    printf("Usage: %s <virtual_disk_file> <mountpoint> [options]\n\n"
+           "    -o attr_timeout=S      seconds the kernel caches attributes (default 1)\n"
+           "    -o entry_timeout=S     seconds the kernel caches names (default 1)\n"
+           "    -o negative_timeout=S  seconds the kernel caches missing names (default 1)\n",
+           prog);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argv[1][0] == '-') {
+        usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    // The image comes first; FUSE parses the mountpoint and options after it.
+    const char* disk_path = argv[1];
+    argv[1] = argv[0];
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) return 1;
+    if (opts.show_help || opts.mountpoint == NULL) {
+        usage(args.argv[0]);
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return opts.show_help ? 0 : 1;
+    }
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0) return 1;
+
+    int rc = myfs_mount(disk_path, &fs);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot open '%s': %s.\n", disk_path, myfs_strerror(rc));
+        return 1;
+    }
+
+    int ret = 1;
+    struct fuse_session* se = fuse_session_new(&args, &operations, sizeof(operations), NULL);
+    if (se && fuse_set_signal_handlers(se) == 0) {
+        if (fuse_session_mount(se, opts.mountpoint) == 0) {
+            fuse_daemonize(opts.foreground);
+            if (opts.singlethread) {
+                ret = fuse_session_loop(se);
+            } else {
+                // The handle is thread-safe, so requests run on a pool of workers.
+                struct fuse_loop_config config = {
+                    .clone_fd = opts.clone_fd,
+                    .max_idle_threads = opts.max_idle_threads,
+                };
+                ret = fuse_session_loop_mt(se, &config);
+            }
+            fuse_session_unmount(se);
+        }
+        fuse_remove_signal_handlers(se);
+    }
+    if (se) fuse_session_destroy(se);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    if (myfs_unmount(fs) != 0) {
+        fprintf(stderr, "Error: Failed to write back '%s'.\n", disk_path);
+        return 1;
+    }
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+// Latency histogram with HDR-style log-linear buckets: each power of two
+// is split into MYFS_HIST_SUB equal buckets, so any recorded value is
+// reported within about 3% however large it is, in a fixed 15 KiB table.
+// Values are plain counts (the callers record nanoseconds). Not
+// thread-safe; give each thread its own and merge them.
+#ifndef MYFS_HIST_H
+#define MYFS_HIST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MYFS_HIST_SUB_BITS 5
+#define MYFS_HIST_SUB (1 << MYFS_HIST_SUB_BITS)
+#define MYFS_HIST_BUCKETS ((64 - MYFS_HIST_SUB_BITS + 1) * MYFS_HIST_SUB)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[MYFS_HIST_BUCKETS];
+} myfs_hist_t;
+
+static inline void myfs_hist_reset(myfs_hist_t* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+// Values below MYFS_HIST_SUB get a bucket each; above that, the bucket is
+// the value's power of two and its next MYFS_HIST_SUB_BITS bits.
+static inline int myfs_hist_bucket(uint64_t v) {
+    if (v < MYFS_HIST_SUB) return (int)v;
+    int exp = 63 - __builtin_clzll(v);
+    int shift = exp - MYFS_HIST_SUB_BITS;
+    return (shift + 1) * MYFS_HIST_SUB + (int)((v >> shift) & (MYFS_HIST_SUB - 1));
+}
+
+// Highest value that falls into bucket 'b'.
+static inline uint64_t myfs_hist_bucket_top(int b) {
+    if (b < MYFS_HIST_SUB) return (uint64_t)b;
+    int shift = b / MYFS_HIST_SUB - 1;
+    uint64_t low = (uint64_t)(MYFS_HIST_SUB + b % MYFS_HIST_SUB) << shift;
+    return low + ((UINT64_C(1) << shift) - 1);
+}
+
+static inline void myfs_hist_record(myfs_hist_t* h, uint64_t v) {
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->count++;
+    h->sum += v;
+    h->buckets[myfs_hist_bucket(v)]++;
+}
+
+static inline void myfs_hist_merge(myfs_hist_t* into, const myfs_hist_t* from) {
+    if (from->count == 0) return;
+    if (into->count == 0 || from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (int b = 0; b < MYFS_HIST_BUCKETS; b++) into->buckets[b] += from->buckets[b];
+}
+
+// Value at or below which 'pct' percent of the recorded values fall,
+// rounded up to its bucket's top and capped at the largest value seen.
+static inline uint64_t myfs_hist_percentile(const myfs_hist_t* h, double pct) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < MYFS_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t top = myfs_hist_bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline double myfs_hist_mean(const myfs_hist_t* h) {
+    return h->count ? (double)h->sum / h->count : 0.0;
+}
+
+#endif
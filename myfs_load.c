@@ -0,0 +1,249 @@
+// myfs_load: load generator for myfsd. Each client thread opens its own
+// connection and keeps 'depth' requests in flight against its own file
+// under /load: a mix of stat, 4 KiB reads and 4 KiB writes. At the end it
+// prints the request rate and the mean time from sending a request to
+// reading its reply.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "myfs.h"
+#include "myfs_proto.h"
+
+#define MAX_CLIENTS 256
+// Replies to a full pipeline stay under myfsd's 1 MiB backlog limit, so the
+// server never stops reading while a client is still sending.
+#define MAX_DEPTH 128
+#define IO_SIZE 4096
+#define FILE_SIZE (4 * IO_SIZE)
+
+typedef struct {
+    int id;
+    uint32_t ino; // this client's file
+    unsigned long ops, failed;
+    double latency_sum; // seconds
+    pthread_t thread;
+} Client;
+
+const char* socket_path;
+int depth = 16, write_percent = 20;
+double seconds = 2.0;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_server(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int send_all(int fd, const void* buf, size_t len) {
+    const unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void* buf, size_t len) {
+    unsigned char* p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Appends a request to 'out' and returns its length.
+size_t put_request(unsigned char* out, uint32_t tag, int op, uint32_t ino, uint64_t offset, uint32_t count,
+                   const void* payload, uint32_t len) {
+    memset(out, 0, MYFSP_REQ_HEADER);
+    myfsp_put32(out, len);
+    myfsp_put32(out + 4, tag);
+    out[8] = op;
+    myfsp_put32(out + 12, ino);
+    myfsp_put64(out + 16, offset);
+    myfsp_put32(out + 24, count);
+    if (len) memcpy(out + MYFSP_REQ_HEADER, payload, len);
+    return MYFSP_REQ_HEADER + len;
+}
+
+// One request and its reply, for setup. Returns the result.
+int64_t call(int fd, int op, uint32_t ino, uint32_t count, const void* payload, uint32_t len) {
+    static unsigned char msg[MYFSP_REQ_HEADER + MYFSP_MAX_PAYLOAD];
+    unsigned char h[MYFSP_RESP_HEADER], skip[256];
+    size_t n = put_request(msg, 0, op, ino, 0, count, payload, len);
+    if (send_all(fd, msg, n) != 0 || recv_all(fd, h, sizeof(h)) != 0) return MYFS_EIO;
+    for (uint32_t left = myfsp_get32(h); left > 0;) {
+        uint32_t chunk = left < sizeof(skip) ? left : sizeof(skip);
+        if (recv_all(fd, skip, chunk) != 0) return MYFS_EIO;
+        left -= chunk;
+    }
+    return (int64_t)myfsp_get64(h + 8);
+}
+
+// Creates /load and one file per client, reusing any left by an earlier run.
+int setup(Client* clients, int n) {
+    static unsigned char payload[32 + FILE_SIZE]; // name, then the file's data
+    char name[32];
+    int fd = connect_server();
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot reach a server on '%s'.\n", socket_path);
+        return -1;
+    }
+    int64_t dir = call(fd, MYFSP_LOOKUP, 0, 0, "/load", 5);
+    if (dir == MYFS_ENOENT) dir = call(fd, MYFSP_MKDIR_AT, MYFS_ROOT_INO, 0, "load", 4);
+    for (int i = 0; i < n && dir >= 0; i++) {
+        int len = snprintf(name, sizeof(name), "c%d", i);
+        int64_t ino = call(fd, MYFSP_LOOKUP_AT, dir, 0, name, len);
+        if (ino == MYFS_ENOENT) {
+            memcpy(payload, name, len);
+            memset(payload + len, 0, FILE_SIZE);
+            ino = call(fd, MYFSP_CREATE_AT, dir, len, payload, len + FILE_SIZE);
+        }
+        if (ino < 0) { dir = ino; break; }
+        clients[i].ino = ino;
+    }
+    close(fd);
+    if (dir < 0) fprintf(stderr, "Error: Setup failed: %s\n", myfs_strerror((int)dir));
+    return dir < 0 ? -1 : 0;
+}
+
+// Picks the next request of the mix: writes at the configured rate, the
+// rest split between reads and stats. Returns its length.
+size_t next_request(const Client* c, unsigned* seed, unsigned char* out, uint32_t tag, const unsigned char* data) {
+    int r = rand_r(seed) % 100;
+    uint64_t offset = (uint64_t)(rand_r(seed) % (FILE_SIZE / IO_SIZE)) * IO_SIZE;
+    if (r < write_percent) return put_request(out, tag, MYFSP_WRITE, c->ino, offset, 0, data, IO_SIZE);
+    if (r % 2) return put_request(out, tag, MYFSP_READ, c->ino, offset, IO_SIZE, NULL, 0);
+    return put_request(out, tag, MYFSP_STAT, c->ino, 0, 0, NULL, 0);
+}
+
+void* run_client(void* arg) {
+    Client* c = arg;
+    static _Thread_local unsigned char out[MAX_DEPTH * (MYFSP_REQ_HEADER + IO_SIZE)];
+    static _Thread_local unsigned char in[256 * 1024];
+    static _Thread_local double sent_at[MAX_DEPTH];
+    unsigned char data[IO_SIZE];
+    unsigned seed = 42u + c->id;
+    memset(data, c->id, sizeof(data));
+
+    int fd = connect_server();
+    if (fd < 0) { c->failed++; return NULL; }
+
+    // Tags are slots 0..depth-1; a reply frees its slot for the next request.
+    size_t out_len = 0;
+    int in_flight = 0;
+    double start = now(), end = start + seconds;
+    for (uint32_t tag = 0; tag < (uint32_t)depth; tag++) {
+        out_len += next_request(c, &seed, out + out_len, tag, data);
+        sent_at[tag] = start;
+        in_flight++;
+    }
+
+    size_t in_len = 0;
+    while (in_flight > 0) {
+        if (out_len > 0) {
+            if (send_all(fd, out, out_len) != 0) { c->failed++; break; }
+            out_len = 0;
+        }
+        ssize_t n = recv(fd, in + in_len, sizeof(in) - in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { c->failed++; break; }
+        in_len += n;
+
+        double t = now();
+        size_t pos = 0;
+        while (in_len - pos >= MYFSP_RESP_HEADER) {
+            uint32_t len = myfsp_get32(in + pos);
+            if (in_len - pos < MYFSP_RESP_HEADER + len) break;
+            uint32_t tag = myfsp_get32(in + pos + 4);
+            int64_t result = (int64_t)myfsp_get64(in + pos + 8);
+            pos += MYFSP_RESP_HEADER + len;
+            in_flight--;
+            c->ops++;
+            if (result < 0) c->failed++;
+            if (tag < (uint32_t)depth) c->latency_sum += t - sent_at[tag];
+            if (t >= end || tag >= (uint32_t)depth) continue;
+
+            out_len += next_request(c, &seed, out + out_len, tag, data);
+            sent_at[tag] = t;
+            in_flight++;
+        }
+        memmove(in, in + pos, in_len - pos);
+        in_len -= pos;
+    }
+    close(fd);
+    return NULL;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d depth] [-s seconds] [-w write_percent] <socket_path>\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int nclients = 4, opt;
+    while ((opt = getopt(argc, argv, "c:d:s:w:")) != -1) {
+        if (opt == 'c') nclients = atoi(optarg);
+        else if (opt == 'd') depth = atoi(optarg);
+        else if (opt == 's') seconds = atof(optarg);
+        else if (opt == 'w') write_percent = atoi(optarg);
+        else { usage(argv[0]); return 1; }
+    }
+    if (argc - optind != 1 || nclients < 1 || nclients > MAX_CLIENTS || depth < 1 || depth > MAX_DEPTH ||
+        seconds <= 0 || write_percent < 0 || write_percent > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    socket_path = argv[optind];
+
+    static Client clients[MAX_CLIENTS];
+    if (setup(clients, nclients) != 0) return 1;
+
+    double start = now();
+    for (int i = 0; i < nclients; i++) {
+        clients[i].id = i;
+        pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+    unsigned long ops = 0, failed = 0;
+    double latency = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        ops += clients[i].ops;
+        failed += clients[i].failed;
+        latency += clients[i].latency_sum;
+    }
+    double elapsed = now() - start;
+
+    printf("%d clients, depth %d, %d%% writes: %lu requests in %.2f s, %.0f ops/s, mean latency %.1f us\n",
+           nclients, depth, write_percent, ops, elapsed, ops / elapsed, ops ? latency / ops * 1e6 : 0.0);
+    if (failed) {
+        printf("Error: %lu requests failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
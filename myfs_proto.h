@@ -0,0 +1,77 @@
+// Wire protocol between myfsd and its clients over a Unix stream socket.
+//
+// Every message is a fixed little-endian header followed by 'len' payload
+// bytes. A client may send any number of requests without waiting; the
+// server answers each one with a response carrying the request's tag, in
+// the order the requests arrived on that connection.
+//
+// Requests work on inode numbers, like the *_at calls in myfs.h, so a
+// client resolves a path once (MYFSP_LOOKUP) and then never sends it again.
+// 'result' in a response is what the matching libmyfs call returned: an
+// inode number or byte count on success, a negative MYFS_E* code otherwise.
+#ifndef MYFS_PROTO_H
+#define MYFS_PROTO_H
+
+#include <stdint.h>
+#include "myfs.h"
+
+#define MYFSP_REQ_HEADER 32
+#define MYFSP_RESP_HEADER 16
+#define MYFSP_MAX_PAYLOAD (MYFS_FILE_MAX + MYFS_NAME_MAX + 1)
+
+/*
+ * Request header:
+ *   0   u32  len      payload bytes after the header
+ *   4   u32  tag      echoed in the response
+ *   8   u8   op       MYFSP_* below
+ *   9   u8   reserved[3]
+ *   12  u32  ino      inode the request works on (file, or directory for *_AT)
+ *   16  u64  offset   byte offset; READDIR: entries to skip; TRUNCATE: new size
+ *   24  u32  count    READ: bytes wanted; READDIR: entries wanted;
+ *                     CREATE_AT: name length (the data follows the name);
+ *                     LINK_AT: directory to link into
+ *   28  u32  reserved
+ *
+ * Response header:
+ *   0   u32  len      payload bytes after the header
+ *   4   u32  tag
+ *   8   i64  result
+ */
+enum {
+    MYFSP_LOOKUP = 1,   // payload: absolute path -> inode number
+    MYFSP_LOOKUP_AT,    // ino: directory, payload: name -> inode number
+    MYFSP_STAT,         // ino -> 0, payload: struct myfs_stat as MYFSP_STAT_SIZE bytes
+    MYFSP_STATFS,       // -> 0, payload: struct myfs_statfs as MYFSP_STATFS_SIZE bytes
+    MYFSP_MKDIR_AT,     // ino: directory, payload: name -> new inode number
+    MYFSP_CREATE_AT,    // ino: directory, count: name length, payload: name then data -> new inode number
+    MYFSP_UNLINK_AT,    // ino: directory, payload: name -> 0
+    MYFSP_RMDIR_AT,     // ino: directory, payload: name -> 0
+    MYFSP_LINK_AT,      // ino: target, count: directory, payload: name -> 0
+    MYFSP_READ,         // ino, offset, count -> bytes read, payload: the bytes
+    MYFSP_WRITE,        // ino, offset, payload: data -> bytes written
+    MYFSP_TRUNCATE,     // ino, offset: new size -> 0
+    MYFSP_READDIR,      // ino: directory, offset: entries to skip, count: most to return
+                        //   -> entries returned, payload: per entry u32 ino, u8 name length, name
+    MYFSP_SYNC,         // -> 0
+};
+
+#define MYFSP_STAT_SIZE 40   // u32 ino, is_dir, size, nlink, blocks, first_block; i64 ctime, mtime
+#define MYFSP_STATFS_SIZE 28 // u32 block_size, total_inodes, free_inodes, total_blocks, free_blocks; u64 total_bytes
+
+static inline void myfsp_put32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static inline void myfsp_put64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+static inline uint32_t myfsp_get32(const unsigned char* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t myfsp_get64(const unsigned char* p) {
+    return (uint64_t)myfsp_get32(p) | (uint64_t)myfsp_get32(p + 4) << 32;
+}
+
+#endif
@@ -0,0 +1,554 @@
+// myfs_work: workload generator and trace replayer. It either synthesises a
+// mix of mkdir, cp-to, ln, rm, append and truncate under one directory of
+// an image, or replays a trace of shell commands, and then reports the
+// command rate, latency percentiles per command, how fragmented the files
+// are and how much space they take beyond their contents.
+//
+// A trace is text, one shell command per line preceded by the time it
+// started, in microseconds from the start of the run:
+//     1520 mkdir /work/d1
+//     1733 cp-to @8192 /work/d1/f2
+// A cp-to source written as @N stands for N bytes of generated data, so a
+// trace replays without the host files it was recorded from. The shell
+// records the same format with --trace=file.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "myfs.h"
+#include "myfs_hist.h"
+
+#define MAX_ARG 512 // longest path or argument in a command line
+#define MAX_LINE (4 * MAX_ARG)
+
+// Commands
+// Generated and replayed commands both go through run_line, which does what
+// the shell does for the command, so the two are timed alike.
+enum { CMD_MKDIR, CMD_RMDIR, CMD_CP_TO, CMD_LN, CMD_RM, CMD_APPEND, CMD_TRUNCATE, CMD_LS, CMD_READ, CMD_CD, CMD_KINDS };
+const char* cmd_names[CMD_KINDS] = { "mkdir", "rmdir", "cp-to", "ln", "rm", "append", "truncate", "ls", "read", "cd" };
+
+typedef struct {
+    myfs_hist_t latency; // nanoseconds
+    unsigned long failed;
+} CommandStats;
+
+myfs_t* fs;
+CommandStats command_stats[CMD_KINDS];
+unsigned long skipped = 0; // trace lines not understood, generated commands with nowhere to go
+FILE* trace_out = NULL;
+double run_start;
+char payload[MYFS_FILE_MAX];
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int command_kind(const char* name) {
+    for (int k = 0; k < CMD_KINDS; k++)
+        if (strcmp(cmd_names[k], name) == 0) return k;
+    return -1;
+}
+
+// cp-to source: @N is N generated bytes, anything else a host file.
+long load_source(const char* source, const char** data) {
+    static char host_data[MYFS_FILE_MAX];
+    if (source[0] == '@') {
+        long size = atol(source + 1);
+        *data = payload;
+        return size < 0 || size > MYFS_FILE_MAX ? MYFS_EFBIG : size;
+    }
+    FILE* in = fopen(source, "rb");
+    if (!in) return MYFS_ENOENT;
+    long size = fread(host_data, 1, sizeof(host_data), in);
+    int more = fgetc(in) != EOF;
+    fclose(in);
+    *data = host_data;
+    return more ? MYFS_EFBIG : size;
+}
+
+// Returns a negative MYFS_E* code if the command failed, else 0 or more
+// (the new inode number for mkdir and cp-to).
+long execute(int kind, const char* a1, const char* a2, const char* a3) {
+    static char buffer[MYFS_FILE_MAX];
+    struct myfs_stat st;
+    long rc, n;
+    switch (kind) {
+    case CMD_MKDIR: return myfs_mkdir(fs, a1);
+    case CMD_RMDIR: return myfs_rmdir(fs, a1);
+    case CMD_LN: return myfs_link(fs, a1, a2);
+    case CMD_RM: return myfs_unlink(fs, a1);
+    case CMD_CD: return myfs_chdir(fs, a1[0] ? a1 : "/");
+    case CMD_CP_TO: {
+        const char* data;
+        long size = load_source(a1, &data);
+        return size < 0 ? size : myfs_create(fs, a2, data, size);
+    }
+    case CMD_APPEND:
+    case CMD_TRUNCATE:
+        n = atol(a2);
+        if (n <= 0) return MYFS_EINVAL;
+        if ((rc = myfs_stat(fs, a1, &st)) != 0) return rc;
+        if (st.is_dir) return MYFS_EISDIR;
+        if (kind == CMD_APPEND) return st.size + n > MYFS_FILE_MAX ? MYFS_EFBIG : myfs_truncate(fs, st.ino, st.size + n);
+        return myfs_truncate(fs, st.ino, n >= st.size ? 0 : st.size - n);
+    case CMD_LS: {
+        myfs_dir_t* d;
+        struct myfs_dirent entry;
+        if ((rc = myfs_opendir(fs, a1[0] ? a1 : ".", &d)) != 0) return rc;
+        while ((rc = myfs_readdir(d, &entry)) == 1) {}
+        myfs_closedir(d);
+        return rc;
+    }
+    case CMD_READ:
+        if ((rc = myfs_lookup(fs, a1)) < 0) return rc;
+        n = atol(a3) > MYFS_FILE_MAX ? MYFS_FILE_MAX : atol(a3);
+        return myfs_pread(fs, rc, buffer, n, atol(a2));
+    }
+    return MYFS_EINVAL;
+}
+
+// Runs one command line; 'record' times it and writes it to the trace.
+// Lines that are not commands this tool runs are counted as skipped.
+long run_line(const char* line, int record) {
+    char cmd[16] = {0}, a1[MAX_ARG] = {0}, a2[MAX_ARG] = {0}, a3[MAX_ARG] = {0};
+    if (sscanf(line, "%15s %511s %511s %511s", cmd, a1, a2, a3) < 1 || cmd[0] == '#') return 0;
+    int kind = command_kind(cmd);
+    if (kind < 0) {
+        skipped++;
+        return MYFS_EINVAL;
+    }
+    double start = now();
+    long rc = execute(kind, a1, a2, a3);
+    if (!record) return rc;
+    double end = now();
+    myfs_hist_record(&command_stats[kind].latency, (uint64_t)((end - start) * 1e9));
+    if (rc < 0) command_stats[kind].failed++;
+    if (trace_out) fprintf(trace_out, "%ld %s\n", (long)((start - run_start) * 1e6), line);
+    return rc;
+}
+
+// Generator
+// The generator keeps its own model of the tree it builds: the directories
+// with their entry counts, and every file name with its inode, so that it
+// can pick targets without asking the image.
+typedef struct {
+    char* path;
+    int entries;
+} Dir;
+
+typedef struct {
+    char* path;
+    int dir;
+    uint32_t ino;
+} Name;
+
+enum { GEN_MKDIR, GEN_CP_TO, GEN_LN, GEN_APPEND, GEN_TRUNCATE, GEN_KINDS };
+const char* gen_names[GEN_KINDS] = { "mkdir", "cp-to", "ln", "append", "truncate" };
+int gen_weights[GEN_KINDS] = { 5, 45, 5, 25, 20 };
+
+Dir* dirs = NULL;
+Name* names = NULL;
+int dir_count = 0, name_count = 0, dir_capacity = 0, name_capacity = 0;
+long* file_sizes; // by inode number; links share one
+unsigned long name_counter = 0;
+uint64_t rng = 0x9E3779B97F4A7C15ULL;
+long min_size = 1, max_size = MYFS_FILE_MAX;
+int fanout = 16, delete_percent = 20;
+
+uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Log-uniform between min_size and max_size: a power of two is picked
+// uniformly, then a size within it, so small files are as common per
+// octave as large ones.
+long sample_size(void) {
+    int low = 63 - __builtin_clzl(min_size), high = 63 - __builtin_clzl(max_size);
+    int octave = low + next_random() % (high - low + 1);
+    long from = 1L << octave, to = (2L << octave) - 1;
+    if (from < min_size) from = min_size;
+    if (to > max_size) to = max_size;
+    return from + next_random() % (to - from + 1);
+}
+
+void add_dir(const char* path) {
+    if (dir_count == dir_capacity) {
+        dir_capacity = dir_capacity ? dir_capacity * 2 : 64;
+        dirs = realloc(dirs, dir_capacity * sizeof(Dir));
+    }
+    dirs[dir_count++] = (Dir){ strdup(path), 0 };
+}
+
+void add_name(const char* path, int dir, uint32_t ino) {
+    if (name_count == name_capacity) {
+        name_capacity = name_capacity ? name_capacity * 2 : 256;
+        names = realloc(names, name_capacity * sizeof(Name));
+    }
+    names[name_count++] = (Name){ strdup(path), dir, ino };
+    dirs[dir].entries++;
+}
+
+// A directory with room for another entry under the fan-out, and short
+// enough a path to hold one, or -1.
+int has_room(int d) {
+    return dirs[d].entries < fanout && strlen(dirs[d].path) < MAX_ARG - 24;
+}
+
+int pick_dir(void) {
+    for (int tries = 0; tries < 32; tries++) {
+        int d = next_random() % dir_count;
+        if (has_room(d)) return d;
+    }
+    for (int d = 0; d < dir_count; d++)
+        if (has_room(d)) return d;
+    return -1;
+}
+
+// Creates a new entry named prefix<n> in a directory with room; returns the
+// result of the command, or MYFS_ENOSPC if every directory is full.
+long gen_create(int mkdir, int record) {
+    int d = pick_dir();
+    if (d < 0) return MYFS_ENOSPC;
+    char path[MAX_ARG], line[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/%c%lu", dirs[d].path, mkdir ? 'd' : 'f', ++name_counter);
+    long size = mkdir ? 0 : sample_size();
+    if (mkdir) snprintf(line, sizeof(line), "mkdir %s", path);
+    else snprintf(line, sizeof(line), "cp-to @%ld %s", size, path);
+    long rc = run_line(line, record);
+    if (rc < 0) return rc;
+    if (mkdir) {
+        add_dir(path);
+        dirs[d].entries++;
+    } else {
+        add_name(path, d, rc);
+        file_sizes[rc] = size;
+    }
+    return rc;
+}
+
+void gen_link(void) {
+    int d = pick_dir();
+    if (d < 0) { skipped++; return; }
+    Name* target = &names[next_random() % name_count];
+    char path[MAX_ARG], line[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/l%lu", dirs[d].path, ++name_counter);
+    snprintf(line, sizeof(line), "ln %s %s", target->path, path);
+    if (run_line(line, 1) == 0) add_name(path, d, target->ino);
+}
+
+void gen_remove(int index, int record) {
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "rm %s", names[index].path);
+    if (run_line(line, record) != 0) return;
+    dirs[names[index].dir].entries--;
+    free(names[index].path);
+    names[index] = names[--name_count];
+}
+
+// Grows a file by a sampled length, or shortens it by part of its size.
+void gen_resize(int grow) {
+    Name* name = &names[next_random() % name_count];
+    long size = file_sizes[name->ino], n;
+    if (grow) {
+        n = sample_size();
+        if (n > MYFS_FILE_MAX - size) n = MYFS_FILE_MAX - size;
+    } else {
+        n = size ? 1 + (long)(next_random() % size) : 0;
+    }
+    if (n <= 0) { skipped++; return; }
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "%s %s %ld", grow ? "append" : "truncate", name->path, n);
+    if (run_line(line, 1) == 0) file_sizes[name->ino] = grow ? size + n : size - n;
+}
+
+void generate_one(void) {
+    if ((int)(next_random() % 100) < delete_percent) {
+        if (name_count) gen_remove(next_random() % name_count, 1);
+        else skipped++;
+        return;
+    }
+    int total = 0, kind = 0;
+    for (int k = 0; k < GEN_KINDS; k++) total += gen_weights[k];
+    int pick = next_random() % total;
+    while (pick >= gen_weights[kind]) pick -= gen_weights[kind++];
+    // Commands on existing files create one first when there is none.
+    if (name_count == 0 && kind != GEN_MKDIR) kind = GEN_CP_TO;
+    if (kind == GEN_MKDIR || kind == GEN_CP_TO) {
+        if (gen_create(kind == GEN_MKDIR, 1) == MYFS_ENOSPC && pick_dir() < 0) skipped++;
+    } else if (kind == GEN_LN) {
+        gen_link();
+    } else {
+        gen_resize(kind == GEN_APPEND);
+    }
+}
+
+// Ages the image before the measured run: each round fills it to about 90%
+// of its data blocks (or until it runs out of inodes or space), then
+// removes a random half of the files. None of this is timed or traced.
+void age(int rounds) {
+    for (int round = 0; round < rounds; round++) {
+        struct myfs_statfs sfs;
+        for (;;) {
+            myfs_statfs(fs, &sfs);
+            if (sfs.free_blocks < sfs.total_blocks / 10 || sfs.free_inodes < 8) break;
+            long rc = gen_create(0, 0);
+            if (rc == MYFS_ENOSPC && pick_dir() < 0) rc = gen_create(1, 0);
+            if (rc < 0) break;
+        }
+        for (int n = name_count / 2; n > 0 && name_count; n--) gen_remove(next_random() % name_count, 0);
+    }
+}
+
+int parse_mix(const char* spec) {
+    int weights[GEN_KINDS] = {0};
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (char* item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        int k = 0;
+        while (k < GEN_KINDS && strcmp(gen_names[k], item) != 0) k++;
+        if (k == GEN_KINDS || atoi(eq + 1) < 0) return -1;
+        weights[k] = atoi(eq + 1);
+    }
+    int total = 0;
+    for (int k = 0; k < GEN_KINDS; k++) total += weights[k];
+    if (total == 0) return -1;
+    memcpy(gen_weights, weights, sizeof(weights));
+    return 0;
+}
+
+// Replay
+// Commands run in trace order; with a speed above 0 each waits for its
+// recorded start time divided by the speed, otherwise they run back to back.
+int replay(const char* path, double speed) {
+    FILE* in = fopen(path, "r");
+    if (!in) {
+        printf("Error: Cannot open trace '%s'.\n", path);
+        return -1;
+    }
+    char line[MAX_LINE + 32];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* command;
+        long at = strtol(line, &command, 10);
+        if (command == line) continue; // blank or comment
+        while (*command == ' ') command++;
+        if (speed > 0) {
+            double wait = run_start + at / 1e6 / speed - now();
+            if (wait > 0) usleep((useconds_t)(wait * 1e6));
+        }
+        run_line(command, 1);
+    }
+    fclose(in);
+    return 0;
+}
+
+// Report
+typedef struct {
+    unsigned long files, multi_block_files, fragmented_files, extents;
+    unsigned long file_bytes, used_blocks;
+} Layout;
+
+// Walks the whole image once, visiting each inode once however many names
+// it has. A file's extents are its runs of consecutive data blocks.
+void scan_layout(uint32_t dir, unsigned char* seen, Layout* out) {
+    myfs_dir_t* d;
+    struct myfs_dirent entry;
+    if (myfs_opendir_ino(fs, dir, &d) != 0) return;
+    while (myfs_readdir(d, &entry) == 1) {
+        if (seen[entry.ino]) continue;
+        seen[entry.ino] = 1;
+        struct myfs_stat st;
+        uint32_t map[MYFS_MAP_SLOTS];
+        if (myfs_stat_ino(fs, entry.ino, &st) != 0) continue;
+        if (st.is_dir) {
+            scan_layout(entry.ino, seen, out);
+            continue;
+        }
+        out->files++;
+        out->file_bytes += st.size;
+        if (myfs_block_map(fs, entry.ino, map) < 2) continue;
+        unsigned long extents = 0;
+        uint32_t last = MYFS_NO_BLOCK;
+        for (int i = 0; i < MYFS_MAP_SLOTS; i++) {
+            if (map[i] == MYFS_NO_BLOCK) continue;
+            if (last == MYFS_NO_BLOCK || map[i] != last + 1) extents++;
+            last = map[i];
+        }
+        out->multi_block_files++;
+        out->extents += extents;
+        if (extents > 1) out->fragmented_files++;
+    }
+    myfs_closedir(d);
+}
+
+void report(double elapsed, const char* json_path) {
+    unsigned long commands = 0, failed = 0;
+    for (int k = 0; k < CMD_KINDS; k++) {
+        commands += command_stats[k].latency.count;
+        failed += command_stats[k].failed;
+    }
+    printf("%lu commands in %.2f s, %.0f commands/s, %lu failed, %lu skipped\n", commands, elapsed,
+           elapsed > 0 ? commands / elapsed : 0.0, failed, skipped);
+    printf("  %-9s %8s %10s %10s %10s %10s %10s %8s\n", "command", "count", "mean_us", "p50_us", "p99_us",
+           "p99.9_us", "max_us", "failed");
+    for (int k = 0; k < CMD_KINDS; k++) {
+        myfs_hist_t* h = &command_stats[k].latency;
+        if (h->count == 0) continue;
+        printf("  %-9s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %8lu\n", cmd_names[k], (unsigned long)h->count,
+               myfs_hist_mean(h) / 1e3, myfs_hist_percentile(h, 50) / 1e3, myfs_hist_percentile(h, 99) / 1e3,
+               myfs_hist_percentile(h, 99.9) / 1e3, h->max / 1e3, command_stats[k].failed);
+    }
+
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    Layout layout = {0};
+    unsigned char* seen = calloc(sfs.total_inodes, 1);
+    seen[MYFS_ROOT_INO] = 1;
+    scan_layout(MYFS_ROOT_INO, seen, &layout);
+    free(seen);
+    layout.used_blocks = sfs.total_blocks - sfs.free_blocks;
+    double extents_per_file = layout.multi_block_files ? (double)layout.extents / layout.multi_block_files : 0.0;
+    double amplification = layout.file_bytes ? (double)layout.used_blocks * sfs.block_size / layout.file_bytes : 0.0;
+    printf("Fragmentation: %lu of %lu multi-block files fragmented, %.2f extents per file\n",
+           layout.fragmented_files, layout.multi_block_files, extents_per_file);
+    printf("Space: %lu data blocks in use for %lu bytes in %lu files, amplification %.2f\n", layout.used_blocks,
+           layout.file_bytes, layout.files, amplification);
+    struct myfs_layout free_space;
+    myfs_layout(fs, &free_space);
+    printf("Free space: %u blocks in %u runs, largest %u blocks\n", free_space.free_blocks, free_space.free_extents,
+           free_space.largest_free_run);
+
+    if (!json_path) return;
+    FILE* out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+    if (!out) {
+        printf("Error: Cannot write '%s'.\n", json_path);
+        return;
+    }
+    fprintf(out, "{\"commands\": %lu, \"seconds\": %.3f, \"commands_per_sec\": %.1f, \"failed\": %lu, "
+                 "\"skipped\": %lu, \"latency_ns\": {", commands, elapsed, elapsed > 0 ? commands / elapsed : 0.0,
+            failed, skipped);
+    int first = 1;
+    for (int k = 0; k < CMD_KINDS; k++) {
+        myfs_hist_t* h = &command_stats[k].latency;
+        if (h->count == 0) continue;
+        fprintf(out, "%s\"%s\": {\"count\": %lu, \"mean\": %.0f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, "
+                     "\"max\": %lu, \"failed\": %lu}", first ? "" : ", ", cmd_names[k], (unsigned long)h->count,
+                myfs_hist_mean(h), (unsigned long)myfs_hist_percentile(h, 50),
+                (unsigned long)myfs_hist_percentile(h, 99), (unsigned long)myfs_hist_percentile(h, 99.9),
+                (unsigned long)h->max, command_stats[k].failed);
+        first = 0;
+    }
+    fprintf(out, "}, \"fragmentation\": {\"multi_block_files\": %lu, \"fragmented_files\": %lu, "
+                 "\"extents_per_file\": %.3f}, \"space\": {\"files\": %lu, \"file_bytes\": %lu, \"used_blocks\": %lu, "
+                 "\"amplification\": %.3f}, \"free_space\": {\"blocks\": %u, \"runs\": %u, \"largest_run\": %u}}\n",
+            layout.multi_block_files, layout.fragmented_files, extents_per_file, layout.files, layout.file_bytes,
+            layout.used_blocks, amplification, free_space.free_blocks, free_space.free_extents,
+            free_space.largest_free_run);
+    if (out != stdout) fclose(out);
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <image>\n"
+            "Generate (default):\n"
+            "  -n commands     commands to run (default 10000)\n"
+            "  -m mix          weights, e.g. mkdir=5,cp-to=45,ln=5,append=25,truncate=20\n"
+            "  -d percent      share of commands that are rm (default 20)\n"
+            "  -s min[:max]    file and append sizes, log-uniform (default 1:%d)\n"
+            "  -f fanout       entries per directory before others are used (default 16)\n"
+            "  -a rounds       age the image first: fill to 90%%, delete half, per round\n"
+            "  -D dir          directory to work in, must not exist (default /work)\n"
+            "  -S seed         random seed\n"
+            "Replay:\n"
+            "  -p trace        run the commands of a trace instead\n"
+            "  -x speed        keep the trace's timing, scaled by speed (default 0: back to back)\n"
+            "Both:\n"
+            "  -r trace        record the commands run to a trace\n"
+            "  -j file|-       write the report as JSON\n"
+            "  -F mib          format the image with this size first\n",
+            prog, MYFS_FILE_MAX);
+}
+
+int main(int argc, char* argv[]) {
+    long commands = 10000;
+    int rounds = 0, format_mib = 0, opt;
+    const char *root = "/work", *replay_path = NULL, *record_path = NULL, *json_path = NULL;
+    double speed = 0;
+    while ((opt = getopt(argc, argv, "n:m:d:s:f:a:D:S:p:x:r:j:F:")) != -1) {
+        if (opt == 'n') commands = atol(optarg);
+        else if (opt == 'm' && parse_mix(optarg) == 0) {}
+        else if (opt == 'd') delete_percent = atoi(optarg);
+        else if (opt == 's') {
+            min_size = max_size = atol(optarg);
+            if (strchr(optarg, ':')) max_size = atol(strchr(optarg, ':') + 1);
+        }
+        else if (opt == 'f') fanout = atoi(optarg);
+        else if (opt == 'a') rounds = atoi(optarg);
+        else if (opt == 'D') root = optarg;
+        else if (opt == 'S') rng = strtoull(optarg, NULL, 10) * 2 + 1;
+        else if (opt == 'p') replay_path = optarg;
+        else if (opt == 'x') speed = atof(optarg);
+        else if (opt == 'r') record_path = optarg;
+        else if (opt == 'j') json_path = optarg;
+        else if (opt == 'F') format_mib = atoi(optarg);
+        else { usage(argv[0]); return 1; }
+    }
+    if (argc - optind != 1 || commands < 0 || delete_percent < 0 || delete_percent > 100 || min_size < 1 ||
+        max_size < min_size || max_size > MYFS_FILE_MAX || fanout < 1 || rounds < 0 || speed < 0 || root[0] != '/') {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* image = argv[optind];
+    for (int i = 0; i < MYFS_FILE_MAX; i++) payload[i] = (char)(i * 7);
+
+    int rc = format_mib > 0 ? myfs_mkfs(image, (long)format_mib << 20) : 0;
+    if (rc == 0) rc = myfs_mount(image, &fs);
+    if (rc != 0) {
+        printf("Error: Cannot open '%s': %s.\n", image, myfs_strerror(rc));
+        return 1;
+    }
+    if (record_path && !(trace_out = fopen(record_path, "w"))) {
+        printf("Error: Cannot write trace '%s'.\n", record_path);
+        myfs_unmount(fs);
+        return 1;
+    }
+
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    file_sizes = calloc(sfs.total_inodes, sizeof(long));
+    run_start = now();
+    if (replay_path) {
+        rc = replay(replay_path, speed);
+    } else {
+        // With aging, the work directory is made untraced along with the
+        // aged files, so such a trace replays on a copy of the aged image.
+        char line[MAX_LINE];
+        snprintf(line, sizeof(line), "mkdir %s", root);
+        rc = run_line(line, rounds == 0) < 0 ? -1 : 0;
+        if (rc != 0) printf("Error: Cannot create '%s'; it must not exist yet.\n", root);
+        else {
+            add_dir(root);
+            age(rounds);
+            if (rounds) run_start = now();
+            for (long i = 0; i < commands; i++) generate_one();
+        }
+    }
+    double elapsed = now() - run_start;
+    if (trace_out) fclose(trace_out);
+    if (rc == 0) report(elapsed, json_path);
+    if (myfs_unmount(fs) != 0) {
+        printf("Error: Failed to write back '%s'.\n", image);
+        return 1;
+    }
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,432 @@
+// myfsd: serves one image to any number of local clients over a Unix
+// socket, using the protocol in myfs_proto.h. The daemon holds the only
+// mount of the image, so every client sees the same bitmaps and shares one
+// warm block cache instead of each loading its own copy.
+//
+// Several event-loop threads share the listening socket; each accepts
+// connections and serves them with its own epoll set. Requests are
+// executed as soon as they are complete in a connection's input buffer,
+// so a client can pipeline as many as it likes; replies are queued in the
+// connection's output buffer and written back in order.
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "myfs.h"
+#include "myfs_proto.h"
+
+#define MAX_LOOP_THREADS 64
+#define IN_BUFFER_SIZE (MYFSP_REQ_HEADER + MYFSP_MAX_PAYLOAD)
+#define OUT_HIGH_WATER (1024 * 1024) // stop reading requests while this much is unsent
+#define MAX_EVENTS 64
+
+typedef struct Conn {
+    int fd;
+    unsigned char in[IN_BUFFER_SIZE];
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len, out_sent, out_cap;
+    uint32_t events;     // currently registered with epoll
+    struct Conn* next;   // the loop's list of open connections
+} Conn;
+
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    Conn* conns;
+    unsigned long requests;
+    unsigned long connections;
+} Loop;
+
+myfs_t* fs = NULL;
+int listen_fd = -1;
+volatile sig_atomic_t stopping = 0;
+
+void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// Output Buffer
+// Returns space for 'n' more bytes at the end of the output buffer, or NULL
+// if it cannot grow.
+unsigned char* out_reserve(Conn* c, size_t n) {
+    if (c->out_sent > 0 && c->out_sent == c->out_len) c->out_sent = c->out_len = 0;
+    if (c->out_len + n > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 64 * 1024;
+        while (cap < c->out_len + n) cap *= 2;
+        unsigned char* grown = realloc(c->out, cap);
+        if (!grown) return NULL;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len;
+}
+
+// Appends a reply whose payload has already been written after the header.
+void out_commit(Conn* c, uint32_t tag, int64_t result, uint32_t payload_len) {
+    unsigned char* h = c->out + c->out_len;
+    myfsp_put32(h, payload_len);
+    myfsp_put32(h + 4, tag);
+    myfsp_put64(h + 8, (uint64_t)result);
+    c->out_len += MYFSP_RESP_HEADER + payload_len;
+}
+
+int reply(Conn* c, uint32_t tag, int64_t result, const void* payload, uint32_t payload_len) {
+    unsigned char* p = out_reserve(c, MYFSP_RESP_HEADER + payload_len);
+    if (!p) return -1;
+    if (payload_len) memcpy(p + MYFSP_RESP_HEADER, payload, payload_len);
+    out_commit(c, tag, result, payload_len);
+    return 0;
+}
+
+// Requests
+// Copies a name out of a payload. Returns 0 or a MYFS_E* code.
+int take_name(const unsigned char* payload, uint32_t len, char* name) {
+    if (len == 0) return MYFS_EINVAL;
+    if (len > MYFS_NAME_MAX) return MYFS_ENAMETOOLONG;
+    memcpy(name, payload, len);
+    name[len] = '\0';
+    if (strlen(name) != len) return MYFS_EINVAL; // embedded NUL
+    return 0;
+}
+
+void encode_stat(const struct myfs_stat* st, unsigned char* p) {
+    myfsp_put32(p, st->ino);
+    myfsp_put32(p + 4, st->is_dir);
+    myfsp_put32(p + 8, st->size);
+    myfsp_put32(p + 12, st->nlink);
+    myfsp_put32(p + 16, st->blocks);
+    myfsp_put32(p + 20, st->first_block);
+    myfsp_put64(p + 24, (uint64_t)st->ctime);
+    myfsp_put64(p + 32, (uint64_t)st->mtime);
+}
+
+void encode_statfs(const struct myfs_statfs* sfs, unsigned char* p) {
+    myfsp_put32(p, sfs->block_size);
+    myfsp_put32(p + 4, sfs->total_inodes);
+    myfsp_put32(p + 8, sfs->free_inodes);
+    myfsp_put32(p + 12, sfs->total_blocks);
+    myfsp_put32(p + 16, sfs->free_blocks);
+    myfsp_put64(p + 20, sfs->total_bytes);
+}
+
+// Lists up to 'want' entries after skipping 'skip', straight into the
+// output buffer. Returns -1 only if the buffer cannot grow.
+int reply_readdir(Conn* c, uint32_t tag, uint32_t ino, uint64_t skip, uint32_t want) {
+    myfs_dir_t* d;
+    int rc = myfs_opendir_ino(fs, ino, &d);
+    if (rc != 0) return reply(c, tag, rc, NULL, 0);
+
+    const uint32_t limit = 64 * 1024;
+    unsigned char* p = out_reserve(c, MYFSP_RESP_HEADER + limit);
+    if (!p) { myfs_closedir(d); return -1; }
+    unsigned char* body = p + MYFSP_RESP_HEADER;
+    uint32_t used = 0, count = 0;
+    struct myfs_dirent entry;
+    uint64_t seen = 0;
+    while (count < want && (rc = myfs_readdir(d, &entry)) == 1) {
+        if (seen++ < skip) continue;
+        uint32_t name_len = strlen(entry.name);
+        if (used + 5 + name_len > limit) break;
+        myfsp_put32(body + used, entry.ino);
+        body[used + 4] = name_len;
+        memcpy(body + used + 5, entry.name, name_len);
+        used += 5 + name_len;
+        count++;
+    }
+    myfs_closedir(d);
+    if (rc < 0) used = 0;
+    out_commit(c, tag, rc < 0 ? rc : (int64_t)count, used);
+    return 0;
+}
+
+// Executes one request and queues its reply. Returns -1 if the connection
+// has to be dropped.
+int handle_request(Conn* c, const unsigned char* h, const unsigned char* payload) {
+    uint32_t len = myfsp_get32(h);
+    uint32_t tag = myfsp_get32(h + 4);
+    int op = h[8];
+    uint32_t ino = myfsp_get32(h + 12);
+    uint64_t offset = myfsp_get64(h + 16);
+    uint32_t count = myfsp_get32(h + 24);
+    char name[MYFS_NAME_MAX + 1];
+    int rc;
+
+    switch (op) {
+    case MYFSP_LOOKUP: {
+        char path[MYFS_PATH_MAX];
+        if (len == 0 || len >= sizeof(path) || payload[0] != '/') return reply(c, tag, MYFS_EINVAL, NULL, 0);
+        memcpy(path, payload, len);
+        path[len] = '\0';
+        return reply(c, tag, myfs_lookup(fs, path), NULL, 0);
+    }
+    case MYFSP_LOOKUP_AT:
+        rc = take_name(payload, len, name);
+        return reply(c, tag, rc ? rc : myfs_lookup_at(fs, ino, name), NULL, 0);
+    case MYFSP_STAT: {
+        struct myfs_stat st;
+        unsigned char buf[MYFSP_STAT_SIZE];
+        rc = myfs_stat_ino(fs, ino, &st);
+        if (rc != 0) return reply(c, tag, rc, NULL, 0);
+        encode_stat(&st, buf);
+        return reply(c, tag, 0, buf, sizeof(buf));
+    }
+    case MYFSP_STATFS: {
+        struct myfs_statfs sfs;
+        unsigned char buf[MYFSP_STATFS_SIZE];
+        myfs_statfs(fs, &sfs);
+        encode_statfs(&sfs, buf);
+        return reply(c, tag, 0, buf, sizeof(buf));
+    }
+    case MYFSP_MKDIR_AT:
+        rc = take_name(payload, len, name);
+        return reply(c, tag, rc ? rc : myfs_mkdir_at(fs, ino, name), NULL, 0);
+    case MYFSP_CREATE_AT:
+        if (count > len) return reply(c, tag, MYFS_EINVAL, NULL, 0);
+        rc = take_name(payload, count, name);
+        return reply(c, tag, rc ? rc : myfs_create_at(fs, ino, name, payload + count, len - count), NULL, 0);
+    case MYFSP_UNLINK_AT:
+        rc = take_name(payload, len, name);
+        return reply(c, tag, rc ? rc : myfs_unlink_at(fs, ino, name), NULL, 0);
+    case MYFSP_RMDIR_AT:
+        rc = take_name(payload, len, name);
+        return reply(c, tag, rc ? rc : myfs_rmdir_at(fs, ino, name), NULL, 0);
+    case MYFSP_LINK_AT:
+        rc = take_name(payload, len, name);
+        return reply(c, tag, rc ? rc : myfs_link_at(fs, ino, count, name), NULL, 0);
+    case MYFSP_READ: {
+        // Read straight into the output buffer behind the reply header.
+        if (count > MYFS_FILE_MAX) count = MYFS_FILE_MAX;
+        unsigned char* p = out_reserve(c, MYFSP_RESP_HEADER + count);
+        if (!p) return -1;
+        long n = offset > MYFS_FILE_MAX ? 0 : myfs_pread(fs, ino, p + MYFSP_RESP_HEADER, count, (long)offset);
+        out_commit(c, tag, n, n > 0 ? (uint32_t)n : 0);
+        return 0;
+    }
+    case MYFSP_WRITE:
+        if (offset > MYFS_FILE_MAX) return reply(c, tag, MYFS_EFBIG, NULL, 0);
+        return reply(c, tag, myfs_pwrite(fs, ino, payload, len, (long)offset), NULL, 0);
+    case MYFSP_TRUNCATE:
+        if (offset > MYFS_FILE_MAX) return reply(c, tag, MYFS_EFBIG, NULL, 0);
+        return reply(c, tag, myfs_truncate(fs, ino, (long)offset), NULL, 0);
+    case MYFSP_READDIR:
+        return reply_readdir(c, tag, ino, offset, count);
+    case MYFSP_SYNC:
+        return reply(c, tag, myfs_sync(fs), NULL, 0);
+    default:
+        return reply(c, tag, MYFS_EINVAL, NULL, 0);
+    }
+}
+
+// Connections
+void set_events(Loop* loop, Conn* c, uint32_t events) {
+    if (events == c->events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+void close_conn(Loop* loop, Conn* c) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (Conn** p = &loop->conns; *p; p = &(*p)->next) {
+        if (*p == c) { *p = c->next; break; }
+    }
+    free(c->out);
+    free(c);
+}
+
+// Writes as much queued output as the socket takes. Returns -1 on error.
+int flush_out(Conn* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n < 0) return -1;
+        c->out_sent += n;
+    }
+    c->out_sent = c->out_len = 0;
+    return 0;
+}
+
+// Executes every complete request in the input buffer, unless the reply
+// backlog is over the high-water mark. Returns -1 on a protocol error.
+int process_input(Loop* loop, Conn* c) {
+    size_t pos = 0;
+    while (c->out_len - c->out_sent < OUT_HIGH_WATER && c->in_len - pos >= MYFSP_REQ_HEADER) {
+        uint32_t len = myfsp_get32(c->in + pos);
+        if (len > MYFSP_MAX_PAYLOAD) return -1;
+        if (c->in_len - pos < MYFSP_REQ_HEADER + len) break;
+        if (handle_request(c, c->in + pos, c->in + pos + MYFSP_REQ_HEADER) != 0) return -1;
+        loop->requests++;
+        pos += MYFSP_REQ_HEADER + len;
+    }
+    if (pos > 0) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+    return 0;
+}
+
+// Reads what has arrived, serves it and writes the replies back. While the
+// client is not reading its replies, the connection stops reading requests.
+void serve_conn(Loop* loop, Conn* c, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) { close_conn(loop, c); return; }
+
+    if (events & EPOLLIN) {
+        for (;;) {
+            if (c->in_len == IN_BUFFER_SIZE) {
+                if (process_input(loop, c) != 0) { close_conn(loop, c); return; }
+                if (c->in_len == IN_BUFFER_SIZE) break; // held back by the reply backlog
+            }
+            ssize_t n = recv(c->fd, c->in + c->in_len, IN_BUFFER_SIZE - c->in_len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) { close_conn(loop, c); return; }
+            c->in_len += n;
+        }
+    }
+
+    // Alternate serving and writing so that replies drain while requests remain.
+    for (;;) {
+        if (process_input(loop, c) != 0 || flush_out(c) != 0) { close_conn(loop, c); return; }
+        int backlog = c->out_len - c->out_sent >= OUT_HIGH_WATER;
+        int more = c->in_len >= MYFSP_REQ_HEADER &&
+                   c->in_len >= MYFSP_REQ_HEADER + (size_t)myfsp_get32(c->in);
+        if (backlog || !more) {
+            uint32_t want = (c->out_sent < c->out_len ? EPOLLOUT : 0) | (backlog ? 0 : EPOLLIN);
+            set_events(loop, c, want);
+            return;
+        }
+    }
+}
+
+void accept_conns(Loop* loop) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return; // EAGAIN: another loop took it, or none left
+        Conn* c = calloc(1, sizeof(Conn));
+        if (!c) { close(fd); continue; }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) { close(fd); free(c); continue; }
+        c->next = loop->conns;
+        loop->conns = c;
+        loop->connections++;
+    }
+}
+
+void* event_loop(void* arg) {
+    Loop* loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, 200); // wakes to notice 'stopping'
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) accept_conns(loop);
+            else serve_conn(loop, events[i].data.ptr, events[i].events);
+        }
+    }
+    while (loop->conns) close_conn(loop, loop->conns);
+    return NULL;
+}
+
+// Startup
+int open_listener(const char* socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+
+    // A socket file nobody answers on is left over from an earlier run.
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: Another server is listening on '%s'.\n", socket_path);
+        close(probe);
+        close(fd);
+        return -1;
+    }
+    if (probe >= 0) close(probe);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        fprintf(stderr, "Error: Cannot listen on '%s': %s.\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-c cache_mib] <virtual_disk_file> <socket_path>\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > 8) threads = 8;
+    if (threads < 1) threads = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:")) != -1) {
+        if (opt == 't') threads = atol(optarg);
+        else if (opt == 'c') myfs_cache_set_limit((size_t)atol(optarg) * 1024 * 1024);
+        else { usage(argv[0]); return 1; }
+    }
+    if (argc - optind != 2 || threads < 1 || threads > MAX_LOOP_THREADS) { usage(argv[0]); return 1; }
+    const char* disk_path = argv[optind];
+    const char* socket_path = argv[optind + 1];
+
+    int rc = myfs_mount(disk_path, &fs);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot open '%s': %s.\n", disk_path, myfs_strerror(rc));
+        return 1;
+    }
+    listen_fd = open_listener(socket_path);
+    if (listen_fd < 0) { myfs_unmount(fs); return 1; }
+
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Every loop watches the listener; EPOLLEXCLUSIVE wakes one per connection.
+    Loop loops[MAX_LOOP_THREADS] = {0};
+    for (int i = 0; i < threads; i++) {
+        loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        pthread_create(&loops[i].thread, NULL, event_loop, &loops[i]);
+    }
+    printf("Serving %s on %s with %ld threads\n", disk_path, socket_path, threads);
+    fflush(stdout);
+
+    unsigned long requests = 0, connections = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(loops[i].thread, NULL);
+        close(loops[i].epoll_fd);
+        requests += loops[i].requests;
+        connections += loops[i].connections;
+    }
+    close(listen_fd);
+    unlink(socket_path);
+
+    printf("Served %lu requests on %lu connections\n", requests, connections);
+    if (myfs_unmount(fs) != 0) {
+        fprintf(stderr, "Error: Failed to write back '%s'.\n", disk_path);
+        return 1;
+    }
+    return 0;
+}
@@ -5,9 +5,36 @@ set -e
 EXECUTABLE="./myfs_test"
 DISK_IMAGE="test_disk.img"
 DISK_SIZE_BYTES="10485760"
-C_SOURCE_FILE="myfs.c"
+C_SOURCE_FILES="myfs.c libmyfs.c"
 LOG_FILE="test_run.log"
 HOST_TEST_FILE="host_file.txt"
+HOST_COPY_FILE="host_copy.txt"
+HOST_TEXT_FILE="host_text.txt"
+HOST_TEST_DIR="host_tree"
+HOST_EXPORT_DIR="host_tree_export"
+HOST_TAR_FILE="host_tree.tar"
+HOST_TAR_DIR="host_tree_untar"
+SECOND_IMAGE="test_shard.img"
+API_TEST_EXECUTABLE="./test_api"
+API_TEST_IMAGE="test_api.img"
+STRESS_TEST_EXECUTABLE="./test_stress"
+STRESS_TEST_IMAGE="test_stress.img"
+STATS_JSON_FILE="test_stats.json"
+SERVER_EXECUTABLE="./myfsd_test"
+LOAD_EXECUTABLE="./myfs_load_test"
+SERVER_SOCKET="test_myfsd.sock"
+SERVER_PID=""
+FUSE_EXECUTABLE="./myfs_fuse_test"
+FUSE_IMAGE="test_fuse.img"
+FUSE_MOUNTPOINT="test_fuse_mnt"
+WORK_EXECUTABLE="./myfs_work_test"
+WORK_IMAGE="test_work.img"
+WORK_TRACE="test_work.trace"
+WORK_JSON_FILE="test_work.json"
+SHELL_TRACE="test_shell.trace"
+BENCH_EXECUTABLE="./bench_myfs_test"
+BENCH_IMAGE="test_bench.img"
+BENCH_JSON_FILE="test_bench.json"
 TEST_FAILED=0
 
 # --- Helper Function ---
@@ -46,8 +73,18 @@ run_and_log() {
 # --- Cleanup Function ---
 cleanup() {
     echo "Cleaning up generated files..."
+    if [ -n "$SERVER_PID" ]; then kill "$SERVER_PID" 2>/dev/null || true; wait "$SERVER_PID" 2>/dev/null || true; fi
     # FIXED: Do not delete the log file, so the user can inspect it.
-    rm -f "$EXECUTABLE" "$DISK_IMAGE" "$HOST_TEST_FILE"
+    rm -f "$EXECUTABLE" "$DISK_IMAGE" "$HOST_TEST_FILE" "$HOST_COPY_FILE" "$HOST_TAR_FILE" "$HOST_TEXT_FILE"
+    rm -f "$API_TEST_EXECUTABLE" "$API_TEST_IMAGE" "$SECOND_IMAGE"
+    rm -f "$STRESS_TEST_EXECUTABLE" "$STRESS_TEST_IMAGE" "$STATS_JSON_FILE"
+    rm -f "$SERVER_EXECUTABLE" "$LOAD_EXECUTABLE" "$SERVER_SOCKET"
+    if mountpoint -q "$FUSE_MOUNTPOINT" 2>/dev/null; then fusermount3 -u "$FUSE_MOUNTPOINT" || true; fi
+    rm -f "$FUSE_EXECUTABLE" "$FUSE_IMAGE"
+    rm -rf "$FUSE_MOUNTPOINT"
+    rm -f "$BENCH_EXECUTABLE" "$BENCH_IMAGE" "$BENCH_JSON_FILE"
+    rm -f "$WORK_EXECUTABLE" "$WORK_IMAGE" "$WORK_TRACE" "$WORK_JSON_FILE" "$SHELL_TRACE"
+    rm -rf "$HOST_TEST_DIR" "$HOST_EXPORT_DIR" "$HOST_TAR_DIR"
 }
 trap cleanup EXIT
 
@@ -55,16 +92,27 @@ trap cleanup EXIT
 
 # 1. Compilation
 echo "Compiling..."
-gcc -Wall -Werror -o "$EXECUTABLE" "$C_SOURCE_FILE"
+gcc -Wall -Werror -pthread -o "$EXECUTABLE" $C_SOURCE_FILES
+gcc -Wall -Werror -pthread -o "$API_TEST_EXECUTABLE" test_api.c libmyfs.c
+gcc -Wall -Werror -pthread -o "$STRESS_TEST_EXECUTABLE" test_stress.c libmyfs.c
+gcc -Wall -Werror -pthread -o "$SERVER_EXECUTABLE" myfsd.c libmyfs.c
+gcc -Wall -Werror -pthread -o "$LOAD_EXECUTABLE" myfs_load.c libmyfs.c
+gcc -Wall -Werror -pthread -o "$WORK_EXECUTABLE" myfs_work.c libmyfs.c
+gcc -Wall -Werror -O2 -pthread -o "$BENCH_EXECUTABLE" bench_myfs.c
 
 # 2. Disk Creation
 echo "Creating disk..."
 # Delete old log and disk to ensure a clean run
-rm -f "$DISK_IMAGE" "$LOG_FILE"
+rm -f "$DISK_IMAGE" "$SECOND_IMAGE" "$LOG_FILE"
 printf "y\n%s\n" "$DISK_SIZE_BYTES" | "$EXECUTABLE" "$DISK_IMAGE" > /dev/null
+printf "y\n%s\n" "$DISK_SIZE_BYTES" | "$EXECUTABLE" "$SECOND_IMAGE" > /dev/null
 
 # 3. Host File Creation
 echo "Hello from the host file!" > "$HOST_TEST_FILE"
+rm -rf "$HOST_TEST_DIR" "$HOST_EXPORT_DIR" "$HOST_TAR_DIR"
+mkdir -p "$HOST_TEST_DIR/nested/deeper"
+for i in 1 2 3 4 5; do head -c $((i * 3000)) /dev/urandom > "$HOST_TEST_DIR/nested/blob$i.bin"; done
+echo "small config" > "$HOST_TEST_DIR/nested/deeper/app.conf"
 
 # 4. Run Command Sequence and Log Everything
 echo "Running tests and generating human-readable log..."
@@ -72,14 +120,311 @@ echo "Running tests and generating human-readable log..."
 run_and_log "Initial df" "df"
 run_and_log "mkdir /dir1" "mkdir /dir1" "/"
 run_and_log "mkdir /dir1/subdir" "mkdir /dir1/subdir" "/dir1"
+run_and_log "cd /dir1/subdir and pwd" $'cd /dir1/subdir\npwd\ncd ..\npwd' "/dir1"
 run_and_log "cp-to /dir1/file1.txt" "cp-to $HOST_TEST_FILE /dir1/file1.txt" "/dir1"
 run_and_log "append to /dir1/file1.txt" "append /dir1/file1.txt 10" "/dir1"
 run_and_log "truncate /dir1/file1.txt" "truncate /dir1/file1.txt 5" "/dir1"
+run_and_log "cp-from /dir1/file1.txt" "cp-from /dir1/file1.txt $HOST_COPY_FILE" "/dir1"
+run_and_log "append past the inline limit" "append /dir1/file1.txt 5000" "/dir1"
+run_and_log "write across a block boundary" "write /dir1/file1.txt 4090 $HOST_TEST_FILE" "/dir1"
+
+# Reading the patched range back must return exactly the bytes written.
+echo "Test Description: read returns the written range" >> "$LOG_FILE"
+if "$EXECUTABLE" "$DISK_IMAGE" read /dir1/file1.txt 4090 "$(stat -c %s "$HOST_TEST_FILE")" | cmp -s - "$HOST_TEST_FILE"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
 run_and_log "ln /dir1/file1.txt /link1" "ln /dir1/file1.txt /link1" "/"
 run_and_log "rm /link1" "rm /link1" "/"
 run_and_log "rm /dir1/file1.txt" "rm /dir1/file1.txt" "/dir1"
 run_and_log "rmdir /dir1/subdir" "rmdir /dir1/subdir" "/dir1"
 run_and_log "rmdir /dir1" "rmdir /dir1" "/"
+run_and_log "import host tree" "import $HOST_TEST_DIR /imported" "/"
+run_and_log "ls imported subtree" "ls /imported/nested/deeper" "/imported/nested"
+run_and_log "export imported tree" "export /imported $HOST_EXPORT_DIR" "/imported"
+
+# The exported tree must match what was imported, byte for byte.
+echo "Test Description: export matches import source" >> "$LOG_FILE"
+if diff -r "$HOST_TEST_DIR" "$HOST_EXPORT_DIR" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+run_and_log "tar-out imported tree" "tar-out /imported $HOST_TAR_FILE" "/imported"
+run_and_log "tar-in into /untarred" "tar-in $HOST_TAR_FILE /untarred" "/"
+
+# A round trip through a pipe must also reproduce the original tree.
+echo "Test Description: tar-out | tar-in pipeline matches import source" >> "$LOG_FILE"
+mkdir -p "$HOST_TAR_DIR"
+if "$EXECUTABLE" "$DISK_IMAGE" tar-out /untarred - 2>> "$LOG_FILE" | tar -xf - -C "$HOST_TAR_DIR" \
+    && diff -r "$HOST_TEST_DIR" "$HOST_TAR_DIR" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+run_and_log "cp a tree to a second mounted image" \
+    $'mount '"$SECOND_IMAGE"$' shard\ncp /imported shard:/\nuse shard\nls /imported/nested\nuse test_disk\nmounts' "/"
+
+# The copy on the second image must export to the original tree as well.
+echo "Test Description: tree copied between images matches import source" >> "$LOG_FILE"
+rm -rf "$HOST_EXPORT_DIR"
+if "$EXECUTABLE" "$SECOND_IMAGE" export /imported "$HOST_EXPORT_DIR" > /dev/null 2>> "$LOG_FILE" \
+    && diff -r "$HOST_TEST_DIR" "$HOST_EXPORT_DIR" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# A text file copied in with compression on must come back out unchanged,
+# also after writing it over with compression off has expanded it and
+# 'compress' has packed it once more.
+for i in $(seq 1 800); do echo "line $i of a text file that compresses well"; done > "$HOST_TEXT_FILE"
+run_and_log "cp-to with compression on" \
+    $'compression on\ncp-to '"$HOST_TEXT_FILE"$' /packed.txt\ncompression off\nwrite /packed.txt 0 '"$HOST_TEXT_FILE"$'\ncompress /packed.txt' "/"
+echo "Test Description: compressed file reads back" >> "$LOG_FILE"
+rm -f "$HOST_COPY_FILE"
+if "$EXECUTABLE" "$DISK_IMAGE" cp-from /packed.txt "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1 \
+    && cmp "$HOST_TEXT_FILE" "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# Two copies of one file share their blocks with dedup on; a write to the
+# second copies the blocks it touches, and the first must read back as it was.
+run_and_log "cp-to twice with dedup on" \
+    $'dedup on\ncp-to '"$HOST_TEXT_FILE"$' /same1.txt\ncp-to '"$HOST_TEXT_FILE"$' /same2.txt\ndedup\nwrite /same2.txt 100 '"$HOST_TEST_FILE"$'\ndedup off\ndedup' "/"
+echo "Test Description: deduplicated file reads back after a write to its copy" >> "$LOG_FILE"
+rm -f "$HOST_COPY_FILE"
+if "$EXECUTABLE" "$DISK_IMAGE" cp-from /same1.txt "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1 \
+    && cmp "$HOST_TEXT_FILE" "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# A clone of the compressed file shares its blocks; writing into the clone
+# must leave the original unchanged.
+run_and_log "clone a file and write to the clone" \
+    $'clone /packed.txt /cloned.txt\nwrite /cloned.txt 5000 '"$HOST_TEST_FILE"$'\ndedup' "/"
+echo "Test Description: clone source reads back after a write to the clone" >> "$LOG_FILE"
+rm -f "$HOST_COPY_FILE"
+if "$EXECUTABLE" "$DISK_IMAGE" cp-from /packed.txt "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1 \
+    && cmp "$HOST_TEXT_FILE" "$HOST_COPY_FILE" >> "$LOG_FILE" 2>&1; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# With checksums on, every block written since must match its CRC on scrub.
+run_and_log "checksums on and scrub" \
+    $'checksums on\ncp-to '"$HOST_TEXT_FILE"$' /summed.txt\nscrub 2\nchecksums' "/"
+
+run_and_log "stats after a few commands" $'ls /imported\nmkdir /statdir\nrmdir /statdir\nstats' "/"
+run_and_log "frag report and df -v" $'frag\ndf -v' "/"
+
+# Everything the tests above did must leave a consistent image.
+echo "Test Description: fsck after the tests above" >> "$LOG_FILE"
+output=$(printf "fsck\nexit\n" | "$EXECUTABLE" "$DISK_IMAGE" 2>&1)
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+if echo "$output" | grep -q "No problems found"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# --stats-json must dump the counters and the command that ran.
+echo "Test Description: --stats-json dump" >> "$LOG_FILE"
+if "$EXECUTABLE" --stats-json="$STATS_JSON_FILE" "$DISK_IMAGE" ls /imported > /dev/null \
+    && grep -q '"ls": {"count": 1' "$STATS_JSON_FILE" && grep -q '"cache_hits": {' "$STATS_JSON_FILE"; then
+    cat "$STATS_JSON_FILE" >> "$LOG_FILE"
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# The library is also checked on its own, without the shell in between.
+echo "Test Description: libmyfs API checks" >> "$LOG_FILE"
+api_status=0
+output=$("$API_TEST_EXECUTABLE" "$API_TEST_IMAGE" 2>&1) || api_status=$?
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+if [ "$api_status" -eq 0 ] && ! echo "$output" | grep -q "Error:"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# Many threads on one handle, then a consistency check of the whole image.
+echo "Test Description: libmyfs multithreaded stress" >> "$LOG_FILE"
+stress_status=0
+output=$("$STRESS_TEST_EXECUTABLE" "$STRESS_TEST_IMAGE" 2>&1) || stress_status=$?
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+if [ "$stress_status" -eq 0 ] && ! echo "$output" | grep -q "Error:"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+
+# The server owns the image while it runs: the shell must be turned away,
+# and clients drive it over the socket until it is stopped.
+echo "Test Description: myfsd serves pipelined clients" >> "$LOG_FILE"
+server_ok=1
+"$SERVER_EXECUTABLE" -t 2 "$DISK_IMAGE" "$SERVER_SOCKET" >> "$LOG_FILE" 2>&1 &
+SERVER_PID=$!
+for i in $(seq 50); do [ -S "$SERVER_SOCKET" ] && break; sleep 0.1; done
+output=$("$EXECUTABLE" "$DISK_IMAGE" ls / 2>&1) || true
+echo "Shell while served: $output" >> "$LOG_FILE"
+echo "$output" | grep -q "in use" || server_ok=0
+output=$("$LOAD_EXECUTABLE" -c 4 -d 16 -s 1 "$SERVER_SOCKET" 2>&1) || server_ok=0
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+kill -TERM "$SERVER_PID" && wait "$SERVER_PID" || server_ok=0
+SERVER_PID=""
+if [ "$server_ok" -eq 1 ] && ! echo "$output" | grep -q "Error:"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+run_and_log "ls files written through the server" "ls /load" "/"
+
+
+# A generated workload is recorded and replayed on a fresh image, where it
+# must run the same commands; the shell records a trace of its own too.
+echo "Test Description: workload generation and trace replay" >> "$LOG_FILE"
+work_ok=1
+output=$("$WORK_EXECUTABLE" -F 16 -n 2000 -S 3 -r "$WORK_TRACE" "$WORK_IMAGE" 2>&1) || work_ok=0
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+generated=$(echo "$output" | head -1 | cut -d' ' -f1)
+generated_failed=$(echo "$output" | head -1 | cut -d' ' -f8)
+output=$("$WORK_EXECUTABLE" -F 16 -p "$WORK_TRACE" -j "$WORK_JSON_FILE" "$WORK_IMAGE" 2>&1) || work_ok=0
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+grep -q "\"commands\": $generated, .*\"failed\": $generated_failed, " "$WORK_JSON_FILE" || work_ok=0
+grep -q '"fragmentation": {' "$WORK_JSON_FILE" && grep -q '"free_space": {' "$WORK_JSON_FILE" || work_ok=0
+# Aging fills and thins out a fresh image before the measured commands.
+output=$("$WORK_EXECUTABLE" -F 16 -a 2 -n 500 "$WORK_IMAGE" 2>&1) || work_ok=0
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+"$EXECUTABLE" --trace="$SHELL_TRACE" "$DISK_IMAGE" ls /imported > /dev/null || work_ok=0
+grep -q "^[0-9]* ls /imported" "$SHELL_TRACE" || work_ok=0
+if [ "$work_ok" -eq 1 ] && ! echo "$output" | grep -q "Error:"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+# The aged image is fragmented; defrag must leave no file it could move in
+# pieces, and leave the image consistent.
+echo "Test Description: defrag of the aged workload image" >> "$LOG_FILE"
+output=$(printf "defrag\nfsck\nexit\n" | "$EXECUTABLE" "$WORK_IMAGE" 2>&1)
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+if echo "$output" | grep -q "Fragmented files *[0-9]* *0$" && echo "$output" | grep -q "No problems found"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+
+# One quick pass of the microbenchmarks, to keep them building and running.
+echo "Test Description: microbenchmarks, one iteration" >> "$LOG_FILE"
+bench_status=0
+output=$("$BENCH_EXECUTABLE" -i 1 -w 0 -j "$BENCH_JSON_FILE" "$BENCH_IMAGE" 2>&1) || bench_status=$?
+echo "Command Output:" >> "$LOG_FILE"
+echo "$output" | sed 's/^/    /' >> "$LOG_FILE"
+if [ "$bench_status" -eq 0 ] && grep -q '"name": "alloc_data_block/fill=99%"' "$BENCH_JSON_FILE" \
+    && grep -q '"name": "cp_from/size=49152"' "$BENCH_JSON_FILE"; then
+    echo "Status: SUCCESS" >> "$LOG_FILE"
+else
+    echo "Status: FAILURE" >> "$LOG_FILE"
+    TEST_FAILED=1
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
+
+
+# Host tools on a FUSE mount of an image, where libfuse3 and /dev/fuse exist.
+echo "Test Description: host tools on a FUSE mount" >> "$LOG_FILE"
+if pkg-config --exists fuse3 2>/dev/null && [ -c /dev/fuse ] && command -v fusermount3 > /dev/null; then
+    fuse_ok=1
+    gcc -Wall -Werror -pthread $(pkg-config --cflags fuse3) -o "$FUSE_EXECUTABLE" myfs_fuse.c libmyfs.c $(pkg-config --libs fuse3)
+    printf "y\n%s\n" "$DISK_SIZE_BYTES" | "$EXECUTABLE" "$FUSE_IMAGE" > /dev/null
+    mkdir -p "$FUSE_MOUNTPOINT"
+    if "$FUSE_EXECUTABLE" "$FUSE_IMAGE" "$FUSE_MOUNTPOINT" >> "$LOG_FILE" 2>&1; then
+        cp -r "$HOST_TEST_DIR" "$FUSE_MOUNTPOINT/tree" 2>> "$LOG_FILE" || fuse_ok=0
+        diff -r "$HOST_TEST_DIR" "$FUSE_MOUNTPOINT/tree" >> "$LOG_FILE" 2>&1 || fuse_ok=0
+        [ "$(find "$FUSE_MOUNTPOINT/tree" -type f | wc -l)" -eq 6 ] || fuse_ok=0
+        fusermount3 -u "$FUSE_MOUNTPOINT" || fuse_ok=0
+        # The daemon writes the image back and releases it after the unmount.
+        for i in $(seq 50); do "$EXECUTABLE" "$FUSE_IMAGE" df 2>&1 | grep -q "in use" || break; sleep 0.1; done
+    else
+        fuse_ok=0
+    fi
+    # What was written through the mount must be on the image afterwards.
+    rm -rf "$HOST_EXPORT_DIR"
+    "$EXECUTABLE" "$FUSE_IMAGE" export /tree "$HOST_EXPORT_DIR" > /dev/null 2>> "$LOG_FILE" || fuse_ok=0
+    diff -r "$HOST_TEST_DIR" "$HOST_EXPORT_DIR" >> "$LOG_FILE" 2>&1 || fuse_ok=0
+    if [ "$fuse_ok" -eq 1 ]; then
+        echo "Status: SUCCESS" >> "$LOG_FILE"
+    else
+        echo "Status: FAILURE" >> "$LOG_FILE"
+        TEST_FAILED=1
+    fi
+else
+    echo "Status: SKIPPED (libfuse3 or /dev/fuse not available)" >> "$LOG_FILE"
+fi
+echo "--------------------------------------------------" >> "$LOG_FILE"
+echo "" >> "$LOG_FILE"
 
 
 # --- Final Output ---
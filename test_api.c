@@ -0,0 +1,271 @@
+// Exercises the libmyfs API directly, without the shell. Prints one line
+// per check and "Error: ..." for each failure; exits non-zero if any failed.
+#include <stdio.h>
+#include <string.h>
+#include "myfs.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+    if (cond) printf("ok: %s\n", what); \
+    else { printf("Error: %s (line %d)\n", what, __LINE__); failures++; } \
+} while (0)
+
+int main(int argc, char* argv[]) {
+    const char* image = argc > 1 ? argv[1] : "test_api.img";
+    myfs_t* fs;
+
+    remove(image);
+    CHECK(myfs_mount(image, &fs) == MYFS_ENOENT, "mount of a missing image is ENOENT");
+    CHECK(myfs_mkfs(image, 4 * 1024 * 1024) == 0, "mkfs");
+    CHECK(myfs_mount(image, &fs) == 0, "mount");
+
+    int dir = myfs_mkdir(fs, "/docs");
+    CHECK(dir > 0, "mkdir /docs");
+    CHECK(myfs_mkdir(fs, "/docs") == MYFS_EEXIST, "mkdir of an existing name is EEXIST");
+    CHECK(myfs_mkdir(fs, "/missing/x") == MYFS_ENOENT, "mkdir under a missing parent is ENOENT");
+    CHECK(myfs_lookup(fs, "/docs") == dir, "lookup /docs");
+
+    const char* text = "hello, library";
+    int ino = myfs_create_at(fs, dir, "a.txt", text, strlen(text));
+    CHECK(ino > 0, "create_at docs/a.txt");
+    CHECK(myfs_create_at(fs, dir, "..", "", 0) == MYFS_EINVAL, "create of '..' is EINVAL");
+
+    // A handle writes across a block boundary, then reads back from the start.
+    myfs_file_t* f;
+    CHECK(myfs_open(fs, "/docs/b.bin", MYFS_O_RDWR | MYFS_O_CREAT, &f) == 0, "open O_CREAT");
+    char block[6000];
+    for (int i = 0; i < (int)sizeof(block); i++) block[i] = (char)(i * 7);
+    CHECK(myfs_write(f, block, sizeof(block)) == (long)sizeof(block), "write 6000 bytes");
+    CHECK(myfs_seek(f, 0, SEEK_SET) == 0, "seek to 0");
+    char back[6000];
+    CHECK(myfs_read(f, back, sizeof(back)) == (long)sizeof(back) && memcmp(block, back, sizeof(back)) == 0,
+          "read back 6000 bytes");
+    CHECK(myfs_read(f, back, 1) == 0, "read at end of file returns 0");
+    CHECK(myfs_close(f) == 0, "close");
+
+    struct myfs_stat st;
+    CHECK(myfs_stat(fs, "/docs/b.bin", &st) == 0 && st.size == sizeof(block) && st.blocks == 2, "stat b.bin");
+    CHECK(myfs_truncate(fs, st.ino, 10) == 0 && myfs_stat_ino(fs, st.ino, &st) == 0 && st.size == 10,
+          "truncate to 10 bytes");
+
+    CHECK(myfs_chdir(fs, "/docs") == 0, "chdir /docs");
+    char cwd[MYFS_PATH_MAX];
+    CHECK(myfs_getcwd(fs, cwd, sizeof(cwd)) == 0 && strcmp(cwd, "/docs") == 0, "getcwd");
+    CHECK(myfs_link(fs, "a.txt", "/a-link") == 0, "link relative to cwd");
+
+    myfs_dir_t* d;
+    struct myfs_dirent entry;
+    int seen = 0, rc;
+    CHECK(myfs_opendir(fs, ".", &d) == 0, "opendir .");
+    while ((rc = myfs_readdir(d, &entry)) == 1) seen++;
+    myfs_closedir(d);
+    CHECK(rc == 0 && seen == 2, "readdir lists two entries");
+
+    CHECK(myfs_rmdir(fs, "/docs") == MYFS_ENOTEMPTY, "rmdir of a non-empty directory is ENOTEMPTY");
+    CHECK(myfs_unlink(fs, "/docs") == MYFS_EISDIR, "unlink of a directory is EISDIR");
+    CHECK(myfs_unmount(fs) == 0, "unmount");
+
+    // Everything above must still be there after a remount.
+    CHECK(myfs_mount(image, &fs) == 0, "remount");
+    myfs_t* again;
+    CHECK(myfs_mount(image, &again) == MYFS_EBUSY, "second mount of the same image is EBUSY");
+    char got[64] = {0};
+    CHECK(myfs_pread(fs, myfs_lookup(fs, "/a-link"), got, sizeof(got), 0) == (long)strlen(text) &&
+          strcmp(got, text) == 0, "pread through the hard link after remount");
+    CHECK(myfs_stat(fs, "/docs/a.txt", &st) == 0 && st.nlink == 2, "link count is 2");
+
+    // A second image mounted alongside the first receives a copy of /docs.
+    char second[512];
+    snprintf(second, sizeof(second), "%s.2", image);
+    myfs_t* fs2;
+    remove(second);
+    CHECK(myfs_mkfs(second, 1024 * 1024) == 0 && myfs_mount(second, &fs2) == 0, "mount a second image");
+    CHECK(myfs_copy(fs, "/docs", fs2, "/") > 0, "copy /docs to the second image");
+    CHECK(myfs_stat(fs2, "/docs/b.bin", &st) == 0 && st.size == 10, "copied file has its size");
+    memset(got, 0, sizeof(got));
+    CHECK(myfs_pread(fs2, myfs_lookup(fs2, "/docs/a.txt"), got, sizeof(got), 0) == (long)strlen(text) &&
+          strcmp(got, text) == 0, "copied file has its contents");
+    CHECK(myfs_copy(fs, "/docs", fs2, "/") == MYFS_EEXIST, "copy onto an existing name is EEXIST");
+    CHECK(myfs_copy(fs, "/docs", fs, "/docs") == MYFS_EINVAL, "copy of a directory into itself is EINVAL");
+
+    struct myfs_io_stats io;
+    CHECK(myfs_io_stats(fs2, &io) == 0 && io.inodes_allocated == 3 && io.writes[MYFS_IO_INODE_TABLE] > 0 &&
+          io.writes[MYFS_IO_BITMAP] > 0 && io.bytes_written % MYFS_BLOCK_SIZE == 0, "I/O counters of the copy");
+
+    struct myfs_cache_stats cs;
+    myfs_cache_stats(&cs);
+    CHECK(cs.hits > 0 && cs.used_bytes <= cs.limit_bytes, "block cache is shared and bounded");
+    myfs_cache_set_limit(0);
+    myfs_cache_stats(&cs);
+    CHECK(cs.used_bytes == 0, "a zero cache limit empties the cache");
+    CHECK(myfs_unmount(fs2) == 0, "unmount the second image");
+    // Two files appended to a block at a time in turn are interleaved on
+    // disk, and removing most names of a directory leaves it full of holes.
+    int many = myfs_mkdir(fs, "/many");
+    int f1 = myfs_create_at(fs, many, "f1", "", 0), f2 = myfs_create_at(fs, many, "f2", "", 0);
+    for (int i = 0; i < 4; i++) {
+        block[0] = (char)i;
+        myfs_pwrite(fs, f1, block, MYFS_BLOCK_SIZE, (long)i * MYFS_BLOCK_SIZE);
+        myfs_pwrite(fs, f2, block, MYFS_BLOCK_SIZE, (long)i * MYFS_BLOCK_SIZE);
+    }
+    char name[16];
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        myfs_create_at(fs, many, name, "x", 1);
+    }
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        if (i % 10 != 9) myfs_unlink_at(fs, many, name);
+    }
+    struct myfs_layout layout;
+    struct myfs_statfs sfs;
+    CHECK(myfs_layout(fs, &layout) == 0 && myfs_statfs(fs, &sfs) == 0 && layout.files_by_extents[4] == 2 &&
+          layout.dir_holes == 36 && layout.directories == 3 && layout.free_blocks == sfs.free_blocks &&
+          layout.inodes_used == sfs.total_inodes - sfs.free_inodes, "layout shows the interleaved files and the holes");
+    struct myfs_defrag_report defrag;
+    CHECK(myfs_defrag(fs, "/many", &defrag) == 0 && defrag.fragmented_before == 2 && defrag.fragmented_after == 0 &&
+          defrag.extents_after == 2 && defrag.dir_holes > 0 && defrag.dir_blocks_freed > 0, "defrag /many");
+    uint32_t map[MYFS_MAP_SLOTS];
+    CHECK(myfs_block_map(fs, f1, map) == 4 && map[1] == map[0] + 1 && map[3] == map[0] + 3,
+          "defragmented file is one run");
+    CHECK(myfs_pread(fs, f2, back, 1, 3 * MYFS_BLOCK_SIZE) == 1 && back[0] == 3, "defragmented file keeps its data");
+    seen = 0;
+    CHECK(myfs_opendir(fs, "/many", &d) == 0, "opendir /many");
+    while ((rc = myfs_readdir(d, &entry)) == 1) seen++;
+    myfs_closedir(d);
+    CHECK(rc == 0 && seen == 6 && myfs_lookup(fs, "/many/n39") > 0, "packed directory lists the same entries");
+    CHECK(myfs_layout(fs, &layout) == 0 && layout.files_by_extents[4] == 0 && layout.dir_holes == 0,
+          "layout after defrag");
+
+    // With compression on, a text file is created in compressed clusters,
+    // and writes and truncates pack the clusters they change again. With it
+    // off a write expands them, and myfs_compress packs the file back.
+    static char prose[40000], prose_back[40000];
+    for (int i = 0; i < (int)sizeof(prose); i++) prose[i] = "the inode of a block "[(i + i / 97) % 21];
+    CHECK(myfs_set_compression(fs, MYFS_COMPRESS_LZ) == 0 && myfs_statfs(fs, &sfs) == 0 &&
+          sfs.compression == MYFS_COMPRESS_LZ, "turn compression on");
+    int prose_ino = myfs_create(fs, "/docs/prose.txt", prose, sizeof(prose));
+    CHECK(myfs_stat_ino(fs, prose_ino, &st) == 0 && st.compressed && st.blocks < 10, "new file is compressed");
+    CHECK(myfs_pread(fs, prose_ino, prose_back, 20000, 10000) == 20000 && memcmp(prose + 10000, prose_back, 20000) == 0,
+          "pread from the middle of a compressed file");
+    CHECK(myfs_pwrite(fs, prose_ino, "!", 1, sizeof(prose)) == 1 && myfs_stat_ino(fs, prose_ino, &st) == 0 &&
+          st.compressed && st.blocks < 10 && st.size == sizeof(prose) + 1, "a write keeps the file compressed");
+    CHECK(myfs_truncate(fs, prose_ino, 30000) == 0 && myfs_pwrite(fs, prose_ino, prose + 30000, 10000, 30000) == 10000 &&
+          myfs_stat_ino(fs, prose_ino, &st) == 0 && st.compressed && st.size == sizeof(prose) &&
+          myfs_pread(fs, prose_ino, prose_back, sizeof(prose), 0) == (long)sizeof(prose) &&
+          memcmp(prose, prose_back, sizeof(prose)) == 0, "a truncated and extended file reads back compressed");
+    CHECK(myfs_set_compression(fs, MYFS_COMPRESS_NONE) == 0 && myfs_pwrite(fs, prose_ino, prose, sizeof(prose), 0) ==
+          (long)sizeof(prose) && myfs_stat_ino(fs, prose_ino, &st) == 0 && !st.compressed && st.blocks == 10,
+          "with compression off a write expands the file");
+    int packed = myfs_compress(fs, prose_ino, MYFS_COMPRESS_LZ);
+    CHECK(packed > 0 && packed < 10 && myfs_defrag(fs, "/docs", &defrag) == 0 &&
+          myfs_pread(fs, prose_ino, prose_back, sizeof(prose), 0) == (long)sizeof(prose) &&
+          memcmp(prose, prose_back, sizeof(prose)) == 0, "recompressed file survives defrag");
+    CHECK(myfs_compress(fs, dir, MYFS_COMPRESS_LZ) == MYFS_EISDIR, "compress of a directory is EISDIR");
+
+    // With deduplication on, copies of a file share its blocks; a write to
+    // one copy goes to a block of its own, and the last reference frees them.
+    CHECK(myfs_set_dedup(fs, 1) == 0 && myfs_set_compression(fs, MYFS_COMPRESS_NONE) == 0 &&
+          myfs_statfs(fs, &sfs) == 0 && sfs.dedup && sfs.saved_blocks == 0, "turn deduplication on");
+    uint32_t free_before = sfs.free_blocks;
+    int dup1 = myfs_create(fs, "/docs/dup1", block, sizeof(block));
+    int dup2 = myfs_create(fs, "/docs/dup2", block, sizeof(block));
+    CHECK(dup1 > 0 && dup2 > 0 && myfs_statfs(fs, &sfs) == 0 && sfs.free_blocks == free_before - 2 &&
+          sfs.saved_blocks == 2, "an identical file takes no new blocks");
+    CHECK(myfs_pwrite(fs, dup2, "x", 1, 0) == 1 && myfs_pread(fs, dup1, back, sizeof(block), 0) == (long)sizeof(block) &&
+          memcmp(back, block, sizeof(block)) == 0 && myfs_statfs(fs, &sfs) == 0 && sfs.saved_blocks == 1,
+          "a write to a shared block copies it");
+    CHECK(myfs_io_stats(fs, &io) == 0 && io.dedup_hits == 2 && io.cow_copies == 1, "dedup counters");
+    CHECK(myfs_unlink(fs, "/docs/dup1") == 0 && myfs_pread(fs, dup2, back, sizeof(block), 0) == (long)sizeof(block) &&
+          back[0] == 'x' && memcmp(back + 1, block + 1, sizeof(block) - 1) == 0, "the other copy outlives an unlink");
+    CHECK(myfs_unlink(fs, "/docs/dup2") == 0 && myfs_statfs(fs, &sfs) == 0 && sfs.free_blocks == free_before &&
+          sfs.saved_blocks == 0, "the last reference frees the blocks");
+    myfs_create(fs, "/docs/dup3", block, sizeof(block));
+    myfs_create(fs, "/docs/dup4", block, sizeof(block));
+
+    // A clone shares every block of its source at once; a write to it copies
+    // only the block it changes, and the source reads back as it was.
+    myfs_statfs(fs, &sfs);
+    free_before = sfs.free_blocks;
+    int clone = myfs_clone(fs, "/docs/dup3", "/docs/dup5");
+    CHECK(clone > 0 && myfs_statfs(fs, &sfs) == 0 && sfs.free_blocks == free_before && sfs.saved_blocks == 4 &&
+          myfs_clone(fs, "/docs/dup3", "/docs/dup5") == MYFS_EEXIST && myfs_clone(fs, "/docs", "/docs2") == MYFS_EISDIR,
+          "clone a file");
+    CHECK(myfs_pwrite(fs, clone, "y", 1, 5000) == 1 && myfs_statfs(fs, &sfs) == 0 && sfs.free_blocks == free_before - 1 &&
+          myfs_pread(fs, myfs_lookup(fs, "/docs/dup3"), back, sizeof(block), 0) == (long)sizeof(block) &&
+          memcmp(back, block, sizeof(block)) == 0, "a write to a clone leaves its source alone");
+    CHECK(myfs_unlink(fs, "/docs/dup5") == 0 && myfs_statfs(fs, &sfs) == 0 && sfs.free_blocks == free_before &&
+          sfs.saved_blocks == 2, "removing a clone keeps the source's blocks");
+    myfs_set_compression(fs, MYFS_COMPRESS_LZ);
+
+    struct myfs_fsck_report report;
+    CHECK(myfs_fsck(fs, 0, 4, &report) == 0 && report.directories == 3, "fsck of a consistent image");
+    CHECK(myfs_unmount(fs) == 0, "unmount");
+
+    // Corrupt the image behind the library's back: mark a never-used inode
+    // allocated, clear the data bitmap and change a file's link count.
+    FILE* raw = fopen(image, "r+b");
+    unsigned char bits = 0, links[4] = {7, 0, 0, 0};
+    CHECK(raw && fseek(raw, MYFS_BLOCK_SIZE + 400 / 8, SEEK_SET) == 0 && fread(&bits, 1, 1, raw) == 1,
+          "read the inode bitmap");
+    bits |= 1 << (400 % 8);
+    char zeros[MYFS_BLOCK_SIZE] = {0};
+    CHECK(fseek(raw, MYFS_BLOCK_SIZE + 400 / 8, SEEK_SET) == 0 && fwrite(&bits, 1, 1, raw) == 1 &&
+          fseek(raw, 2 * MYFS_BLOCK_SIZE, SEEK_SET) == 0 && fwrite(zeros, sizeof(zeros), 1, raw) == 1 &&
+          fseek(raw, 3 * MYFS_BLOCK_SIZE + ino * 128 + 8, SEEK_SET) == 0 && fwrite(links, 4, 1, raw) == 1 &&
+          fclose(raw) == 0, "corrupt the image");
+    CHECK(myfs_mount(image, &fs) == 0, "mount the corrupted image");
+    CHECK(myfs_fsck(fs, 0, 4, &report) > 0 && report.orphans == 1 && report.link_counts == 1 &&
+          report.block_bitmap > 0 && report.repaired == 0, "fsck finds the damage");
+    CHECK(myfs_fsck(fs, MYFS_FSCK_REPAIR, 4, &report) > 0 && report.repaired > 0, "fsck repair");
+    CHECK(myfs_fsck(fs, 0, 1, &report) == 0, "fsck after repair finds nothing");
+    CHECK(myfs_stat(fs, "/docs/a.txt", &st) == 0 && st.nlink == 2, "link count was restored");
+    CHECK(myfs_statfs(fs, &sfs) == 0 && sfs.compression == MYFS_COMPRESS_LZ &&
+          myfs_pread(fs, prose_ino, prose_back, sizeof(prose), 0) == (long)sizeof(prose) &&
+          memcmp(prose, prose_back, sizeof(prose)) == 0, "compression policy and data survive the remount and repair");
+    CHECK(myfs_statfs(fs, &sfs) == 0 && sfs.dedup && sfs.saved_blocks == 2 && report.ref_counts == 0,
+          "shared blocks survive the remount and repair");
+    CHECK(myfs_unmount(fs) == 0, "unmount");
+
+    // Checksums, on a fresh second image: a data block changed behind the
+    // library's back fails its read and shows up in a scrub, a rewrite heals
+    // it, and a damaged superblock fails the mount.
+    struct myfs_scrub_report scrub;
+    remove(second);
+    CHECK(myfs_mkfs(second, 1024 * 1024) == 0 && myfs_mount(second, &fs2) == 0 &&
+          myfs_scrub(fs2, 2, &scrub) == MYFS_EINVAL && myfs_set_checksums(fs2, 1) == 0 &&
+          myfs_statfs(fs2, &sfs) == 0 && sfs.checksums, "turn checksums on");
+    CHECK(myfs_create(fs2, "/summed", block, sizeof(block)) > 0 && myfs_unmount(fs2) == 0 &&
+          myfs_mount(second, &fs2) == 0 && myfs_scrub(fs2, 2, &scrub) == 0 && scrub.blocks > 2 && scrub.threads == 2,
+          "a new file scrubs clean after a remount");
+    CHECK(myfs_unmount(fs2) == 0, "unmount");
+    raw = fopen(second, "r+b");
+    char disk_block[MYFS_BLOCK_SIZE];
+    long at = -1;
+    for (long b = 0; raw && at < 0 && fread(disk_block, sizeof(disk_block), 1, raw) == 1; b++) {
+        if (memcmp(disk_block, block, sizeof(disk_block)) == 0) at = b;
+    }
+    CHECK(at > 0 && fseek(raw, at * MYFS_BLOCK_SIZE + 100, SEEK_SET) == 0 && fwrite("!", 1, 1, raw) == 1 &&
+          fclose(raw) == 0, "corrupt a data block");
+    int summed = myfs_mount(second, &fs2) == 0 ? myfs_lookup(fs2, "/summed") : -1;
+    CHECK(summed > 0 && myfs_pread(fs2, summed, back, sizeof(back), 0) == MYFS_ECORRUPT &&
+          myfs_io_stats(fs2, &io) == 0 && io.checksum_failures > 0, "a read of the block fails its checksum");
+    CHECK(myfs_scrub(fs2, 2, &scrub) == 1 && scrub.bad == 1 && scrub.bad_metadata == 0 && scrub.listed == 1 &&
+          scrub.bad_blocks[0].block == (uint32_t)at && scrub.bad_blocks[0].kind == MYFS_IO_DATA,
+          "scrub finds the corrupt block");
+    CHECK(myfs_pwrite(fs2, summed, "?", 1, 10) == MYFS_ECORRUPT &&
+          myfs_pread(fs2, summed, back, sizeof(back), 0) == MYFS_ECORRUPT && myfs_scrub(fs2, 0, &scrub) == 1 &&
+          scrub.bad_blocks[0].block == (uint32_t)at, "a partial write into the corrupt block fails and leaves it corrupt");
+    CHECK(myfs_pwrite(fs2, summed, block, sizeof(block), 0) == (long)sizeof(block) && myfs_scrub(fs2, 0, &scrub) == 0 &&
+          myfs_pread(fs2, summed, back, sizeof(back), 0) == (long)sizeof(back) && memcmp(back, block, sizeof(block)) == 0,
+          "rewriting the block heals it");
+    CHECK(myfs_unmount(fs2) == 0, "unmount");
+    raw = fopen(second, "r+b");
+    CHECK(raw && fseek(raw, 0, SEEK_SET) == 0 && fwrite("X", 1, 1, raw) == 1 && fclose(raw) == 0 &&
+          myfs_mount(second, &fs2) == MYFS_ECORRUPT, "a damaged superblock fails the mount");
+
+    remove(second);
+    remove(image);
+    return failures ? 1 : 0;
+}
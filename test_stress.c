@@ -0,0 +1,250 @@
+// Drives one libmyfs handle from many threads at once, then checks that the
+// image is consistent: every file holds what its thread last wrote, link
+// counts match the directory entries, and the allocation bitmaps account
+// for exactly the inodes and blocks the tree uses, before and after a
+// remount. Prints "ok: ..." or "Error: ..." per check like test_api.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "myfs.h"
+
+#define WORKERS 8
+#define ROUNDS 300
+#define FILES_PER_WORKER 12
+#define READERS 2
+#define HOT_SIZE (3 * MYFS_BLOCK_SIZE)
+
+static int failures = 0;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CHECK(cond, what) do { \
+    if (cond) printf("ok: %s\n", what); \
+    else { printf("Error: %s (line %d)\n", what, __LINE__); failures++; } \
+} while (0)
+
+// Failures inside worker threads are reported once each, with the detail.
+static void fail(const char* what, const char* name, long rc) {
+    pthread_mutex_lock(&report_lock);
+    printf("Error: %s %s: %s (%ld)\n", what, name, rc < 0 ? myfs_strerror(rc) : "mismatch", rc);
+    failures++;
+    pthread_mutex_unlock(&report_lock);
+}
+
+static myfs_t* fs;
+static volatile int writers_done = 0;
+
+// What each worker believes its files hold; size -1 means absent.
+typedef struct {
+    int id;
+    long size[FILES_PER_WORKER];
+    unsigned char fill[FILES_PER_WORKER];
+} Worker;
+
+static void make_data(unsigned char* buf, long size, unsigned char fill) {
+    for (long i = 0; i < size; i++) buf[i] = (unsigned char)(fill + i % 251);
+}
+
+static int verify_file(const char* path, long size, unsigned char fill) {
+    static _Thread_local unsigned char want[MYFS_FILE_MAX], got[MYFS_FILE_MAX];
+    struct myfs_stat st;
+    if (myfs_stat(fs, path, &st) != 0 || st.size != size) return 0;
+    make_data(want, size, fill);
+    return myfs_pread(fs, st.ino, got, MYFS_FILE_MAX, 0) == size && memcmp(want, got, size) == 0;
+}
+
+// Each worker churns files in its own directory and adds and removes
+// names in /shared, where all workers contend for one directory lock.
+static void* worker(void* arg) {
+    Worker* w = arg;
+    static _Thread_local unsigned char buf[MYFS_FILE_MAX];
+    char dir[32], path[64], shared[64];
+    snprintf(dir, sizeof(dir), "/w%d", w->id);
+    int dir_ino = myfs_mkdir(fs, dir);
+    if (dir_ino < 0) { fail("mkdir", dir, dir_ino); return NULL; }
+    unsigned seed = 1234u + w->id;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int f = rand_r(&seed) % FILES_PER_WORKER;
+        snprintf(path, sizeof(path), "%s/f%d", dir, f);
+        int op = rand_r(&seed) % 4;
+
+        if (w->size[f] < 0) {
+            long size = rand_r(&seed) % (5 * MYFS_BLOCK_SIZE);
+            unsigned char fill = (unsigned char)rand_r(&seed);
+            make_data(buf, size, fill);
+            int rc = myfs_create(fs, path, buf, size);
+            if (rc < 0) { fail("create", path, rc); continue; }
+            w->size[f] = size;
+            w->fill[f] = fill;
+        } else if (op == 0) {
+            int rc = myfs_unlink(fs, path);
+            if (rc < 0) { fail("unlink", path, rc); continue; }
+            w->size[f] = -1;
+        } else if (op == 1) {
+            // Rewrite the whole file in place, growing it past a block boundary.
+            long size = w->size[f] + MYFS_BLOCK_SIZE / 2;
+            if (size > 6 * MYFS_BLOCK_SIZE) size = MYFS_BLOCK_SIZE / 3;
+            unsigned char fill = (unsigned char)rand_r(&seed);
+            make_data(buf, size, fill);
+            int ino = myfs_lookup(fs, path);
+            long n = ino < 0 ? ino : myfs_truncate(fs, ino, 0);
+            if (n == 0) n = myfs_pwrite(fs, ino, buf, size, 0);
+            if (n != size) { fail("rewrite", path, n); continue; }
+            w->size[f] = size;
+            w->fill[f] = fill;
+        } else if (op == 2) {
+            // A name in the shared directory, linked and unlinked again.
+            snprintf(shared, sizeof(shared), "/shared/w%d-%d", w->id, round);
+            int rc = myfs_link(fs, path, shared);
+            if (rc == 0) rc = myfs_unlink(fs, shared);
+            if (rc != 0) fail("link/unlink in /shared", shared, rc);
+        } else {
+            // A short-lived subdirectory with a file in it.
+            snprintf(shared, sizeof(shared), "%s/sub%d", dir, round);
+            int sub = myfs_mkdir(fs, shared);
+            int rc = sub < 0 ? sub : myfs_create_at(fs, sub, "x", "x", 1);
+            if (rc >= 0) rc = myfs_unlink_at(fs, sub, "x");
+            if (rc >= 0) rc = myfs_rmdir(fs, shared);
+            if (rc != 0) fail("mkdir/rmdir", shared, rc);
+        }
+
+        if (w->size[f] >= 0 && !verify_file(path, w->size[f], w->fill[f])) fail("read back", path, 0);
+    }
+    return NULL;
+}
+
+// Readers of /hot must never see a mix of two rewrites: the writer below
+// fills the whole file with one byte value per pwrite.
+static void* hot_reader(void* arg) {
+    (void)arg;
+    static _Thread_local unsigned char got[HOT_SIZE];
+    int ino = myfs_lookup(fs, "/hot");
+    while (!__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE)) {
+        long n = myfs_pread(fs, ino, got, HOT_SIZE, 0);
+        if (n != HOT_SIZE) { fail("pread", "/hot", n); return NULL; }
+        for (int i = 1; i < HOT_SIZE; i++) {
+            if (got[i] != got[0]) { fail("torn read of", "/hot", 0); return NULL; }
+        }
+    }
+    return NULL;
+}
+
+static void* hot_writer(void* arg) {
+    (void)arg;
+    static _Thread_local unsigned char buf[HOT_SIZE];
+    int ino = myfs_lookup(fs, "/hot");
+    for (int i = 0; i < ROUNDS * 4; i++) {
+        memset(buf, i & 0xff, HOT_SIZE);
+        long n = myfs_pwrite(fs, ino, buf, HOT_SIZE, 0);
+        if (n != HOT_SIZE) { fail("pwrite", "/hot", n); break; }
+    }
+    return NULL;
+}
+
+// Walks the tree counting every directory entry per inode and the data
+// blocks in use. Returns 0 if the walk found an inconsistency.
+static int walk(uint32_t dir_ino, int* refs, long* blocks, int* dirs) {
+    struct myfs_stat st;
+    if (myfs_stat_ino(fs, dir_ino, &st) != 0) return 0;
+    *blocks += st.blocks;
+    (*dirs)++;
+
+    myfs_dir_t* d;
+    struct myfs_dirent entry;
+    int rc, subdirs = 0;
+    if (myfs_opendir_ino(fs, dir_ino, &d) != 0) return 0;
+    while ((rc = myfs_readdir(d, &entry)) == 1) {
+        if (myfs_stat_ino(fs, entry.ino, &st) != 0) { myfs_closedir(d); return 0; }
+        if (st.is_dir) {
+            subdirs++;
+            if (!walk(entry.ino, refs, blocks, dirs)) { myfs_closedir(d); return 0; }
+        } else {
+            if (refs[entry.ino]++ == 0) *blocks += st.blocks;
+        }
+    }
+    myfs_closedir(d);
+    if (rc != 0) return 0;
+
+    // A directory is linked from its parent, from "." and from each child's "..".
+    return myfs_stat_ino(fs, dir_ino, &st) == 0 && st.nlink == (uint32_t)(2 + subdirs);
+}
+
+static void check_consistency(const Worker* workers, const char* when) {
+    char what[128], path[64];
+    int ok = 1;
+    for (int w = 0; w < WORKERS; w++) {
+        for (int f = 0; f < FILES_PER_WORKER; f++) {
+            snprintf(path, sizeof(path), "/w%d/f%d", w, f);
+            if (workers[w].size[f] < 0) ok &= myfs_lookup(fs, path) == MYFS_ENOENT;
+            else ok &= verify_file(path, workers[w].size[f], workers[w].fill[f]);
+        }
+    }
+    snprintf(what, sizeof(what), "every file holds its last write %s", when);
+    CHECK(ok, what);
+
+    myfs_dir_t* d;
+    struct myfs_dirent entry;
+    int left = 0;
+    if (myfs_opendir(fs, "/shared", &d) == 0) {
+        while (myfs_readdir(d, &entry) == 1) left++;
+        myfs_closedir(d);
+    }
+    snprintf(what, sizeof(what), "/shared is empty %s", when);
+    CHECK(left == 0, what);
+
+    static int refs[4096];
+    long blocks = 0;
+    int dirs = 0, files = 0, links_ok = 1;
+    memset(refs, 0, sizeof(refs));
+    snprintf(what, sizeof(what), "tree walk and directory link counts %s", when);
+    CHECK(walk(MYFS_ROOT_INO, refs, &blocks, &dirs), what);
+    for (uint32_t ino = 0; ino < sizeof(refs) / sizeof(refs[0]); ino++) {
+        if (refs[ino] == 0) continue;
+        struct myfs_stat st;
+        files++;
+        links_ok &= myfs_stat_ino(fs, ino, &st) == 0 && st.nlink == (uint32_t)refs[ino];
+    }
+    snprintf(what, sizeof(what), "file link counts match directory entries %s", when);
+    CHECK(links_ok, what);
+
+    struct myfs_statfs sfs;
+    myfs_statfs(fs, &sfs);
+    snprintf(what, sizeof(what), "inode bitmap matches the tree %s", when);
+    CHECK(sfs.total_inodes - sfs.free_inodes == (uint32_t)(dirs + files), what);
+    snprintf(what, sizeof(what), "block bitmap matches the tree %s", when);
+    CHECK(sfs.total_blocks - sfs.free_blocks == (uint32_t)blocks, what);
+}
+
+int main(int argc, char* argv[]) {
+    const char* image = argc > 1 ? argv[1] : "test_stress.img";
+    static unsigned char hot[HOT_SIZE];
+
+    remove(image);
+    CHECK(myfs_mkfs(image, 16 * 1024 * 1024) == 0 && myfs_mount(image, &fs) == 0, "mkfs and mount");
+    CHECK(myfs_mkdir(fs, "/shared") > 0 && myfs_create(fs, "/hot", hot, HOT_SIZE) > 0, "create /shared and /hot");
+
+    Worker workers[WORKERS];
+    pthread_t threads[WORKERS + READERS + 1];
+    for (int w = 0; w < WORKERS; w++) {
+        workers[w].id = w;
+        for (int f = 0; f < FILES_PER_WORKER; f++) workers[w].size[f] = -1;
+        pthread_create(&threads[w], NULL, worker, &workers[w]);
+    }
+    for (int r = 0; r < READERS; r++) pthread_create(&threads[WORKERS + r], NULL, hot_reader, NULL);
+    pthread_create(&threads[WORKERS + READERS], NULL, hot_writer, NULL);
+
+    for (int w = 0; w < WORKERS; w++) pthread_join(threads[w], NULL);
+    pthread_join(threads[WORKERS + READERS], NULL);
+    __atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+    for (int r = 0; r < READERS; r++) pthread_join(threads[WORKERS + r], NULL);
+    CHECK(failures == 0, "concurrent workload ran without errors");
+
+    check_consistency(workers, "after the workload");
+    CHECK(myfs_unmount(fs) == 0 && myfs_mount(image, &fs) == 0, "remount");
+    check_consistency(workers, "after a remount");
+    CHECK(myfs_unmount(fs) == 0, "unmount");
+
+    remove(image);
+    return failures ? 1 : 0;
+}